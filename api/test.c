@@ -27,6 +27,7 @@ void cb_test_chunks(mk_request_t *request, void *data)
 
     mk_http_status(request, 200);
     mk_http_header(request, "X-Monkey", 8, "OK", 2);
+    mk_http_header(request, "Content-Type", 12, "text/plain", 10);
 
     for (i = 0; i < 1000; i++) {
         len = snprintf(tmp, sizeof(tmp) -1, "test-chunk %6i\n ", i);
@@ -90,6 +91,7 @@ int main()
     vid = mk_vhost_create(ctx, NULL);
     mk_vhost_set(ctx, vid,
                  "Name", "monotop",
+                 "Compression", "On",
                  NULL);
     mk_vhost_handler(ctx, vid, "/test_chunks", cb_test_chunks, NULL);
     mk_vhost_handler(ctx, vid, "/test_big_chunk", cb_test_big_chunk, NULL);
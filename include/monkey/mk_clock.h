@@ -43,4 +43,21 @@ void mk_clock_set_time(void);
 void mk_clock_sequential_init(struct mk_server *server);
 void mk_clock_exit();
 
+/*
+ * Monotonic time in microseconds, used to time the phases of a request. The
+ * coarse clock is read from the vDSO without a syscall, its resolution is
+ * one scheduler tick which is enough to spot slow requests.
+ */
+static inline uint64_t mk_clock_mono()
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
 #endif
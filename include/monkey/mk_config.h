@@ -38,6 +38,14 @@
 #define MK_DEFAULT_LISTEN_ADDR              "0.0.0.0"
 #define MK_DEFAULT_LISTEN_PORT              "2001"
 #define MK_WORKERS_DEFAULT                  1
+#define MK_FILE_CACHE_SIZE                  1024
+#define MK_FILE_CACHE_TTL                   60
+#define MK_FILE_CACHE_NEG_SIZE              256
+#define MK_FILE_CACHE_NEG_TTL               5
+#define MK_USER_CACHE_TTL                   300
+#define MK_USER_CACHE_NEG_TTL               30
+#define MK_RESPONSE_CACHE_SIZE              8192  /* KB */
+#define MK_RESPONSE_CACHE_MAX_FILE          64    /* KB */
 
 /* Core capabilities, used as identifiers to match plugins */
 #define MK_CAP_HTTP        1
@@ -50,6 +58,22 @@ struct mk_config_listener
     char *address;                /* address to bind */
     char *port;                   /* TCP port        */
     uint32_t flags;               /* properties: http | http2 | ssl */
+    int backlog;                  /* listen(2) backlog, 0 = default */
+    struct mk_list _head;
+};
+
+/*
+ * Worker pool: a named set of worker threads defined through a
+ * [WORKER_POOL] section. Requests for a virtual host or a content
+ * handler bound to a pool are served by the workers of that pool, the
+ * workers defined in the [SERVER] section are the default pool.
+ */
+struct mk_config_pool
+{
+    char *name;                   /* pool name                      */
+    int workers;                  /* number of worker threads       */
+    int first;                    /* index of first worker (sched)  */
+    struct mk_list *handlers;     /* handler plugins bound to pool  */
     struct mk_list _head;
 };
 
@@ -65,6 +89,15 @@ struct mk_server
     short int manual_tcp_cork;    /* If enabled it will handle TCP_CORK */
 
     int8_t fdt;                   /* is FDT enabled ? */
+    int8_t precompressed;         /* serve .br/.gz sidecar files ? */
+    int file_cache_size;          /* open file cache entries (0 = off) */
+    int file_cache_ttl;           /* open file cache entries TTL */
+    int file_cache_neg_size;      /* failed lookups cached (0 = off) */
+    int file_cache_neg_ttl;       /* failed lookups TTL */
+    int user_cache_ttl;           /* ~user home directories TTL */
+    int user_cache_neg_ttl;       /* unknown users TTL */
+    size_t response_cache_size;   /* in memory responses (bytes) */
+    size_t response_cache_max_file; /* max file size kept in memory */
     int8_t is_daemon;
     int8_t is_seteuid;
     int8_t scheduler_mode;        /* Scheduler balancing mode */
@@ -84,6 +117,13 @@ struct mk_server
     mk_ptr_t server_software;
 
     struct mk_list listeners;
+    int listen_backlog;           /* default listen(2) backlog */
+
+    /* Kernel counter of listen queue overflows (last sample) */
+    unsigned long long listen_overflows;
+
+    /* worker pools ([WORKER_POOL] sections) */
+    struct mk_list worker_pools;
 
     char *one_shot;
     char *port_override;
@@ -101,6 +141,12 @@ struct mk_server
     int8_t keep_alive;            /* it's a persisten connection ? */
     int max_keep_alive_request; /* max persistent connections to allow */
     int keep_alive_timeout;     /* persistent connection timeout */
+    int8_t keep_alive_adaptive; /* shrink keep-alive under load ? */
+
+    /* data rates, zero disables each limit */
+    int max_header_time;        /* seconds to receive the headers */
+    int min_request_rate;       /* bytes per second from the client */
+    int min_response_rate;      /* bytes per second to the client */
 
     /* counter of threads working */
     int thread_counter;
@@ -146,6 +192,18 @@ struct mk_server
     /* Scheduler context (struct mk_sched_ctx) */
     void *sched_ctx;
 
+    /* Open file cache context (struct mk_file_cache) */
+    void *file_cache;
+
+    /* Default error pages (struct mk_http_error_body) */
+    void *error_bodies;
+
+    /* Users home directories cache (struct mk_user_cache) */
+    void *user_cache;
+
+    /* Rewrite map files watcher (struct mk_vhost_rewrite_watch) */
+    void *rewrite_watch;
+
     /*
      * This list head, allow to link a set of callbacks that Monkey core
      * must invoke inside each thread worker once created. This list is
@@ -182,6 +240,9 @@ struct mk_config_listener *mk_config_listener_add(char *address,
                                                   struct mk_server *server);
 int mk_config_listen_check_busy();
 void mk_config_listeners_free();
+struct mk_config_pool *mk_config_pool_get(char *name, struct mk_server *server);
+struct mk_config_pool *mk_config_pool_handler(char *handler,
+                                              struct mk_server *server);
 
 int mk_config_get_bool(char *value);
 void mk_config_read_hosts(char *path);
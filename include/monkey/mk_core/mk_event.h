@@ -30,6 +30,7 @@
 #define MK_EVENT_CONNECTION      2    /* data on active connection        */
 #define MK_EVENT_CUSTOM          3    /* custom fd registered             */
 #define MK_EVENT_THREAD          4    /* thread-coroutine                 */
+#define MK_EVENT_THREAD_NET      5    /* thread-coroutine upstream socket */
 
 /* Event triggered for file descriptors  */
 #define MK_EVENT_EMPTY           0
@@ -41,4 +41,13 @@ struct mk_event_ctx {
          __i++,                                                         \
              event = __ctx->events[__i].data.ptr                        \
          )
+
+/*
+ * Only valid inside mk_event_foreach(): true if the socket got an error or
+ * was shut down in both directions. A half-close (EPOLLRDHUP) is not a
+ * hangup, the peer may still be waiting for the response.
+ */
+#define mk_event_hangup(evl)                                            \
+    (__ctx->events[__i].events & (EPOLLHUP | EPOLLERR))
+
 #endif
@@ -69,4 +69,16 @@ static inline int filter_mask(int16_t f)
          __i++,                                                         \
              event = __ctx->events[__i].udata                           \
          )
+
+/*
+ * Only valid inside mk_event_foreach(): true if the filter reported an
+ * error or the connection ended with a socket error (EV_EOF carrying an
+ * errno in fflags). A plain EV_EOF is a half-close, the peer may still be
+ * waiting for the response.
+ */
+#define mk_event_hangup(evl)                                            \
+    ((__ctx->events[__i].flags & EV_ERROR) ||                           \
+     ((__ctx->events[__i].flags & EV_EOF) &&                            \
+      __ctx->events[__i].fflags != 0))
+
 #endif
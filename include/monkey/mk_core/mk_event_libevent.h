@@ -42,4 +42,8 @@ struct mk_event_ctx {
          __i++,                                                         \
              event = __ctx->fired[__i].data                             \
          )
+
+/* Remote hangup is not reported by this backend, detected on read/write */
+#define mk_event_hangup(evl)   0
+
 #endif
@@ -56,4 +56,8 @@ struct mk_event_ctx {
              event = __ctx->fired[__i].data                             \
          )
 
+
+/* select(2) cannot report a remote hangup, it's detected on read/write */
+#define mk_event_hangup(evl)   0
+
 #endif
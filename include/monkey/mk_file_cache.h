@@ -0,0 +1,187 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FILE_CACHE_H
+#define MK_FILE_CACHE_H
+
+#include <pthread.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_mimetype.h>
+#include <monkey/mk_http_internal.h>
+#include <monkey/mk_vhost_cache.h>
+
+/*
+ * Open File Cache
+ * ---------------
+ * Process wide cache of static resources keyed by their real path. Every
+ * entry holds the stat(2) information, the open file descriptor, the
+ * mime type, the ETag header and the index file resolution of a
+ * directory, so the common request path do not need to hit the file
+ * system at all.
+ *
+ * Entries are distributed across shards, each one protected by its own
+ * mutex and bounded by a LRU list. On Linux, the parent directory of each
+ * entry is watched through inotify(7) and changes invalidate the entries
+ * right away. A watch is shared by the entries of its directory and removed
+ * along with the last one. Entries also expire after FileCacheTTL seconds, which is the
+ * only invalidation mechanism on other systems (or if a watch cannot be
+ * registered).
+ *
+ * Failed lookups (e.g: scanners looking for missing resources) are kept as
+ * negative entries in a separate LRU list, bounded by FileCacheNegativeSize
+ * and FileCacheNegativeTTL, so they cannot evict the positive ones. Since the
+ * key is the real path, which includes the document root, negative results
+ * are naturally scoped per virtual host.
+ *
+ * Response cache: once a small file (up to ResponseCacheMaxFile) is hit
+ * again, its content and the precomposed entity header rows are kept in
+ * memory, so a response is a single writev(2) of prebuilt buffers. The
+ * memory is bounded per shard (ResponseCacheSize / shards) and the
+ * content of the least recently used entries is dropped first.
+ */
+
+#define MK_FILE_CACHE_SHARDS      16
+#define MK_FILE_CACHE_BUCKETS     64    /* hash buckets per shard */
+#define MK_FILE_CACHE_WATCH_BUCKETS 256 /* watched directories buckets */
+#define MK_FILE_CACHE_ADMIT       2     /* hits to keep a file in memory */
+
+/* Index resolution state of a directory entry */
+#define MK_FILE_CACHE_INDEX_UNKNOWN  -1
+#define MK_FILE_CACHE_INDEX_FOUND     0
+#define MK_FILE_CACHE_INDEX_NONE      1
+
+/* Precompressed sidecars of a file not resolved yet */
+#define MK_FILE_CACHE_ENCODINGS_UNKNOWN  -1
+
+struct mk_file_cache;
+struct mk_file_cache_shard;
+struct mk_file_cache_watch;
+
+struct mk_file_cache_entry {
+    unsigned int hash;
+    char *path;
+    size_t path_len;
+
+    int negative;                 /* cached lookup failure             */
+    int ret;                      /* mk_file_get_info() return value   */
+    struct file_info info;        /* mk_file_get_info() result         */
+    int fd;                       /* shared file descriptor, or -1     */
+    struct mk_mimetype *mime;     /* mime type (static files only)     */
+    int etag_len;
+    char etag[MK_HEADER_ETAG_SIZE];
+
+    /* directories: resolved index file */
+    int index_state;
+    char *index;
+    size_t index_len;
+
+    /* files: available precompressed sidecars (MK_HTTP_ENCODING_*) */
+    int encodings;
+
+    /* files: cache policy rule resolved for the last virtual host */
+    struct mk_vhost *policy_host;
+    struct mk_vhost_cache_rule *policy;
+
+    /* response cache */
+    char *body;                   /* file content                      */
+    char *rows;                   /* precomposed entity header rows    */
+    size_t rows_len;
+    struct mk_vhost_cache_rule *rows_policy;  /* folded in the rows    */
+    unsigned int hits;
+
+    time_t expire;                /* TTL deadline                      */
+    int refs;                     /* requests using this entry         */
+    int dead;                     /* unlinked, free on last release    */
+
+    struct mk_file_cache_watch *watch;   /* directory watch reference  */
+    struct mk_file_cache_shard *shard;
+    struct mk_list _head;         /* link to hash bucket               */
+    struct mk_list _lru;          /* link to shard LRU list            */
+};
+
+struct mk_file_cache_shard {
+    pthread_mutex_t lock;
+    int entries;
+    int neg_entries;
+    struct mk_list lru;
+    struct mk_list neg_lru;
+    struct mk_list buckets[MK_FILE_CACHE_BUCKETS];
+
+    /* metrics */
+    size_t mem;                        /* response cache memory in use */
+    unsigned long long lookups;
+    unsigned long long hits;
+    unsigned long long resp_hits;
+};
+
+/* Directory watched through inotify(7), referenced by its entries */
+struct mk_file_cache_watch {
+    int wd;                       /* -1 once the kernel dropped it     */
+    int refs;
+    unsigned int hash;
+    char *dir;
+    size_t len;
+    struct mk_file_cache *cache;
+    struct mk_list _head;         /* link to directory hash bucket     */
+    struct mk_list _wd_head;      /* link to descriptor hash bucket    */
+};
+
+struct mk_file_cache {
+    int capacity;                 /* max entries per shard             */
+    int ttl;                      /* seconds                           */
+    int neg_capacity;             /* max negative entries per shard    */
+    int neg_ttl;                  /* negative entries TTL (seconds)    */
+    size_t mem_limit;             /* response cache bytes per shard    */
+    size_t max_body;              /* max file size kept in memory      */
+
+    /* inotify */
+    int notify_fd;
+    pthread_t notify_tid;
+    pthread_mutex_t watch_lock;
+    struct mk_list watches[MK_FILE_CACHE_WATCH_BUCKETS];
+    struct mk_list watches_wd[MK_FILE_CACHE_WATCH_BUCKETS];
+
+    struct mk_file_cache_shard shards[MK_FILE_CACHE_SHARDS];
+};
+
+int mk_file_cache_init(struct mk_server *server);
+void mk_file_cache_exit(struct mk_server *server);
+
+int mk_file_cache_lookup(char *path, size_t len, struct file_info *info,
+                         struct mk_file_cache_entry **entry,
+                         struct mk_server *server);
+void mk_file_cache_release(struct mk_file_cache_entry *entry);
+int mk_file_cache_open(struct mk_file_cache_entry *entry);
+int mk_file_cache_response(struct mk_file_cache_entry *entry,
+                           struct mk_vhost_cache_rule *policy,
+                           struct mk_server *server);
+
+int mk_file_cache_index_get(struct mk_file_cache_entry *entry,
+                            char *buf, size_t size, size_t *len);
+void mk_file_cache_index_set(struct mk_file_cache_entry *entry,
+                             char *index, size_t len);
+
+int mk_file_cache_encodings_get(struct mk_file_cache_entry *entry);
+void mk_file_cache_encodings_set(struct mk_file_cache_entry *entry,
+                                 int encodings);
+
+struct mk_vhost_cache_rule *mk_file_cache_policy_get(struct mk_file_cache_entry *entry,
+                                                     struct mk_vhost *host);
+
+#endif
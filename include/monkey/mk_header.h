@@ -25,6 +25,17 @@
 
 #define MK_HEADER_BREAKLINE 1
 
+/* Response heads: status line + preset rows (Server, Date) */
+#define MK_HEADER_STATUS_SIZE       64      /* longest status line */
+#define MK_HEADER_STATUS_MAX        600
+
+/*
+ * Entity rows (response_headers->entity_rows) must be followed by a CRLF
+ * not counted in their length, a response without other rows is then
+ * ended by the same buffer.
+ */
+#define MK_HEADER_ROWS(rows)        rows MK_CRLF
+
 /*
  * header response: We handle this as static global data in order
  * to save some process time when building the response header.
@@ -50,6 +61,8 @@
 #define	MK_RH_REDIR_SEE_OTHER "HTTP/1.1 303 See Other\r\n"
 #define MK_RH_NOT_MODIFIED "HTTP/1.1 304 Not Modified\r\n"
 #define MK_RH_REDIR_USE_PROXY "HTTP/1.1 305 Use Proxy\r\n"
+#define MK_RH_REDIR_TEMPORARY "HTTP/1.1 307 Temporary Redirect\r\n"
+#define MK_RH_REDIR_PERMANENT "HTTP/1.1 308 Permanent Redirect\r\n"
 
 /* Client side errors */
 #define MK_RH_CLIENT_BAD_REQUEST "HTTP/1.1 400 Bad Request\r\n"
@@ -86,6 +99,10 @@ struct header_status_response {
     char *response;
 };
 
+/* ETag row of static files: 'ETag: "<mtime>-<size>"' */
+#define MK_HEADER_ETAG              "ETag: "
+#define MK_HEADER_ETAG_FMT          MK_HEADER_ETAG "\"%x-%zx\"" MK_CRLF
+
 #define MK_HEADER_TE_TYPE_CHUNKED   0
 #define MK_HEADER_CONN_UPGRADED    11
 #define MK_HEADER_UPGRADED_H2C     20
@@ -102,10 +119,16 @@ extern const mk_ptr_t mk_header_content_encoding;
 extern const mk_ptr_t mk_header_accept_ranges;
 extern const mk_ptr_t mk_header_te_chunked;
 extern const mk_ptr_t mk_header_last_modified;
+extern const mk_ptr_t mk_header_vary;
 
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                       struct mk_server *server);
 
+int mk_header_entity_rows(char **buf, unsigned long *len,
+                          time_t last_modified, mk_ptr_t *content_type,
+                          char *etag, int etag_len, long content_length,
+                          mk_ptr_t *cache_control);
+void mk_header_heads_update(mk_ptr_t *preset);
 void mk_header_response_reset(struct response_headers *header);
 void mk_header_set_http_status(struct mk_http_request *sr, int status);
 void mk_header_set_content_length(struct mk_http_request *sr, long len);
@@ -28,6 +28,14 @@
 
 /* Request buffer chunks = 4KB */
 #define MK_REQUEST_CHUNK (int) 4096
+
+/* Max number of pipelined requests dispatched in a single batch */
+#define MK_HTTP_PIPELINE_BATCH  32
+
+/* Interim response for 'Expect: 100-continue' and streamed body reads */
+#define MK_HTTP_CONTINUE     "HTTP/1.1 100 Continue\r\n\r\n"
+#define MK_HTTP_BODY_CHUNK   16384
+#define MK_HTTP_BODY_INVALID -2     /* broken chunked framing */
 #define MK_REQUEST_DEFAULT_PAGE  "<HTML><HEAD><STYLE type=\"text/css\"> body {font-size: 12px;} </STYLE></HEAD><BODY><H1>%s</H1>%s<BR><HR><ADDRESS>Powered by %s</ADDRESS></BODY></HTML>"
 
 /* Hard coded restrictions */
@@ -58,6 +66,11 @@
 #define RH_RANGE "Range:"
 #define RH_USER_AGENT "User-Agent:"
 
+/* Content codings accepted by the client (Accept-Encoding) */
+#define MK_HTTP_ENCODING_GZIP     1
+#define MK_HTTP_ENCODING_BR       2
+#define MK_HTTP_ENCODING_DEFLATE  4
+
 #define MK_REQUEST_STATUS_INCOMPLETE -1
 #define MK_REQUEST_STATUS_COMPLETED 0
 
@@ -95,6 +108,13 @@ extern const mk_ptr_t mk_http_protocol_10_p;
 extern const mk_ptr_t mk_http_protocol_11_p;
 extern const mk_ptr_t mk_http_protocol_null_p;
 
+/* Default error page of a status code, composed when the server starts */
+struct mk_http_error_body {
+    int status;
+    mk_ptr_t page;               /* HTML page                            */
+    mk_ptr_t rows;               /* Content-Type and Content-Length rows */
+};
+
 /*
  * A HTTP session represents an incoming session
  * from a client, a session can be used for pipelined or
@@ -125,6 +145,17 @@ struct mk_http_session
     unsigned int body_size;
     unsigned int body_length;
 
+    /*
+     * Read cursor for pipelined requests: the request being parsed starts
+     * at 'body_pos', the data after the last complete request starts at
+     * 'body_next'. The buffer is not moved while requests are served.
+     */
+    unsigned int body_pos;
+    unsigned int body_next;
+
+    /* Pipelined requests are being dispatched as a batch */
+    int pipeline_batch;
+
     /* head for mk_http_request list nodes, each request is linked here */
     struct mk_list request_list;
 
@@ -175,6 +206,8 @@ static inline int mk_http_status_completed(struct mk_http_session *cs,
 int mk_http_error(int http_status, struct mk_http_session *cs,
                   struct mk_http_request *sr,
                   struct mk_server *server);
+int mk_http_error_bodies_init(struct mk_server *server);
+void mk_http_error_bodies_exit(struct mk_server *server);
 
 int mk_http_method_check(mk_ptr_t method);
 mk_ptr_t mk_http_method_check_str(int method);
@@ -217,6 +250,22 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
                                           const char *key, unsigned int len);
 
 int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server);
+int mk_http_request_continue(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_server *server);
+
+/* streamed request body */
+int mk_http_body_continue_queue(struct mk_http_session *cs,
+                                struct mk_http_request *sr);
+int mk_http_body_continue(struct mk_http_session *cs,
+                          struct mk_http_request *sr);
+int mk_http_body_pause(struct mk_http_session *cs);
+int mk_http_body_resume(struct mk_http_session *cs);
+int mk_http_body_recv(struct mk_http_session *cs, struct mk_http_request *sr,
+                      char *buf, size_t size);
+
+int mk_http_accept_encoding(mk_ptr_t *header);
+int mk_http_compress_start(struct mk_http_request *sr);
 
 #define mk_http_session_get(conn)               \
     (struct mk_http_session *)                  \
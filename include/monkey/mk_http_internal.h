@@ -22,8 +22,56 @@
 
 #include <monkey/mk_stream.h>
 
+struct mk_stream_deflate;
+struct mk_vhost_handler;
+struct mk_http_upload;
+struct mk_vhost_cache_rule;
+
 #define MK_HEADER_IOV         32
 #define MK_HEADER_ETAG_SIZE   32
+#define MK_HEADER_LM_SIZE     32
+#define MK_HEADER_CL_SIZE     24
+#define MK_HEADER_RANGE_SIZE  96
+
+/*
+ * Byte ranges: a Range header with more than MK_HTTP_RANGES_MAX ranges is
+ * ignored and the full entity is served. Overlapping and adjacent ranges are
+ * coalesced, so a range set can never send more than the file size plus the
+ * multipart boundaries.
+ */
+#define MK_HTTP_RANGES_MAX        16
+#define MK_HTTP_RANGES_IGNORE     -2
+
+/* Resolved byte range, offsets are inclusive */
+struct mk_http_range {
+    off_t start;
+    off_t end;
+};
+
+/* A multipart/byteranges body part: boundary headers and the file slice */
+struct mk_http_range_part {
+    struct mk_iov iov;
+    struct iovec io[3];
+    char content_range[80];
+    struct mk_stream_input in_headers;
+    struct mk_stream_input in_file;
+};
+
+struct mk_http_multipart {
+    int n_parts;
+    int delim_len;
+    int close_len;
+    int content_type_len;
+    char delim[32];                /* CRLF "--" boundary CRLF           */
+    char close[32];                /* CRLF "--" boundary "--" CRLF      */
+    char content_type[80];
+
+    struct mk_iov tail_iov;
+    struct iovec tail_io[1];
+    struct mk_stream_input in_tail;
+
+    struct mk_http_range_part parts[];
+};
 
 struct response_headers
 {
@@ -52,17 +100,35 @@ struct response_headers
 
     int upgrade;
 
-    int ranges[2];
+    long ranges[2];
 
     time_t last_modified;
     mk_ptr_t allow_methods;
     mk_ptr_t content_type;
     mk_ptr_t content_encoding;
+    mk_ptr_t vary;
     char *location;
 
     int  etag_len;
     char etag_buf[MK_HEADER_ETAG_SIZE];
 
+    /*
+     * Last-Modified and Content-Length values: the headers of a pipelined
+     * batch are written after all of them were composed.
+     */
+    char lm_buf[MK_HEADER_LM_SIZE];
+    char cl_buf[MK_HEADER_CL_SIZE];
+    char range_buf[MK_HEADER_RANGE_SIZE];
+
+    /*
+     * Last-Modified, Content-Type, ETag and Content-Length rows
+     * precomposed by the open file cache (response cache hits)
+     */
+    mk_ptr_t entity_rows;
+
+    /* Cache policy of a static file: Cache-Control and Expires rows */
+    struct mk_vhost_cache_rule *cache_policy;
+
     /*
      * This field allow plugins to add their own response
      * headers
@@ -78,6 +144,22 @@ struct response_headers
     void *__iov_buf[MK_HEADER_IOV];
 };
 
+/*
+ * Request phases timestamps taken from mk_clock_mono(), a phase the request
+ * did not go through keeps a zero value. They are available to the STAGE_40
+ * plugins, e.g: the logger slow requests log.
+ */
+struct mk_http_timing {
+    uint64_t arrive;      /* connection accepted, or request read start */
+    uint64_t read;        /* first data of the request read             */
+    uint64_t parsed;      /* request headers (and buffered body) parsed */
+    uint64_t matched;     /* virtual host and handler matched           */
+    uint64_t opened;      /* static file opened                         */
+    uint64_t stage30;     /* STAGE_30 handler returned                  */
+    uint64_t first_byte;  /* first byte of the response written         */
+    uint64_t last_byte;   /* last byte of the response written          */
+};
+
 struct mk_http_request
 {
     int status;
@@ -86,6 +168,10 @@ struct mk_http_request
     /* is it serving a user's home directory ? */
     int user_home;
 
+    /* waiting for the home directory to be resolved (mk_user.c) */
+    int user_wait;
+    struct mk_list _user_head;
+
     /*-Connection-*/
     long port;
     /*------------*/
@@ -93,6 +179,12 @@ struct mk_http_request
     /* Body Stream size */
     uint64_t stream_size;
 
+    /* On-the-fly compressor of the body (if any) */
+    struct mk_stream_deflate *deflate;
+
+    /* multipart/byteranges body (multiple ranges requested) */
+    struct mk_http_multipart *multipart;
+
     /* Streams handling: headers and static file */
     struct mk_stream stream;
     struct mk_stream_input in_headers;
@@ -100,6 +192,12 @@ struct mk_http_request
     struct mk_stream_input in_file;
     struct mk_stream_input page_stream;
 
+    /* Interim '100 Continue', queued right before the response stream */
+    struct mk_stream stream_continue;
+    struct mk_stream_input in_continue;
+    struct mk_iov iov_continue;
+    struct iovec io_continue[1];
+
     int headers_len;
 
     /*----First header of client request--*/
@@ -122,8 +220,13 @@ struct mk_http_request
     mk_ptr_t host;
     mk_ptr_t host_port;
     mk_ptr_t if_modified_since;
+    mk_ptr_t if_unmodified_since;
+    mk_ptr_t if_match;
+    mk_ptr_t if_none_match;
+    mk_ptr_t if_range;
     mk_ptr_t last_modified_since;
     mk_ptr_t range;
+    mk_ptr_t accept_encoding;
 
     /*---------------------*/
 
@@ -131,6 +234,21 @@ struct mk_http_request
     mk_ptr_t data;
     /*-----------------*/
 
+    /*
+     * Request body streaming: when the handler consumes the body as it
+     * arrives, 'data' holds only the bytes received with the headers and
+     * the rest is read from the socket on demand.
+     */
+    int body_checked;              /* body mode already decided            */
+    int body_stream;               /* body is streamed to the handler      */
+    int body_expect;               /* client waits for '100 Continue'      */
+    int body_continue;             /* '100 Continue' left to the write ev. */
+    long body_left;                /* bytes still pending on the socket    */
+    unsigned long body_offset;     /* bytes of 'data' already consumed     */
+
+    /* Body stored to a file by an upload location */
+    struct mk_http_upload *upload;
+
     /*-Internal-*/
     mk_ptr_t real_path;        /* Absolute real path */
 
@@ -163,9 +281,18 @@ struct mk_http_request
      */
     void *stage30_handler;
 
+    /* Handler matching the processed URI, resolved once per request */
+    int handler_resolved;
+    struct mk_vhost_handler *handler;
+
+    /* Redirect rows composed by the vhost rewrite rules */
+    char *rewrite_buf;
+    int rewrite_checked;        /* rewrite rules looked up already */
+
     /* Static file information */
     int file_fd;
     struct file_info file_info;
+    struct mk_file_cache_entry *file_cache;   /* open file cache reference */
 
     /* Vhost */
     int vhost_fdt_id;
@@ -190,6 +317,9 @@ struct mk_http_request
     /* Head to list of requests */
     struct mk_list _head;
 
+    /* Phases timing */
+    struct mk_http_timing timing;
+
     /* Response headers */
     struct response_headers headers;
 };
@@ -45,7 +45,34 @@
 #define MK_HTTP_PARSER_UPGRADE_H2    1
 #define MK_HTTP_PARSER_UPGRADE_H2C   2
 
+/* Transfer-Encoding header values */
+#define MK_HTTP_PARSER_TE_NONE       0
+#define MK_HTTP_PARSER_TE_CHUNKED    1
+#define MK_HTTP_PARSER_TE_UNKNOWN   -1
+
+/* Chunked body decoder return values */
+#define MK_HTTP_CHUNKED_PENDING      0  /* more chunked data is expected     */
+#define MK_HTTP_CHUNKED_DONE         1  /* last chunk and trailers consumed  */
+#define MK_HTTP_CHUNKED_ERROR       -1  /* malformed chunk framing           */
+#define MK_HTTP_CHUNKED_TOO_LARGE   -2  /* chunk size or trailers over limit */
+
+/* Chunked body limits */
+#define MK_HTTP_CHUNK_SIZE_MAX       0x7fffffffL  /* single chunk           */
+#define MK_HTTP_CHUNK_LINE_MAX       1024         /* size line + extensions */
+#define MK_HTTP_CHUNK_TRAILER_MAX    4096         /* all trailer fields     */
+
+/* Byte scan implementations, see mk_http_parser_scan_init() */
+#define MK_HTTP_PARSER_SCAN_AUTO     0
+#define MK_HTTP_PARSER_SCAN_SCALAR   1
+#define MK_HTTP_PARSER_SCAN_SSE42    2
+#define MK_HTTP_PARSER_SCAN_AVX2     3
+
+/*
+ * Unknown headers: the first ones are stored in the parser, the table grows
+ * on the heap up to MK_HEADER_EXTRA_MAX entries.
+ */
 #define MK_HEADER_EXTRA_SIZE         8
+#define MK_HEADER_EXTRA_MAX          128
 
 /* Request levels
  * ==============
@@ -100,27 +127,64 @@ enum mk_request_methods {
  * lookups in the parser and further Monkey core.
  */
 enum mk_request_headers {
-    MK_HEADER_ACCEPT             = 0,
-    MK_HEADER_ACCEPT_CHARSET        ,
-    MK_HEADER_ACCEPT_ENCODING       ,
-    MK_HEADER_ACCEPT_LANGUAGE       ,
-    MK_HEADER_AUTHORIZATION         ,
-    MK_HEADER_CACHE_CONTROL         ,
-    MK_HEADER_COOKIE                ,
-    MK_HEADER_CONNECTION            ,
-    MK_HEADER_CONTENT_LENGTH        ,
-    MK_HEADER_CONTENT_RANGE         ,
-    MK_HEADER_CONTENT_TYPE          ,
-    MK_HEADER_HOST                  ,
-    MK_HEADER_HTTP2_SETTINGS        ,
-    MK_HEADER_IF_MODIFIED_SINCE     ,
-    MK_HEADER_LAST_MODIFIED         ,
-    MK_HEADER_LAST_MODIFIED_SINCE   ,
-    MK_HEADER_RANGE                 ,
-    MK_HEADER_REFERER               ,
-    MK_HEADER_UPGRADE               ,
-    MK_HEADER_USER_AGENT            ,
-    MK_HEADER_SIZEOF                ,
+    MK_HEADER_ACCEPT                         = 0,
+    MK_HEADER_ACCEPT_CHARSET                 ,
+    MK_HEADER_ACCEPT_ENCODING                ,
+    MK_HEADER_ACCEPT_LANGUAGE                ,
+    MK_HEADER_ACCESS_CONTROL_REQUEST_HEADERS ,
+    MK_HEADER_ACCESS_CONTROL_REQUEST_METHOD  ,
+    MK_HEADER_AUTHORIZATION                  ,
+    MK_HEADER_CACHE_CONTROL                  ,
+    MK_HEADER_CONNECTION                     ,
+    MK_HEADER_CONTENT_ENCODING               ,
+    MK_HEADER_CONTENT_LENGTH                 ,
+    MK_HEADER_CONTENT_RANGE                  ,
+    MK_HEADER_CONTENT_TYPE                   ,
+    MK_HEADER_COOKIE                         ,
+    MK_HEADER_DNT                            ,
+    MK_HEADER_EXPECT                         ,
+    MK_HEADER_FORWARDED                      ,
+    MK_HEADER_HOST                           ,
+    MK_HEADER_HTTP2_SETTINGS                 ,
+    MK_HEADER_IF_MATCH                       ,
+    MK_HEADER_IF_MODIFIED_SINCE              ,
+    MK_HEADER_IF_NONE_MATCH                  ,
+    MK_HEADER_IF_RANGE                       ,
+    MK_HEADER_IF_UNMODIFIED_SINCE            ,
+    MK_HEADER_KEEP_ALIVE                     ,
+    MK_HEADER_LAST_MODIFIED                  ,
+    MK_HEADER_LAST_MODIFIED_SINCE            ,
+    MK_HEADER_ORIGIN                         ,
+    MK_HEADER_PRAGMA                         ,
+    MK_HEADER_PRIORITY                       ,
+    MK_HEADER_PROXY_AUTHORIZATION            ,
+    MK_HEADER_RANGE                          ,
+    MK_HEADER_REFERER                        ,
+    MK_HEADER_SEC_CH_UA                      ,
+    MK_HEADER_SEC_CH_UA_MOBILE               ,
+    MK_HEADER_SEC_CH_UA_PLATFORM             ,
+    MK_HEADER_SEC_FETCH_DEST                 ,
+    MK_HEADER_SEC_FETCH_MODE                 ,
+    MK_HEADER_SEC_FETCH_SITE                 ,
+    MK_HEADER_SEC_FETCH_USER                 ,
+    MK_HEADER_SEC_WEBSOCKET_EXTENSIONS       ,
+    MK_HEADER_SEC_WEBSOCKET_KEY              ,
+    MK_HEADER_SEC_WEBSOCKET_PROTOCOL         ,
+    MK_HEADER_SEC_WEBSOCKET_VERSION          ,
+    MK_HEADER_TE                             ,
+    MK_HEADER_TRACEPARENT                    ,
+    MK_HEADER_TRACESTATE                     ,
+    MK_HEADER_TRANSFER_ENCODING              ,
+    MK_HEADER_UPGRADE                        ,
+    MK_HEADER_UPGRADE_INSECURE_REQUESTS      ,
+    MK_HEADER_USER_AGENT                     ,
+    MK_HEADER_VIA                            ,
+    MK_HEADER_X_FORWARDED_FOR                ,
+    MK_HEADER_X_FORWARDED_HOST               ,
+    MK_HEADER_X_FORWARDED_PROTO              ,
+    MK_HEADER_X_REAL_IP                      ,
+    MK_HEADER_X_REQUESTED_WITH               ,
+    MK_HEADER_SIZEOF                         ,
 
     /* used by the core for custom headers */
     MK_HEADER_OTHER
@@ -138,6 +202,12 @@ enum mk_request_headers {
 #define MK_UPGRADE_H2          "h2"
 #define MK_UPGRADE_H2C         "h2c"
 
+/* Expect header */
+#define MK_EXPECT_CONTINUE     "100-continue"
+
+/* Transfer-Encoding header */
+#define MK_TE_CHUNKED          "chunked"
+
 struct mk_http_header {
     /* The header type/name, e.g: MK_HEADER_CONTENT_LENGTH */
     int type;
@@ -155,6 +225,34 @@ struct mk_http_header {
     struct mk_list _head;
 };
 
+/* Chunked decoder states */
+enum {
+    MK_CHUNK_SIZE         = 0,   /* chunk size hex digits               */
+    MK_CHUNK_EXT             ,   /* chunk extensions, ignored           */
+    MK_CHUNK_SIZE_LF         ,
+    MK_CHUNK_DATA            ,
+    MK_CHUNK_DATA_CR         ,
+    MK_CHUNK_DATA_LF         ,
+    MK_CHUNK_TRAILER         ,   /* start of a trailer line or last CRLF */
+    MK_CHUNK_TRAILER_LINE    ,
+    MK_CHUNK_TRAILER_LF      ,
+    MK_CHUNK_END_LF          ,
+    MK_CHUNK_DONE
+};
+
+/*
+ * Incremental decoder for a chunked body, it keeps the framing state
+ * between reads so the body can be decoded as it arrives.
+ */
+struct mk_http_chunked {
+    int                        state;
+    int                        digits;     /* hex digits in the size line  */
+    int                        line_len;   /* size line length so far      */
+    int                        trailer_len;
+    long int                   chunk_left; /* data bytes left in the chunk */
+    long int                   decoded;    /* body bytes decoded so far    */
+};
+
 /* This structure is the 'Parser Context' */
 struct mk_http_parser {
     int                        i;
@@ -193,13 +291,30 @@ struct mk_http_parser {
      */
     int                        header_upgrade;
 
+    /* Expect: 100-continue was sent by the client */
+    int                        header_expect_continue;
+
+    /*
+     * Transfer-Encoding header value:
+     *
+     * MK_HTTP_PARSER_TE_NONE    : header not set
+     * MK_HTTP_PARSER_TE_CHUNKED : chunked, the body is decoded by 'chunk'
+     * MK_HTTP_PARSER_TE_UNKNOWN : any other coding (not supported)
+     */
+    int                        header_transfer_encoding;
+    struct mk_http_chunked     chunk;
+
+    /*
+     * Streamed body: once the headers are complete the request is reported
+     * as ready with the body bytes received so far, the handler reads the
+     * rest (set by the core before resuming the parser).
+     */
+    int                        body_stream;
+
     /* probable current header, fly parsing */
     int                        header_key;
     int                        header_sep;
     int                        header_val;
-    int                        header_min;
-    int                        header_max;
-    int                        headers_extra_count;
 
     /* Known headers */
     struct mk_http_header      headers[MK_HEADER_SIZEOF];
@@ -208,8 +323,15 @@ struct mk_http_parser {
     int                        header_count;
     struct mk_list             header_list;
 
-    /* Extra headers */
-    struct mk_http_header      headers_extra[MK_HEADER_EXTRA_SIZE];
+    /*
+     * Extra headers: unknown ones and repeated known ones. The table points
+     * to 'headers_extra_fixed' until it grows, a grown table is kept for the
+     * next requests of the session (see mk_http_parser_init()).
+     */
+    int                        headers_extra_count;
+    int                        headers_extra_size;
+    struct mk_http_header     *headers_extra;
+    struct mk_http_header      headers_extra_fixed[MK_HEADER_EXTRA_SIZE];
 };
 
 
@@ -311,10 +433,31 @@ static inline int eval_field(struct mk_http_parser *req, char *buffer)
     }
 
 
+/*
+ * Reset the parser for a new request. A table of extra headers grown by a
+ * previous request is kept, 'headers_extra' must be NULL on the first call.
+ */
 static inline void mk_http_parser_init(struct mk_http_parser *p)
 {
+    int extra_size = 0;
+    struct mk_http_header *extra = NULL;
+
+    if (p->headers_extra && p->headers_extra != p->headers_extra_fixed) {
+        extra = p->headers_extra;
+        extra_size = p->headers_extra_size;
+    }
+
     memset(p, '\0', sizeof(struct mk_http_parser));
 
+    if (extra) {
+        p->headers_extra = extra;
+        p->headers_extra_size = extra_size;
+    }
+    else {
+        p->headers_extra = p->headers_extra_fixed;
+        p->headers_extra_size = MK_HEADER_EXTRA_SIZE;
+    }
+
     p->level  = REQ_LEVEL_FIRST;
     p->status = MK_ST_REQ_METHOD;
     p->chars  = -1;
@@ -324,8 +467,6 @@ static inline void mk_http_parser_init(struct mk_http_parser *p)
     p->header_key = -1;
     p->header_sep = -1;
     p->header_val = -1;
-    p->header_min = -1;
-    p->header_max = -1;
     p->header_content_length = -1;
 
     /* init list header */
@@ -342,7 +483,63 @@ static inline int mk_http_parser_more(struct mk_http_parser *p, int len)
     return MK_FALSE;
 }
 
+/* The body of the request uses the chunked transfer coding */
+static inline int mk_http_parser_chunked(struct mk_http_parser *p)
+{
+    return (p->header_transfer_encoding == MK_HTTP_PARSER_TE_CHUNKED);
+}
+
+/*
+ * Bytes the rest of a chunked body has for sure, reading up to this amount
+ * never consumes data of a pipelined request that follows the body.
+ */
+static inline long mk_http_chunked_want(struct mk_http_chunked *c)
+{
+    /* the shortest ending is the last chunk: '0' CRLF CRLF */
+    long next = 5;
+
+    switch (c->state) {
+    case MK_CHUNK_SIZE:
+        if (c->digits == 0) {
+            return next;
+        }
+        /* fall through */
+    case MK_CHUNK_EXT:
+        if (c->chunk_left == 0) {
+            return 4;
+        }
+        return c->chunk_left + 4 + next;
+    case MK_CHUNK_SIZE_LF:
+        if (c->chunk_left == 0) {
+            return 3;
+        }
+        return c->chunk_left + 3 + next;
+    case MK_CHUNK_DATA:
+        return c->chunk_left + 2 + next;
+    case MK_CHUNK_DATA_CR:
+        return 2 + next;
+    case MK_CHUNK_DATA_LF:
+        return 1 + next;
+    case MK_CHUNK_TRAILER:
+        return 2;
+    case MK_CHUNK_TRAILER_LINE:
+        return 4;
+    case MK_CHUNK_TRAILER_LF:
+        return 3;
+    case MK_CHUNK_END_LF:
+        return 1;
+    }
+
+    return 0;
+}
+
+int mk_http_chunked_decode(struct mk_http_chunked *c,
+                           char *in, size_t in_len, char *out,
+                           size_t *consumed, size_t *produced);
+
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len, struct mk_server *server);
+int mk_http_parser_scan_init(int type);
+int mk_http_header_index(const char *key, int len);
 
 #endif /* MK_HTTP_H */
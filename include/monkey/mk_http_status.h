@@ -50,6 +50,8 @@
 #define	MK_REDIR_SEE_OTHER			303
 #define MK_NOT_MODIFIED			        304
 #define MK_REDIR_USE_PROXY			305
+#define MK_REDIR_TEMPORARY			307
+#define MK_REDIR_PERMANENT			308
 
 /* Client Errors */
 #define MK_CLIENT_BAD_REQUEST			400
@@ -28,6 +28,7 @@
 #define MK_HTTP_THREAD_PLUGIN  1
 
 struct mk_http_thread {
+    int cancelled;                    /* client went away?       */
     struct mk_http_session *session;  /* HTTP session            */
     struct mk_http_request *request;  /* HTTP request            */
     struct mk_thread       *parent;   /* Parent thread           */
@@ -51,5 +52,6 @@ int mk_http_thread_event(struct mk_event *event);
 
 int mk_http_thread_start(struct mk_http_thread *mth);
 int mk_http_thread_purge(struct mk_http_thread *mth);
+int mk_http_thread_cancel(struct mk_http_thread *mth);
 
 #endif
@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_HTTP_UPLOAD_H
+#define MK_HTTP_UPLOAD_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http.h>
+
+/*
+ * Upload Locations
+ * ----------------
+ * The UPLOAD section of a virtual host maps a path prefix to a directory:
+ * a PUT or POST under the prefix stores the request body as the file named
+ * by the rest of the path. The body goes to a temporary file next to the
+ * target as it arrives, without being buffered in the request, and the
+ * file is renamed into place once complete (201 Created, or 204 No Content
+ * if it replaced a file).
+ *
+ * On Linux a plain (non TLS) body with a known length is moved from the
+ * socket to the file with splice() through a pipe, so it is never copied
+ * to user space. Chunked and TLS bodies are read and written in pieces of
+ * MK_HTTP_BODY_CHUNK bytes.
+ */
+
+#define MK_HTTP_UPLOAD_MAX_SIZE    1024           /* default limit, MB    */
+#define MK_HTTP_UPLOAD_PIPE_SIZE   (1024 * 1024)  /* splice pipe capacity */
+
+struct mk_http_upload_rule {
+    char *prefix;
+    size_t prefix_len;
+    char *dir;                     /* directory receiving the files        */
+    long max_size;                 /* bytes, zero means no limit           */
+    struct mk_list _head;          /* link to vhost->uploads               */
+};
+
+/* Body being stored for a request */
+struct mk_http_upload {
+    int fd;                        /* temporary file                       */
+    int pipe[2];                   /* splice pipe, -1 if not used          */
+    int replace;                   /* target existed                       */
+    long received;
+    long max_size;
+    char *path;                    /* target file                          */
+    char *tmp_path;                /* temporary file, NULL once renamed    */
+};
+
+struct mk_http_upload_rule *mk_http_upload_rule_create(char *val);
+void mk_http_upload_rule_free(struct mk_http_upload_rule *rule);
+struct mk_http_upload_rule *mk_http_upload_lookup(struct mk_http_request *sr);
+
+int mk_http_upload_start(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_http_upload_rule *rule);
+int mk_http_upload_read(struct mk_http_session *cs,
+                        struct mk_http_request *sr);
+void mk_http_upload_free(struct mk_http_request *sr);
+
+#endif
@@ -49,6 +49,9 @@ MK_EXPORT int mk_vhost_create(mk_ctx_t *ctx, char *name);
 MK_EXPORT int mk_vhost_set(mk_ctx_t *ctx, int vid, ...);
 MK_EXPORT int mk_vhost_handler(mk_ctx_t *ctx, int vid, char *regex,
                                void (*cb)(mk_request_t *, void *), void *data);
+MK_EXPORT int mk_vhost_handler_stream(mk_ctx_t *ctx, int vid, char *regex,
+                                      void (*cb)(mk_request_t *, void *),
+                                      void *data);
 
 MK_EXPORT int mk_http_status(mk_request_t *req, int status);
 MK_EXPORT int mk_http_header(mk_request_t *req,
@@ -57,6 +60,7 @@ MK_EXPORT int mk_http_header(mk_request_t *req,
 MK_EXPORT int mk_http_send(mk_request_t *req, char *buf, size_t len,
                            void (*cb_finish)(mk_request_t *));
 MK_EXPORT int mk_http_done(mk_request_t *req);
+MK_EXPORT long mk_http_body_read(mk_request_t *req, char *buf, size_t size);
 
 MK_EXPORT int mk_worker_callback(mk_ctx_t *ctx,
                                  void (*cb_func) (void *),
@@ -23,7 +23,7 @@
 #ifndef MK_MIMETYPE_H
 #define MK_MIMETYPE_H
 
-#define MIMETYPE_DEFAULT_TYPE "text/plain\r\n"
+#define MIMETYPE_DEFAULT_TYPE "text/plain"
 #define MIMETYPE_DEFAULT_NAME "default"
 
 struct mk_mimetype
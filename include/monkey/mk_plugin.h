@@ -116,6 +116,10 @@ struct plugin_api
     int   (*http_request_error) (int, struct mk_http_session *,
                                  struct mk_http_request *, struct mk_plugin *);
 
+    /* Streamed request body flow control */
+    int   (*http_body_pause) (struct mk_http_session *);
+    int   (*http_body_resume) (struct mk_http_session *);
+
     /* memory functions */
     void *(*mem_alloc) (const size_t size);
     void *(*mem_alloc_z) (const size_t size);
@@ -300,6 +304,15 @@ struct mk_plugin_stage {
                             struct mk_http_request *, int, struct mk_list *);
     int (*stage30_hangup) (struct mk_plugin *, struct mk_http_session *,
                            struct mk_http_request *);
+    int (*stage30_cancel) (struct mk_plugin *, struct mk_http_session *,
+                           struct mk_http_request *);
+
+    /*
+     * Optional: receive the request body as it arrives instead of waiting
+     * for it to be buffered. The last argument is set on the final piece.
+     */
+    int (*stage30_body) (struct mk_plugin *, struct mk_http_session *,
+                         struct mk_http_request *, char *, size_t, int);
     int (*stage40) (struct mk_http_session *, struct mk_http_request *);
     int (*stage50) (int);
 
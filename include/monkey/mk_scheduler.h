@@ -33,8 +33,40 @@
 #define MK_SCHED_CONN_TIMEOUT    -1
 #define MK_SCHED_CONN_CLOSED     -2
 
+/* conn->is_timeout_on: idle persistent connection, in ka_idle_queue */
+#define MK_SCHED_CONN_KA_IDLE     2
+
+/*
+ * Keep-alive governor: up to MK_SCHED_KA_LOW percent of the worker
+ * capacity the configured KeepAliveTimeout and MaxKeepAliveRequest apply,
+ * above it they shrink linearly down to the MK_SCHED_KA_MIN_* values
+ * reached at MK_SCHED_KA_HIGH percent. From there the oldest idle
+ * connections are closed to make room for new clients.
+ */
+#define MK_SCHED_KA_LOW           50
+#define MK_SCHED_KA_HIGH          90
+#define MK_SCHED_KA_MIN_TIMEOUT   1
+#define MK_SCHED_KA_MIN_REQUESTS  4
+
+/*
+ * Data rates: a connection receiving a request (headers or body) or
+ * draining a response is watched from the start of that phase. Past
+ * MK_SCHED_RATE_GRACE seconds it must have moved MinRequestRate or
+ * MinResponseRate bytes per second on average (for a response, the bytes
+ * the client acknowledged), and the headers must be complete within
+ * MaxHeaderTime seconds. The body phase is suspended while the handler
+ * holds the body back.
+ */
+#define MK_SCHED_RATE_NONE        0
+#define MK_SCHED_RATE_HEADER      1
+#define MK_SCHED_RATE_BODY        2
+#define MK_SCHED_RATE_DRAIN       3
+#define MK_SCHED_RATE_GRACE       5
+
 #define MK_SCHED_SIGNAL_DEADBEEF  0xDEADBEEF
 #define MK_SCHED_SIGNAL_FREE_ALL  0xFFEE0000
+#define MK_SCHED_SIGNAL_HANDOFF   0xFFEE0001
+#define MK_SCHED_SIGNAL_USER      0xFFEE0002
 
 /*
  * Scheduler balancing mode:
@@ -96,6 +128,16 @@ struct mk_sched_worker
     /* If using REUSEPORT, this points to the list of listeners */
     struct mk_list *listeners;
 
+    /* Worker pool where this worker belongs, NULL for the default pool */
+    struct mk_config_pool *pool;
+
+    /*
+     * Connections handed off by other workers, they are registered
+     * on this worker event loop once MK_SCHED_SIGNAL_HANDOFF arrives.
+     */
+    pthread_mutex_t handoff_mutex;
+    struct mk_list handoff_queue;
+
     /*
      * List head for finished requests that need to be cleared after each
      * event loop round.
@@ -106,6 +148,27 @@ struct mk_sched_worker
     struct mk_list threads;
     struct mk_list threads_purge;
 
+    /*
+     * Idle persistent connections waiting for their next request, the
+     * oldest first, and the keep-alive settings in effect for the
+     * current load of the worker (mk_sched_ka_update()).
+     */
+    struct mk_list ka_idle_queue;
+    unsigned int capacity;             /* connections for this worker  */
+    int ka_timeout;
+    int ka_max_requests;
+    unsigned long long ka_pressure_closed;
+
+    /*
+     * Connections in a receive or drain phase (conn->rate_mode), checked
+     * every second against the minimum data rates, and the number of
+     * connections shed for each limit.
+     */
+    int rate_limits;                   /* any rate limit configured ?  */
+    struct mk_list rate_queue;
+    unsigned long long shed_header_time;
+    unsigned long long shed_request_rate;
+    unsigned long long shed_response_rate;
 };
 
 
@@ -116,12 +179,19 @@ struct mk_sched_conn
     int status;                        /* connection status            */
     uint32_t properties;
     char is_timeout_on;                /* registered to timeout queue? */
+                                       /* or MK_SCHED_CONN_KA_IDLE     */
     time_t arrive_time;                /* arrive time                  */
+    uint64_t arrive_clock;             /* arrive time, mk_clock_mono() */
     struct mk_sched_handler *protocol; /* protocol handler             */
     struct mk_server_listen *server_listen;
     struct mk_plugin_network *net;     /* I/O network layer            */
     struct mk_channel channel;         /* stream channel               */
-    struct mk_list timeout_head;       /* link to the timeout queue    */
+    struct mk_list timeout_head;       /* link to the timeout or idle  */
+                                       /* queue                        */
+    char rate_mode;                    /* MK_SCHED_RATE_*              */
+    time_t rate_start;                 /* start of the watched phase   */
+    unsigned long rate_bytes;          /* bytes moved in the phase     */
+    struct mk_list rate_head;          /* link to the rate queue       */
     void *data;                        /* optional ref for protocols   */
 };
 
@@ -149,6 +219,15 @@ struct mk_sched_handler
      *             callback indicate to the scheduler of the channel should be
      *             closed or not: -1 = close, 0 = leave it open and wait for more
      *             data.
+     * - cb_cancel: callback triggered when the remote peer hung up while the
+     *             connection is still registered (e.g: EPOLLRDHUP). It lets
+     *             the protocol abort pending work that nobody will read. This
+     *             callback is optional, a return value of -1 tells the
+     *             scheduler to close the connection right away.
+     * - cb_handoff: callback triggered on the worker that receives a
+     *             connection handed off by another worker pool, it gets the
+     *             data that was already read from the socket. A return value
+     *             of -1 tells the scheduler to close the connection.
      */
     const char *name;
     int (*cb_read)  (struct mk_sched_conn *, struct mk_sched_worker *,
@@ -157,6 +236,10 @@ struct mk_sched_handler
                      struct mk_server *);
     int (*cb_done)  (struct mk_sched_conn *, struct mk_sched_worker *,
                      struct mk_server *);
+    int (*cb_cancel) (struct mk_sched_conn *, struct mk_sched_worker *,
+                      struct mk_server *);
+    int (*cb_handoff) (struct mk_sched_conn *, struct mk_sched_worker *,
+                       char *, size_t, struct mk_server *);
     int (*cb_upgrade) (void *, void *, struct mk_server *);
 
     /*
@@ -196,6 +279,15 @@ struct mk_sched_thread_conf {
     struct mk_server *server;
 };
 
+/* A connection moving from one worker to another */
+struct mk_sched_handoff {
+    int fd;
+    char *data;                              /* data already read */
+    size_t size;
+    struct mk_server_listen *server_listen;
+    struct mk_list _head;
+};
+
 struct mk_sched_worker_cb {
     void (*cb_func) (void *);
     void *data;
@@ -209,13 +301,18 @@ struct mk_sched_worker_cb {
 struct mk_sched_ctx {
     /* Array of sched_worker */
     struct mk_sched_worker *workers;
+
+    /* Total number of workers: default pool + [WORKER_POOL] sections */
+    int n_workers;
 };
 
 extern pthread_mutex_t mutex_worker_init;
 extern pthread_mutex_t mutex_worker_exit;
 pthread_mutex_t mutex_port_init;
 
-struct mk_sched_worker *mk_sched_next_target();
+struct mk_sched_worker *mk_sched_next_target(struct mk_server *server);
+struct mk_sched_worker *mk_sched_pool_target(struct mk_config_pool *pool,
+                                             struct mk_server *server);
 int mk_sched_init(struct mk_server *server);
 int mk_sched_exit(struct mk_server *server);
 
@@ -249,6 +346,15 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
                              struct mk_sched_worker *sched,
                              struct mk_server *server);
 
+void mk_sched_ka_update(struct mk_sched_worker *sched,
+                        struct mk_server *server);
+int mk_sched_ka_check(struct mk_sched_worker *sched,
+                      struct mk_server *server);
+void mk_sched_conn_rate_drain(struct mk_sched_conn *conn,
+                              struct mk_sched_worker *sched,
+                              size_t bytes);
+int mk_sched_rate_check(struct mk_sched_worker *sched,
+                        struct mk_server *server);
 int mk_sched_check_timeouts(struct mk_sched_worker *sched,
                             struct mk_server *server);
 
@@ -262,6 +368,13 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
                            struct mk_sched_worker *sched,
                            struct mk_server *server);
 
+int mk_sched_conn_handoff(struct mk_sched_conn *conn,
+                          struct mk_sched_worker *sched,
+                          struct mk_sched_worker *target,
+                          char *data, size_t size);
+int mk_sched_conn_handoff_resume(struct mk_sched_worker *sched,
+                                 struct mk_server *server);
+
 struct mk_sched_conn *mk_sched_get_connection(struct mk_sched_worker
                                                      *sched, int remote_fd);
 int mk_sched_update_conn_status(struct mk_sched_worker *sched, int remote_fd,
@@ -280,6 +393,9 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
                          struct mk_server *server);
 
+int mk_sched_event_cancel(struct mk_sched_conn *conn,
+                          struct mk_sched_worker *sched,
+                          struct mk_server *server);
 
 int mk_sched_event_close(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
@@ -304,6 +420,12 @@ static inline void mk_sched_event_free_all(struct mk_sched_worker *sched)
 static inline void mk_sched_conn_timeout_add(struct mk_sched_conn *conn,
                                              struct mk_sched_worker *sched)
 {
+    /* An idle persistent connection got a new request */
+    if (conn->is_timeout_on == MK_SCHED_CONN_KA_IDLE) {
+        mk_list_del(&conn->timeout_head);
+        conn->is_timeout_on = MK_FALSE;
+    }
+
     if (conn->is_timeout_on == MK_FALSE) {
         mk_list_add(&conn->timeout_head, &sched->timeout_queue);
         conn->is_timeout_on = MK_TRUE;
@@ -312,12 +434,64 @@ static inline void mk_sched_conn_timeout_add(struct mk_sched_conn *conn,
 
 static inline void mk_sched_conn_timeout_del(struct mk_sched_conn *conn)
 {
-    if (conn->is_timeout_on == MK_TRUE) {
+    if (conn->is_timeout_on != MK_FALSE) {
         mk_list_del(&conn->timeout_head);
         conn->is_timeout_on = MK_FALSE;
     }
 }
 
+/*
+ * Enter a receive or drain phase, MK_SCHED_RATE_NONE ends it. The
+ * counters restart when the phase changes.
+ */
+static inline void mk_sched_conn_rate(struct mk_sched_conn *conn,
+                                      struct mk_sched_worker *sched,
+                                      int mode, time_t now)
+{
+    if (conn->rate_mode == mode || sched->rate_limits == MK_FALSE) {
+        return;
+    }
+
+    if (conn->rate_mode == MK_SCHED_RATE_NONE) {
+        mk_list_add(&conn->rate_head, &sched->rate_queue);
+    }
+    else if (mode == MK_SCHED_RATE_NONE) {
+        mk_list_del(&conn->rate_head);
+    }
+    conn->rate_mode = mode;
+    conn->rate_start = now;
+    conn->rate_bytes = 0;
+}
+
+static inline void mk_sched_conn_rate_add(struct mk_sched_conn *conn,
+                                          unsigned long bytes)
+{
+    conn->rate_bytes += bytes;
+}
+
+static inline void mk_sched_conn_rate_del(struct mk_sched_conn *conn)
+{
+    if (conn->rate_mode != MK_SCHED_RATE_NONE) {
+        mk_list_del(&conn->rate_head);
+        conn->rate_mode = MK_SCHED_RATE_NONE;
+    }
+}
+
+/*
+ * The connection waits for the next request: it goes to the tail of the
+ * idle queue, 'now' is the time it became idle.
+ */
+static inline void mk_sched_conn_idle_add(struct mk_sched_conn *conn,
+                                          struct mk_sched_worker *sched,
+                                          time_t now)
+{
+    mk_sched_conn_timeout_del(conn);
+    mk_sched_conn_rate_del(conn);
+    mk_list_add(&conn->timeout_head, &sched->ka_idle_queue);
+    conn->is_timeout_on = MK_SCHED_CONN_KA_IDLE;
+    conn->arrive_time = now;
+}
+
 
 #define mk_sched_conn_read(conn, buf, s)                \
     conn->net->read(conn->event.fd, buf, s)
@@ -36,6 +36,14 @@ struct mk_server_listen
     struct mk_plugin *network;
     struct mk_sched_handler *protocol;
     struct mk_config_listener *listen;
+
+    /* Accept queue telemetry, updated by mk_server_listen_sample() */
+    int backlog;                     /* requested listen(2) backlog    */
+    unsigned int queue_len;          /* connections waiting (last)     */
+    unsigned int queue_max;          /* queue limit set by the Kernel  */
+    unsigned int queue_peak;         /* highest queue length sampled   */
+    unsigned long long queue_full;   /* samples with a full queue      */
+
     struct mk_list _head;
 };
 
@@ -62,6 +70,8 @@ int mk_server_listen_check(struct mk_server_listen *listen, int server_fd);
 
 void mk_server_listen_free();
 struct mk_list *mk_server_listen_init(struct mk_server *server);
+void mk_server_listen_sample(struct mk_list *listeners);
+void mk_server_listen_overflows(struct mk_server *server);
 
 unsigned int mk_server_capacity(struct mk_server *server);
 void mk_server_launch_workers(struct mk_server *server);
@@ -62,6 +62,8 @@ int mk_socket_set_tcp_nodelay(int sockfd);
 int mk_socket_set_tcp_defer_accept(int sockfd);
 int mk_socket_set_tcp_reuseport(int sockfd);
 int mk_socket_set_nonblocking(int sockfd);
+int mk_socket_set_linger_reset(int sockfd);
+int mk_socket_unsent(int sockfd);
 
 int mk_socket_create(int domain, int type, int protocol);
 int mk_socket_connect(char *host, int port, int async);
@@ -71,7 +73,9 @@ int mk_socket_bind(int socket_fd, const struct sockaddr *addr,
                    socklen_t addrlen, int backlog, struct mk_server *server);
 
 int mk_socket_server(char *port, char *listen_addr,
-                     int reuse_port, struct mk_server *server);
+                     int reuse_port, int backlog, struct mk_server *server);
+int mk_socket_accept_queue(int server_fd, unsigned int *len, unsigned int *max);
+int mk_socket_listen_overflows(unsigned long long *overflows);
 
 int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len);
 
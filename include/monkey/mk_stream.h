@@ -32,6 +32,7 @@
 #define MK_STREAM_IOV       1  /* mk_iov struct        */
 #define MK_STREAM_FILE      2  /* opened file          */
 #define MK_STREAM_SOCKET    3  /* socket, scared..     */
+#define MK_STREAM_DEFLATE   4  /* compressed RAW/IOV   */
 
 /* Channel return values for write event */
 #define MK_CHANNEL_OK       0  /* channel is ok (channel->status) */
@@ -46,6 +47,10 @@
 #define MK_CHANNEL_DISABLED 0 /* channel is sleeping */
 #define MK_CHANNEL_ENABLED  1 /* channel enabled, have some data */
 
+/* Inputs and buffers written together by a single writev(2) */
+#define MK_CHANNEL_GATHER_MAX  16
+#define MK_CHANNEL_GATHER_IOV  64
+
 /*
  * Channel types: by default the only channel supported
  * is a direct write to the network layer.
@@ -321,6 +326,9 @@ static inline void mk_stream_input_consume(struct mk_stream_input *in, long byte
     else if (in->type == MK_STREAM_SOCKET) {
         fmt = "[INPUT_SOCK %p] bytes consumed %lu/%lu";
     }
+    else if (in->type == MK_STREAM_DEFLATE) {
+        fmt = "[INPUT_DEFL %p] bytes consumed %lu/%lu";
+    }
     else if (in->type == MK_STREAM_COPYBUF) {
         fmt = "[INPUT_CBUF %p] bytes consumed %lu/%lu";
     }
@@ -363,6 +371,9 @@ static inline void mk_channel_debug(struct mk_channel *channel)
             case MK_STREAM_SOCKET:
                 printf("     in.%i] %p SOCKET : ", i_input, in);
                 break;
+            case MK_STREAM_DEFLATE:
+                printf("     in.%i] %p DEFLATE: ", i_input, in);
+                break;
             case MK_STREAM_COPYBUF:
                 printf("     in.%i] %p COPYBUF: ", i_input, in);
                 break;
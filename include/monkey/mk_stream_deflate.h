@@ -0,0 +1,167 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_STREAM_DEFLATE_H
+#define MK_STREAM_DEFLATE_H
+
+#include <monkey/mk_info.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_stream.h>
+
+#ifdef MK_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Deflate Stream Input
+ * --------------------
+ * A MK_STREAM_DEFLATE input wraps a RAW or IOV input and compresses it
+ * while the channel consumes it: the compressed data is produced into a
+ * fixed output buffer owned by the compressor, which is refilled only
+ * once the socket took the previous piece. The memory used by a
+ * connection is bounded by the zlib state plus MK_STREAM_DEFLATE_BUF,
+ * no matter the size of the response.
+ *
+ * A compressor is attached to a request and shared by all the inputs
+ * queued for its body, so the output is one compressed stream. Each input
+ * ends with a sync flush (data is delivered to the client right away),
+ * except the last one, which finishes the stream. If the response uses
+ * chunked transfer encoding, the output is framed as HTTP chunks,
+ * including the last-chunk.
+ *
+ * Compressors are kept in a per-worker pool and reset when released, so
+ * a request does not allocate the zlib state.
+ */
+
+#define MK_STREAM_DEFLATE_BUF       16384  /* output buffer size            */
+#define MK_STREAM_DEFLATE_POOL      16     /* idle compressors per worker   */
+#define MK_STREAM_DEFLATE_MEMLEVEL  8
+
+/* Chunk framing room: 'hex-size\r\n' ... '\r\n' + '0\r\n\r\n' */
+#define MK_STREAM_DEFLATE_CHUNK_HDR  8
+#define MK_STREAM_DEFLATE_CHUNK_END  7
+
+/* Compressed data formats */
+#define MK_STREAM_DEFLATE_GZIP      0      /* RFC 1952, 'gzip' coding       */
+#define MK_STREAM_DEFLATE_ZLIB      1      /* RFC 1950, 'deflate' coding    */
+
+struct mk_stream_deflate {
+    int format;
+    int level;
+    int chunked;                     /* frame output as HTTP chunks     */
+    int finished;                    /* last input was queued           */
+
+#ifdef MK_HAVE_ZLIB
+    z_stream strm;
+#endif
+
+    struct mk_stream_input *current; /* input owning the output buffer  */
+    size_t out_end;                  /* end of the pending output       */
+    char out[MK_STREAM_DEFLATE_BUF];
+
+    struct mk_list _head;            /* link to worker pool             */
+};
+
+/* Source of a deflate input: a private RAW or IOV input */
+struct mk_stream_deflate_src {
+    struct mk_stream_input in;
+    int last;                        /* finish the compressed stream ?  */
+    int done;                        /* everything was compressed       */
+
+    /* IOV cursor, the caller mk_iov is not modified */
+    int iov_idx;
+    size_t iov_off;
+};
+
+/* Per worker pool of idle compressors */
+struct mk_stream_deflate_pool {
+    int size;
+    struct mk_list list;
+};
+
+#ifdef MK_HAVE_ZLIB
+
+struct mk_stream_deflate *mk_stream_deflate_get(int format, int level,
+                                                int chunked);
+void mk_stream_deflate_put(struct mk_stream_deflate *d);
+void mk_stream_deflate_worker_exit();
+
+int mk_stream_in_deflate(struct mk_stream *stream,
+                         struct mk_stream_input *in,
+                         struct mk_stream_deflate *d,
+                         int type, void *buffer, size_t size, int last,
+                         void (*cb_finished)(struct mk_stream_input *));
+int mk_stream_deflate_fill(struct mk_stream_input *in);
+
+#else
+
+static inline struct mk_stream_deflate *mk_stream_deflate_get(int format,
+                                                              int level,
+                                                              int chunked)
+{
+    (void) format;
+    (void) level;
+    (void) chunked;
+    return NULL;
+}
+
+static inline void mk_stream_deflate_put(struct mk_stream_deflate *d)
+{
+    (void) d;
+}
+
+static inline void mk_stream_deflate_worker_exit()
+{
+}
+
+static inline int mk_stream_in_deflate(struct mk_stream *stream,
+                                       struct mk_stream_input *in,
+                                       struct mk_stream_deflate *d,
+                                       int type, void *buffer, size_t size,
+                                       int last,
+                                       void (*cb_finished)(struct mk_stream_input *))
+{
+    (void) stream;
+    (void) in;
+    (void) d;
+    (void) type;
+    (void) buffer;
+    (void) size;
+    (void) last;
+    (void) cb_finished;
+    return -1;
+}
+
+static inline int mk_stream_deflate_fill(struct mk_stream_input *in)
+{
+    (void) in;
+    return -1;
+}
+
+#endif /* MK_HAVE_ZLIB */
+
+/* Pending compressed bytes of a deflate input */
+static inline char *mk_stream_deflate_data(struct mk_stream_input *in)
+{
+    struct mk_stream_deflate *d = in->context;
+
+    return d->out + d->out_end - in->bytes_total;
+}
+
+#endif
@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_info.h>
+
+#ifdef MK_HAVE_C_TLS
+
+#ifndef MK_STREAM_DEFLATE_TLS_H
+#define MK_STREAM_DEFLATE_TLS_H
+
+#include <monkey/mk_core.h>
+
+__thread struct mk_stream_deflate_pool *mk_tls_stream_deflate;
+
+#endif /* MK_STREAM_DEFLATE_TLS_H */
+#endif /* MK_HAVE_C_TLS  */
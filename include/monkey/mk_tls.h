@@ -34,6 +34,12 @@ extern __thread struct mk_gmt_cache *mk_tls_cache_gmtext;
 /* mk_vhost.c */
 extern __thread struct mk_list *mk_tls_vhost_fdt;
 
+/* mk_stream_deflate.c */
+extern __thread struct mk_stream_deflate_pool *mk_tls_stream_deflate;
+
+/* mk_user.c */
+extern __thread struct mk_list *mk_tls_user_wait;
+
 /* mk_scheduler.c */
 extern __thread struct rb_root *mk_tls_sched_cs;
 extern __thread struct mk_list *mk_tls_sched_cs_incomplete;
@@ -61,6 +67,12 @@ pthread_key_t mk_tls_cache_gmtext;
 /* mk_vhost.c */
 pthread_key_t mk_tls_vhost_fdt;
 
+/* mk_stream_deflate.c */
+pthread_key_t mk_tls_stream_deflate;
+
+/* mk_user.c */
+pthread_key_t mk_tls_user_wait;
+
 /* mk_scheduler.c */
 pthread_key_t mk_tls_sched_cs;
 pthread_key_t mk_tls_sched_cs_incomplete;
@@ -84,6 +96,12 @@ pthread_key_t mk_tls_server_timeout;
     /* mk_vhost.c */                                            \
     pthread_key_create(&mk_tls_vhost_fdt, NULL);                \
                                                                 \
+    /* mk_stream_deflate.c */                                   \
+    pthread_key_create(&mk_tls_stream_deflate, NULL);           \
+                                                                \
+    /* mk_user.c */                                             \
+    pthread_key_create(&mk_tls_user_wait, NULL);                \
+                                                                \
     /* mk_scheduler.c */                                        \
     pthread_key_create(&mk_tls_sched_cs, NULL);                 \
     pthread_key_create(&mk_tls_sched_cs_incomplete, NULL);      \
@@ -20,15 +20,77 @@
 #ifndef MK_USER_H
 #define MK_USER_H
 
+#include <pthread.h>
+
 #include "mk_http.h"
 #include "mk_http_internal.h"
+#include "mk_scheduler.h"
 
 /* User home string */
 #define MK_USER_HOME '~'
 
+/*
+ * Users cache
+ * -----------
+ * The home directory of the users requested through /~user is resolved by
+ * a background thread, so NSS lookups (LDAP, sssd...) never block a worker.
+ * The results, including unknown users, are cached with a TTL. A request
+ * that misses the cache waits without reading more data, the resolver
+ * wakes up the workers with MK_SCHED_SIGNAL_USER once the answer is ready.
+ * An expired entry keeps answering while it is resolved again. At most
+ * MK_USER_CACHE_PENDING users wait for the resolver, lookups of further
+ * unknown users get a 503 until it catches up.
+ */
+#define MK_USER_CACHE_BUCKETS   64
+#define MK_USER_CACHE_SIZE      1024
+#define MK_USER_CACHE_PENDING   128
+
+/* Entry states */
+#define MK_USER_PENDING         0
+#define MK_USER_FOUND           1
+#define MK_USER_NONE            2
+
+/* mk_user_init() return values: waiting for the resolver, or saturated */
+#define MK_USER_WAIT            1
+#define MK_USER_BUSY            2
+
+struct mk_user_entry {
+    unsigned int hash;
+    char *name;
+    size_t len;
+    char *home;                   /* pw_dir of the user                */
+    int state;
+    int refresh;                  /* expired, queued to resolve again  */
+    time_t expire;
+    struct mk_list _head;         /* link to hash bucket               */
+    struct mk_list _lru;          /* link to the LRU list or the queue */
+};
+
+struct mk_user_cache {
+    int ttl;                      /* seconds                           */
+    int neg_ttl;                  /* unknown users TTL (seconds)       */
+    int entries;
+    int pending;                  /* entries queued or being resolved  */
+    int exit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t tid;
+
+    struct mk_list lru;
+    struct mk_list queue;         /* entries waiting for the resolver  */
+    struct mk_list buckets[MK_USER_CACHE_BUCKETS];
+
+    struct mk_server *server;
+};
+
 /* user.c */
+int mk_user_cache_init(struct mk_server *server);
+void mk_user_cache_exit(struct mk_server *server);
 int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
                  struct mk_server *server);
+void mk_user_resume(struct mk_sched_worker *sched, struct mk_server *server);
+void mk_user_worker_exit();
 int mk_user_set_uidgid(struct mk_server *server);
 int mk_user_undo_uidgid(struct mk_server *server);
 
@@ -40,7 +40,7 @@ struct mk_gmt_cache {
 
 
 int    mk_utils_utime2gmt(char **data, time_t date);
-time_t mk_utils_gmt2utime(char *date);
+time_t mk_utils_gmt2utime(char *date, int len);
 
 int mk_buffer_cat(mk_ptr_t * p, char *buf1, int len1, char *buf2, int len2);
 
@@ -26,6 +26,9 @@
 
 #include <regex.h>
 
+struct mk_vhost_matcher;
+struct mk_vhost_rewrite;
+
 /* Custom error page */
 struct mk_vhost_error_page {
     short int status;
@@ -41,18 +44,36 @@ struct mk_vhost_handler_param {
 
 struct mk_vhost_handler {
     regex_t match;                         /* regex match rule               */
+    char *pattern;                         /* source of the match rule       */
     char *name;                            /* plugin handler name            */
     int n_params;                          /* number of parameters           */
 
     /* optional callback and opaque data for lib mode */
     void (*cb) (struct mk_http_request *, void *);
     void *data;
+    int stream_body;                       /* lib: callback reads the body   */
 
     struct mk_list params;                 /* parameters given by config     */
     struct mk_plugin *handler;             /* handler plugin                 */
+    struct mk_config_pool *pool;           /* worker pool (optional)         */
     struct mk_list _head;                  /* link to vhost->handlers        */
 };
 
+/* On-the-fly compression of dynamic responses */
+#define MK_VHOST_COMPRESSION_LEVEL     6
+#define MK_VHOST_COMPRESSION_MIN_SIZE  256
+#define MK_VHOST_COMPRESSION_TYPES                              \
+    "text/html text/plain text/css text/xml text/javascript "   \
+    "application/javascript application/json application/xml "  \
+    "image/svg+xml"
+
+struct mk_vhost_compression {
+    int enabled;
+    int level;                             /* zlib level: 1-9                */
+    long min_size;                         /* skip smaller known lengths     */
+    struct mk_list *types;                 /* mime types (mk_string_line)    */
+};
+
 struct mk_vhost
 {
     int id;
@@ -62,6 +83,10 @@ struct mk_vhost
     mk_ptr_t documentroot;
     mk_ptr_t header_redirect;
 
+    /* worker pool serving this virtual host (optional) */
+    char *worker_pool;
+    struct mk_config_pool *pool;
+
     /* source configuration */
     struct mk_rconf *config;
 
@@ -70,6 +95,19 @@ struct mk_vhost
 
     /* content handlers */
     struct mk_list handlers;
+    struct mk_vhost_matcher *matcher;      /* compiled handlers match rules */
+
+    /* rewrite and redirect rules (optional) */
+    struct mk_vhost_rewrite *rewrite;
+
+    /* upload locations (struct mk_http_upload_rule) */
+    struct mk_list uploads;
+
+    /* cache policy of static files (struct mk_vhost_cache_rule) */
+    struct mk_list cache_rules;
+
+    /* on-the-fly compression rules */
+    struct mk_vhost_compression compression;
 
     /* link node */
     struct mk_list _head;
@@ -120,6 +158,15 @@ int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server);
 int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server);
 void mk_vhost_free_all(struct mk_server *server);
 int mk_vhost_map_handlers(struct mk_server *server);
+void mk_vhost_compression_init(struct mk_vhost *host);
+int mk_vhost_compression_types(struct mk_vhost *host, char *types);
+int mk_vhost_compression_match(struct mk_vhost *host, mk_ptr_t *row);
+int mk_vhost_matchers_init(struct mk_server *server);
+struct mk_vhost_handler *mk_vhost_handler_lookup(struct mk_vhost *host,
+                                                 char *uri, size_t len);
+struct mk_vhost_handler *mk_vhost_handler_next(struct mk_vhost *host,
+                                               struct mk_vhost_handler *h,
+                                               char *uri);
 struct mk_vhost_handler *mk_vhost_handler_match(char *match,
                                                 void (*cb)(struct mk_http_request *,
                                                            void *),
@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_VHOST_CACHE_H
+#define MK_VHOST_CACHE_H
+
+#include <time.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_mimetype.h>
+
+/*
+ * Cache Policy
+ * ------------
+ * The CACHE section of a virtual host sets the Cache-Control (and
+ * optionally Expires) headers of the static files it serves:
+ *
+ *   Rule <path prefix|*> <mime type|*> <directives>
+ *
+ * A mime type ending with a slash matches the whole family ('image/').
+ * The directives are max-age=N, public, private, no-cache, no-store,
+ * must-revalidate and immutable, plus 'expires' to also send an Expires
+ * header max-age seconds from now. The first matching rule is used.
+ *
+ * The row of every rule is composed when the configuration is read and
+ * the rule is resolved once per open file cache entry, the response cache
+ * folds it in its precomposed entity rows. The Expires rows are updated
+ * by the clock worker every second together with the Date header.
+ */
+
+#define MK_VHOST_CACHE_EXPIRES_SIZE   64
+
+struct mk_vhost_cache_rule {
+    char *prefix;                  /* DocumentRoot + prefix, NULL: any    */
+    size_t prefix_len;
+    char *mime;                    /* NULL: any                           */
+    size_t mime_len;
+    long max_age;                  /* seconds, -1 if not set              */
+    mk_ptr_t row;                  /* 'Cache-Control: ...' + CRLF         */
+
+    /* Expires row, double buffered like the Date header */
+    mk_ptr_t expires;
+    char *expires_buf[2];
+
+    struct mk_list _head;          /* link to vhost->cache_rules          */
+};
+
+struct mk_vhost;
+struct mk_server;
+
+struct mk_vhost_cache_rule *mk_vhost_cache_rule_create(struct mk_vhost *host,
+                                                       char *val);
+void mk_vhost_cache_rule_free(struct mk_vhost_cache_rule *rule);
+struct mk_vhost_cache_rule *mk_vhost_cache_match(struct mk_vhost *host,
+                                                 char *path, size_t len,
+                                                 struct mk_mimetype *mime);
+void mk_vhost_cache_expires_update(struct mk_server *server, time_t utime);
+
+#endif
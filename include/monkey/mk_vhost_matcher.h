@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_VHOST_MATCHER_H
+#define MK_VHOST_MATCHER_H
+
+#include <limits.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Handler Matcher
+ * ---------------
+ * The match rules of the virtual host handlers are compiled when the server
+ * starts. Rules made only of literal alternatives are decomposed:
+ *
+ *   ^/literal       -> prefix trie
+ *   ^/literal$      -> prefix trie (exact match)
+ *   literal$        -> suffix trie (built over the reversed literals)
+ *   literal         -> case insensitive substring search
+ *
+ * Everything else is kept as the original regex. A lookup walks both tries
+ * once, then it only evaluates the substring and regex rules with a higher
+ * priority than the best literal match found. The first matching handler in
+ * configuration order wins, as it always did; all comparisons are case
+ * insensitive like the REG_ICASE regexes.
+ */
+
+#define MK_VHOST_MATCH_NONE      INT_MAX
+
+/* Literal rule kinds */
+#define MK_VHOST_MATCH_PREFIX    0
+#define MK_VHOST_MATCH_EXACT     1
+#define MK_VHOST_MATCH_SUFFIX    2
+#define MK_VHOST_MATCH_SUBSTR    3
+#define MK_VHOST_MATCH_REGEX     4
+
+struct mk_vhost_handler;
+
+/* Trie node, children are linked as a list of siblings */
+struct mk_vhost_matcher_node {
+    unsigned char c;
+    int child;
+    int sibling;
+    int match;                       /* best rule ending here             */
+    int exact;                       /* best rule if the input ends here  */
+};
+
+struct mk_vhost_matcher_trie {
+    int size;
+    int capacity;
+    struct mk_vhost_matcher_node *nodes;   /* nodes[0] is the root */
+};
+
+/* Rule evaluated one by one: substring or regex */
+struct mk_vhost_matcher_scan {
+    int type;
+    int priority;
+    char *literal;
+    size_t len;
+    struct mk_vhost_handler *handler;
+};
+
+struct mk_vhost_matcher {
+    int n_rules;
+    struct mk_vhost_handler **rules;       /* by priority */
+
+    struct mk_vhost_matcher_trie prefix;
+    struct mk_vhost_matcher_trie suffix;
+
+    int n_scan;
+    struct mk_vhost_matcher_scan *scan;    /* sorted by priority */
+};
+
+struct mk_vhost_matcher *mk_vhost_matcher_create(struct mk_list *handlers);
+void mk_vhost_matcher_destroy(struct mk_vhost_matcher *m);
+struct mk_vhost_handler *mk_vhost_matcher_lookup(struct mk_vhost_matcher *m,
+                                                 char *uri, size_t len);
+
+#endif
@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_VHOST_REWRITE_H
+#define MK_VHOST_REWRITE_H
+
+#include <pthread.h>
+#include <regex.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+
+/*
+ * Rewrite and Redirect Rules
+ * --------------------------
+ * The REWRITE section of a virtual host maps request paths to a new
+ * location. The decoded path (without the query string) is looked up
+ * before the file system:
+ *
+ *   Exact  <path>   <target> [action]  -> hash table
+ *   Map    <file>                      -> hash table loaded from a file
+ *   Prefix <prefix> <target> [action]  -> trie, the longest prefix wins
+ *   Regex  <regex>  <target> [action]  -> evaluated in order, last
+ *
+ * The action is the redirect status (301 by default, 302, 303, 307 or
+ * 308) or 'rewrite', which changes the path served internally. The
+ * rest of the path after a prefix is appended to its target, regex
+ * targets can refer to the groups matched as $1 to $9. The query string
+ * of the request is kept unless the target sets one. Paths under a user
+ * home directory (~user) are not looked up.
+ *
+ * The 'Location' and 'Content-Length' rows of the exact redirects are
+ * precomposed when they are loaded. On Linux, the directories holding
+ * the map files are watched and a map that changes is loaded again in
+ * the background, its table is replaced at once.
+ */
+
+#define MK_VHOST_REWRITE_INTERNAL   0       /* action: rewrite the path   */
+#define MK_VHOST_REWRITE_LINE       4096    /* max map file line length   */
+
+/* Exact rule, allocated together with its strings */
+struct mk_vhost_rewrite_entry {
+    unsigned int hash;
+    int action;
+    size_t path_len;
+    char *path;
+    mk_ptr_t target;
+    mk_ptr_t rows;                     /* precomposed redirect rows        */
+};
+
+/* Open addressing hash table of exact rules */
+struct mk_vhost_rewrite_table {
+    unsigned int size;                 /* slots, power of two              */
+    unsigned int count;
+    struct mk_vhost_rewrite_entry **slots;
+};
+
+/* Exact rules, given in the section or loaded from a file */
+struct mk_vhost_rewrite_map {
+    char *file;                        /* NULL: rules of the section       */
+    char *dir;                         /* directory holding the file       */
+    char *name;                        /* file name                        */
+    int wd;                            /* inotify watch descriptor         */
+    pthread_rwlock_t lock;             /* protects the table swap          */
+    struct mk_vhost_rewrite_table *table;
+    struct mk_list _head;
+};
+
+/* Prefix or regex rule */
+struct mk_vhost_rewrite_rule {
+    int action;
+    char *pattern;
+    size_t len;
+    regex_t regex;
+    mk_ptr_t target;
+};
+
+/* Trie node, children are linked as a list of siblings */
+struct mk_vhost_rewrite_node {
+    unsigned char c;
+    int child;
+    int sibling;
+    int rule;                          /* prefix rule ending here, or -1   */
+};
+
+struct mk_vhost_rewrite {
+    struct mk_list maps;                    /* section rules first */
+
+    int n_prefix;
+    struct mk_vhost_rewrite_rule *prefix;
+    int n_nodes;
+    int nodes_size;
+    struct mk_vhost_rewrite_node *nodes;    /* nodes[0] is the root */
+
+    int n_regex;
+    struct mk_vhost_rewrite_rule *regex;
+};
+
+/* Result of a lookup, 'buf' belongs to the caller */
+struct mk_vhost_rewrite_result {
+    int action;
+    char *buf;                         /* rows or the new path            */
+    size_t len;
+    char *query;                       /* rewrite: query string, or NULL  */
+    size_t query_len;
+};
+
+struct mk_vhost_rewrite *mk_vhost_rewrite_create(struct mk_rconf_section *section,
+                                                 char *vhost_file);
+void mk_vhost_rewrite_destroy(struct mk_vhost_rewrite *rw);
+int mk_vhost_rewrite_lookup(struct mk_vhost_rewrite *rw,
+                            mk_ptr_t path, mk_ptr_t query,
+                            struct mk_vhost_rewrite_result *res);
+int mk_vhost_rewrite_watch_init(struct mk_server *server);
+void mk_vhost_rewrite_watch_exit(struct mk_server *server);
+
+#endif
@@ -17,6 +17,8 @@
  *  limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -27,6 +29,9 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_utils.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_vhost_cache.h>
+#include <monkey/mk_server.h>
 
 time_t log_current_utime;
 time_t monkey_init_time;
@@ -90,6 +95,12 @@ static void mk_clock_headers_preset(time_t utime, struct mk_server *server)
 
     headers_preset.data = buffer;
     headers_preset.len  = len1 + len2;
+
+    /* Status lines with the preset rows */
+    mk_header_heads_update(&headers_preset);
+
+    /* Expires rows of the virtual hosts cache policies */
+    mk_vhost_cache_expires_update(server, utime);
 }
 
 void *mk_clock_worker_init(void *data)
@@ -109,6 +120,9 @@ void *mk_clock_worker_init(void *data)
             mk_clock_log_set_time(cur_time);
             mk_clock_headers_preset(cur_time, server);
         }
+
+        /* System wide listen queue drops, one sample for all the workers */
+        mk_server_listen_overflows(server);
         sleep(1);
     }
 
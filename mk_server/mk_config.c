@@ -53,6 +53,24 @@ static int mk_config_key_have(struct mk_list *list, const char *value)
     return MK_FALSE;
 }
 
+/* Lookup the value of a 'key=value' option, NULL if not found */
+static char *mk_config_key_value(struct mk_list *list, const char *key)
+{
+    int len;
+    struct mk_list *head;
+    struct mk_string_line *entry;
+
+    len = strlen(key);
+    mk_list_foreach(head, list) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+        if (entry->len > len && entry->val[len] == '=' &&
+            strncasecmp(entry->val, key, len) == 0) {
+            return entry->val + len + 1;
+        }
+    }
+    return NULL;
+}
+
 void mk_config_listeners_free(struct mk_server *server)
 {
     struct mk_list *tmp;
@@ -68,6 +86,23 @@ void mk_config_listeners_free(struct mk_server *server)
     }
 }
 
+static void mk_config_pools_free(struct mk_server *server)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_config_pool *pool;
+
+    mk_list_foreach_safe(head, tmp, &server->worker_pools) {
+        pool = mk_list_entry(head, struct mk_config_pool, _head);
+        mk_list_del(&pool->_head);
+        if (pool->handlers) {
+            mk_string_split_free(pool->handlers);
+        }
+        mk_mem_free(pool->name);
+        mk_mem_free(pool);
+    }
+}
+
 void mk_config_free_all(struct mk_server *server)
 {
     mk_vhost_free_all(server);
@@ -103,6 +138,7 @@ void mk_config_free_all(struct mk_server *server)
     }
 
     mk_config_listeners_free(server);
+    mk_config_pools_free(server);
 
     mk_ptr_free(&server->server_software);
     mk_mem_free(server);
@@ -151,12 +187,15 @@ int mk_config_listen_parse(char *value, struct mk_server *server)
 {
     int ret = -1;
     int flags = 0;
+    int backlog = 0;
     long port_num;
     char *address = NULL;
     char *port = NULL;
     char *divider;
+    char *tmp;
     struct mk_list *list = NULL;
     struct mk_string_line *listener;
+    struct mk_config_listener *config_listener;
 
     list = mk_string_split_line(value);
     if (!list) {
@@ -229,8 +268,22 @@ int mk_config_listen_parse(char *value, struct mk_server *server)
         flags |= MK_CAP_SOCK_TLS;
     }
 
+    /* Listen queue size */
+    tmp = mk_config_key_value(list, "backlog");
+    if (tmp) {
+        backlog = atoi(tmp);
+        if (backlog <= 0) {
+            mk_warn("[config] Invalid backlog for \"Listen %s\", using default",
+                    listener->val);
+            backlog = 0;
+        }
+    }
+
     /* register the new listener */
-    mk_config_listener_add(address, port, flags, server);
+    config_listener = mk_config_listener_add(address, port, flags, server);
+    if (config_listener) {
+        config_listener->backlog = backlog;
+    }
     mk_string_split_free(list);
     list = NULL;
     ret = 0;
@@ -271,12 +324,109 @@ static int mk_config_listen_read(struct mk_rconf_section *section,
     return 0;
 }
 
+/* Lookup a worker pool by name */
+struct mk_config_pool *mk_config_pool_get(char *name, struct mk_server *server)
+{
+    struct mk_list *head;
+    struct mk_config_pool *pool;
+
+    mk_list_foreach(head, &server->worker_pools) {
+        pool = mk_list_entry(head, struct mk_config_pool, _head);
+        if (strcasecmp(pool->name, name) == 0) {
+            return pool;
+        }
+    }
+
+    return NULL;
+}
+
+/* Lookup the worker pool where a handler plugin is bound (if any) */
+struct mk_config_pool *mk_config_pool_handler(char *handler,
+                                              struct mk_server *server)
+{
+    struct mk_list *head;
+    struct mk_list *head_h;
+    struct mk_string_line *entry;
+    struct mk_config_pool *pool;
+
+    mk_list_foreach(head, &server->worker_pools) {
+        pool = mk_list_entry(head, struct mk_config_pool, _head);
+        if (!pool->handlers) {
+            continue;
+        }
+
+        mk_list_foreach(head_h, pool->handlers) {
+            entry = mk_list_entry(head_h, struct mk_string_line, _head);
+            if (strcasecmp(entry->val, handler) == 0) {
+                return pool;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read the [WORKER_POOL] sections, we don't use mk_rconf_section_get()
+ * because multiple pools can be defined.
+ */
+static int mk_config_pools_read(struct mk_rconf *cnf, char *path,
+                                struct mk_server *server)
+{
+    char *name;
+    struct mk_list *head;
+    struct mk_rconf_section *section;
+    struct mk_config_pool *pool;
+
+    mk_list_foreach(head, &cnf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "WORKER_POOL") != 0) {
+            continue;
+        }
+
+        name = mk_rconf_section_get_key(section, "Name", MK_RCONF_STR);
+        if (!name) {
+            mk_config_print_error_msg("WORKER_POOL Name", path);
+        }
+
+        if (strcasecmp(name, "default") == 0 ||
+            mk_config_pool_get(name, server)) {
+            mk_err("[config] Worker pool '%s' is already defined", name);
+            mk_mem_free(name);
+            return -1;
+        }
+
+        pool = mk_mem_alloc_z(sizeof(struct mk_config_pool));
+        if (!pool) {
+            mk_mem_free(name);
+            return -1;
+        }
+        pool->name = name;
+        pool->workers = (size_t) mk_rconf_section_get_key(section,
+                                                          "Workers",
+                                                          MK_RCONF_NUM);
+        if (pool->workers < 1) {
+            mk_mem_free(pool->name);
+            mk_mem_free(pool);
+            mk_config_print_error_msg("WORKER_POOL Workers", path);
+        }
+
+        pool->handlers = mk_rconf_section_get_key(section, "Handlers",
+                                                  MK_RCONF_LIST);
+        mk_list_add(&pool->_head, &server->worker_pools);
+    }
+
+    return 0;
+}
+
 /* Read configuration files */
 static int mk_config_read_files(char *path_conf, char *file_conf,
                                 struct mk_server *server)
 {
     unsigned long len;
+    int num;
     char *tmp = NULL;
+    char *val;
     struct stat checkdir;
     struct mk_rconf *cnf;
     struct mk_rconf_section *section;
@@ -328,6 +478,14 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
                                MK_CAP_HTTP, server);
     }
 
+    /* Listen backlog */
+    server->listen_backlog = (size_t) mk_rconf_section_get_key(section,
+                                                               "ListenBacklog",
+                                                               MK_RCONF_NUM);
+    if (server->listen_backlog < 1) {
+        server->listen_backlog = MK_SOMAXCONN;
+    }
+
     /* Number of thread workers */
     if (server->workers == -1) {
         server->workers = (size_t) mk_rconf_section_get_key(section,
@@ -342,6 +500,13 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         }
     }
 
+    /* Worker pools */
+    if (mk_config_pools_read(cnf, tmp, server) != 0) {
+        mk_err("[config] Failed to read worker pools.");
+        mk_mem_free(tmp);
+        return -1;
+    }
+
     /* Timeout */
     server->timeout = (size_t) mk_rconf_section_get_key(section,
                                                            "Timeout", MK_RCONF_NUM);
@@ -375,6 +540,42 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
         mk_config_print_error_msg("KeepAliveTimeout", tmp);
     }
 
+    /* KeepAliveAdaptive */
+    val = mk_rconf_section_get_key(section, "KeepAliveAdaptive", MK_RCONF_STR);
+    if (val) {
+        mk_mem_free(val);
+        server->keep_alive_adaptive = (size_t) mk_rconf_section_get_key(section,
+                                                                        "KeepAliveAdaptive",
+                                                                        MK_RCONF_BOOL);
+        if (server->keep_alive_adaptive == MK_ERROR) {
+            mk_config_print_error_msg("KeepAliveAdaptive", tmp);
+        }
+    }
+
+    /* MaxHeaderTime */
+    server->max_header_time = (size_t) mk_rconf_section_get_key(section,
+                                                                 "MaxHeaderTime",
+                                                                 MK_RCONF_NUM);
+    if (server->max_header_time < 0) {
+        mk_config_print_error_msg("MaxHeaderTime", tmp);
+    }
+
+    /* MinRequestRate */
+    server->min_request_rate = (size_t) mk_rconf_section_get_key(section,
+                                                                  "MinRequestRate",
+                                                                  MK_RCONF_NUM);
+    if (server->min_request_rate < 0) {
+        mk_config_print_error_msg("MinRequestRate", tmp);
+    }
+
+    /* MinResponseRate */
+    server->min_response_rate = (size_t) mk_rconf_section_get_key(section,
+                                                                   "MinResponseRate",
+                                                                   MK_RCONF_NUM);
+    if (server->min_response_rate < 0) {
+        mk_config_print_error_msg("MinResponseRate", tmp);
+    }
+
     /* Pid File */
     if (!server->path_conf_pidfile) {
         server->path_conf_pidfile = mk_rconf_section_get_key(section,
@@ -387,6 +588,25 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
                                                         "UserDir",
                                                         MK_RCONF_STR);
 
+    val = mk_rconf_section_get_key(section, "UserDirCacheTTL", MK_RCONF_STR);
+    if (val) {
+        server->user_cache_ttl = atoi(val);
+        mk_mem_free(val);
+        if (server->user_cache_ttl < 0) {
+            mk_config_print_error_msg("UserDirCacheTTL", tmp);
+        }
+    }
+
+    val = mk_rconf_section_get_key(section, "UserDirCacheNegativeTTL",
+                                   MK_RCONF_STR);
+    if (val) {
+        server->user_cache_neg_ttl = atoi(val);
+        mk_mem_free(val);
+        if (server->user_cache_neg_ttl < 0) {
+            mk_config_print_error_msg("UserDirCacheNegativeTTL", tmp);
+        }
+    }
+
     /* Index files */
     server->index_files = mk_rconf_section_get_key(section,
                                                       "Indexfile", MK_RCONF_LIST);
@@ -438,7 +658,7 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
     mk_mem_free(tmp);
     tmp = mk_rconf_section_get_key(section, "DefaultMimeType", MK_RCONF_STR);
     if (tmp) {
-        mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", tmp);
+        server->mimetype_default_str = mk_string_dup(tmp);
     }
 
     /* File Descriptor Table (FDT) */
@@ -446,6 +666,79 @@ static int mk_config_read_files(char *path_conf, char *file_conf,
                                                     "FDT",
                                                     MK_RCONF_BOOL);
 
+    /* Precompressed sidecar files */
+    val = mk_rconf_section_get_key(section, "Precompressed", MK_RCONF_STR);
+    if (val) {
+        mk_mem_free(val);
+        server->precompressed = (size_t) mk_rconf_section_get_key(section,
+                                                                  "Precompressed",
+                                                                  MK_RCONF_BOOL);
+        if (server->precompressed == MK_ERROR) {
+            mk_config_print_error_msg("Precompressed", tmp);
+        }
+    }
+
+    /* Open file cache */
+    val = mk_rconf_section_get_key(section, "FileCacheSize", MK_RCONF_STR);
+    if (val) {
+        server->file_cache_size = atoi(val);
+        mk_mem_free(val);
+        if (server->file_cache_size < 0) {
+            mk_config_print_error_msg("FileCacheSize", tmp);
+        }
+    }
+
+    val = mk_rconf_section_get_key(section, "FileCacheTTL", MK_RCONF_STR);
+    if (val) {
+        server->file_cache_ttl = atoi(val);
+        mk_mem_free(val);
+        if (server->file_cache_ttl < 0) {
+            mk_config_print_error_msg("FileCacheTTL", tmp);
+        }
+    }
+
+    val = mk_rconf_section_get_key(section, "FileCacheNegativeSize",
+                                   MK_RCONF_STR);
+    if (val) {
+        server->file_cache_neg_size = atoi(val);
+        mk_mem_free(val);
+        if (server->file_cache_neg_size < 0) {
+            mk_config_print_error_msg("FileCacheNegativeSize", tmp);
+        }
+    }
+
+    val = mk_rconf_section_get_key(section, "FileCacheNegativeTTL",
+                                   MK_RCONF_STR);
+    if (val) {
+        server->file_cache_neg_ttl = atoi(val);
+        mk_mem_free(val);
+        if (server->file_cache_neg_ttl < 0) {
+            mk_config_print_error_msg("FileCacheNegativeTTL", tmp);
+        }
+    }
+
+    /* Response cache (KB) */
+    val = mk_rconf_section_get_key(section, "ResponseCacheSize", MK_RCONF_STR);
+    if (val) {
+        num = atoi(val);
+        mk_mem_free(val);
+        if (num < 0) {
+            mk_config_print_error_msg("ResponseCacheSize", tmp);
+        }
+        server->response_cache_size = (size_t) num * 1024;
+    }
+
+    val = mk_rconf_section_get_key(section, "ResponseCacheMaxFile",
+                                   MK_RCONF_STR);
+    if (val) {
+        num = atoi(val);
+        mk_mem_free(val);
+        if (num < 0) {
+            mk_config_print_error_msg("ResponseCacheMaxFile", tmp);
+        }
+        server->response_cache_max_file = (size_t) num * 1024;
+    }
+
     /* FIXME: Overcapacity not ready */
     server->fd_limit = (size_t) mk_rconf_section_get_key(section,
                                                            "FDLimit",
@@ -545,6 +838,7 @@ struct mk_config_listener *mk_config_listener_add(char *address,
 
     listen->port = mk_string_dup(port);
     listen->flags = flags;
+    listen->backlog = 0;
 
     /* Before to add a new listener, lets make sure it's not a duplicated */
     mk_list_foreach(head, &server->listeners) {
@@ -575,6 +869,10 @@ void mk_config_set_init_values(struct mk_server *server)
     server->keep_alive = MK_TRUE;
     server->keep_alive_timeout = 15;
     server->max_keep_alive_request = 50;
+    server->keep_alive_adaptive = MK_TRUE;
+    server->max_header_time = 0;
+    server->min_request_rate = 0;
+    server->min_response_rate = 0;
     server->resume = MK_TRUE;
     server->standard_port = 80;
     server->symlink = MK_FALSE;
@@ -609,6 +907,27 @@ void mk_config_set_init_values(struct mk_server *server)
 
     /* Init listeners */
     mk_list_init(&server->listeners);
+    server->listen_backlog = MK_SOMAXCONN;
+
+    /* Init worker pools */
+    mk_list_init(&server->worker_pools);
+
+    /* Precompressed sidecar files */
+    server->precompressed = MK_TRUE;
+
+    /* Open file cache */
+    server->file_cache_size = MK_FILE_CACHE_SIZE;
+    server->file_cache_ttl  = MK_FILE_CACHE_TTL;
+    server->file_cache_neg_size = MK_FILE_CACHE_NEG_SIZE;
+    server->file_cache_neg_ttl  = MK_FILE_CACHE_NEG_TTL;
+    server->response_cache_size = MK_RESPONSE_CACHE_SIZE * 1024;
+    server->response_cache_max_file = MK_RESPONSE_CACHE_MAX_FILE * 1024;
+    server->file_cache      = NULL;
+
+    /* Users home directories cache */
+    server->user_cache_ttl     = MK_USER_CACHE_TTL;
+    server->user_cache_neg_ttl = MK_USER_CACHE_NEG_TTL;
+    server->user_cache         = NULL;
 }
 
 void mk_config_sanity_check(struct mk_server *server)
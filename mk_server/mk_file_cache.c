@@ -0,0 +1,1014 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_mimetype.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_file_cache.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+
+#define MK_FILE_CACHE_NOTIFY_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM |  \
+                                   IN_MOVED_TO | IN_DELETE_SELF |           \
+                                   IN_MOVE_SELF)
+#endif
+
+static void watch_release(struct mk_file_cache_watch *watch);
+
+/* Drop the in memory content of an entry, called under the shard lock */
+static inline void entry_body_free(struct mk_file_cache_entry *entry)
+{
+    entry->shard->mem -= entry->info.size + entry->rows_len;
+    mk_mem_free(entry->body);
+    mk_mem_free(entry->rows);
+    entry->body = NULL;
+    entry->rows = NULL;
+    entry->rows_len = 0;
+    entry->rows_policy = NULL;
+}
+
+static inline void entry_free(struct mk_file_cache_entry *entry)
+{
+    if (entry->body) {
+        entry_body_free(entry);
+    }
+    if (entry->fd != -1) {
+        close(entry->fd);
+    }
+    if (entry->index) {
+        mk_mem_free(entry->index);
+    }
+    if (entry->watch) {
+        watch_release(entry->watch);
+    }
+    mk_mem_free(entry->path);
+    mk_mem_free(entry);
+}
+
+/* Remove an entry from the shard, it must be called under the shard lock */
+static inline void entry_unlink(struct mk_file_cache_shard *shard,
+                                struct mk_file_cache_entry *entry)
+{
+    mk_list_del(&entry->_head);
+    mk_list_del(&entry->_lru);
+    if (entry->negative == MK_TRUE) {
+        shard->neg_entries--;
+    }
+    else {
+        shard->entries--;
+    }
+    entry->dead = MK_TRUE;
+
+    if (entry->refs == 0) {
+        entry_free(entry);
+    }
+}
+
+static inline struct mk_list *entry_bucket(struct mk_file_cache_shard *shard,
+                                           unsigned int hash)
+{
+    return &shard->buckets[(hash / MK_FILE_CACHE_SHARDS) %
+                           MK_FILE_CACHE_BUCKETS];
+}
+
+static struct mk_file_cache_entry *entry_find(struct mk_file_cache_shard *shard,
+                                              unsigned int hash,
+                                              char *path, size_t len)
+{
+    struct mk_list *head;
+    struct mk_file_cache_entry *entry;
+
+    mk_list_foreach(head, entry_bucket(shard, hash)) {
+        entry = mk_list_entry(head, struct mk_file_cache_entry, _head);
+        if (entry->hash == hash && entry->path_len == len &&
+            memcmp(entry->path, path, len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+static void cache_invalidate(struct mk_file_cache *cache,
+                             char *path, size_t len)
+{
+    unsigned int hash;
+    struct mk_file_cache_shard *shard;
+    struct mk_file_cache_entry *entry;
+
+    hash = mk_utils_gen_hash(path, len);
+    shard = &cache->shards[hash % MK_FILE_CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    entry = entry_find(shard, hash, path, len);
+    if (entry) {
+        MK_TRACE("[file cache] invalidate '%s'", entry->path);
+        entry_unlink(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Drop the negative entries, and the positive ones if 'all' is set */
+static void cache_flush(struct mk_file_cache *cache, int all)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_file_cache_shard *shard;
+    struct mk_file_cache_entry *entry;
+
+    for (i = 0; i < MK_FILE_CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        mk_list_foreach_safe(head, tmp, &shard->neg_lru) {
+            entry = mk_list_entry(head, struct mk_file_cache_entry, _lru);
+            entry_unlink(shard, entry);
+        }
+        if (all == MK_TRUE) {
+            mk_list_foreach_safe(head, tmp, &shard->lru) {
+                entry = mk_list_entry(head, struct mk_file_cache_entry, _lru);
+                entry_unlink(shard, entry);
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+#if defined(__linux__)
+static inline struct mk_list *watch_bucket(struct mk_list *table,
+                                           unsigned int hash)
+{
+    return &table[hash % MK_FILE_CACHE_WATCH_BUCKETS];
+}
+
+/* Find the watch of a descriptor, it must be called under the watch lock */
+static struct mk_file_cache_watch *watch_find_wd(struct mk_file_cache *cache,
+                                                 int wd)
+{
+    struct mk_list *head;
+    struct mk_file_cache_watch *watch;
+
+    mk_list_foreach(head, watch_bucket(cache->watches_wd, wd)) {
+        watch = mk_list_entry(head, struct mk_file_cache_watch, _wd_head);
+        if (watch->wd == wd) {
+            return watch;
+        }
+    }
+
+    return NULL;
+}
+
+/* Forget a watch the kernel dropped, called under the watch lock */
+static void watch_unlink(struct mk_file_cache_watch *watch)
+{
+    mk_list_del(&watch->_head);
+    mk_list_del(&watch->_wd_head);
+    watch->wd = -1;
+}
+
+/* Drop an entry reference, the last one removes the watch */
+static void watch_release(struct mk_file_cache_watch *watch)
+{
+    struct mk_file_cache *cache = watch->cache;
+
+    pthread_mutex_lock(&cache->watch_lock);
+    watch->refs--;
+    if (watch->refs > 0) {
+        pthread_mutex_unlock(&cache->watch_lock);
+        return;
+    }
+
+    if (watch->wd != -1) {
+        MK_TRACE("[file cache] unwatch '%s'", watch->dir);
+        if (cache->notify_fd != -1) {
+            inotify_rm_watch(cache->notify_fd, watch->wd);
+        }
+        watch_unlink(watch);
+    }
+    pthread_mutex_unlock(&cache->watch_lock);
+
+    mk_mem_free(watch->dir);
+    mk_mem_free(watch);
+}
+
+/*
+ * Watch the directory path[0..len] and return a reference to the watch, or
+ * NULL if it cannot be watched.
+ */
+static struct mk_file_cache_watch *cache_watch_dir(struct mk_file_cache *cache,
+                                                   char *path, size_t len)
+{
+    int wd;
+    int err;
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_file_cache_watch *watch;
+
+    hash = mk_utils_gen_hash(path, len);
+
+    pthread_mutex_lock(&cache->watch_lock);
+    mk_list_foreach(head, watch_bucket(cache->watches, hash)) {
+        watch = mk_list_entry(head, struct mk_file_cache_watch, _head);
+        if (watch->hash == hash && watch->len == len &&
+            memcmp(watch->dir, path, len) == 0) {
+            watch->refs++;
+            pthread_mutex_unlock(&cache->watch_lock);
+            return watch;
+        }
+    }
+
+    watch = mk_mem_alloc(sizeof(struct mk_file_cache_watch));
+    if (!watch) {
+        pthread_mutex_unlock(&cache->watch_lock);
+        return NULL;
+    }
+    watch->dir = mk_string_copy_substr(path, 0, len);
+    watch->len = len;
+    watch->hash = hash;
+    watch->refs = 1;
+    watch->cache = cache;
+
+    wd = inotify_add_watch(cache->notify_fd, watch->dir,
+                           MK_FILE_CACHE_NOTIFY_MASK);
+    if (wd == -1) {
+        err = errno;
+        MK_TRACE("[file cache] cannot watch '%s'", watch->dir);
+        mk_mem_free(watch->dir);
+        mk_mem_free(watch);
+        pthread_mutex_unlock(&cache->watch_lock);
+        errno = err;
+        return NULL;
+    }
+
+    /*
+     * The kernel hands out the same descriptor for an inode already
+     * watched, e.g: the same directory through a different path.
+     */
+    if (watch_find_wd(cache, wd)) {
+        mk_mem_free(watch->dir);
+        mk_mem_free(watch);
+        pthread_mutex_unlock(&cache->watch_lock);
+        return NULL;
+    }
+
+    watch->wd = wd;
+    mk_list_add(&watch->_head, watch_bucket(cache->watches, hash));
+    mk_list_add(&watch->_wd_head, watch_bucket(cache->watches_wd, wd));
+    pthread_mutex_unlock(&cache->watch_lock);
+
+    return watch;
+}
+
+/*
+ * Register an inotify watch for the directory holding 'path', it returns
+ * the watch reference the cache entry of the path must hold.
+ */
+static struct mk_file_cache_watch *cache_watch(struct mk_file_cache *cache,
+                                               char *path, size_t len)
+{
+    size_t dir_len;
+    struct mk_file_cache_watch *watch;
+
+    if (cache->notify_fd == -1) {
+        return NULL;
+    }
+
+    /*
+     * A directory entry (trailing slash) is watched itself, so new or removed
+     * index files are noticed, otherwise watch the parent directory.
+     */
+    dir_len = len;
+    if (dir_len > 1 && path[dir_len - 1] == '/') {
+        dir_len--;
+    }
+    else {
+        while (dir_len > 0 && path[dir_len - 1] != '/') {
+            dir_len--;
+        }
+        if (dir_len > 1) {
+            dir_len--;
+        }
+    }
+
+    /*
+     * If the directory does not exists (a lookup that will fail), watch the
+     * closest ancestor: creating the missing directory flushes the negative
+     * entries. Otherwise (e.g: out of watches) the entries rely on the TTL.
+     */
+    while (dir_len > 0 && dir_len < PATH_MAX) {
+        watch = cache_watch_dir(cache, path, dir_len);
+        if (watch || errno != ENOENT) {
+            return watch;
+        }
+
+        while (dir_len > 0 && path[dir_len - 1] != '/') {
+            dir_len--;
+        }
+        if (dir_len > 1) {
+            dir_len--;
+        }
+        else {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/* Invalidate the entries affected by an inotify event */
+static void cache_notify_event(struct mk_file_cache *cache,
+                               struct inotify_event *ev)
+{
+    size_t len;
+    char path[PATH_MAX];
+    struct mk_file_cache_watch *watch;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        cache_flush(cache, MK_TRUE);
+        return;
+    }
+
+    /* A watch removed along with its last entry is not found anymore */
+    pthread_mutex_lock(&cache->watch_lock);
+    watch = watch_find_wd(cache, ev->wd);
+    if (!watch) {
+        pthread_mutex_unlock(&cache->watch_lock);
+        return;
+    }
+
+    /*
+     * The directory itself is gone, drop everything. The watch is freed
+     * once the entries release it.
+     */
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (ev->mask & IN_IGNORED) {
+            watch_unlink(watch);
+        }
+        pthread_mutex_unlock(&cache->watch_lock);
+        cache_flush(cache, MK_TRUE);
+        return;
+    }
+
+    len = watch->len;
+    memcpy(path, watch->dir, len);
+    pthread_mutex_unlock(&cache->watch_lock);
+
+    /* The directory entry holds the index resolution */
+    cache_invalidate(cache, path, len);
+    if (path[len - 1] != '/') {
+        path[len++] = '/';
+        cache_invalidate(cache, path, len);
+    }
+
+    if (ev->len > 0 && len + strlen(ev->name) < sizeof(path)) {
+        strcpy(path + len, ev->name);
+        len += strlen(ev->name);
+        cache_invalidate(cache, path, len);
+
+        /* A precompressed sidecar changes the resolution of its file */
+        if (len > 3 && (strcmp(path + len - 3, ".gz") == 0 ||
+                        strcmp(path + len - 3, ".br") == 0)) {
+            cache_invalidate(cache, path, len - 3);
+        }
+    }
+
+    /* A new directory may hold paths with a negative entry */
+    if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        cache_flush(cache, MK_FALSE);
+    }
+}
+
+static void *cache_notify_worker(void *data)
+{
+    ssize_t bytes;
+    char *p;
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct mk_file_cache *cache = data;
+
+    mk_utils_worker_rename("monkey: fcache");
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    while (1) {
+        bytes = read(cache->notify_fd, buf, sizeof(buf));
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (p = buf; p < buf + bytes;
+             p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            cache_notify_event(cache, ev);
+        }
+    }
+
+    return NULL;
+}
+#else
+static inline struct mk_file_cache_watch *cache_watch(struct mk_file_cache *cache,
+                                                      char *path, size_t len)
+{
+    (void) cache;
+    (void) path;
+    (void) len;
+    return NULL;
+}
+
+static inline void watch_release(struct mk_file_cache_watch *watch)
+{
+    (void) watch;
+}
+#endif
+
+int mk_file_cache_init(struct mk_server *server)
+{
+    int i;
+    int j;
+    struct mk_file_cache *cache;
+    struct mk_file_cache_shard *shard;
+
+    server->file_cache = NULL;
+    if (server->file_cache_size <= 0 && server->file_cache_neg_size <= 0) {
+        return 0;
+    }
+
+    cache = mk_mem_alloc_z(sizeof(struct mk_file_cache));
+    if (!cache) {
+        return -1;
+    }
+
+    cache->capacity = server->file_cache_size / MK_FILE_CACHE_SHARDS;
+    if (cache->capacity < 1 && server->file_cache_size > 0) {
+        cache->capacity = 1;
+    }
+    cache->ttl = server->file_cache_ttl;
+
+    cache->neg_capacity = server->file_cache_neg_size / MK_FILE_CACHE_SHARDS;
+    if (cache->neg_capacity < 1 && server->file_cache_neg_size > 0) {
+        cache->neg_capacity = 1;
+    }
+    cache->neg_ttl = server->file_cache_neg_ttl;
+
+    cache->mem_limit = server->response_cache_size / MK_FILE_CACHE_SHARDS;
+    cache->max_body  = server->response_cache_max_file;
+
+    for (i = 0; i < MK_FILE_CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->entries = 0;
+        shard->neg_entries = 0;
+        mk_list_init(&shard->lru);
+        mk_list_init(&shard->neg_lru);
+        for (j = 0; j < MK_FILE_CACHE_BUCKETS; j++) {
+            mk_list_init(&shard->buckets[j]);
+        }
+    }
+
+    pthread_mutex_init(&cache->watch_lock, NULL);
+    for (i = 0; i < MK_FILE_CACHE_WATCH_BUCKETS; i++) {
+        mk_list_init(&cache->watches[i]);
+        mk_list_init(&cache->watches_wd[i]);
+    }
+    cache->notify_fd = -1;
+
+#if defined(__linux__)
+    cache->notify_fd = inotify_init1(IN_CLOEXEC);
+    if (cache->notify_fd == -1) {
+        mk_warn("[file cache] inotify not available, using TTL only");
+    }
+    else if (mk_utils_worker_spawn((void *) cache_notify_worker, cache,
+                                   &cache->notify_tid) != 0) {
+        close(cache->notify_fd);
+        cache->notify_fd = -1;
+    }
+#endif
+
+    server->file_cache = cache;
+    return 0;
+}
+
+void mk_file_cache_exit(struct mk_server *server)
+{
+    int i;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_file_cache *cache = server->file_cache;
+    struct mk_file_cache_watch *watch;
+
+    if (!cache) {
+        return;
+    }
+
+#if defined(__linux__)
+    if (cache->notify_fd != -1) {
+        pthread_cancel(cache->notify_tid);
+        pthread_join(cache->notify_tid, NULL);
+        close(cache->notify_fd);
+        cache->notify_fd = -1;
+    }
+#endif
+
+    cache_flush(cache, MK_TRUE);
+
+    /* Watches still referenced by entries in use */
+    for (i = 0; i < MK_FILE_CACHE_WATCH_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &cache->watches[i]) {
+            watch = mk_list_entry(head, struct mk_file_cache_watch, _head);
+            mk_list_del(&watch->_head);
+            mk_mem_free(watch->dir);
+            mk_mem_free(watch);
+        }
+    }
+
+    mk_mem_free(cache);
+    server->file_cache = NULL;
+}
+
+static struct mk_file_cache_entry *entry_create(char *path, size_t len,
+                                                unsigned int hash, int ret,
+                                                struct file_info *info,
+                                                struct mk_server *server)
+{
+    mk_ptr_t p;
+    struct mk_file_cache *cache = server->file_cache;
+    struct mk_file_cache_entry *entry;
+
+    entry = mk_mem_alloc_z(sizeof(struct mk_file_cache_entry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->path = mk_string_copy_substr(path, 0, len);
+    if (!entry->path) {
+        mk_mem_free(entry);
+        return NULL;
+    }
+    entry->path_len    = len;
+    entry->hash        = hash;
+    entry->ret         = ret;
+    entry->fd          = -1;
+    entry->index_state = MK_FILE_CACHE_INDEX_UNKNOWN;
+    entry->encodings   = MK_FILE_CACHE_ENCODINGS_UNKNOWN;
+    entry->expire      = 0;
+    entry->shard       = &cache->shards[hash % MK_FILE_CACHE_SHARDS];
+
+    /* A failed lookup only reports if the resource exists */
+    if (ret != 0) {
+        entry->negative    = MK_TRUE;
+        entry->info.exists = info->exists;
+        if (cache->neg_ttl > 0) {
+            entry->expire = log_current_utime + cache->neg_ttl;
+        }
+        return entry;
+    }
+
+    entry->info = *info;
+    entry->refs = 1;
+    entry->hits = 1;
+    if (cache->ttl > 0) {
+        entry->expire = log_current_utime + cache->ttl;
+    }
+
+    if (info->is_directory == MK_FALSE) {
+        p.data = entry->path;
+        p.len  = len;
+        entry->mime = mk_mimetype_find(server, &p);
+        if (!entry->mime) {
+            entry->mime = server->mimetype_default;
+        }
+
+        entry->etag_len = snprintf(entry->etag, MK_HEADER_ETAG_SIZE,
+                                   MK_HEADER_ETAG_FMT,
+                                   (unsigned int) info->last_modification,
+                                   info->size);
+    }
+
+    return entry;
+}
+
+/* Register a new entry and evict the least recently used ones */
+static void entry_insert(struct mk_file_cache *cache,
+                         struct mk_file_cache_shard *shard,
+                         struct mk_file_cache_entry *entry)
+{
+    int *entries;
+    int capacity;
+    struct mk_list *lru;
+    struct mk_file_cache_entry *old;
+
+    if (entry->negative == MK_TRUE) {
+        lru = &shard->neg_lru;
+        entries = &shard->neg_entries;
+        capacity = cache->neg_capacity;
+    }
+    else {
+        lru = &shard->lru;
+        entries = &shard->entries;
+        capacity = cache->capacity;
+    }
+
+    mk_list_add(&entry->_head, entry_bucket(shard, entry->hash));
+    mk_list_add(&entry->_lru, lru);
+    (*entries)++;
+
+    /* The head of the list is the least recently used entry */
+    while (*entries > capacity) {
+        old = mk_list_entry(lru->next, struct mk_file_cache_entry, _lru);
+        entry_unlink(shard, old);
+    }
+}
+
+/*
+ * Lookup the file information of 'path'. The return value and 'info' have the
+ * same semantics than mk_file_get_info(). On success and if the cache is
+ * enabled, 'entry' is set to a referenced cache entry that must be released
+ * through mk_file_cache_release().
+ */
+int mk_file_cache_lookup(char *path, size_t len, struct file_info *info,
+                         struct mk_file_cache_entry **entry,
+                         struct mk_server *server)
+{
+    int ret;
+    int capacity;
+    unsigned int hash;
+    struct mk_file_cache *cache = server->file_cache;
+    struct mk_file_cache_shard *shard;
+    struct mk_file_cache_entry *e;
+    struct mk_file_cache_entry *check;
+    struct mk_file_cache_watch *watch;
+
+    *entry = NULL;
+    if (!cache) {
+        return mk_file_get_info(path, info, MK_FILE_READ);
+    }
+
+    hash = mk_utils_gen_hash(path, len);
+    shard = &cache->shards[hash % MK_FILE_CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    shard->lookups++;
+    e = entry_find(shard, hash, path, len);
+    if (e) {
+        if (e->expire == 0 || e->expire > log_current_utime) {
+            mk_list_del(&e->_lru);
+            shard->hits++;
+            if (e->negative == MK_TRUE) {
+                mk_list_add(&e->_lru, &shard->neg_lru);
+                info->exists = e->info.exists;
+                ret = e->ret;
+                pthread_mutex_unlock(&shard->lock);
+                return ret;
+            }
+
+            e->refs++;
+            e->hits++;
+            mk_list_add(&e->_lru, &shard->lru);
+            pthread_mutex_unlock(&shard->lock);
+
+            *info = e->info;
+            *entry = e;
+            return 0;
+        }
+        entry_unlink(shard, e);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    /*
+     * Register the watch before stat(2), so any change that happens after
+     * the information is collected triggers an invalidation.
+     */
+    watch = cache_watch(cache, path, len);
+
+    ret = mk_file_get_info(path, info, MK_FILE_READ);
+    capacity = (ret == 0) ? cache->capacity : cache->neg_capacity;
+    e = NULL;
+    if (capacity > 0) {
+        e = entry_create(path, len, hash, ret, info, server);
+    }
+    if (!e) {
+        if (watch) {
+            watch_release(watch);
+        }
+        return ret;
+    }
+    e->watch = watch;
+
+    pthread_mutex_lock(&shard->lock);
+
+    /* Someone else could have registered the same path meanwhile */
+    check = entry_find(shard, hash, path, len);
+    if (check) {
+        entry_unlink(shard, check);
+    }
+    entry_insert(cache, shard, e);
+    pthread_mutex_unlock(&shard->lock);
+
+    if (ret == 0) {
+        *entry = e;
+    }
+    return ret;
+}
+
+void mk_file_cache_release(struct mk_file_cache_entry *entry)
+{
+    struct mk_file_cache_shard *shard = entry->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    entry->refs--;
+    if (entry->refs == 0 && entry->dead == MK_TRUE) {
+        entry_free(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/* Return the shared file descriptor of the entry, open it if required */
+int mk_file_cache_open(struct mk_file_cache_entry *entry)
+{
+    int fd;
+    struct mk_file_cache_shard *shard = entry->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    fd = entry->fd;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (fd != -1) {
+        return fd;
+    }
+
+    fd = open(entry->path, entry->info.flags_read_only);
+    if (fd == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    if (entry->fd == -1) {
+        entry->fd = fd;
+    }
+    else {
+        close(fd);
+        fd = entry->fd;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return fd;
+}
+
+/*
+ * Get the cached index file resolution of a directory entry, on
+ * MK_FILE_CACHE_INDEX_FOUND the index path is copied into 'buf'.
+ */
+int mk_file_cache_index_get(struct mk_file_cache_entry *entry,
+                            char *buf, size_t size, size_t *len)
+{
+    int state;
+    struct mk_file_cache_shard *shard = entry->shard;
+
+    pthread_mutex_lock(&shard->lock);
+    state = entry->index_state;
+    if (state == MK_FILE_CACHE_INDEX_FOUND) {
+        if (entry->index_len >= size) {
+            state = MK_FILE_CACHE_INDEX_UNKNOWN;
+        }
+        else {
+            memcpy(buf, entry->index, entry->index_len);
+            buf[entry->index_len] = '\0';
+            *len = entry->index_len;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return state;
+}
+
+/* Store the index file resolution, a NULL index means no index exists */
+void mk_file_cache_index_set(struct mk_file_cache_entry *entry,
+                             char *index, size_t len)
+{
+    char *tmp = NULL;
+    struct mk_file_cache_shard *shard = entry->shard;
+
+    if (index) {
+        tmp = mk_string_copy_substr(index, 0, len);
+        if (!tmp) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    if (entry->index_state != MK_FILE_CACHE_INDEX_UNKNOWN) {
+        pthread_mutex_unlock(&shard->lock);
+        if (tmp) {
+            mk_mem_free(tmp);
+        }
+        return;
+    }
+
+    if (tmp) {
+        entry->index = tmp;
+        entry->index_len = len;
+        entry->index_state = MK_FILE_CACHE_INDEX_FOUND;
+    }
+    else {
+        entry->index_state = MK_FILE_CACHE_INDEX_NONE;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Make the content of a file available in memory (entry->body) together
+ * with its precomposed entity rows, which carry the Cache-Control row of
+ * 'policy'. Returns 0 if the response can be served from memory, the entry
+ * must be referenced by the caller.
+ */
+int mk_file_cache_response(struct mk_file_cache_entry *entry,
+                           struct mk_vhost_cache_rule *policy,
+                           struct mk_server *server)
+{
+    int fd;
+    int ret;
+    ssize_t bytes;
+    size_t total;
+    unsigned long rows_len;
+    char *body;
+    char *rows;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_file_cache *cache = server->file_cache;
+    struct mk_file_cache_shard *shard = entry->shard;
+    struct mk_file_cache_entry *e;
+
+    if (cache->mem_limit == 0 || entry->info.size == 0 ||
+        entry->info.size > cache->max_body || !entry->mime) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    if (entry->body) {
+        /* Rows composed for another virtual host policy */
+        if (entry->rows_policy != policy) {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        shard->resp_hits++;
+        pthread_mutex_unlock(&shard->lock);
+        return 0;
+    }
+
+    /* Only keep in memory files requested more than once */
+    if (entry->dead == MK_TRUE || entry->hits < MK_FILE_CACHE_ADMIT) {
+        pthread_mutex_unlock(&shard->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    fd = mk_file_cache_open(entry);
+    if (fd == -1) {
+        return -1;
+    }
+
+    body = mk_mem_alloc(entry->info.size);
+    if (!body) {
+        return -1;
+    }
+
+    total = 0;
+    while (total < entry->info.size) {
+        bytes = pread(fd, body + total, entry->info.size - total, total);
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total += bytes;
+    }
+
+    /* The file changed since it was stat(2)ed, let inotify catch up */
+    if (total != entry->info.size) {
+        mk_mem_free(body);
+        return -1;
+    }
+
+    if (mk_header_entity_rows(&rows, &rows_len,
+                              entry->info.last_modification,
+                              &entry->mime->header_type,
+                              entry->etag, entry->etag_len,
+                              entry->info.size,
+                              policy ? &policy->row : NULL) != 0) {
+        mk_mem_free(body);
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    if (entry->body) {
+        ret = (entry->rows_policy == policy) ? 0 : -1;
+        if (ret == 0) {
+            shard->resp_hits++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        mk_mem_free(body);
+        mk_mem_free(rows);
+        return ret;
+    }
+
+    /* Release the content of the least recently used entries */
+    mk_list_foreach_safe(head, tmp, &shard->lru) {
+        if (shard->mem + entry->info.size + rows_len <= cache->mem_limit) {
+            break;
+        }
+        e = mk_list_entry(head, struct mk_file_cache_entry, _lru);
+        if (e->body && e->refs == 0) {
+            entry_body_free(e);
+        }
+    }
+
+    if (entry->dead == MK_TRUE ||
+        shard->mem + entry->info.size + rows_len > cache->mem_limit) {
+        pthread_mutex_unlock(&shard->lock);
+        mk_mem_free(body);
+        mk_mem_free(rows);
+        return -1;
+    }
+
+    entry->body = body;
+    entry->rows = rows;
+    entry->rows_len = rows_len;
+    entry->rows_policy = policy;
+    shard->mem += entry->info.size + rows_len;
+    shard->resp_hits++;
+    pthread_mutex_unlock(&shard->lock);
+
+    return 0;
+}
+
+/* Get the cached precompressed sidecars resolution of a file entry */
+int mk_file_cache_encodings_get(struct mk_file_cache_entry *entry)
+{
+    int encodings;
+
+    pthread_mutex_lock(&entry->shard->lock);
+    encodings = entry->encodings;
+    pthread_mutex_unlock(&entry->shard->lock);
+
+    return encodings;
+}
+
+void mk_file_cache_encodings_set(struct mk_file_cache_entry *entry,
+                                 int encodings)
+{
+    pthread_mutex_lock(&entry->shard->lock);
+    entry->encodings = encodings;
+    pthread_mutex_unlock(&entry->shard->lock);
+}
+
+/*
+ * Cache policy rule of a file for a virtual host: it is resolved once and
+ * kept by the entry, a file served by several virtual hosts is resolved
+ * again when the host changes.
+ */
+struct mk_vhost_cache_rule *mk_file_cache_policy_get(struct mk_file_cache_entry *entry,
+                                                     struct mk_vhost *host)
+{
+    struct mk_vhost_cache_rule *policy;
+
+    pthread_mutex_lock(&entry->shard->lock);
+    if (entry->policy_host != host) {
+        entry->policy = mk_vhost_cache_match(host, entry->path,
+                                             entry->path_len, entry->mime);
+        entry->policy_host = host;
+    }
+    policy = entry->policy;
+    pthread_mutex_unlock(&entry->shard->lock);
+
+    return policy;
+}
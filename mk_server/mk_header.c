@@ -27,6 +27,7 @@
 #include <monkey/mk_utils.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_cache.h>
+#include <monkey/mk_vhost_cache.h>
 #include <monkey/mk_http.h>
 #include <monkey/mk_vhost.h>
 #include <monkey/mk_tls.h>
@@ -44,6 +45,7 @@
 #define MK_HEADER_TE_CHUNKED       "Transfer-Encoding: chunked" MK_CRLF
 #define MK_HEADER_LAST_MODIFIED    "Last-Modified: "
 #define MK_HEADER_UPGRADE_H2C      "Upgrade: h2c" MK_CRLF
+#define MK_HEADER_VARY             "Vary: "
 
 const mk_ptr_t mk_header_short_date = mk_ptr_init(MK_HEADER_SHORT_DATE);
 const mk_ptr_t mk_header_short_location = mk_ptr_init(MK_HEADER_SHORT_LOCATION);
@@ -59,6 +61,7 @@ const mk_ptr_t mk_header_accept_ranges = mk_ptr_init(MK_HEADER_ACCEPT_RANGES);
 const mk_ptr_t mk_header_te_chunked = mk_ptr_init(MK_HEADER_TE_CHUNKED);
 const mk_ptr_t mk_header_last_modified = mk_ptr_init(MK_HEADER_LAST_MODIFIED);
 const mk_ptr_t mk_header_upgrade_h2c = mk_ptr_init(MK_HEADER_UPGRADE_H2C);
+const mk_ptr_t mk_header_vary = mk_ptr_init(MK_HEADER_VARY);
 
 #define status_entry(num, str) {num, sizeof(str) - 1, str}
 
@@ -92,6 +95,8 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_REDIR_SEE_OTHER, MK_RH_REDIR_SEE_OTHER),
     status_entry(MK_NOT_MODIFIED, MK_RH_NOT_MODIFIED),
     status_entry(MK_REDIR_USE_PROXY, MK_RH_REDIR_USE_PROXY),
+    status_entry(MK_REDIR_TEMPORARY, MK_RH_REDIR_TEMPORARY),
+    status_entry(MK_REDIR_PERMANENT, MK_RH_REDIR_PERMANENT),
 
     /* Client side errors */
     status_entry(MK_CLIENT_BAD_REQUEST, MK_RH_CLIENT_BAD_REQUEST),
@@ -123,8 +128,74 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_SERVER_HTTP_VERSION_UNSUP, MK_RH_SERVER_HTTP_VERSION_UNSUP)
 };
 
-static const int status_response_len =
-    (sizeof(status_response)/(sizeof(status_response[0])));
+#define MK_HEADER_STATUSES                                      \
+    (sizeof(status_response) / sizeof(status_response[0]))
+
+/*
+ * Response heads
+ * --------------
+ * The status line of every status known by the server is precomposed
+ * together with the preset rows (Server and Date). The clock thread
+ * rebuilds them once per second on the buffer not in use, so a response
+ * starts with a single iov entry and the status is found by index.
+ */
+struct mk_header_heads {
+    mk_ptr_t head[MK_HEADER_STATUSES];
+    char buf[MK_HEADER_STATUSES * (MK_HEADER_STATUS_SIZE + HEADER_PRESET_SIZE)];
+};
+
+static struct mk_header_heads header_heads[2];
+static struct mk_header_heads *header_heads_cur = NULL;
+
+/* status code -> status_response index + 1 */
+static unsigned char status_index[MK_HEADER_STATUS_MAX];
+
+void mk_header_heads_update(mk_ptr_t *preset)
+{
+    unsigned int i;
+    char *p;
+    struct mk_header_heads *heads;
+
+    if (header_heads_cur == &header_heads[0]) {
+        heads = &header_heads[1];
+    }
+    else {
+        heads = &header_heads[0];
+    }
+
+    p = heads->buf;
+    for (i = 0; i < MK_HEADER_STATUSES; i++) {
+        if (!status_index[status_response[i].status]) {
+            status_index[status_response[i].status] = i + 1;
+        }
+
+        heads->head[i].data = p;
+        memcpy(p, status_response[i].response, status_response[i].length);
+        p += status_response[i].length;
+        memcpy(p, preset->data, preset->len);
+        p += preset->len;
+        heads->head[i].len = p - heads->head[i].data;
+    }
+
+    header_heads_cur = heads;
+}
+
+/* Status line and preset rows of a status, NULL if it's unknown */
+static inline mk_ptr_t *mk_header_head(int status)
+{
+    int i;
+
+    if (status < 0 || status >= MK_HEADER_STATUS_MAX) {
+        return NULL;
+    }
+
+    i = status_index[status];
+    if (i == 0) {
+        return NULL;
+    }
+
+    return &header_heads_cur->head[i - 1];
+}
 
 static void mk_header_cb_finished(struct mk_stream_input *in)
 {
@@ -166,59 +237,56 @@ static void cb_stream_iov_extended_free(struct mk_stream_input *in)
 int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                       struct mk_server *server)
 {
-    int i = 0;
-    unsigned long len = 0;
-    char *buffer = 0;
-    mk_ptr_t response;
+    int len;
+    int cached;
+    int breakline;
+    mk_ptr_t *head;
     struct response_headers *sh;
     struct mk_iov *iov;
 
     sh = &sr->headers;
     iov = &sh->headers_iov;
+    cached = (sh->entity_rows.data != NULL);
 
     /* HTTP Status Code */
     if (sh->status == MK_CUSTOM_STATUS) {
-        response.data = sh->custom_status.data;
-        response.len = sh->custom_status.len;
+        mk_iov_add(iov, sh->custom_status.data, sh->custom_status.len,
+                   MK_FALSE);
+
+        /*
+         * Preset headers (mk_clock.c):
+         *
+         * - Server
+         * - Date
+         */
+        mk_iov_add(iov,
+                   headers_preset.data,
+                   headers_preset.len,
+                   MK_FALSE);
     }
     else {
-        for (i = 0; i < status_response_len; i++) {
-            if (status_response[i].status == sh->status) {
-                response.data = status_response[i].response;
-                response.len  = status_response[i].length;
-                break;
-            }
-        }
-    }
-
-    /* Invalid status set */
-    mk_bug(i == status_response_len);
+        head = mk_header_head(sh->status);
 
-    mk_iov_add(iov, response.data, response.len, MK_FALSE);
+        /* Invalid status set */
+        mk_bug(!head);
 
-    /*
-     * Preset headers (mk_clock.c):
-     *
-     * - Server
-     * - Date
-     */
-    mk_iov_add(iov,
-               headers_preset.data,
-               headers_preset.len,
-               MK_FALSE);
+        mk_iov_add(iov, head->data, head->len, MK_FALSE);
+    }
 
     /* Last-Modified */
-    if (sh->last_modified > 0) {
-        mk_ptr_t *lm = MK_TLS_GET(mk_tls_cache_header_lm);
-        lm->len = mk_utils_utime2gmt(&lm->data, sh->last_modified);
+    if (sh->last_modified > 0 && !cached) {
+        mk_ptr_t lm;
+
+        lm.data = sh->lm_buf;
+        lm.len = mk_utils_utime2gmt(&lm.data, sh->last_modified);
 
         mk_iov_add(iov,
                    mk_header_last_modified.data,
                    mk_header_last_modified.len,
                    MK_FALSE);
         mk_iov_add(iov,
-                   lm->data,
-                   lm->len,
+                   lm.data,
+                   lm.len,
                    MK_FALSE);
     }
 
@@ -274,7 +342,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     /* Content type */
-    if (sh->content_type.len > 0) {
+    if (sh->content_type.len > 0 && !cached) {
         mk_iov_add(iov,
                    sh->content_type.data,
                    sh->content_type.len,
@@ -295,7 +363,7 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     /* E-Tag */
-    if (sh->etag_len > 0) {
+    if (sh->etag_len > 0 && !cached) {
         mk_iov_add(iov, sh->etag_buf, sh->etag_len, MK_FALSE);
     }
 
@@ -309,11 +377,19 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    MK_FALSE);
     }
 
+    /* Vary */
+    if (sh->vary.len > 0) {
+        mk_iov_add(iov, mk_header_vary.data, mk_header_vary.len, MK_FALSE);
+        mk_iov_add(iov, sh->vary.data, sh->vary.len, MK_FALSE);
+    }
+
     /* Content-Length */
-    if (sh->content_length >= 0 && sh->transfer_encoding != 0) {
+    if (sh->content_length >= 0 && sh->transfer_encoding != 0 && !cached) {
         /* Map content length to MK_POINTER */
-        mk_ptr_t *cl = MK_TLS_GET(mk_tls_cache_header_cl);
-        mk_string_itop(sh->content_length, cl);
+        mk_ptr_t cl;
+
+        cl.data = sh->cl_buf;
+        mk_string_itop(sh->content_length, &cl);
 
         /* Set headers */
         mk_iov_add(iov,
@@ -321,47 +397,19 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    mk_header_content_length.len,
                    MK_FALSE);
         mk_iov_add(iov,
-                   cl->data,
-                   cl->len,
+                   cl.data,
+                   cl.len,
                    MK_FALSE);
     }
 
-    if ((sh->content_length != 0 && (sh->ranges[0] >= 0 || sh->ranges[1] >= 0)) &&
+    /* Content-Range: the range is resolved against the file size */
+    if ((sh->content_length != 0 && sh->ranges[0] >= 0 && sh->ranges[1] >= 0) &&
         server->resume == MK_TRUE) {
-        buffer = 0;
-
-        /* yyy- */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %d-%ld/%ld\r\n",
-                            RH_CONTENT_RANGE,
-                            sh->ranges[0],
-                            (sh->real_length - 1), sh->real_length);
-            mk_iov_add(iov, buffer, len, MK_TRUE);
-        }
-
-        /* yyy-xxx */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %d-%d/%ld\r\n",
-                            RH_CONTENT_RANGE,
-                            sh->ranges[0], sh->ranges[1], sh->real_length);
-
-            mk_iov_add(iov, buffer, len, MK_TRUE);
-        }
-
-        /* -xxx */
-        if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
-            mk_string_build(&buffer,
-                            &len,
-                            "%s bytes %ld-%ld/%ld\r\n",
-                            RH_CONTENT_RANGE,
-                            (sh->real_length - sh->ranges[1]),
-                            (sh->real_length - 1), sh->real_length);
-            mk_iov_add(iov, buffer, len, MK_TRUE);
-        }
+        len = snprintf(sh->range_buf, sizeof(sh->range_buf),
+                       "%s bytes %ld-%ld/%ld\r\n",
+                       RH_CONTENT_RANGE,
+                       sh->ranges[0], sh->ranges[1], sh->real_length);
+        mk_iov_add(iov, sh->range_buf, len, MK_FALSE);
     }
 
     if (sh->upgrade == MK_HEADER_UPGRADED_H2C) {
@@ -369,8 +417,42 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
                    MK_FALSE);
     }
 
+    /* Cache policy, the entity rows already carry its Cache-Control */
+    if (sh->cache_policy) {
+        if (sh->cache_policy->row.len > 0 && !cached) {
+            mk_iov_add(iov, sh->cache_policy->row.data,
+                       sh->cache_policy->row.len, MK_FALSE);
+        }
+        if (sh->cache_policy->expires.data) {
+            mk_iov_add(iov, sh->cache_policy->expires.data,
+                       sh->cache_policy->expires.len, MK_FALSE);
+        }
+    }
+
+    breakline = (sh->cgi == SH_NOCGI || sh->breakline == MK_HEADER_BREAKLINE);
+
+    /*
+     * Entity rows precomposed by the open file cache or the default error
+     * pages: they go last since the CRLF that ends the headers follows
+     * them in the same buffer.
+     */
+    if (cached) {
+        if (breakline && !sr->headers._extra_rows) {
+            mk_iov_add(iov,
+                       sh->entity_rows.data,
+                       sh->entity_rows.len + mk_iov_crlf.len,
+                       MK_FALSE);
+            breakline = MK_FALSE;
+        }
+        else {
+            mk_iov_add(iov,
+                       sh->entity_rows.data,
+                       sh->entity_rows.len,
+                       MK_FALSE);
+        }
+    }
 
-    if (sh->cgi == SH_NOCGI || sh->breakline == MK_HEADER_BREAKLINE) {
+    if (breakline) {
         if (!sr->headers._extra_rows) {
             mk_iov_add(iov, mk_iov_crlf.data, mk_iov_crlf.len,
                        MK_FALSE);
@@ -415,6 +497,50 @@ int mk_header_prepare(struct mk_http_session *cs, struct mk_http_request *sr,
     return 0;
 }
 
+/*
+ * Compose the entity rows of a static resource (Last-Modified, Content-Type,
+ * ETag, Content-Length and the Cache-Control row of its cache policy, if
+ * any) into a single buffer, the open file cache keeps it so
+ * mk_header_prepare() do not need to build them on every hit. The buffer is
+ * followed by the CRLF that ends the headers (MK_HEADER_ROWS).
+ */
+int mk_header_entity_rows(char **buf, unsigned long *len,
+                          time_t last_modified, mk_ptr_t *content_type,
+                          char *etag, int etag_len, long content_length,
+                          mk_ptr_t *cache_control)
+{
+    int lm_len;
+    int cc_len = 0;
+    char tmp[32];
+    char *lm = tmp;
+    char *cc = NULL;
+
+    if (cache_control) {
+        cc = cache_control->data;
+        cc_len = cache_control->len;
+    }
+
+    lm_len = mk_utils_utime2gmt(&lm, last_modified);
+    if (lm_len < 0) {
+        return -1;
+    }
+
+    *buf = NULL;
+    mk_string_build(buf, len, MK_HEADER_ROWS("%s%.*s%.*s%.*s%s%ld%s%.*s"),
+                    MK_HEADER_LAST_MODIFIED, lm_len, lm,
+                    (int) content_type->len, content_type->data,
+                    etag_len, etag,
+                    MK_HEADER_CONTENT_LENGTH, content_length, MK_CRLF,
+                    cc_len, cc ? cc : "");
+    if (!*buf) {
+        return -1;
+    }
+
+    /* the CRLF that ends the headers is not part of the rows */
+    *len -= 2;
+    return 0;
+}
+
 void mk_header_set_http_status(struct mk_http_request *sr, int status)
 {
     mk_bug(!sr);
@@ -439,6 +565,9 @@ void mk_header_response_reset(struct response_headers *header)
     header->cgi = SH_NOCGI;
     mk_ptr_reset(&header->content_type);
     mk_ptr_reset(&header->content_encoding);
+    mk_ptr_reset(&header->vary);
+    mk_ptr_reset(&header->entity_rows);
+    header->cache_policy = NULL;
     header->location = NULL;
     header->_extra_rows = NULL;
     header->allow_methods.len = 0;
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -32,6 +33,8 @@
 #include <monkey/mk_http.h>
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_http_upload.h>
+#include <monkey/mk_vhost_cache.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_config.h>
@@ -40,8 +43,11 @@
 #include <monkey/mk_header.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_rewrite.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_stream_deflate.h>
 
 const mk_ptr_t mk_http_method_get_p = mk_ptr_init(MK_METHOD_GET_STR);
 const mk_ptr_t mk_http_method_post_p = mk_ptr_init(MK_METHOD_POST_STR);
@@ -56,6 +62,21 @@ const mk_ptr_t mk_http_protocol_10_p = mk_ptr_init(MK_HTTP_PROTOCOL_10_STR);
 const mk_ptr_t mk_http_protocol_11_p = mk_ptr_init(MK_HTTP_PROTOCOL_11_STR);
 const mk_ptr_t mk_http_protocol_null_p = { NULL, 0 };
 
+/*
+ * Stream callback, the writes of the response stamp the first and the last
+ * byte sent.
+ */
+static void mk_http_request_written(struct mk_stream *stream, long bytes)
+{
+    struct mk_http_request *sr = stream->context;
+    (void) bytes;
+
+    sr->timing.last_byte = mk_clock_mono();
+    if (sr->timing.first_byte == 0) {
+        sr->timing.first_byte = sr->timing.last_byte;
+    }
+}
+
 /* Create a memory allocation in order to handle the request data */
 void mk_http_request_init(struct mk_http_session *session,
                           struct mk_http_request *request,
@@ -71,25 +92,65 @@ void mk_http_request_init(struct mk_http_session *session,
     request->connection.len = -1;
     request->file_fd        = -1;
     request->file_info.size = -1;
+    request->file_cache = NULL;
+    request->deflate = NULL;
+    request->multipart = NULL;
     request->vhost_fdt_id = 0;
     request->vhost_fdt_hash = 0;
     request->vhost_fdt_enabled = MK_FALSE;
     request->host.data = NULL;
     request->stage30_blocked = MK_FALSE;
+    request->stage30_handler = NULL;
+    request->handler_resolved = MK_FALSE;
+    request->handler = NULL;
+    request->rewrite_buf = NULL;
+    request->rewrite_checked = MK_FALSE;
+    request->thread = NULL;
+    request->user_home = MK_FALSE;
+    request->user_wait = MK_FALSE;
+    request->data.data = NULL;
+    request->data.len = 0;
+    request->body_checked = MK_FALSE;
+    request->body_stream = MK_FALSE;
+    request->body_expect = MK_FALSE;
+    request->body_continue = MK_FALSE;
+    request->stream_continue.channel = NULL;
+    request->body_left = 0;
+    request->body_offset = 0;
+    request->upload = NULL;
     request->session = session;
     request->host_conf = mk_list_entry_first(host_list, struct mk_vhost, _head);
     request->uri_processed.data = NULL;
     request->real_path.data = NULL;
     request->handler_data = NULL;
 
+    /*
+     * Phases timing: the first request of a connection also accounts the
+     * time it waited since the connection was accepted.
+     */
+    memset(&request->timing, '\0', sizeof(struct mk_http_timing));
+    request->timing.read = mk_clock_mono();
+    if (session->counter_connections == 0 && session->conn) {
+        request->timing.arrive = session->conn->arrive_clock;
+    }
+    else {
+        request->timing.arrive = request->timing.read;
+    }
+
     /* Response Headers */
     mk_header_response_reset(&request->headers);
 
     /* Reset callbacks for headers stream */
     mk_stream_set(&request->stream,
                   session->channel,
-                  NULL,
-                  NULL, NULL, NULL);
+                  request,
+                  NULL, mk_http_request_written, NULL);
+}
+
+/* Requests per connection allowed by the keep-alive governor of the worker */
+static inline int mk_http_ka_requests()
+{
+    return mk_sched_get_thread_conf()->ka_max_requests;
 }
 
 static inline int mk_http_point_header(mk_ptr_t *h,
@@ -111,16 +172,182 @@ static inline int mk_http_point_header(mk_ptr_t *h,
     return -1;
 }
 
-static int mk_http_request_prepare(struct mk_http_session *cs,
+/* Manually set the headers input streams */
+static inline void mk_http_request_headers_input(struct mk_http_request *sr)
+{
+    sr->in_headers.type        = MK_STREAM_IOV;
+    sr->in_headers.dynamic     = MK_FALSE;
+    sr->in_headers.cb_consumed = NULL;
+    sr->in_headers.cb_finished = NULL;
+    sr->in_headers.stream      = &sr->stream;
+    mk_list_add(&sr->in_headers._head, &sr->stream.inputs);
+}
+
+/* Is the request path under a user home directory ? */
+static inline int mk_http_request_user_path(struct mk_http_request *sr,
+                                            struct mk_server *server)
+{
+    if (server->conf_user_pub &&
+        sr->uri_processed.len > 2 &&
+        sr->uri_processed.data[1] == MK_USER_HOME) {
+        return MK_TRUE;
+    }
+    return MK_FALSE;
+}
+
+/* Switch the request to the path (and query string) of an internal rewrite */
+static void mk_http_rewrite_apply(struct mk_http_request *sr,
+                                  struct mk_vhost_rewrite_result *res)
+{
+    MK_TRACE("Rewrite '%s' to '%s'", sr->uri_processed.data, res->buf);
+
+    if (sr->uri_processed.data != sr->uri.data) {
+        mk_ptr_free(&sr->uri_processed);
+    }
+    /* the new path (and query string) is released with the request */
+    sr->uri_processed.data = res->buf;
+    sr->uri_processed.len = res->len;
+    if (res->query) {
+        sr->query_string.data = res->query;
+        sr->query_string.len = res->query_len;
+    }
+
+    /* the new path may match a different handler */
+    sr->handler_resolved = MK_FALSE;
+}
+
+/*
+ * Apply an internal rewrite rule of the virtual host before the handler,
+ * the worker pool and the way the body is read get decided, so all of
+ * them see the same URI. Redirects are answered by mk_http_rewrite().
+ */
+static void mk_http_request_rewrite(struct mk_http_request *sr,
+                                    struct mk_server *server)
+{
+    int ret;
+    struct mk_vhost_rewrite_result res;
+
+    if (sr->rewrite_checked == MK_TRUE || !sr->host_conf->rewrite ||
+        mk_http_request_user_path(sr, server) == MK_TRUE) {
+        return;
+    }
+
+    sr->uri_processed.data[sr->uri_processed.len] = '\0';
+    ret = mk_vhost_rewrite_lookup(sr->host_conf->rewrite, sr->uri_processed,
+                                  sr->query_string, &res);
+    if (ret == MK_FALSE) {
+        sr->rewrite_checked = MK_TRUE;
+    }
+    else if (ret == MK_TRUE && res.action == MK_VHOST_REWRITE_INTERNAL) {
+        mk_http_rewrite_apply(sr, &res);
+        sr->rewrite_checked = MK_TRUE;
+    }
+    else if (ret == MK_TRUE) {
+        mk_mem_free(res.buf);
+    }
+}
+
+/*
+ * Lookup the handler matching the processed URI, the result is kept in the
+ * request so the worker pool and the stage 30 lookups share it.
+ */
+static struct mk_vhost_handler *mk_http_request_handler(struct mk_http_request *sr)
+{
+    if (sr->handler_resolved == MK_FALSE) {
+        sr->uri_processed.data[sr->uri_processed.len] = '\0';
+        sr->handler = mk_vhost_handler_lookup(sr->host_conf,
+                                              sr->uri_processed.data,
+                                              sr->uri_processed.len);
+        sr->handler_resolved = MK_TRUE;
+        sr->timing.matched = mk_clock_mono();
+    }
+
+    return sr->handler;
+}
+
+/*
+ * Worker pools: lookup the pool that must serve the request, the pool of
+ * the virtual host takes precedence over the pool of the matching handler.
+ */
+static struct mk_config_pool *mk_http_request_pool(struct mk_http_request *sr)
+{
+    struct mk_vhost_handler *h_handler;
+
+    if (sr->host_conf->pool) {
+        return sr->host_conf->pool;
+    }
+
+    h_handler = mk_http_request_handler(sr);
+    if (h_handler) {
+        return h_handler->pool;
+    }
+
+    return NULL;
+}
+
+/*
+ * If the request belongs to a different worker pool, hand off the
+ * connection to a worker of that pool. It returns MK_TRUE if the
+ * connection is no longer owned by this worker.
+ */
+static int mk_http_request_handoff(struct mk_http_session *cs,
                                    struct mk_http_request *sr,
                                    struct mk_server *server)
 {
     int ret;
-    int status = 0;
+    struct mk_config_pool *pool;
+    struct mk_sched_worker *sched;
+    struct mk_sched_worker *target;
+
+    sched = mk_sched_get_thread_conf();
+    pool = mk_http_request_pool(sr);
+    if (pool == sched->pool) {
+        return MK_FALSE;
+    }
+
+    /*
+     * Only move the connection if there is no pending output: the channel
+     * must hold just the (empty) stream of this request. A chunked body was
+     * already decoded in place, the buffer cannot be parsed again.
+     */
+    if (mk_http_parser_chunked(&cs->parser)) {
+        return MK_FALSE;
+    }
+
+    /*
+     * The TLS plugin keeps the session of a socket in the worker that
+     * accepted it, a TLS connection is always served there.
+     */
+    if (MK_SCHED_CONN_PROP(cs->conn) & MK_CAP_SOCK_TLS) {
+        return MK_FALSE;
+    }
+
+    if (mk_list_size(&cs->channel->streams) > 1 ||
+        mk_list_is_empty(&sr->stream.inputs) != 0) {
+        return MK_FALSE;
+    }
+
+    target = mk_sched_pool_target(pool, server);
+    if (!target) {
+        MK_TRACE("[FD %i] Worker pool over capacity", cs->socket);
+        return MK_FALSE;
+    }
+
+    /* The target worker parses again the data read so far */
+    ret = mk_sched_conn_handoff(cs->conn, sched, target,
+                                cs->body + cs->body_pos,
+                                cs->body_length - cs->body_pos);
+    if (ret != 0) {
+        return MK_FALSE;
+    }
+
+    mk_http_session_remove(cs, server);
+    return MK_TRUE;
+}
+
+static void mk_http_request_uri(struct mk_http_request *sr)
+{
     char *temp;
-    struct mk_list *hosts = &server->hosts;
-    struct mk_list *alias;
-    struct mk_http_header *header;
 
     /*
      * Process URI, if it contains ASCII encoded strings like '%20',
@@ -137,6 +364,44 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         sr->uri_processed.data = sr->uri.data;
         sr->uri_processed.len  = sr->uri.len;
     }
+}
+
+static int mk_http_request_dispatch(struct mk_http_session *cs,
+                                    struct mk_http_request *sr,
+                                    struct mk_server *server)
+{
+    int ret;
+    int status;
+
+    /* Plugins Stage 20 */
+    ret = mk_plugin_stage_run_20(cs, sr, server);
+    if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
+        MK_TRACE("STAGE 20 requested close conexion");
+        return MK_EXIT_ABORT;
+    }
+
+    /* Normal HTTP process */
+    status = mk_http_init(cs, sr, server);
+
+    MK_TRACE("[FD %i] HTTP Init returning %i", cs->socket, status);
+    return status;
+}
+
+static int mk_http_request_prepare(struct mk_http_session *cs,
+                                   struct mk_http_request *sr,
+                                   struct mk_server *server)
+{
+    int ret;
+    struct mk_list *hosts = &server->hosts;
+    struct mk_list *alias;
+    struct mk_http_header *header;
+
+    sr->timing.parsed = mk_clock_mono();
+
+    /* The URI may be decoded already if the body mode was checked */
+    if (!sr->uri_processed.data) {
+        mk_http_request_uri(sr);
+    }
 
     /* Always assign the default vhost' */
     sr->host_conf = mk_list_entry_first(hosts, struct mk_vhost, _head);
@@ -157,11 +422,24 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
     /* Header: Range */
     mk_http_point_header(&sr->range, &cs->parser, MK_HEADER_RANGE);
 
+    /* Header: Accept-Encoding */
+    mk_http_point_header(&sr->accept_encoding, &cs->parser,
+                         MK_HEADER_ACCEPT_ENCODING);
+
     /* Header: If-Modified-Since */
     mk_http_point_header(&sr->if_modified_since,
                          &cs->parser,
                          MK_HEADER_IF_MODIFIED_SINCE);
 
+    /* Headers: If-Unmodified-Since, If-Match, If-None-Match, If-Range */
+    mk_http_point_header(&sr->if_unmodified_since,
+                         &cs->parser,
+                         MK_HEADER_IF_UNMODIFIED_SINCE);
+    mk_http_point_header(&sr->if_match, &cs->parser, MK_HEADER_IF_MATCH);
+    mk_http_point_header(&sr->if_none_match, &cs->parser,
+                         MK_HEADER_IF_NONE_MATCH);
+    mk_http_point_header(&sr->if_range, &cs->parser, MK_HEADER_IF_RANGE);
+
     /* HTTP/1.1 needs Host header */
     if (!sr->host.data && sr->protocol == MK_HTTP_PROTOCOL_11) {
         mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr, server);
@@ -206,29 +484,33 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         }
     }
 
+    mk_http_request_rewrite(sr, server);
+
+    /* Worker pools */
+    if (mk_list_is_empty(&server->worker_pools) != 0 &&
+        mk_http_request_handoff(cs, sr, server) == MK_TRUE) {
+        return MK_EXIT_OK;
+    }
+
     /* Is requesting an user home directory ? */
-    if (server->conf_user_pub &&
-        sr->uri_processed.len > 2 &&
-        sr->uri_processed.data[1] == MK_USER_HOME) {
+    if (mk_http_request_user_path(sr, server) == MK_TRUE) {
 
-        if (mk_user_init(cs, sr, server) != 0) {
+        ret = mk_user_init(cs, sr, server);
+        if (ret == MK_USER_WAIT) {
+            /* it continues through mk_http_request_continue() */
+            return MK_EXIT_OK;
+        }
+        else if (ret == MK_USER_BUSY) {
+            mk_http_error(MK_SERVER_SERVICE_UNAV, cs, sr, server);
+            return MK_EXIT_ABORT;
+        }
+        else if (ret != 0) {
             mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
             return MK_EXIT_ABORT;
         }
     }
 
-    /* Plugins Stage 20 */
-    ret = mk_plugin_stage_run_20(cs, sr, server);
-    if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
-        MK_TRACE("STAGE 20 requested close conexion");
-        return MK_EXIT_ABORT;
-    }
-
-    /* Normal HTTP process */
-    status = mk_http_init(cs, sr, server);
-
-    MK_TRACE("[FD %i] HTTP Init returning %i", cs->socket, status);
-    return status;
+    return mk_http_request_dispatch(cs, sr, server);
 }
 
 /*
@@ -365,168 +647,797 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs,
     return total_bytes;
 }
 
-/* Build error page */
-static int mk_http_error_page(char *title, mk_ptr_t *message, char *signature,
-                              char **out_buf, unsigned long *out_size)
+/*
+ * Streamed request bodies
+ * -----------------------
+ * Handlers that consume the body as it arrives (lib callbacks registered
+ * through mk_vhost_handler_stream() and plugins implementing stage30_body)
+ * do not wait for the whole body to be buffered: the request is dispatched
+ * as soon as the headers are complete and the rest of the body is read
+ * from the socket when the handler asks for it.
+ */
+static inline int mk_http_handler_streams(struct mk_vhost_handler *h)
 {
-    char *temp;
-
-    *out_buf = NULL;
-
-    if (message) {
-        temp = mk_ptr_to_buf(*message);
+    if (h->cb) {
+        return h->stream_body;
     }
-    else {
-        temp = mk_string_dup("");
+
+    if (h->handler && h->handler->stage->stage30_body) {
+        return MK_TRUE;
     }
 
-    mk_string_build(out_buf, out_size,
-                    MK_REQUEST_DEFAULT_PAGE, title, temp, signature);
-    mk_mem_free(temp);
-    return 0;
+    return MK_FALSE;
 }
 
-static int mk_http_range_set(struct mk_http_request *sr, size_t file_size,
-                             struct mk_server *server)
+/*
+ * Queue the interim response for a client waiting for 'Expect: 100-continue'.
+ * It goes in its own stream right before the response of the request, so
+ * it is written after any previous response still in the channel and never
+ * in the middle of one. It returns MK_TRUE if the line was queued.
+ */
+int mk_http_body_continue_queue(struct mk_http_session *cs,
+                                struct mk_http_request *sr)
 {
-    struct response_headers *sh = &sr->headers;
-    struct mk_stream_input *in;
-
-    in = &sr->in_file;
-    in->bytes_total  = file_size;
-    in->bytes_offset = 0;
-
-    if (server->resume == MK_TRUE && sr->range.data) {
-        /* yyy- */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] == -1) {
-            in->bytes_offset = sh->ranges[0];
-            in->bytes_total = file_size - in->bytes_offset;
-        }
+    struct mk_stream *stream = &sr->stream_continue;
 
-        /* yyy-xxx */
-        if (sh->ranges[0] >= 0 && sh->ranges[1] >= 0) {
-            in->bytes_offset = sh->ranges[0];
-            in->bytes_total  = labs(sh->ranges[1] - sh->ranges[0]) + 1;
-        }
+    if (sr->body_expect == MK_FALSE) {
+        return MK_FALSE;
+    }
+    sr->body_expect = MK_FALSE;
 
-        /* -xxx */
-        if (sh->ranges[0] == -1 && sh->ranges[1] > 0) {
-            in->bytes_total = sh->ranges[1];
-            in->bytes_offset = file_size - sh->ranges[1];
-        }
+    /* The final response is on its way, no interim response is needed */
+    if (sr->headers.sent == MK_TRUE) {
+        return MK_FALSE;
+    }
 
-        if ((size_t) in->bytes_offset >= file_size ||
-            in->bytes_total > file_size) {
-            return -1;
-        }
+    mk_stream_set(stream, cs->channel, sr, NULL, NULL, NULL);
+    mk_list_del(&stream->_head);
+    mk_list_add(&stream->_head, &sr->stream._head);
 
-        lseek(in->fd, in->bytes_offset, SEEK_SET);
-    }
-    return 0;
+    sr->iov_continue.io = sr->io_continue;
+    sr->iov_continue.buf_to_free = NULL;
+    mk_iov_init(&sr->iov_continue, 1, 0);
+    mk_iov_add(&sr->iov_continue, MK_HTTP_CONTINUE,
+               sizeof(MK_HTTP_CONTINUE) - 1, MK_FALSE);
+    mk_stream_in_iov(stream, &sr->in_continue, &sr->iov_continue,
+                     NULL, NULL);
+    return MK_TRUE;
 }
 
-static int mk_http_range_parse(struct mk_http_request *sr)
+/*
+ * Let a client waiting for 'Expect: 100-continue' send the body. What the
+ * socket does not take now is written by the write event, the body is read
+ * once the channel is flushed.
+ */
+int mk_http_body_continue(struct mk_http_session *cs,
+                          struct mk_http_request *sr)
 {
-    int eq_pos, sep_pos, len;
-    char *buffer = 0;
-    struct response_headers *sh;
-
-    if (!sr->range.data)
-        return -1;
+    int ret;
 
-    if ((eq_pos = mk_string_char_search(sr->range.data, '=', sr->range.len)) < 0)
-        return -1;
+    if (mk_http_body_continue_queue(cs, sr) == MK_FALSE) {
+        return 0;
+    }
 
-    if (strncasecmp(sr->range.data, "Bytes", eq_pos) != 0)
+    ret = mk_channel_flush(cs->channel);
+    if (ret & MK_CHANNEL_ERROR) {
         return -1;
+    }
+    else if (ret & (MK_CHANNEL_FLUSH | MK_CHANNEL_BUSY)) {
+        sr->body_continue = MK_TRUE;
+    }
 
-    if ((sep_pos = mk_string_char_search(sr->range.data, '-', sr->range.len)) < 0)
-        return -1;
+    return 0;
+}
 
-    len = sr->range.len;
-    sh = &sr->headers;
+/*
+ * Flow control of a streamed body: stop watching the socket for reads until
+ * the handler wants more data, pending output is not affected. The client
+ * is not accountable for the body rate while the server does not read.
+ */
+int mk_http_body_pause(struct mk_http_session *cs)
+{
+    uint32_t mask;
+    struct mk_event *event = cs->channel->event;
 
-    /* =-xxx */
-    if (eq_pos + 1 == sep_pos) {
-        sh->ranges[0] = -1;
-        sh->ranges[1] = (unsigned long) atol(sr->range.data + sep_pos + 1);
+    if (cs->conn->rate_mode == MK_SCHED_RATE_BODY) {
+        mk_sched_conn_rate(cs->conn, mk_sched_get_thread_conf(),
+                           MK_SCHED_RATE_NONE, log_current_utime);
+    }
 
-        if (sh->ranges[1] <= 0) {
-            return -1;
-        }
+    mask = event->mask & MK_EVENT_WRITE;
+    if (mask == 0) {
+        mask = MK_EVENT_SLEEP;
+    }
 
-        sh->content_length = sh->ranges[1];
+    if (mask == event->mask) {
         return 0;
     }
 
-    /* =yyy-xxx */
-    if ((eq_pos + 1 != sep_pos) && (len > sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, sep_pos);
-        sh->ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
+    return mk_event_add(mk_sched_loop(), cs->socket,
+                        MK_EVENT_CONNECTION, mask, event);
+}
 
-        buffer = mk_string_copy_substr(sr->range.data, sep_pos + 1, len);
-        sh->ranges[1] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
+int mk_http_body_resume(struct mk_http_session *cs)
+{
+    uint32_t mask;
+    struct mk_event *event = cs->channel->event;
+    struct mk_http_request *sr;
 
-        if (sh->ranges[1] < 0 || (sh->ranges[0] > sh->ranges[1])) {
-            return -1;
+    /* The rate phase starts over, with a new grace period */
+    if (cs->conn->rate_mode == MK_SCHED_RATE_NONE &&
+        mk_list_is_empty(&cs->request_list) != 0) {
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (sr->body_stream == MK_TRUE && sr->body_left > 0) {
+            mk_sched_conn_rate(cs->conn, mk_sched_get_thread_conf(),
+                               MK_SCHED_RATE_BODY, log_current_utime);
         }
-
-        sh->content_length = abs(sh->ranges[1] - sh->ranges[0]) + 1;
-        return 0;
     }
-    /* =yyy- */
-    if ((eq_pos + 1 != sep_pos) && (len == sep_pos + 1)) {
-        buffer = mk_string_copy_substr(sr->range.data, eq_pos + 1, len);
-        sr->headers.ranges[0] = (unsigned long) atol(buffer);
-        mk_mem_free(buffer);
 
-        sh->content_length = (sh->content_length - sh->ranges[0]);
+    mask = (event->mask & MK_EVENT_WRITE) | MK_EVENT_READ;
+    if (mask == event->mask) {
         return 0;
     }
 
-    return -1;
+    return mk_event_add(mk_sched_loop(), cs->socket,
+                        MK_EVENT_CONNECTION, mask, event);
 }
 
-static int mk_http_directory_redirect_check(struct mk_http_session *cs,
-                                            struct mk_http_request *sr,
-                                            struct mk_server *server)
+/*
+ * Resolve the virtual host and the handler of a parsed request the same way
+ * mk_http_request_prepare() does, before the request gets prepared.
+ */
+static struct mk_vhost_handler *mk_http_request_resolve(struct mk_http_session *cs,
+                                                        struct mk_http_request *sr,
+                                                        struct mk_server *server)
 {
-    int port_redirect = 0;
-    char *host;
-    char *location = 0;
-    char *real_location = 0;
-    char *protocol = "http";
-    unsigned long len;
+    mk_http_request_uri(sr);
+    if (sr->uri_processed.data[0] != '/') {
+        return NULL;
+    }
 
-    /*
-     * We have to check if there is a slash at the end of
-     * this string. If it doesn't exist, we send a redirection header.
-     */
-    if (sr->uri_processed.data[sr->uri_processed.len - 1] == '/') {
-        return 0;
+    mk_http_point_header(&sr->host, &cs->parser, MK_HEADER_HOST);
+    if (sr->host.data) {
+        mk_vhost_get(sr->host, &sr->host_conf, &sr->host_alias, server);
+    }
+    if (sr->host_conf->header_redirect.data) {
+        return NULL;
     }
 
-    host = mk_ptr_to_buf(sr->host);
+    mk_http_request_rewrite(sr, server);
+    return mk_http_request_handler(sr);
+}
 
-    /*
-     * Add ending slash to the location string
-     */
-    location = mk_mem_alloc(sr->uri_processed.len + 2);
-    memcpy(location, sr->uri_processed.data, sr->uri_processed.len);
-    location[sr->uri_processed.len]     = '/';
-    location[sr->uri_processed.len + 1] = '\0';
+/*
+ * The headers are complete and the body is still arriving. If the handler
+ * takes the body as a stream (or an upload location stores it) the request
+ * can be dispatched right away, otherwise it gets buffered: a body that
+ * will never fit in the request buffer is refused now and a client waiting
+ * for '100 Continue' is told to go ahead.
+ */
+static int mk_http_body_check(struct mk_http_session *cs,
+                              struct mk_http_request *sr,
+                              struct mk_server *server)
+{
+    struct mk_http_parser *p = &cs->parser;
+    struct mk_vhost_handler *h;
 
-    /* FIXME: should we done something similar for SSL = 443 */
-    if (sr->host.data && sr->port > 0) {
-        if (sr->port != server->standard_port) {
-            port_redirect = sr->port;
-        }
+    sr->body_checked = MK_TRUE;
+    if (p->header_expect_continue == MK_TRUE &&
+        sr->protocol == MK_HTTP_PROTOCOL_11) {
+        sr->body_expect = MK_TRUE;
     }
 
-    if (MK_SCHED_CONN_PROP(cs->conn) & MK_CAP_SOCK_TLS) {
-        protocol = "https";
+    h = mk_http_request_resolve(cs, sr, server);
+    if (mk_list_is_empty(&sr->host_conf->uploads) != 0 &&
+        mk_http_upload_lookup(sr)) {
+        sr->body_stream = MK_TRUE;
+        p->body_stream = MK_TRUE;
+        return 0;
+    }
+
+    if (h && mk_http_handler_streams(h) == MK_TRUE) {
+        sr->body_stream = MK_TRUE;
+        p->body_stream = MK_TRUE;
+        return 0;
+    }
+
+    if (p->start + p->header_content_length > server->max_request_size) {
+        MK_TRACE("[FD %i] Request body is > max_request_size", cs->socket);
+        mk_request_premature_close(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, cs,
+                                   server);
+        return -1;
+    }
+
+    /* The connection failed writing the interim response */
+    if (mk_http_body_continue(cs, sr) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Hand a piece of the body to the stage30 plugin serving the request */
+static int mk_http_body_deliver(struct mk_http_session *cs,
+                                struct mk_http_request *sr,
+                                char *data, size_t len)
+{
+    int ret;
+    struct mk_plugin *plugin = sr->stage30_handler;
+
+    ret = plugin->stage->stage30_body(plugin, cs, sr, data, len,
+                                      sr->body_left == 0);
+    if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
+        /* Do not read the rest, close once the response is sent */
+        cs->close_now = MK_TRUE;
+        mk_http_body_pause(cs);
+        return -1;
+    }
+
+    /* Body complete: pipelined data waits until the response is done */
+    if (sr->body_left == 0) {
+        mk_http_body_pause(cs);
+    }
+
+    return 0;
+}
+
+/* The request was dispatched to a plugin, start feeding the body */
+static int mk_http_body_stream_start(struct mk_http_session *cs,
+                                     struct mk_http_request *sr)
+{
+    if (sr->body_left > 0 && mk_http_body_continue(cs, sr) != 0) {
+        return -1;
+    }
+
+    if (sr->data.len == 0 && sr->body_left > 0) {
+        return 0;
+    }
+
+    sr->body_offset = sr->data.len;
+    return mk_http_body_deliver(cs, sr, sr->data.data, sr->data.len);
+}
+
+/*
+ * Read the next piece of a streamed body from the socket. A chunked body is
+ * decoded in place and the read never goes past its last chunk, so the data
+ * of a pipelined request stays in the socket. It returns the body bytes
+ * stored in 'buf' (zero if only chunk framing arrived), -1 if the read
+ * failed (errno is kept) or MK_HTTP_BODY_INVALID on broken chunk framing.
+ */
+int mk_http_body_recv(struct mk_http_session *cs, struct mk_http_request *sr,
+                      char *buf, size_t size)
+{
+    int ret;
+    int bytes;
+    long want;
+    size_t consumed;
+    size_t produced;
+    struct mk_http_chunked *chunk = &cs->parser.chunk;
+
+    if (mk_http_parser_chunked(&cs->parser)) {
+        want = mk_http_chunked_want(chunk);
+    }
+    else {
+        want = sr->body_left;
+    }
+    if (size > (size_t) want) {
+        size = want;
+    }
+
+    bytes = mk_sched_conn_read(cs->conn, buf, size);
+    if (bytes == 0) {
+        errno = 0;
+        return -1;
+    }
+    else if (bytes == -1) {
+        return -1;
+    }
+    mk_sched_conn_rate_add(cs->conn, bytes);
+
+    if (mk_http_parser_chunked(&cs->parser) == MK_FALSE) {
+        sr->body_left -= bytes;
+        return bytes;
+    }
+
+    ret = mk_http_chunked_decode(chunk, buf, bytes, buf,
+                                 &consumed, &produced);
+    if (ret < 0) {
+        MK_TRACE("[FD %i] Invalid chunked body", cs->socket);
+        cs->close_now = MK_TRUE;
+        return MK_HTTP_BODY_INVALID;
+    }
+    else if (ret == MK_HTTP_CHUNKED_DONE) {
+        sr->body_left = 0;
+    }
+
+    return produced;
+}
+
+/*
+ * Answer a request served by an upload location: the status tells if the
+ * body was stored or why it was not.
+ */
+static int mk_http_upload_reply(struct mk_http_session *cs,
+                                struct mk_http_request *sr,
+                                int status,
+                                struct mk_server *server)
+{
+    size_t count;
+
+    if (status >= MK_CLIENT_BAD_REQUEST) {
+        return mk_http_error(status, cs, sr, server);
+    }
+
+    mk_header_set_http_status(sr, status);
+    if (status == MK_HTTP_NOCONTENT) {
+        sr->headers.content_length = -1;
+    }
+    else {
+        sr->headers.content_length = 0;
+    }
+    mk_ptr_reset(&sr->headers.content_type);
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.pconnections_left =
+        (mk_http_ka_requests() - cs->counter_connections);
+
+    mk_http_request_headers_input(sr);
+    mk_header_prepare(cs, sr, server);
+
+    mk_channel_write(cs->channel, &count);
+    return mk_http_request_end(cs, server);
+}
+
+/* Socket data for a body stored by an upload location */
+static int mk_http_upload_body(struct mk_http_session *cs,
+                               struct mk_http_request *sr,
+                               struct mk_server *server)
+{
+    int status;
+
+    status = mk_http_upload_read(cs, sr);
+    if (status == 0) {
+        return 1;
+    }
+    else if (status == -1) {
+        return -1;
+    }
+
+    if (mk_http_upload_reply(cs, sr, status, server) == -1) {
+        errno = 0;
+        return -1;
+    }
+    return 1;
+}
+
+/* Socket data for a body streamed to a plugin */
+static int mk_http_body_stream_read(struct mk_http_session *cs,
+                                    struct mk_http_request *sr)
+{
+    int bytes;
+    char buf[MK_HTTP_BODY_CHUNK];
+
+    bytes = mk_http_body_recv(cs, sr, buf, sizeof(buf));
+    if (bytes < 0) {
+        return -1;
+    }
+
+    /* Only chunk framing so far */
+    if (bytes == 0 && sr->body_left > 0) {
+        return 1;
+    }
+
+    mk_http_body_deliver(cs, sr, buf, bytes);
+    return 1;
+}
+
+/*
+ * Default error pages, they are composed once when the server starts. The
+ * pages do not include anything from the request, so the same buffers are
+ * shared by every response.
+ */
+static struct {
+    int status;
+    char *title;
+    char *message;
+} mk_http_error_defaults[] = {
+    {MK_CLIENT_FORBIDDEN, "Forbidden",
+     "You don't have permission to access the requested URL."},
+    {MK_CLIENT_NOT_FOUND, "Not Found",
+     "The requested URL was not found on this server."},
+    {MK_CLIENT_METHOD_NOT_ALLOWED, "Method Not Allowed",
+     "The requested method is not allowed for this URL."},
+    {MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, "Entity too large",
+     "The request entity is too large."},
+    {MK_SERVER_INTERNAL_ERROR, "Internal Server Error",
+     "The server could not complete the request."},
+    {MK_SERVER_NOT_IMPLEMENTED, "Method Not Implemented",
+     "The requested method is not implemented."},
+    {MK_SERVER_SERVICE_UNAV, "Service Unavailable",
+     "The server is temporarily unable to handle the request."},
+};
+
+#define MK_HTTP_ERROR_DEFAULTS \
+    (sizeof(mk_http_error_defaults) / sizeof(mk_http_error_defaults[0]))
+
+int mk_http_error_bodies_init(struct mk_server *server)
+{
+    unsigned int i;
+    struct mk_http_error_body *bodies;
+    struct mk_http_error_body *e;
+
+    bodies = mk_mem_alloc_z(sizeof(struct mk_http_error_body) *
+                            MK_HTTP_ERROR_DEFAULTS);
+    if (!bodies) {
+        return -1;
+    }
+
+    for (i = 0; i < MK_HTTP_ERROR_DEFAULTS; i++) {
+        e = &bodies[i];
+        e->status = mk_http_error_defaults[i].status;
+        mk_string_build(&e->page.data, &e->page.len,
+                        MK_REQUEST_DEFAULT_PAGE,
+                        mk_http_error_defaults[i].title,
+                        mk_http_error_defaults[i].message,
+                        server->server_signature);
+        if (!e->page.data) {
+            goto error;
+        }
+
+        /* Entity rows, they replace Content-Type and Content-Length */
+        mk_string_build(&e->rows.data, &e->rows.len,
+                        MK_HEADER_ROWS("Content-Type: text/html\r\n"
+                                       "Content-Length: %lu\r\n"),
+                        e->page.len);
+        if (!e->rows.data) {
+            goto error;
+        }
+        e->rows.len -= 2;
+    }
+
+    server->error_bodies = bodies;
+    return 0;
+
+ error:
+    server->error_bodies = bodies;
+    mk_http_error_bodies_exit(server);
+    return -1;
+}
+
+void mk_http_error_bodies_exit(struct mk_server *server)
+{
+    unsigned int i;
+    struct mk_http_error_body *bodies = server->error_bodies;
+
+    if (!bodies) {
+        return;
+    }
+
+    for (i = 0; i < MK_HTTP_ERROR_DEFAULTS; i++) {
+        mk_ptr_free(&bodies[i].page);
+        mk_ptr_free(&bodies[i].rows);
+    }
+    mk_mem_free(bodies);
+    server->error_bodies = NULL;
+}
+
+static struct mk_http_error_body *mk_http_error_body_get(int status,
+                                                         struct mk_server *server)
+{
+    unsigned int i;
+    struct mk_http_error_body *bodies = server->error_bodies;
+
+    if (!bodies) {
+        return NULL;
+    }
+
+    for (i = 0; i < MK_HTTP_ERROR_DEFAULTS; i++) {
+        if (bodies[i].status == status) {
+            return &bodies[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Parse a range offset, it returns zero if there are no digits */
+static inline int mk_http_range_number(char **p, char *end, off_t *val)
+{
+    off_t v = 0;
+    char *s = *p;
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        if (v > (off_t) (LLONG_MAX / 10) - 1) {
+            return -1;
+        }
+        v = (v * 10) + (*s - '0');
+        s++;
+    }
+
+    if (s == *p) {
+        return 0;
+    }
+
+    *val = v;
+    *p = s;
+    return 1;
+}
+
+/*
+ * Parse the Range header into 'set', every range is resolved against the
+ * file size and nothing is allocated. It returns the number of satisfiable
+ * ranges (zero if none), -1 if the header is malformed or
+ * MK_HTTP_RANGES_IGNORE if there are too many ranges.
+ */
+static int mk_http_range_parse(struct mk_http_request *sr, off_t file_size,
+                               struct mk_http_range *set)
+{
+    int n = 0;
+    int total = 0;
+    int has_first;
+    int has_last;
+    off_t first = 0;
+    off_t last = 0;
+    char *p;
+    char *end;
+
+    p = sr->range.data;
+    end = p + sr->range.len;
+
+    if (sr->range.len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    p += 6;
+
+    while (p < end) {
+        /* skip whitespaces and empty list elements */
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        has_first = mk_http_range_number(&p, end, &first);
+        if (has_first == -1 || p == end || *p != '-') {
+            return -1;
+        }
+        p++;
+
+        has_last = mk_http_range_number(&p, end, &last);
+        if (has_last == -1) {
+            return -1;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p < end && *p != ',') {
+            return -1;
+        }
+
+        if ((!has_first && !has_last) ||
+            (has_first && has_last && last < first)) {
+            return -1;
+        }
+
+        if (++total > MK_HTTP_RANGES_MAX) {
+            return MK_HTTP_RANGES_IGNORE;
+        }
+
+        if (!has_first) {
+            /* -xxx: the last 'xxx' bytes */
+            if (last == 0) {
+                continue;
+            }
+            if (last > file_size) {
+                last = file_size;
+            }
+            first = file_size - last;
+            last  = file_size - 1;
+        }
+        else {
+            /* yyy- and yyy-xxx */
+            if (first >= file_size) {
+                continue;
+            }
+            if (!has_last || last >= file_size) {
+                last = file_size - 1;
+            }
+        }
+
+        set[n].start = first;
+        set[n].end   = last;
+        n++;
+    }
+
+    if (total == 0) {
+        return -1;
+    }
+
+    return n;
+}
+
+/*
+ * Sort the ranges and merge the ones overlapping or adjacent, so a client
+ * cannot make us send the same bytes many times. It returns the new number
+ * of ranges.
+ */
+static int mk_http_range_coalesce(struct mk_http_range *set, int n)
+{
+    int i;
+    int j;
+    struct mk_http_range tmp;
+
+    for (i = 1; i < n; i++) {
+        tmp = set[i];
+        for (j = i; j > 0 && set[j - 1].start > tmp.start; j--) {
+            set[j] = set[j - 1];
+        }
+        set[j] = tmp;
+    }
+
+    for (i = 0, j = 1; j < n; j++) {
+        if (set[j].start <= set[i].end + 1) {
+            if (set[j].end > set[i].end) {
+                set[i].end = set[j].end;
+            }
+        }
+        else {
+            set[++i] = set[j];
+        }
+    }
+
+    return i + 1;
+}
+
+/* Single range: the file input sends just the requested slice */
+static void mk_http_range_set(struct mk_http_request *sr,
+                              struct mk_http_range *range)
+{
+    struct response_headers *sh = &sr->headers;
+
+    sh->ranges[0] = range->start;
+    sh->ranges[1] = range->end;
+    sh->content_length = (range->end - range->start) + 1;
+
+    sr->in_file.bytes_offset = range->start;
+    sr->in_file.bytes_total  = sh->content_length;
+}
+
+/*
+ * Multiple ranges: compose a multipart/byteranges body. The boundary
+ * headers of each part are kept in its own IOV and the file slices are
+ * sent through sendfile(2), everything lives in a single allocation
+ * released with the request.
+ */
+static int mk_http_multipart_set(struct mk_http_request *sr,
+                                 struct mk_http_range *set, int n,
+                                 struct mk_mimetype *mime)
+{
+    int i;
+    int len;
+    long length = 0;
+    char boundary[17];
+    struct mk_http_range_part *part;
+    struct mk_http_multipart *mp;
+
+    mp = mk_mem_alloc(sizeof(struct mk_http_multipart) +
+                      (sizeof(struct mk_http_range_part) * n));
+    if (!mp) {
+        return -1;
+    }
+
+    /* Some entropy, so the boundary is not likely to show up in the content */
+    snprintf(boundary, sizeof(boundary), "%08x%08x",
+             (unsigned int) (random() ^ log_current_utime),
+             (unsigned int) sr->file_info.size);
+
+    mp->n_parts = n;
+    mp->delim_len = snprintf(mp->delim, sizeof(mp->delim),
+                             "\r\n--%s\r\n", boundary);
+    mp->close_len = snprintf(mp->close, sizeof(mp->close),
+                             "\r\n--%s--\r\n", boundary);
+    mp->content_type_len = snprintf(mp->content_type,
+                                    sizeof(mp->content_type),
+                                    "Content-Type: multipart/byteranges; "
+                                    "boundary=%s\r\n", boundary);
+
+    for (i = 0; i < n; i++) {
+        part = &mp->parts[i];
+        part->iov.io = part->io;
+        part->iov.buf_to_free = NULL;
+        mk_iov_init(&part->iov, 3, 0);
+
+        mk_iov_add(&part->iov, mp->delim, mp->delim_len, MK_FALSE);
+        if (mime) {
+            mk_iov_add(&part->iov, mime->header_type.data,
+                       mime->header_type.len, MK_FALSE);
+        }
+
+        len = snprintf(part->content_range, sizeof(part->content_range),
+                       "%s bytes %ld-%ld/%ld\r\n\r\n",
+                       RH_CONTENT_RANGE,
+                       (long) set[i].start, (long) set[i].end,
+                       (long) sr->file_info.size);
+        mk_iov_add(&part->iov, part->content_range, len, MK_FALSE);
+
+        part->in_file.bytes_offset = set[i].start;
+        part->in_file.bytes_total  = (set[i].end - set[i].start) + 1;
+
+        length += part->iov.total_len + part->in_file.bytes_total;
+    }
+
+    mp->tail_iov.io = mp->tail_io;
+    mp->tail_iov.buf_to_free = NULL;
+    mk_iov_init(&mp->tail_iov, 1, 0);
+    mk_iov_add(&mp->tail_iov, mp->close, mp->close_len, MK_FALSE);
+    length += mp->close_len;
+
+    sr->multipart = mp;
+    sr->headers.content_length = length;
+    sr->headers.content_type.data = mp->content_type;
+    sr->headers.content_type.len  = mp->content_type_len;
+
+    return 0;
+}
+
+/* Queue the multipart body parts in the request stream */
+static void mk_http_multipart_append(struct mk_http_request *sr)
+{
+    int i;
+    struct mk_http_range_part *part;
+    struct mk_http_multipart *mp = sr->multipart;
+
+    for (i = 0; i < mp->n_parts; i++) {
+        part = &mp->parts[i];
+        mk_stream_in_iov(&sr->stream, &part->in_headers, &part->iov,
+                         NULL, NULL);
+        mk_stream_in_file(&sr->stream, &part->in_file, sr->file_fd,
+                          part->in_file.bytes_total,
+                          part->in_file.bytes_offset,
+                          NULL, NULL);
+    }
+    mk_stream_in_iov(&sr->stream, &mp->in_tail, &mp->tail_iov, NULL, NULL);
+}
+
+static int mk_http_directory_redirect_check(struct mk_http_session *cs,
+                                            struct mk_http_request *sr,
+                                            struct mk_server *server)
+{
+    int port_redirect = 0;
+    char *host;
+    char *location = 0;
+    char *real_location = 0;
+    char *protocol = "http";
+    unsigned long len;
+
+    /*
+     * We have to check if there is a slash at the end of
+     * this string. If it doesn't exist, we send a redirection header.
+     */
+    if (sr->uri_processed.data[sr->uri_processed.len - 1] == '/') {
+        return 0;
+    }
+
+    host = mk_ptr_to_buf(sr->host);
+
+    /*
+     * Add ending slash to the location string
+     */
+    location = mk_mem_alloc(sr->uri_processed.len + 2);
+    memcpy(location, sr->uri_processed.data, sr->uri_processed.len);
+    location[sr->uri_processed.len]     = '/';
+    location[sr->uri_processed.len + 1] = '\0';
+
+    /* FIXME: should we done something similar for SSL = 443 */
+    if (sr->host.data && sr->port > 0) {
+        if (sr->port != server->standard_port) {
+            port_redirect = sr->port;
+        }
+    }
+
+    if (MK_SCHED_CONN_PROP(cs->conn) & MK_CAP_SOCK_TLS) {
+        protocol = "https";
     }
 
     if (port_redirect > 0) {
@@ -541,61 +1452,567 @@ static int mk_http_directory_redirect_check(struct mk_http_session *cs,
     MK_TRACE("Redirecting to '%s'", real_location);
     mk_mem_free(host);
 
-    mk_header_set_http_status(sr, MK_REDIR_MOVED);
-    sr->headers.content_length = 0;
+    mk_header_set_http_status(sr, MK_REDIR_MOVED);
+    sr->headers.content_length = 0;
+
+    mk_ptr_reset(&sr->headers.content_type);
+    sr->headers.location = real_location;
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.pconnections_left =
+        (mk_http_ka_requests() - cs->counter_connections);
+
+    mk_header_prepare(cs, sr, server);
+
+    /* we do not free() real_location as it's freed by iov */
+    mk_mem_free(location);
+    sr->headers.location = NULL;
+    return -1;
+}
+
+/*
+ * Apply the rewrite rules of the virtual host. A redirect is answered
+ * right away with the rows of the rule (returns MK_TRUE), a rewrite
+ * replaces the processed URI and lets the request continue.
+ */
+static int mk_http_rewrite(struct mk_http_session *cs,
+                           struct mk_http_request *sr,
+                           struct mk_server *server)
+{
+    int ret;
+    struct mk_vhost_rewrite_result res;
+
+    /* an internal rewrite (or no rule) was resolved already */
+    if (sr->rewrite_checked == MK_TRUE) {
+        return MK_FALSE;
+    }
+    sr->rewrite_checked = MK_TRUE;
+
+    sr->uri_processed.data[sr->uri_processed.len] = '\0';
+    ret = mk_vhost_rewrite_lookup(sr->host_conf->rewrite, sr->uri_processed,
+                                  sr->query_string, &res);
+    if (ret == MK_FALSE) {
+        return MK_FALSE;
+    }
+    else if (ret == -1) {
+        mk_http_error(MK_SERVER_INTERNAL_ERROR, cs, sr, server);
+        return MK_TRUE;
+    }
+
+    if (res.action == MK_VHOST_REWRITE_INTERNAL) {
+        mk_http_rewrite_apply(sr, &res);
+        return MK_FALSE;
+    }
+
+    MK_TRACE("Redirecting '%s' (%i)", sr->uri_processed.data, res.action);
+
+    mk_header_set_http_status(sr, res.action);
+    sr->headers.content_length = 0;
+
+    mk_ptr_reset(&sr->headers.content_type);
+    sr->rewrite_buf = res.buf;
+    sr->headers.entity_rows.data = res.buf;
+    sr->headers.entity_rows.len = res.len;
+    sr->headers.cgi = SH_NOCGI;
+    sr->headers.pconnections_left =
+        (mk_http_ka_requests() - cs->counter_connections);
+
+    mk_http_request_headers_input(sr);
+    mk_header_prepare(cs, sr, server);
+    return MK_TRUE;
+}
+
+/* Look for some  index.xxx in pathfile */
+static inline char *mk_http_index_lookup(mk_ptr_t *path_base,
+                                         char *buf, size_t buf_size,
+                                         size_t *out, size_t *bytes,
+                                         struct mk_server *server)
+{
+    off_t off = 0;
+    size_t len;
+    struct mk_string_line *entry;
+    struct mk_list *head;
+
+    if (!server->index_files) {
+        return NULL;
+    }
+
+    off = path_base->len;
+    memcpy(buf, path_base->data, off);
+
+    mk_list_foreach(head, server->index_files) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+
+        len = off + entry->len + 1;
+        if (len >= buf_size) {
+            continue;
+        }
+
+        memcpy(buf + off, entry->val, entry->len);
+        buf[off + entry->len] = '\0';
+
+        if (access(buf, F_OK) == 0) {
+            MK_TRACE("Index lookup OK '%s'", buf);
+            *out = off + entry->len;
+            *bytes = path_base->len - 1;
+            return buf;
+        }
+    }
+
+    return NULL;
+}
+
+/* Replace the real path of the request, e.g: index file or sidecar */
+static inline void mk_http_real_path_set(struct mk_http_request *sr,
+                                         char *path, size_t len)
+{
+    if (sr->real_path.data != sr->real_path_static) {
+        mk_ptr_free(&sr->real_path);
+        sr->real_path.data = mk_string_dup(path);
+    }
+    /* If it's static and it still fits */
+    else if (len < MK_PATH_BASE) {
+        memcpy(sr->real_path_static, path, len);
+        sr->real_path_static[len] = '\0';
+    }
+    /* It was static, but didn't fit */
+    else {
+        sr->real_path.data = mk_string_dup(path);
+    }
+    sr->real_path.len = len;
+}
+
+/* Precompressed sidecar files, in order of preference */
+static const struct mk_http_sidecar {
+    int encoding;
+    const char *ext;
+    mk_ptr_t coding;
+} mk_http_sidecars[] = {
+    { MK_HTTP_ENCODING_BR,   ".br", mk_ptr_init("br" MK_CRLF)   },
+    { MK_HTTP_ENCODING_GZIP, ".gz", mk_ptr_init("gzip" MK_CRLF) },
+};
+
+#define MK_HTTP_SIDECARS (sizeof(mk_http_sidecars) / sizeof(mk_http_sidecars[0]))
+
+/* Map the Accept-Encoding header value to MK_HTTP_ENCODING_* flags */
+int mk_http_accept_encoding(mk_ptr_t *header)
+{
+    int flags = 0;
+    int flag;
+    size_t len;
+    char *p;
+    char *end;
+    char *token;
+    char *q;
+
+    if (!header->data || header->len <= 0) {
+        return 0;
+    }
+
+    p = header->data;
+    end = header->data + header->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+        len = p - token;
+
+        flag = 0;
+        if (len == 2 && strncasecmp(token, "br", 2) == 0) {
+            flag = MK_HTTP_ENCODING_BR;
+        }
+        else if ((len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+                 (len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            flag = MK_HTTP_ENCODING_GZIP;
+        }
+        else if (len == 7 && strncasecmp(token, "deflate", 7) == 0) {
+            flag = MK_HTTP_ENCODING_DEFLATE;
+        }
+        else if (len == 1 && *token == '*') {
+            flag = MK_HTTP_ENCODING_BR | MK_HTTP_ENCODING_GZIP |
+                MK_HTTP_ENCODING_DEFLATE;
+        }
+
+        /* Parameters: only 'q=0' matters, it means not acceptable */
+        while (p < end && *p != ',') {
+            if (*p == 'q' && p + 2 < end && p[1] == '=') {
+                q = p + 2;
+                if (*q == '0') {
+                    q++;
+                    if (q < end && *q == '.') {
+                        q++;
+                    }
+                    while (q < end && *q == '0') {
+                        q++;
+                    }
+                    if (q >= end || *q < '1' || *q > '9') {
+                        flag = 0;
+                    }
+                }
+            }
+            p++;
+        }
+        flags |= flag;
+    }
+
+    return flags;
+}
+
+/*
+ * Check a sidecar candidate: it must be a readable regular file and be
+ * newer than the file it was generated from.
+ */
+static inline int mk_http_sidecar_valid(struct file_info *sidecar,
+                                        struct file_info *file)
+{
+    return (sidecar->is_directory == MK_FALSE &&
+            sidecar->read_access == MK_TRUE &&
+            sidecar->size > 0 &&
+            sidecar->last_modification >= file->last_modification);
+}
+
+/*
+ * Return the MK_HTTP_ENCODING_* flags of the sidecars available for the
+ * requested file. The result is kept in the open file cache entry, so the
+ * lookups happen just once per entry.
+ */
+static int mk_http_sidecars_available(struct mk_http_request *sr,
+                                      struct mk_server *server)
+{
+    int ret;
+    unsigned int i;
+    int available = 0;
+    size_t len;
+    char path[MK_MAX_PATH];
+    struct file_info finfo;
+    struct mk_file_cache_entry *entry;
+
+    if (sr->file_cache) {
+        available = mk_file_cache_encodings_get(sr->file_cache);
+        if (available != MK_FILE_CACHE_ENCODINGS_UNKNOWN) {
+            return available;
+        }
+        available = 0;
+    }
+
+    if (sr->real_path.len + 4 > MK_MAX_PATH) {
+        return 0;
+    }
+    memcpy(path, sr->real_path.data, sr->real_path.len);
+
+    for (i = 0; i < MK_HTTP_SIDECARS; i++) {
+        len = sr->real_path.len;
+        memcpy(path + len, mk_http_sidecars[i].ext, 4);
+        len += 3;
+
+        ret = mk_file_cache_lookup(path, len, &finfo, &entry, server);
+        if (entry) {
+            mk_file_cache_release(entry);
+        }
+        if (ret == 0 && mk_http_sidecar_valid(&finfo, &sr->file_info)) {
+            available |= mk_http_sidecars[i].encoding;
+        }
+    }
+
+    if (sr->file_cache) {
+        mk_file_cache_encodings_set(sr->file_cache, available);
+    }
+
+    return available;
+}
+
+/*
+ * Switch the request to a precompressed sidecar file (foo.js.br, foo.js.gz)
+ * if the client accepts its encoding. The real path, file information and
+ * cache entry of the request are replaced, so the file is sent and ranges
+ * are resolved against the sidecar.
+ */
+static void mk_http_sidecar_select(struct mk_http_request *sr,
+                                   struct mk_server *server)
+{
+    int ret;
+    int accept;
+    int available;
+    unsigned int i;
+    size_t len;
+    char path[MK_MAX_PATH];
+    struct file_info finfo;
+    struct mk_file_cache_entry *entry;
+
+    if (sr->real_path.len + 4 > MK_MAX_PATH) {
+        return;
+    }
+
+    available = mk_http_sidecars_available(sr, server);
+    if (available == 0) {
+        return;
+    }
+
+    /* The representation depends on the client Accept-Encoding */
+    mk_ptr_set(&sr->headers.vary, "Accept-Encoding" MK_CRLF);
+
+    accept = mk_http_accept_encoding(&sr->accept_encoding) & available;
+    if (accept == 0) {
+        return;
+    }
+
+    for (i = 0; i < MK_HTTP_SIDECARS; i++) {
+        if (!(accept & mk_http_sidecars[i].encoding)) {
+            continue;
+        }
+
+        len = sr->real_path.len;
+        memcpy(path, sr->real_path.data, len);
+        memcpy(path + len, mk_http_sidecars[i].ext, 4);
+        len += 3;
+
+        ret = mk_file_cache_lookup(path, len, &finfo, &entry, server);
+        if (ret != 0 || !mk_http_sidecar_valid(&finfo, &sr->file_info)) {
+            if (entry) {
+                mk_file_cache_release(entry);
+            }
+            continue;
+        }
+
+        if (sr->file_cache) {
+            mk_file_cache_release(sr->file_cache);
+        }
+        sr->file_cache = entry;
+        sr->file_info  = finfo;
+        mk_http_real_path_set(sr, path, len);
+        sr->headers.content_encoding = mk_http_sidecars[i].coding;
+        return;
+    }
+}
+
+/* Lookup the Content-Type row of a response */
+static int mk_http_response_type(struct mk_http_request *sr, mk_ptr_t *row)
+{
+    int i;
+    struct mk_iov *iov;
+
+    if (sr->headers.content_type.len > 0) {
+        *row = sr->headers.content_type;
+        return 0;
+    }
+
+    /* Rows added by plugins or the library API */
+    iov = sr->headers._extra_rows;
+    if (!iov) {
+        return -1;
+    }
+
+    for (i = 0; i < iov->iov_idx; i++) {
+        if (iov->io[i].iov_len > sizeof(RH_CONTENT_TYPE) - 1 &&
+            strncasecmp(iov->io[i].iov_base, RH_CONTENT_TYPE,
+                        sizeof(RH_CONTENT_TYPE) - 1) == 0) {
+            row->data = iov->io[i].iov_base;
+            row->len  = iov->io[i].iov_len;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Decide if the body of a response that is about to be sent must be
+ * compressed on the fly, based on the virtual host rules and the client
+ * Accept-Encoding. On success the compressor is attached to the request
+ * and the response headers are adjusted: the body length is unknown from
+ * now on.
+ */
+int mk_http_compress_start(struct mk_http_request *sr)
+{
+    int accept;
+    int format;
+    int chunked;
+    mk_ptr_t row;
+    struct mk_vhost *host = sr->host_conf;
+    if (sr->deflate) {
+        return 0;
+    }
+
+    if (!host || host->compression.enabled == MK_FALSE ||
+        sr->headers.sent == MK_TRUE ||
+        sr->headers.status != MK_HTTP_OK ||
+        sr->method == MK_METHOD_HEAD ||
+        sr->protocol < MK_HTTP_PROTOCOL_10 ||
+        sr->headers.content_encoding.len > 0) {
+        return -1;
+    }
+
+    /* A zero length means it was not set (e.g: streamed body) */
+    if (sr->headers.content_length > 0 &&
+        sr->headers.content_length < host->compression.min_size) {
+        return -1;
+    }
+
+    if (mk_http_response_type(sr, &row) != 0 ||
+        mk_vhost_compression_match(host, &row) == MK_FALSE) {
+        return -1;
+    }
+
+    /* The representation depends on the client Accept-Encoding */
+    mk_ptr_set(&sr->headers.vary, "Accept-Encoding" MK_CRLF);
+
+    accept = mk_http_accept_encoding(&sr->accept_encoding);
+    if (accept & MK_HTTP_ENCODING_GZIP) {
+        format = MK_STREAM_DEFLATE_GZIP;
+        mk_ptr_set(&sr->headers.content_encoding, "gzip" MK_CRLF);
+    }
+    else if (accept & MK_HTTP_ENCODING_DEFLATE) {
+        format = MK_STREAM_DEFLATE_ZLIB;
+        mk_ptr_set(&sr->headers.content_encoding, "deflate" MK_CRLF);
+    }
+    else {
+        return -1;
+    }
+
+    chunked = (sr->protocol == MK_HTTP_PROTOCOL_11);
+    sr->deflate = mk_stream_deflate_get(format, host->compression.level,
+                                        chunked);
+    if (!sr->deflate) {
+        mk_ptr_reset(&sr->headers.content_encoding);
+        return -1;
+    }
+
+    /* Compressed length is unknown: chunked or close delimited body */
+    sr->headers.content_length = -1;
+    if (chunked == MK_TRUE) {
+        sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+    }
+    else {
+        sr->session->close_now = MK_TRUE;
+    }
+
+    return 0;
+}
+
+/*
+ * Check if the entity-tag list of an If-Match or If-None-Match header
+ * contains the ETag of the response. A strong comparison never matches
+ * weak tags; our own tags are always strong.
+ */
+static int mk_http_etag_match(mk_ptr_t *header, char *etag, int etag_len,
+                              int strong)
+{
+    int weak;
+    char *p;
+    char *end;
+    char *tag;
+
+    p = header->data;
+    end = header->data + header->len;
 
-    mk_ptr_reset(&sr->headers.content_type);
-    sr->headers.location = real_location;
-    sr->headers.cgi = SH_NOCGI;
-    sr->headers.pconnections_left =
-        (server->max_keep_alive_request - cs->counter_connections);
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        if (p >= end) {
+            break;
+        }
 
-    mk_header_prepare(cs, sr, server);
+        if (*p == '*') {
+            return MK_TRUE;
+        }
 
-    /* we do not free() real_location as it's freed by iov */
-    mk_mem_free(location);
-    sr->headers.location = NULL;
-    return -1;
-}
+        weak = MK_FALSE;
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            weak = MK_TRUE;
+            p += 2;
+        }
 
-/* Look for some  index.xxx in pathfile */
-static inline char *mk_http_index_lookup(mk_ptr_t *path_base,
-                                         char *buf, size_t buf_size,
-                                         size_t *out, size_t *bytes,
-                                         struct mk_server *server)
-{
-    off_t off = 0;
-    size_t len;
-    struct mk_string_line *entry;
-    struct mk_list *head;
+        if (*p != '"') {
+            return MK_FALSE;
+        }
+        tag = p++;
+        while (p < end && *p != '"') {
+            p++;
+        }
+        if (p >= end) {
+            return MK_FALSE;
+        }
+        p++;
 
-    if (!server->index_files) {
-        return NULL;
+        if ((weak == MK_FALSE || strong == MK_FALSE) &&
+            p - tag == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return MK_TRUE;
+        }
     }
 
-    off = path_base->len;
-    memcpy(buf, path_base->data, off);
-
-    mk_list_foreach(head, server->index_files) {
-        entry = mk_list_entry(head, struct mk_string_line, _head);
+    return MK_FALSE;
+}
 
-        len = off + entry->len + 1;
-        if (len >= buf_size) {
-            continue;
+/*
+ * Evaluate the request preconditions of a static file in the order
+ * defined by RFC 7232 (section 6). It returns MK_NOT_MODIFIED,
+ * MK_CLIENT_PRECOND_FAILED, or zero if the request must be served. A
+ * failed If-Range makes the response ignore the Range header.
+ */
+static int mk_http_conditional(struct mk_http_request *sr)
+{
+    int len;
+    char *etag;
+    time_t date;
+    time_t lm = sr->file_info.last_modification;
+
+    /* Opaque tag, including quotes: 'ETag: "..."\r\n' */
+    etag = sr->headers.etag_buf + (sizeof(MK_HEADER_ETAG) - 1);
+    len  = sr->headers.etag_len - (sizeof(MK_HEADER_ETAG) - 1) - 2;
+
+    /* If-Match, or If-Unmodified-Since when absent */
+    if (sr->if_match.data) {
+        if (!mk_http_etag_match(&sr->if_match, etag, len, MK_TRUE)) {
+            return MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+    else if (sr->if_unmodified_since.data) {
+        date = mk_utils_gmt2utime(sr->if_unmodified_since.data,
+                                  sr->if_unmodified_since.len);
+        if (date >= 0 && lm > date) {
+            return MK_CLIENT_PRECOND_FAILED;
         }
+    }
 
-        memcpy(buf + off, entry->val, entry->len);
-        buf[off + entry->len] = '\0';
+    /* If-None-Match, or If-Modified-Since when absent */
+    if (sr->if_none_match.data) {
+        if (mk_http_etag_match(&sr->if_none_match, etag, len, MK_FALSE)) {
+            if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) {
+                return MK_NOT_MODIFIED;
+            }
+            return MK_CLIENT_PRECOND_FAILED;
+        }
+    }
+    else if (sr->if_modified_since.data &&
+             (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD)) {
+        date = mk_utils_gmt2utime(sr->if_modified_since.data,
+                                  sr->if_modified_since.len);
+        if (date > 0 && lm <= date) {
+            return MK_NOT_MODIFIED;
+        }
+    }
 
-        if (access(buf, F_OK) == 0) {
-            MK_TRACE("Index lookup OK '%s'", buf);
-            *out = off + entry->len;
-            *bytes = path_base->len - 1;
-            return buf;
+    /* If-Range: send the ranges only if the representation did not change */
+    if (sr->if_range.data && sr->range.data) {
+        if (sr->if_range.len > 0 && sr->if_range.data[0] == '"') {
+            if (!mk_http_etag_match(&sr->if_range, etag, len, MK_TRUE)) {
+                mk_ptr_reset(&sr->range);
+            }
+        }
+        else {
+            date = mk_utils_gmt2utime(sr->if_range.data, sr->if_range.len);
+            if (date != lm) {
+                mk_ptr_reset(&sr->range);
+            }
         }
     }
 
-    return NULL;
+    return 0;
 }
 
 /* Turn CORK_OFF once headers are sent */
@@ -624,13 +2041,14 @@ static inline void mk_http_cb_file_on_consume(struct mk_stream_input *in,
 int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                  struct mk_server *server)
 {
+    int n;
     int ret;
     int ret_file;
     struct mk_mimetype *mime;
-    struct mk_list *head;
-    struct mk_list *handlers;
+    struct mk_http_range ranges[MK_HTTP_RANGES_MAX];
     struct mk_plugin *plugin;
     struct mk_vhost_handler *h_handler;
+    struct mk_http_upload_rule *upload;
     struct mk_http_thread *mth = NULL;
     size_t index_length;
     size_t index_bytes;
@@ -638,6 +2056,12 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     MK_TRACE("[FD %i] HTTP Protocol Init, session %p", cs->socket, sr);
 
+    /* Rewrite and redirect rules, paths under a home directory excluded */
+    if (sr->host_conf->rewrite && sr->user_home == MK_FALSE &&
+        mk_http_rewrite(cs, sr, server) == MK_TRUE) {
+        return -1;
+    }
+
     /* Request to root path of the virtualhost in question */
     if (sr->uri_processed.len == 1 && sr->uri_processed.data[0] == '/') {
         sr->real_path.data = sr->host_conf->documentroot.data;
@@ -707,34 +2131,37 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
     }
 
-    if (sr->_content_length.data &&
+    if ((sr->_content_length.data || mk_http_parser_chunked(&cs->parser)) &&
         (sr->method != MK_METHOD_POST &&
          sr->method != MK_METHOD_PUT)) {
         return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr, server);
     }
 
+    /* Upload location: store the body */
+    if (mk_list_is_empty(&sr->host_conf->uploads) != 0) {
+        upload = mk_http_upload_lookup(sr);
+        if (upload) {
+            ret = mk_http_upload_start(cs, sr, upload);
+            if (ret > 0) {
+                mk_http_upload_reply(cs, sr, ret, server);
+            }
+            return MK_EXIT_OK;
+        }
+    }
 
-    ret_file = mk_file_get_info(sr->real_path.data, &sr->file_info, MK_FILE_READ);
+    if (sr->file_cache) {
+        mk_file_cache_release(sr->file_cache);
+        sr->file_cache = NULL;
+    }
+    ret_file = mk_file_cache_lookup(sr->real_path.data, sr->real_path.len,
+                                    &sr->file_info, &sr->file_cache, server);
 
-    /* Manually set the headers input streams */
-    sr->in_headers.type        = MK_STREAM_IOV;
-    sr->in_headers.dynamic     = MK_FALSE;
-    sr->in_headers.cb_consumed = NULL;
-    sr->in_headers.cb_finished = NULL;
-    sr->in_headers.stream      = &sr->stream;
-    mk_list_add(&sr->in_headers._head, &sr->stream.inputs);
+    mk_http_request_headers_input(sr);
 
     /* Plugin Stage 30: look for handlers for this request */
     if (sr->stage30_blocked == MK_FALSE) {
-        sr->uri_processed.data[sr->uri_processed.len] = '\0';
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(&h_handler->match,
-                        sr->uri_processed.data, 0, NULL, 0) != 0) {
-                continue;
-            }
-
+        h_handler = mk_http_request_handler(sr);
+        while (h_handler) {
             if (h_handler->cb) {
                 /* Create coroutine/thread context */
                 sr->headers.content_length = 0;
@@ -758,12 +2185,18 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
                 ret = plugin->stage->stage30(plugin, cs, sr,
                                              h_handler->n_params,
                                              &h_handler->params);
+                sr->timing.stage30 = mk_clock_mono();
                 mk_header_prepare(cs, sr, server);
             }
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
             switch (ret) {
             case MK_PLUGIN_RET_CONTINUE:
+                if (plugin->stage->stage30_body &&
+                    (cs->parser.header_content_length > 0 ||
+                     mk_http_parser_chunked(&cs->parser))) {
+                    mk_http_body_stream_start(cs, sr);
+                }
                 /* FIXME: PLUGINS DISABLED
                 if ((plugin->flags & MK_PLUGIN_THREAD) &&
                     plugin->stage->stage30_thread) {
@@ -786,6 +2219,10 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             case MK_PLUGIN_RET_END:
                 return MK_EXIT_OK;
             }
+
+            /* The handler declined the request, try the next one */
+            h_handler = mk_vhost_handler_next(sr->host_conf, h_handler,
+                                              sr->uri_processed.data);
         }
     }
 
@@ -804,30 +2241,40 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             return -1;
         }
 
-        /* looking for an index file */
+        /* looking for an index file, the cache may already know it */
         char tmppath[MK_MAX_PATH];
-        index_path = mk_http_index_lookup(&sr->real_path,
-                                          tmppath, MK_MAX_PATH,
-                                          &index_length, &index_bytes,
-                                          server);
-        if (index_path) {
-            if (sr->real_path.data != sr->real_path_static) {
-                mk_ptr_free(&sr->real_path);
-                sr->real_path.data = mk_string_dup(index_path);
-            }
-            /* If it's static and it still fits */
-            else if (index_length < MK_PATH_BASE) {
-                memcpy(sr->real_path_static, index_path, index_length);
-                sr->real_path_static[index_length] = '\0';
-            }
-            /* It was static, but didn't fit */
-            else {
-                sr->real_path.data = mk_string_dup(index_path);
+
+        ret = MK_FILE_CACHE_INDEX_UNKNOWN;
+        if (sr->file_cache) {
+            ret = mk_file_cache_index_get(sr->file_cache, tmppath,
+                                          MK_MAX_PATH, &index_length);
+        }
+
+        if (ret == MK_FILE_CACHE_INDEX_FOUND) {
+            index_path  = tmppath;
+            index_bytes = sr->real_path.len - 1;
+        }
+        else if (ret == MK_FILE_CACHE_INDEX_UNKNOWN) {
+            index_path = mk_http_index_lookup(&sr->real_path,
+                                              tmppath, MK_MAX_PATH,
+                                              &index_length, &index_bytes,
+                                              server);
+            if (sr->file_cache) {
+                mk_file_cache_index_set(sr->file_cache,
+                                        index_path, index_length);
             }
-            sr->real_path.len  = index_length;
+        }
+
+        if (index_path) {
+            mk_http_real_path_set(sr, index_path, index_length);
 
-            ret = mk_file_get_info(sr->real_path.data,
-                                   &sr->file_info, MK_FILE_READ);
+            if (sr->file_cache) {
+                mk_file_cache_release(sr->file_cache);
+                sr->file_cache = NULL;
+            }
+            ret = mk_file_cache_lookup(sr->real_path.data, sr->real_path.len,
+                                       &sr->file_info, &sr->file_cache,
+                                       server);
             if (ret != 0) {
                 return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
             }
@@ -862,19 +2309,22 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             uri = sr->real_path.data + index_bytes;
         }
 
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_vhost_handler, _head);
-            if (regexec(&h_handler->match,
-                        uri, 0, NULL, 0) != 0) {
-                continue;
-            }
+        if (!index_path) {
+            h_handler = mk_http_request_handler(sr);
+        }
+        else {
+            h_handler = mk_vhost_handler_lookup(sr->host_conf, uri,
+                                                strlen(uri));
+        }
+
+        while (h_handler) {
 
             plugin = h_handler->handler;
             sr->stage30_handler = h_handler->handler;
             ret = plugin->stage->stage30(plugin, cs, sr,
                                          h_handler->n_params,
                                          &h_handler->params);
+            sr->timing.stage30 = mk_clock_mono();
 
             MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
             switch (ret) {
@@ -890,6 +2340,8 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             case MK_PLUGIN_RET_END:
                 return MK_EXIT_OK;
             }
+
+            h_handler = mk_vhost_handler_next(sr->host_conf, h_handler, uri);
         }
     }
 
@@ -907,7 +2359,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
     /* counter connections */
     sr->headers.pconnections_left = (int)
-        (server->max_keep_alive_request - cs->counter_connections);
+        (mk_http_ka_requests() - cs->counter_connections);
 
     /* Set default value */
     mk_header_set_http_status(sr, MK_HTTP_OK);
@@ -937,9 +2389,14 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     }
 
     /* Matching MimeType  */
-    mime = mk_mimetype_find(server, &sr->real_path);
-    if (!mime) {
-        mime = server->mimetype_default;
+    if (sr->file_cache) {
+        mime = sr->file_cache->mime;
+    }
+    else {
+        mime = mk_mimetype_find(server, &sr->real_path);
+        if (!mime) {
+            mime = server->mimetype_default;
+        }
     }
 
     if (sr->file_info.is_directory == MK_TRUE) {
@@ -951,27 +2408,50 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         return mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
     }
 
+    /* Cache policy of the virtual host, resolved once per cached file */
+    if (mk_list_is_empty(&sr->host_conf->cache_rules) != 0) {
+        if (sr->file_cache) {
+            sr->headers.cache_policy = mk_file_cache_policy_get(sr->file_cache,
+                                                                sr->host_conf);
+        }
+        else {
+            sr->headers.cache_policy = mk_vhost_cache_match(sr->host_conf,
+                                                            sr->real_path.data,
+                                                            sr->real_path.len,
+                                                            mime);
+        }
+    }
+
+    /* Precompressed sidecar, the mime type of the original file is kept */
+    if (server->precompressed == MK_TRUE &&
+        (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD)) {
+        mk_http_sidecar_select(sr, server);
+    }
+
     /* Configure some headers */
     sr->headers.last_modified = sr->file_info.last_modification;
-    sr->headers.etag_len = snprintf(sr->headers.etag_buf,
-                                    MK_HEADER_ETAG_SIZE,
-                                    "ETag: \"%x-%zx\"\r\n",
-                                    (unsigned int) sr->file_info.last_modification,
-                                    sr->file_info.size);
-
-    if (sr->if_modified_since.data && sr->method == MK_METHOD_GET) {
-        time_t date_client;       /* Date sent by client */
-        time_t date_file_server;  /* Date server file */
-
-        date_client = mk_utils_gmt2utime(sr->if_modified_since.data);
-        date_file_server = sr->file_info.last_modification;
-
-        if (date_file_server <= date_client &&
-            date_client > 0) {
-            mk_header_set_http_status(sr, MK_NOT_MODIFIED);
-            mk_header_prepare(cs, sr, server);
-            return MK_EXIT_OK;
-        }
+    if (sr->file_cache) {
+        memcpy(sr->headers.etag_buf, sr->file_cache->etag,
+               sr->file_cache->etag_len);
+        sr->headers.etag_len = sr->file_cache->etag_len;
+    }
+    else {
+        sr->headers.etag_len = snprintf(sr->headers.etag_buf,
+                                        MK_HEADER_ETAG_SIZE,
+                                        MK_HEADER_ETAG_FMT,
+                                        (unsigned int) sr->file_info.last_modification,
+                                        sr->file_info.size);
+    }
+
+    /* Conditional requests */
+    ret = mk_http_conditional(sr);
+    if (ret == MK_NOT_MODIFIED) {
+        mk_header_set_http_status(sr, MK_NOT_MODIFIED);
+        mk_header_prepare(cs, sr, server);
+        return MK_EXIT_OK;
+    }
+    else if (ret == MK_CLIENT_PRECOND_FAILED) {
+        return mk_http_error(MK_CLIENT_PRECOND_FAILED, cs, sr, server);
     }
 
     /* Object size for log and response headers */
@@ -985,6 +2465,7 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
             MK_TRACE("open() failed");
             return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr, server);
         }
+        sr->timing.opened = mk_clock_mono();
         sr->in_file.fd           = sr->file_fd;
         sr->in_file.bytes_offset = 0;
         sr->in_file.bytes_total  = sr->file_info.size;
@@ -999,23 +2480,27 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
         /* HTTP Ranges */
         if (sr->range.data != NULL && server->resume == MK_TRUE) {
-            if (mk_http_range_parse(sr) < 0) {
-                sr->headers.ranges[0] = -1;
-                sr->headers.ranges[1] = -1;
+            ret = mk_http_range_parse(sr, sr->file_info.size, ranges);
+            if (ret == -1) {
                 return mk_http_error(MK_CLIENT_BAD_REQUEST, cs, sr, server);
             }
-            if (sr->headers.ranges[0] >= 0 || sr->headers.ranges[1] >= 0) {
-                mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
-            }
-
-            /* Calc bytes to send & offset */
-            if (mk_http_range_set(sr, sr->file_info.size, server) != 0) {
+            else if (ret == 0) {
                 sr->headers.content_length = -1;
-                sr->headers.ranges[0] = -1;
-                sr->headers.ranges[1] = -1;
                 return mk_http_error(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF,
                                      cs, sr, server);
             }
+            else if (ret > 0) {
+                n = mk_http_range_coalesce(ranges, ret);
+                if (n == 1) {
+                    mk_http_range_set(sr, &ranges[0]);
+                }
+                else if (mk_http_multipart_set(sr, ranges, n, mime) != 0) {
+                    return mk_http_error(MK_SERVER_INTERNAL_ERROR,
+                                         cs, sr, server);
+                }
+                mk_header_set_http_status(sr, MK_HTTP_PARTIAL);
+            }
+            /* MK_HTTP_RANGES_IGNORE: send the full entity */
         }
     }
     else {
@@ -1023,6 +2508,29 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
         mk_ptr_reset(&sr->headers.content_type);
     }
 
+    /*
+     * Response cache: small hot files are served from memory, the
+     * headers and the content are dispatched with a single writev(2).
+     */
+    if (sr->file_cache && sr->headers.status == MK_HTTP_OK &&
+        (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_HEAD) &&
+        !sr->headers._extra_rows && sr->headers.content_encoding.len <= 0 &&
+        mk_file_cache_response(sr->file_cache, sr->headers.cache_policy,
+                               server) == 0) {
+
+        sr->headers.entity_rows.data = sr->file_cache->rows;
+        sr->headers.entity_rows.len  = sr->file_cache->rows_len;
+        mk_header_prepare(cs, sr, server);
+
+        if (sr->method == MK_METHOD_GET) {
+            mk_iov_add(&sr->headers.headers_iov,
+                       sr->file_cache->body, sr->file_cache->info.size,
+                       MK_FALSE);
+            sr->in_headers.bytes_total += sr->file_cache->info.size;
+        }
+        return 0;
+    }
+
     /* Send headers */
     mk_header_prepare(cs, sr, server);
     if (mk_unlikely(sr->headers.content_length == 0)) {
@@ -1030,6 +2538,11 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr,
     }
     /* Send file content */
     if (sr->method == MK_METHOD_GET || sr->method == MK_METHOD_POST) {
+        if (sr->multipart) {
+            mk_http_multipart_append(sr);
+            return MK_EXIT_OK;
+        }
+
         /* Note: bytes and offsets are set after the Range check */
         sr->in_file.type = MK_STREAM_FILE;
         mk_stream_append(&sr->in_file, &sr->stream);
@@ -1083,66 +2596,334 @@ int mk_http_keepalive_check(struct mk_http_session *cs,
         if (cs->parser.header_connection == MK_HTTP_PARSER_CONN_KA) {
             cs->close_now  = MK_FALSE;
         }
-        else if (cs->parser.header_connection == MK_HTTP_PARSER_CONN_CLOSE) {
-            cs->close_now  = MK_TRUE;
+        else if (cs->parser.header_connection == MK_HTTP_PARSER_CONN_CLOSE) {
+            cs->close_now  = MK_TRUE;
+        }
+    }
+
+    /* Client has reached keep-alive connections limit */
+    if (cs->counter_connections >= mk_http_ka_requests()) {
+        cs->close_now = MK_TRUE;
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline void mk_http_request_ka_next(struct mk_http_session *cs)
+{
+    cs->body_length = 0;
+    cs->body_pos = 0;
+    cs->body_next = 0;
+    cs->counter_connections++;
+
+    /* Update data for scheduler */
+    cs->init_time = log_current_utime;
+    cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+
+    /* Initialize parser */
+    mk_http_parser_init(&cs->parser);
+}
+
+/*
+ * Pipelined requests
+ * ------------------
+ * The session buffer is consumed through a read cursor, the data of the
+ * requests already served is not moved. The tail is moved to the front of
+ * the buffer only when the next request is incomplete and more data must
+ * be read.
+ *
+ * The complete requests found in the buffer are dispatched in a batch as
+ * long as the core queues their whole response (static content, redirects
+ * and errors). A request served by a handler ends the batch, it's processed
+ * alone once the previous responses are written. All the responses of a
+ * batch are then flushed together, consecutive buffers go out through a
+ * single writev(2).
+ */
+
+extern struct mk_sched_handler mk_http_handler;
+int mk_http_sched_done(struct mk_sched_conn *conn,
+                       struct mk_sched_worker *worker,
+                       struct mk_server *server);
+
+/* Parse the request found at the read cursor of the session buffer */
+static int mk_http_session_parse(struct mk_http_session *cs,
+                                 struct mk_http_request *sr,
+                                 struct mk_server *server)
+{
+    int status;
+
+    cs->body_next = cs->body_pos;
+    status = mk_http_parser(sr, &cs->parser, cs->body + cs->body_pos,
+                            cs->body_length - cs->body_pos, server);
+    if (status == MK_HTTP_PARSER_OK) {
+        cs->body_next = cs->body_pos + cs->parser.i + 1;
+    }
+
+    return status;
+}
+
+/* Move the unparsed tail of the buffer to the front */
+static void mk_http_session_compact(struct mk_http_session *cs)
+{
+    unsigned int len;
+
+    if (cs->body_pos == 0) {
+        return;
+    }
+
+    len = cs->body_length - cs->body_pos;
+    memmove(cs->body, cs->body + cs->body_pos, len);
+    cs->body_length = len;
+    cs->body_pos = 0;
+    cs->body_next = 0;
+}
+
+/*
+ * The read cursor reached an incomplete request: keep its data at the
+ * front of the buffer and wait for the rest of it.
+ */
+static void mk_http_session_wait(struct mk_http_session *cs,
+                                 struct mk_http_request *sr,
+                                 struct mk_server *server)
+{
+    mk_http_session_compact(cs);
+    mk_http_parser_init(&cs->parser);
+    mk_http_parser(sr, &cs->parser, cs->body, cs->body_length, server);
+    cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+    mk_sched_conn_timeout_add(cs->conn, mk_sched_get_thread_conf());
+}
+
+/* Whether the responses of all the requests were queued by the core */
+static int mk_http_session_queued(struct mk_http_session *cs)
+{
+    struct mk_list *head;
+    struct mk_http_request *sr;
+
+    /* An error response may have closed the session already */
+    if (cs->_sched_init == MK_FALSE ||
+        cs->conn->protocol != &mk_http_handler ||
+        mk_list_is_empty(&cs->request_list) == 0) {
+        return MK_FALSE;
+    }
+
+    mk_list_foreach(head, &cs->request_list) {
+        sr = mk_list_entry(head, struct mk_http_request, _head);
+        if (sr->handler || sr->stage30_handler || sr->user_wait ||
+            sr->upload) {
+            return MK_FALSE;
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/* Whether the last request waits for its user home directory */
+static inline int mk_http_session_user_wait(struct mk_http_session *cs)
+{
+    struct mk_http_request *sr;
+
+    if (mk_list_is_empty(&cs->request_list) == 0) {
+        return MK_FALSE;
+    }
+
+    sr = mk_list_entry_last(&cs->request_list, struct mk_http_request, _head);
+    return sr->user_wait;
+}
+
+/*
+ * Dispatch the complete requests that follow the one just prepared. It
+ * returns the number of requests added to the batch.
+ */
+static int mk_http_session_batch(struct mk_http_session *cs,
+                                 struct mk_server *server)
+{
+    int n = 0;
+    int status;
+    unsigned int prev;
+    struct mk_http_request *sr;
+
+    cs->pipeline_batch = MK_TRUE;
+
+    while (n < MK_HTTP_PIPELINE_BATCH &&
+           cs->close_now == MK_FALSE &&
+           cs->body_next < cs->body_length &&
+           cs->counter_connections + 1 < mk_http_ka_requests()) {
+
+        sr = mk_mem_alloc_z(sizeof(struct mk_http_request));
+        if (!sr) {
+            break;
+        }
+        mk_http_request_init(cs, sr, server);
+        mk_list_add(&sr->_head, &cs->request_list);
+
+        prev = cs->body_pos;
+        cs->body_pos = cs->body_next;
+        mk_http_parser_init(&cs->parser);
+        status = mk_http_session_parse(cs, sr, server);
+        if (status == MK_HTTP_PARSER_ERROR) {
+            /* the error response was queued, nothing else is read */
+            cs->close_now = MK_TRUE;
+            break;
+        }
+
+        /*
+         * Incomplete or served by a handler: it's parsed again once the
+         * batch is written.
+         */
+        if (status != MK_HTTP_PARSER_OK ||
+            mk_http_request_resolve(cs, sr, server) != NULL) {
+            cs->body_next = cs->body_pos;
+            cs->body_pos = prev;
+            mk_list_del(&sr->_head);
+            mk_http_request_free(sr, server);
+            mk_mem_free(sr);
+            break;
+        }
+
+        cs->counter_connections++;
+        mk_http_request_prepare(cs, sr, server);
+        n++;
+
+        /*
+         * A plugin took the request, it writes its response later. A
+         * request waiting for a user home directory holds the batch.
+         */
+        if (sr->stage30_handler || sr->user_wait) {
+            break;
+        }
+    }
+
+    cs->pipeline_batch = MK_FALSE;
+    return n;
+}
+
+/*
+ * Write the responses queued by the core, once they are all out the
+ * requests end as the write event would do.
+ */
+static int mk_http_session_flush(struct mk_http_session *cs,
+                                 struct mk_server *server)
+{
+    int ret = 0;
+
+    while (mk_http_session_queued(cs) == MK_TRUE) {
+        ret = mk_channel_flush(cs->channel);
+        if (ret & MK_CHANNEL_ERROR) {
+            return -1;
+        }
+        else if (ret & (MK_CHANNEL_FLUSH | MK_CHANNEL_BUSY)) {
+            /* the write event continues */
+            mk_sched_conn_rate_drain(cs->conn, mk_sched_get_thread_conf(), 0);
+            return 0;
+        }
+
+        ret = mk_http_sched_done(cs->conn, mk_sched_get_thread_conf(),
+                                 server);
+        if (ret != 1) {
+            return ret;
         }
     }
 
-    /* Client has reached keep-alive connections limit */
-    if (cs->counter_connections >= server->max_keep_alive_request) {
-        cs->close_now = MK_TRUE;
-        return -1;
+    /*
+     * The next request is served by a handler, keep watching the write
+     * event as the scheduler does once a response is done.
+     */
+    if (ret == 1 && (cs->conn->event.mask & MK_EVENT_WRITE) == 0 &&
+        mk_http_session_user_wait(cs) == MK_FALSE) {
+        mk_event_add(mk_sched_loop(), cs->conn->event.fd,
+                     MK_EVENT_CONNECTION, MK_EVENT_WRITE, &cs->conn->event);
     }
 
     return 0;
 }
 
-static inline void mk_http_request_ka_next(struct mk_http_session *cs)
+/*
+ * The home directory of a /~user request was resolved, the request is
+ * processed and the connection events are restored. A request that was
+ * part of a batch ends together with the responses queued before it.
+ */
+int mk_http_request_continue(struct mk_http_session *cs,
+                             struct mk_http_request *sr,
+                             struct mk_server *server)
 {
-    cs->body_length = 0;
-    cs->counter_connections++;
+    int ret;
+    int batch;
 
-    /* Update data for scheduler */
-    cs->init_time = log_current_utime;
-    cs->status = MK_REQUEST_STATUS_INCOMPLETE;
+    ret = mk_user_init(cs, sr, server);
+    if (ret == MK_USER_WAIT) {
+        return 0;
+    }
 
-    /* Initialize parser */
-    mk_http_parser_init(&cs->parser);
+    mk_event_add(mk_sched_loop(), cs->socket, MK_EVENT_CONNECTION,
+                 MK_EVENT_READ, cs->channel->event);
+
+    batch = (mk_list_size(&cs->request_list) > 1);
+    cs->pipeline_batch = batch;
+    if (ret == MK_USER_BUSY) {
+        mk_http_error(MK_SERVER_SERVICE_UNAV, cs, sr, server);
+    }
+    else if (ret != 0) {
+        mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
+    }
+    else {
+        mk_http_request_dispatch(cs, sr, server);
+    }
+    cs->pipeline_batch = MK_FALSE;
+
+    if (mk_http_session_queued(cs) == MK_TRUE) {
+        mk_http_session_batch(cs, server);
+        return mk_http_session_flush(cs, server);
+    }
+
+    return 0;
 }
 
 int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
 {
-    int ret;
     int status;
-    int len;
     struct mk_http_request *sr = NULL;
 
-    if (server->max_keep_alive_request <= cs->counter_connections) {
+    /* The batch being dispatched ends once all its responses are written */
+    if (cs->pipeline_batch == MK_TRUE) {
+        return 0;
+    }
+
+    if (mk_http_ka_requests() <= cs->counter_connections) {
         cs->close_now = MK_TRUE;
         goto shutdown;
     }
 
+    /* The handler did not read the whole streamed body */
+    if (mk_list_is_empty(&cs->request_list) != 0) {
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (sr->body_left > 0) {
+            cs->close_now = MK_TRUE;
+            goto shutdown;
+        }
+    }
+
     /* Check if we have some enqueued pipeline requests */
-    ret = mk_http_parser_more(&cs->parser, cs->body_length);
-    if (ret == MK_TRUE) {
+    if (cs->body_next > cs->body_pos && cs->body_next < cs->body_length) {
+        cs->body_pos = cs->body_next;
 
         /* Our pipeline request limit is the same that our keepalive limit */
         cs->counter_connections++;
-        len = (cs->body_length - cs->parser.i) -1;
-        memmove(cs->body,
-                cs->body + cs->parser.i + 1,
-                len);
-        cs->body_length = len;
 
         /* Prepare for next one */
-        sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
-        mk_http_request_free(sr, server);
+        mk_http_request_free_list(cs, server);
+        sr = &cs->sr_fixed;
         mk_http_request_init(cs, sr, server);
+        mk_list_add(&sr->_head, &cs->request_list);
+
         mk_http_parser_init(&cs->parser);
-        status = mk_http_parser(sr, &cs->parser, cs->body, cs->body_length,
-                                server);
+        status = mk_http_session_parse(cs, sr, server);
         if (status == MK_HTTP_PARSER_OK) {
             mk_http_request_prepare(cs, sr, server);
+            if (mk_http_session_queued(cs) == MK_TRUE) {
+                mk_http_session_batch(cs, server);
+            }
             /*
              * Return 1 means, we still have more data to send in a different
              * scheduler round.
@@ -1150,6 +2931,7 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
             return 1;
         }
         else if (status == MK_HTTP_PARSER_PENDING) {
+            mk_http_session_wait(cs, sr, server);
             return 0;
         }
         else if (status == MK_HTTP_PARSER_ERROR) {
@@ -1171,7 +2953,8 @@ int mk_http_request_end(struct mk_http_session *cs, struct mk_server *server)
     else {
         mk_http_request_free_list(cs, server);
         mk_http_request_ka_next(cs);
-        mk_sched_conn_timeout_add(cs->conn, mk_sched_get_thread_conf());
+        mk_sched_conn_idle_add(cs->conn, mk_sched_get_thread_conf(),
+                               log_current_utime);
         return 0;
     }
 
@@ -1193,15 +2976,39 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
 {
     int ret, fd;
     size_t count;
-    mk_ptr_t message;
-    mk_ptr_t page;
     struct mk_vhost_error_page *entry;
     struct mk_list *head;
     struct file_info finfo;
+    mk_ptr_t page;
     struct mk_iov *iov;
+    struct mk_mimetype *mime;
+    struct mk_http_error_body *body;
 
     mk_header_set_http_status(sr, http_status);
-    mk_ptr_reset(&page);
+    sr->headers.cache_policy = NULL;
+
+    /*
+     * An error response only describes its body: no validators of the
+     * requested resource or of the error page file.
+     */
+    sr->headers.last_modified = -1;
+    sr->headers.etag_len = 0;
+    mk_ptr_reset(&sr->headers.entity_rows);
+    mk_ptr_reset(&sr->headers.content_type);
+
+    /* Nor the coding picked for it: a sidecar file or the compressor */
+    mk_ptr_reset(&sr->headers.content_encoding);
+    mk_ptr_reset(&sr->headers.vary);
+    if (sr->deflate) {
+        mk_stream_deflate_put(sr->deflate);
+        sr->deflate = NULL;
+        sr->headers.transfer_encoding = -1;
+    }
+
+    /* Errors raised by the parser come before the request streams are set */
+    if (mk_list_is_empty(&sr->stream.inputs) == 0) {
+        mk_http_request_headers_input(sr);
+    }
 
     /*
      * We are nice sending error pages for clients who at least respect
@@ -1218,112 +3025,111 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
                 continue;
             }
 
-            /* validate error file */
-            ret = mk_file_get_info(entry->real_path, &finfo, MK_FILE_READ);
+            /*
+             * Validate the error file, it's served through the open file
+             * cache so the requested resource reference is not longer used.
+             */
+            if (sr->file_cache) {
+                mk_file_cache_release(sr->file_cache);
+                sr->file_cache = NULL;
+            }
+            ret = mk_file_cache_lookup(entry->real_path,
+                                       strlen(entry->real_path),
+                                       &finfo, &sr->file_cache, server);
             if (ret == -1) {
                 break;
             }
 
+            /* Outgoing headers: Content-Type and Content-Length only */
+            sr->headers.content_length = finfo.size;
+            sr->headers.real_length    = finfo.size;
+            if (sr->file_cache) {
+                mime = sr->file_cache->mime;
+            }
+            else {
+                page.data = entry->real_path;
+                page.len  = strlen(entry->real_path);
+                mime = mk_mimetype_find(server, &page);
+            }
+            if (!mime) {
+                mime = server->mimetype_default;
+            }
+            sr->headers.content_type = mime->header_type;
+
+            /*
+             * A page used often is kept in memory by the response cache,
+             * it goes out with the headers in a single writev(2).
+             */
+            if (sr->file_cache &&
+                mk_file_cache_response(sr->file_cache, NULL, server) == 0) {
+                mk_header_prepare(cs, sr, server);
+
+                if (sr->method != MK_METHOD_HEAD) {
+                    if (sr->headers._extra_rows) {
+                        iov = sr->headers._extra_rows;
+                        sr->in_headers_extra.bytes_total += finfo.size;
+                    }
+                    else {
+                        iov = &sr->headers.headers_iov;
+                        sr->in_headers.bytes_total += finfo.size;
+                    }
+                    mk_iov_add(iov, sr->file_cache->body, finfo.size,
+                               MK_FALSE);
+                }
+                return MK_EXIT_OK;
+            }
+
             /* open file */
-            fd = open(entry->real_path, server->open_flags);
+            if (sr->file_cache) {
+                fd = mk_file_cache_open(sr->file_cache);
+            }
+            else {
+                fd = open(entry->real_path, server->open_flags);
+            }
             if (fd == -1) {
                 break;
             }
-
-            /* Outgoing headers */
-            sr->headers.content_length = finfo.size;
-            sr->headers.real_length    = finfo.size;
             mk_header_prepare(cs, sr, server);
 
             /* Stream setup */
-            mk_stream_in_file(&sr->stream, &sr->in_file, sr->file_fd,
+            mk_stream_in_file(&sr->stream, &sr->in_file, fd,
                               finfo.size, 0, NULL, NULL);
             return MK_EXIT_OK;
         }
     }
 
-    mk_ptr_reset(&message);
-
-    switch (http_status) {
-    case MK_CLIENT_FORBIDDEN:
-        mk_http_error_page("Forbidden",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    case MK_CLIENT_NOT_FOUND:
-        mk_string_build(&message.data, &message.len,
-                        "The requested URL was not found on this server.");
-        mk_http_error_page("Not Found",
-                           &message,
-                           server->server_signature,
-                           &page.data, &page.len);
-        mk_ptr_free(&message);
-        break;
-    case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
-        mk_string_build(&message.data, &message.len,
-                        "The request entity is too large.");
-        mk_http_error_page("Entity too large",
-                           &message,
-                           server->server_signature,
-                           &page.data, &page.len);
-        mk_ptr_free(&message);
-        break;
-    case MK_CLIENT_METHOD_NOT_ALLOWED:
-        mk_http_error_page("Method Not Allowed",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    case MK_SERVER_NOT_IMPLEMENTED:
-        mk_http_error_page("Method Not Implemented",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    case MK_SERVER_INTERNAL_ERROR:
-        mk_http_error_page("Internal Server Error",
-                           &sr->uri,
-                           server->server_signature,
-                           &page.data, &page.len);
-        break;
-    }
-
-    if (page.len > 0 && sr->method != MK_METHOD_HEAD && sr->method != MK_METHOD_UNKNOWN) {
-        sr->headers.content_length = page.len;
-    }
-    else {
-        sr->headers.content_length = 0;
-    }
+    /* Default page, precomposed by mk_http_error_bodies_init() */
+    body = mk_http_error_body_get(http_status, server);
 
     sr->headers.location = NULL;
     sr->headers.cgi = SH_NOCGI;
     sr->headers.pconnections_left = 0;
-    sr->headers.last_modified = -1;
 
-    if (!page.data) {
-        mk_ptr_reset(&sr->headers.content_type);
+    if (body && sr->method != MK_METHOD_HEAD &&
+        sr->method != MK_METHOD_UNKNOWN) {
+        sr->headers.content_length = body->page.len;
+        sr->headers.entity_rows = body->rows;
+        mk_header_prepare(cs, sr, server);
+
+        if (sr->headers._extra_rows) {
+            iov = sr->headers._extra_rows;
+            sr->in_headers_extra.bytes_total += body->page.len;
+        }
+        else {
+            iov = &sr->headers.headers_iov;
+            sr->in_headers.bytes_total += body->page.len;
+        }
+        mk_iov_add(iov, body->page.data, body->page.len, MK_FALSE);
     }
     else {
-        mk_ptr_set(&sr->headers.content_type, "Content-Type: text/html\r\n");
-    }
-
-    mk_header_prepare(cs, sr, server);
-    if (page.data) {
-        if (sr->method != MK_METHOD_HEAD) {
-            if (sr->headers._extra_rows) {
-                iov = sr->headers._extra_rows;
-                sr->in_headers_extra.bytes_total += page.len;
-            }
-            else {
-                iov = &sr->headers.headers_iov;
-                sr->in_headers.bytes_total += page.len;
-            }
-            mk_iov_add(iov, page.data, page.len, MK_TRUE);
+        sr->headers.content_length = 0;
+        if (body) {
+            mk_ptr_set(&sr->headers.content_type, "Content-Type: text/html\r\n");
         }
         else {
-            mk_mem_free(page.data);
+            mk_ptr_reset(&sr->headers.content_type);
         }
+        mk_header_prepare(cs, sr, server);
     }
 
     mk_channel_write(cs->channel, &count);
@@ -1366,6 +3172,9 @@ void mk_http_session_remove(struct mk_http_session *cs,
     if (cs->body != cs->body_fixed) {
         mk_mem_free(cs->body);
     }
+    if (cs->parser.headers_extra != cs->parser.headers_extra_fixed) {
+        mk_mem_free(cs->parser.headers_extra);
+    }
     mk_http_request_free_list(cs, server);
     mk_list_del(&cs->request_list);
 
@@ -1414,13 +3223,17 @@ int mk_http_session_init(struct mk_http_session *cs, struct mk_sched_conn *conn,
         cs->body_size = MK_REQUEST_CHUNK;
     }
 
-    /* Current data length */
+    /* Current data length and read cursor */
     cs->body_length = 0;
+    cs->body_pos = 0;
+    cs->body_next = 0;
+    cs->pipeline_batch = MK_FALSE;
 
     /* Init session request list */
     mk_list_init(&cs->request_list);
 
-    /* Initialize the parser */
+    /* Initialize the parser, it starts with the fixed extra headers table */
+    cs->parser.headers_extra = NULL;
     mk_http_parser_init(&cs->parser);
 
     return 0;
@@ -1432,6 +3245,11 @@ void mk_http_request_free(struct mk_http_request *sr, struct mk_server *server)
     /* Let the vhost interface to handle the session close */
     mk_vhost_close(sr, server);
 
+    if (sr->user_wait == MK_TRUE) {
+        mk_list_del(&sr->_user_head);
+        sr->user_wait = MK_FALSE;
+    }
+
     if (sr->headers.location) {
         mk_mem_free(sr->headers.location);
     }
@@ -1444,9 +3262,32 @@ void mk_http_request_free(struct mk_http_request *sr, struct mk_server *server)
         mk_ptr_free(&sr->real_path);
     }
 
+    if (sr->rewrite_buf) {
+        mk_mem_free(sr->rewrite_buf);
+        sr->rewrite_buf = NULL;
+    }
+
+    if (sr->upload) {
+        mk_http_upload_free(sr);
+    }
+
+    if (sr->stream_continue.channel) {
+        mk_stream_release(&sr->stream_continue);
+    }
+
     if (sr->stream.channel) {
         mk_stream_release(&sr->stream);
     }
+
+    if (sr->multipart) {
+        mk_mem_free(sr->multipart);
+        sr->multipart = NULL;
+    }
+
+    if (sr->deflate) {
+        mk_stream_deflate_put(sr->deflate);
+        sr->deflate = NULL;
+    }
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs,
@@ -1470,7 +3311,8 @@ void mk_http_request_free_list(struct mk_http_session *cs,
 
 /*
  * Lookup a known header or a non-known header. For unknown headers
- * set the 'key' value wth a lowercase string
+ * set the 'key' value wth a lowercase string, a key naming a known
+ * header is resolved without scanning the extra headers.
  */
 struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
                                           const char *key, unsigned int len)
@@ -1486,10 +3328,20 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
 
     /* Check if want to retrieve a custom header */
     if (name == MK_HEADER_OTHER) {
+        i = mk_http_header_index(key, len);
+        if (i >= 0) {
+            header = &parser->headers[i];
+            if (!header->key.data) {
+                return NULL;
+            }
+            return header;
+        }
+
         /* Iterate over the extra headers identified by the parser */
         for (i = 0; i < parser->headers_extra_count; i++) {
             header = &parser->headers_extra[i];
-            if (header->key.len != len) {
+            if (header->type != MK_HEADER_OTHER ||
+                header->key.len != len) {
                 continue;
             }
 
@@ -1503,6 +3355,100 @@ struct mk_http_header *mk_http_header_get(int name, struct mk_http_request *req,
     return NULL;
 }
 
+/*
+ * Parse the data available on the session buffer, once a request is
+ * complete it gets processed.
+ */
+static int mk_http_session_process(struct mk_sched_conn *conn,
+                                   struct mk_http_session *cs,
+                                   struct mk_server *server)
+{
+    int status;
+    size_t count;
+    struct mk_http_request *sr;
+
+#ifdef TRACE
+    int socket = conn->event.fd;
+#endif
+
+    if (mk_list_is_empty(&cs->request_list) == 0) {
+        /* Add the first entry */
+        sr = &cs->sr_fixed;
+        mk_list_add(&sr->_head, &cs->request_list);
+        mk_http_request_init(cs, sr, server);
+    }
+    else {
+        sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+    }
+    status = mk_http_session_parse(cs, sr, server);
+
+    /* Headers complete, the body is pending */
+    if (status == MK_HTTP_PARSER_PENDING &&
+        cs->parser.level == REQ_LEVEL_BODY && sr->body_checked == MK_FALSE) {
+        if (mk_http_body_check(cs, sr, server) == -1) {
+            return -1;
+        }
+        if (sr->body_stream == MK_TRUE) {
+            status = mk_http_session_parse(cs, sr, server);
+            if (mk_http_parser_chunked(&cs->parser)) {
+                /* the size is unknown until the last chunk arrives */
+                if (cs->parser.chunk.state == MK_CHUNK_DONE) {
+                    sr->body_left = 0;
+                }
+                else {
+                    sr->body_left = LONG_MAX;
+                }
+            }
+            else {
+                sr->body_left = cs->parser.header_content_length -
+                    sr->data.len;
+            }
+        }
+    }
+
+    /* The headers are complete, from now on the body is watched */
+    if (status == MK_HTTP_PARSER_PENDING &&
+        cs->parser.level == REQ_LEVEL_BODY) {
+        mk_sched_conn_rate(conn, mk_sched_get_thread_conf(),
+                           MK_SCHED_RATE_BODY, log_current_utime);
+    }
+
+    if (status == MK_HTTP_PARSER_OK) {
+        MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
+        if (mk_http_status_completed(cs, conn) == -1) {
+            mk_http_session_remove(cs, server);
+            return -1;
+        }
+        mk_sched_conn_timeout_del(conn);
+        mk_sched_conn_rate(conn, mk_sched_get_thread_conf(),
+                           MK_SCHED_RATE_NONE, log_current_utime);
+        mk_http_request_prepare(cs, sr, server);
+
+        /*
+         * Dispatch the complete requests that came in the same read and
+         * write all their responses at once.
+         */
+        if (mk_http_session_queued(cs) == MK_TRUE) {
+            mk_http_session_batch(cs, server);
+            return mk_http_session_flush(cs, server);
+        }
+    }
+    else if (status == MK_HTTP_PARSER_ERROR) {
+        /* The HTTP parser may enqueued some response error */
+        if (mk_channel_is_empty(cs->channel) != 0) {
+            mk_channel_write(cs->channel, &count);
+        }
+        mk_http_session_remove(cs, server);
+        MK_TRACE("[FD %i] HTTP_PARSER_ERROR", socket);
+        return -1;
+    }
+    else {
+        MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
+    }
+
+    return 0;
+}
+
 /*
  * Main callbacks for the Scheduler
  */
@@ -1511,8 +3457,6 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
                        struct mk_server *server)
 {
     int ret;
-    int status;
-    size_t count;
     (void) worker;
     struct mk_http_session *cs;
     struct mk_http_request *sr;
@@ -1531,44 +3475,87 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
         }
     }
 
+    /* A new request on an idle persistent connection */
+    if (conn->is_timeout_on == MK_SCHED_CONN_KA_IDLE) {
+        conn->arrive_time = log_current_utime;
+        mk_sched_conn_timeout_add(conn, worker);
+    }
+
+    /* The body of the current request is being streamed to a plugin */
+    if (mk_list_is_empty(&cs->request_list) != 0) {
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (sr->body_stream == MK_TRUE && sr->body_left > 0 &&
+            sr->stage30_handler) {
+            mk_sched_conn_rate(conn, worker, MK_SCHED_RATE_BODY,
+                               log_current_utime);
+            return mk_http_body_stream_read(cs, sr);
+        }
+        if (sr->upload && sr->body_left > 0) {
+            mk_sched_conn_rate(conn, worker, MK_SCHED_RATE_BODY,
+                               log_current_utime);
+            return mk_http_upload_body(cs, sr, server);
+        }
+    }
+
     /* Invoke the read handler, on this case we only support HTTP (for now :) */
     ret = mk_http_handler_read(conn, cs, server);
     if (ret > 0) {
-        if (mk_list_is_empty(&cs->request_list) == 0) {
-            /* Add the first entry */
-            sr = &cs->sr_fixed;
-            mk_list_add(&sr->_head, &cs->request_list);
-            mk_http_request_init(cs, sr, server);
+        /* The first bytes of a request start the header clock */
+        if (conn->rate_mode == MK_SCHED_RATE_NONE) {
+            mk_sched_conn_rate(conn, worker, MK_SCHED_RATE_HEADER,
+                               log_current_utime);
         }
-        else {
-            sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
+        mk_sched_conn_rate_add(conn, ret);
+        if (mk_http_session_process(conn, cs, server) == -1) {
+            return -1;
         }
-        status = mk_http_parser(sr, &cs->parser, cs->body,
-                                cs->body_length, server);
-        if (status == MK_HTTP_PARSER_OK) {
-            MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
-            if (mk_http_status_completed(cs, conn) == -1) {
-                mk_http_session_remove(cs, server);
-                return -1;
-            }
-            mk_sched_conn_timeout_del(conn);
-            mk_http_request_prepare(cs, sr, server);
+    }
+
+    return ret;
+}
+
+/*
+ * A connection was handed off by a worker of a different pool, restore
+ * the data it already read and process the request on this worker.
+ */
+int mk_http_sched_handoff(struct mk_sched_conn *conn,
+                          struct mk_sched_worker *worker,
+                          char *data, size_t size,
+                          struct mk_server *server)
+{
+    int ret;
+    (void) worker;
+    struct mk_http_session *cs;
+
+    cs = mk_http_session_get(conn);
+    ret = mk_http_session_init(cs, conn, server);
+    if (ret == -1) {
+        return -1;
+    }
+
+    if (size >= (size_t) cs->body_size) {
+        if (cs->body != cs->body_fixed) {
+            mk_mem_free(cs->body);
         }
-        else if (status == MK_HTTP_PARSER_ERROR) {
-            /* The HTTP parser may enqueued some response error */
-            if (mk_channel_is_empty(cs->channel) != 0) {
-                mk_channel_write(cs->channel, &count);
-            }
+        cs->body = mk_mem_alloc(size + 1);
+        if (!cs->body) {
+            cs->body = cs->body_fixed;
             mk_http_session_remove(cs, server);
-            MK_TRACE("[FD %i] HTTP_PARSER_ERROR", socket);
             return -1;
         }
-        else {
-            MK_TRACE("[FD %i] HTTP_PARSER_PENDING", socket);
-        }
+        cs->body_size = size;
     }
 
-    return ret;
+    memcpy(cs->body, data, size);
+    cs->body_length = size;
+    cs->body[cs->body_length] = '\0';
+
+    if (size == 0) {
+        return 0;
+    }
+
+    return mk_http_session_process(conn, cs, server);
 }
 
 /* The scheduler got a connection close event from the remote client */
@@ -1591,18 +3578,84 @@ int mk_http_sched_close(struct mk_sched_conn *conn,
     return 0;
 }
 
+/*
+ * The remote client hung up while some request may still be in progress:
+ * notify the stage30 handlers and cancel the coroutines so upstream work
+ * (CGI children, FastCGI requests, lib callbacks) can be aborted right away.
+ */
+int mk_http_sched_cancel(struct mk_sched_conn *conn,
+                         struct mk_sched_worker *sched,
+                         struct mk_server *server)
+{
+    int pending = MK_FALSE;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_plugin *handler;
+    struct mk_http_session *cs;
+    struct mk_http_request *sr;
+    (void) sched;
+    (void) server;
+
+    cs = mk_http_session_get(conn);
+    if (cs->_sched_init == MK_FALSE) {
+        return 0;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cs->request_list) {
+        sr = mk_list_entry(head, struct mk_http_request, _head);
+        if (sr->thread) {
+            MK_TRACE("[FD %i] Cancel HTTP thread", cs->socket);
+            mk_http_thread_cancel(sr->thread);
+            pending = MK_TRUE;
+        }
+
+        if (sr->stage30_handler) {
+            MK_TRACE("[FD %i] Cancel stage30 handler", cs->socket);
+            handler = sr->stage30_handler;
+            if (handler->stage->stage30_cancel) {
+                handler->stage->stage30_cancel(handler, cs, sr);
+            }
+            pending = MK_TRUE;
+        }
+    }
+
+    /*
+     * A pending response will never be read: ask the scheduler to drop the
+     * connection, the stage30_hangup callbacks release the resources.
+     */
+    if (pending == MK_TRUE) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int mk_http_sched_done(struct mk_sched_conn *conn,
                        struct mk_sched_worker *worker,
                        struct mk_server *server)
 {
     (void) worker;
+    struct mk_list *head;
     struct mk_http_session *cs;
     struct mk_http_request *sr;
 
     cs = mk_http_session_get(conn);
-    sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
 
-    mk_plugin_stage_run_40(cs, sr, server);
+    /* Only the '100 Continue' was written, the body is read now */
+    if (mk_list_is_empty(&cs->request_list) != 0) {
+        sr = mk_list_entry_first(&cs->request_list,
+                                 struct mk_http_request, _head);
+        if (sr->body_continue == MK_TRUE && sr->headers.sent == MK_FALSE) {
+            sr->body_continue = MK_FALSE;
+            return 0;
+        }
+    }
+
+    /* A pipelined batch ends all its requests together */
+    mk_list_foreach(head, &cs->request_list) {
+        sr = mk_list_entry(head, struct mk_http_request, _head);
+        mk_plugin_stage_run_40(cs, sr, server);
+    }
 
     return mk_http_request_end(cs, server);
 }
@@ -1612,6 +3665,8 @@ struct mk_sched_handler mk_http_handler = {
     .cb_read          = mk_http_sched_read,
     .cb_close         = mk_http_sched_close,
     .cb_done          = mk_http_sched_done,
+    .cb_cancel        = mk_http_sched_cancel,
+    .cb_handoff       = mk_http_sched_handoff,
     .sched_extra_size = sizeof(struct mk_http_session),
     .capabilities     = MK_CAP_HTTP
 };
@@ -30,6 +30,11 @@
 #include <monkey/mk_http_parser.h>
 #include <monkey/mk_http_status.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MK_HTTP_PARSER_SIMD
+#include <immintrin.h>
+#endif
+
 #define mark_end()                              \
     p->end = p->i;                              \
     p->chars = -1;
@@ -39,7 +44,6 @@
     continue
 
 #define field_len()   (p->end - p->start)
-#define header_scope_eq(p, x) p->header_min = p->header_max = x
 
 struct row_entry {
     int len;
@@ -56,40 +60,333 @@ struct row_entry mk_methods_table[] = {
 };
 
 struct row_entry mk_headers_table[] = {
-    {  6, "accept"              },
-    { 14, "accept-charset"      },
-    { 15, "accept-encoding"     },
-    { 15, "accept-language"     },
-    { 13, "authorization"       },
-    { 13, "cache-control"       },
-    {  6, "cookie"              },
-    { 10, "connection"          },
-    { 14, "content-length"      },
-    { 13, "content-range"       },
-    { 12, "content-type"        },
-    {  4, "host"                },
-    { 14, "http2-settings"      },
-    { 17, "if-modified-since"   },
-    { 13, "last-modified"       },
-    { 19, "last-modified-since" },
-    {  5, "range"               },
-    {  7, "referer"             },
-    {  7, "upgrade"             },
-    { 10, "user-agent"          }
+    {  6, "accept"                         },
+    { 14, "accept-charset"                 },
+    { 15, "accept-encoding"                },
+    { 15, "accept-language"                },
+    { 30, "access-control-request-headers" },
+    { 29, "access-control-request-method"  },
+    { 13, "authorization"                  },
+    { 13, "cache-control"                  },
+    { 10, "connection"                     },
+    { 16, "content-encoding"               },
+    { 14, "content-length"                 },
+    { 13, "content-range"                  },
+    { 12, "content-type"                   },
+    {  6, "cookie"                         },
+    {  3, "dnt"                            },
+    {  6, "expect"                         },
+    {  9, "forwarded"                      },
+    {  4, "host"                           },
+    { 14, "http2-settings"                 },
+    {  8, "if-match"                       },
+    { 17, "if-modified-since"              },
+    { 13, "if-none-match"                  },
+    {  8, "if-range"                       },
+    { 19, "if-unmodified-since"            },
+    { 10, "keep-alive"                     },
+    { 13, "last-modified"                  },
+    { 19, "last-modified-since"            },
+    {  6, "origin"                         },
+    {  6, "pragma"                         },
+    {  8, "priority"                       },
+    { 19, "proxy-authorization"            },
+    {  5, "range"                          },
+    {  7, "referer"                        },
+    {  9, "sec-ch-ua"                      },
+    { 16, "sec-ch-ua-mobile"               },
+    { 18, "sec-ch-ua-platform"             },
+    { 14, "sec-fetch-dest"                 },
+    { 14, "sec-fetch-mode"                 },
+    { 14, "sec-fetch-site"                 },
+    { 14, "sec-fetch-user"                 },
+    { 24, "sec-websocket-extensions"       },
+    { 17, "sec-websocket-key"              },
+    { 22, "sec-websocket-protocol"         },
+    { 21, "sec-websocket-version"          },
+    {  2, "te"                             },
+    { 11, "traceparent"                    },
+    { 10, "tracestate"                     },
+    { 17, "transfer-encoding"              },
+    {  7, "upgrade"                        },
+    { 25, "upgrade-insecure-requests"      },
+    { 10, "user-agent"                     },
+    {  3, "via"                            },
+    { 15, "x-forwarded-for"                },
+    { 16, "x-forwarded-host"               },
+    { 17, "x-forwarded-proto"              },
+    {  9, "x-real-ip"                      },
+    { 16, "x-requested-with"               }
+};
+
+/*
+ * Known headers lookup
+ * --------------------
+ * A header name is found with a perfect hash over its length, the first
+ * character and the last two ones (lowercase), the slot holds the header
+ * index + 1. The table is set at compile time: a new header hashing to a
+ * used slot makes the compiler warn about an overwritten initializer.
+ */
+#define MK_HEADER_HASH_SIZE  256
+#define MK_HEADER_HASH(len, first, penult, last)                          \
+    (((len) * 2 + (first) + (penult) * 36 + (last) * 11) &                \
+     (MK_HEADER_HASH_SIZE - 1))
+#define MK_HEADER_SLOT(len, first, penult, last, type)                    \
+    [MK_HEADER_HASH(len, first, penult, last)] = (type) + 1
+
+static const unsigned char mk_headers_hash[MK_HEADER_HASH_SIZE] = {
+    MK_HEADER_SLOT( 6, 'a', 'p', 't', MK_HEADER_ACCEPT),
+    MK_HEADER_SLOT(14, 'a', 'e', 't', MK_HEADER_ACCEPT_CHARSET),
+    MK_HEADER_SLOT(15, 'a', 'n', 'g', MK_HEADER_ACCEPT_ENCODING),
+    MK_HEADER_SLOT(15, 'a', 'g', 'e', MK_HEADER_ACCEPT_LANGUAGE),
+    MK_HEADER_SLOT(30, 'a', 'r', 's', MK_HEADER_ACCESS_CONTROL_REQUEST_HEADERS),
+    MK_HEADER_SLOT(29, 'a', 'o', 'd', MK_HEADER_ACCESS_CONTROL_REQUEST_METHOD),
+    MK_HEADER_SLOT(13, 'a', 'o', 'n', MK_HEADER_AUTHORIZATION),
+    MK_HEADER_SLOT(13, 'c', 'o', 'l', MK_HEADER_CACHE_CONTROL),
+    MK_HEADER_SLOT(10, 'c', 'o', 'n', MK_HEADER_CONNECTION),
+    MK_HEADER_SLOT(16, 'c', 'n', 'g', MK_HEADER_CONTENT_ENCODING),
+    MK_HEADER_SLOT(14, 'c', 't', 'h', MK_HEADER_CONTENT_LENGTH),
+    MK_HEADER_SLOT(13, 'c', 'g', 'e', MK_HEADER_CONTENT_RANGE),
+    MK_HEADER_SLOT(12, 'c', 'p', 'e', MK_HEADER_CONTENT_TYPE),
+    MK_HEADER_SLOT( 6, 'c', 'i', 'e', MK_HEADER_COOKIE),
+    MK_HEADER_SLOT( 3, 'd', 'n', 't', MK_HEADER_DNT),
+    MK_HEADER_SLOT( 6, 'e', 'c', 't', MK_HEADER_EXPECT),
+    MK_HEADER_SLOT( 9, 'f', 'e', 'd', MK_HEADER_FORWARDED),
+    MK_HEADER_SLOT( 4, 'h', 's', 't', MK_HEADER_HOST),
+    MK_HEADER_SLOT(14, 'h', 'g', 's', MK_HEADER_HTTP2_SETTINGS),
+    MK_HEADER_SLOT( 8, 'i', 'c', 'h', MK_HEADER_IF_MATCH),
+    MK_HEADER_SLOT(17, 'i', 'c', 'e', MK_HEADER_IF_MODIFIED_SINCE),
+    MK_HEADER_SLOT(13, 'i', 'c', 'h', MK_HEADER_IF_NONE_MATCH),
+    MK_HEADER_SLOT( 8, 'i', 'g', 'e', MK_HEADER_IF_RANGE),
+    MK_HEADER_SLOT(19, 'i', 'c', 'e', MK_HEADER_IF_UNMODIFIED_SINCE),
+    MK_HEADER_SLOT(10, 'k', 'v', 'e', MK_HEADER_KEEP_ALIVE),
+    MK_HEADER_SLOT(13, 'l', 'e', 'd', MK_HEADER_LAST_MODIFIED),
+    MK_HEADER_SLOT(19, 'l', 'c', 'e', MK_HEADER_LAST_MODIFIED_SINCE),
+    MK_HEADER_SLOT( 6, 'o', 'i', 'n', MK_HEADER_ORIGIN),
+    MK_HEADER_SLOT( 6, 'p', 'm', 'a', MK_HEADER_PRAGMA),
+    MK_HEADER_SLOT( 8, 'p', 't', 'y', MK_HEADER_PRIORITY),
+    MK_HEADER_SLOT(19, 'p', 'o', 'n', MK_HEADER_PROXY_AUTHORIZATION),
+    MK_HEADER_SLOT( 5, 'r', 'g', 'e', MK_HEADER_RANGE),
+    MK_HEADER_SLOT( 7, 'r', 'e', 'r', MK_HEADER_REFERER),
+    MK_HEADER_SLOT( 9, 's', 'u', 'a', MK_HEADER_SEC_CH_UA),
+    MK_HEADER_SLOT(16, 's', 'l', 'e', MK_HEADER_SEC_CH_UA_MOBILE),
+    MK_HEADER_SLOT(18, 's', 'r', 'm', MK_HEADER_SEC_CH_UA_PLATFORM),
+    MK_HEADER_SLOT(14, 's', 's', 't', MK_HEADER_SEC_FETCH_DEST),
+    MK_HEADER_SLOT(14, 's', 'd', 'e', MK_HEADER_SEC_FETCH_MODE),
+    MK_HEADER_SLOT(14, 's', 't', 'e', MK_HEADER_SEC_FETCH_SITE),
+    MK_HEADER_SLOT(14, 's', 'e', 'r', MK_HEADER_SEC_FETCH_USER),
+    MK_HEADER_SLOT(24, 's', 'n', 's', MK_HEADER_SEC_WEBSOCKET_EXTENSIONS),
+    MK_HEADER_SLOT(17, 's', 'e', 'y', MK_HEADER_SEC_WEBSOCKET_KEY),
+    MK_HEADER_SLOT(22, 's', 'o', 'l', MK_HEADER_SEC_WEBSOCKET_PROTOCOL),
+    MK_HEADER_SLOT(21, 's', 'o', 'n', MK_HEADER_SEC_WEBSOCKET_VERSION),
+    MK_HEADER_SLOT( 2, 't', 't', 'e', MK_HEADER_TE),
+    MK_HEADER_SLOT(11, 't', 'n', 't', MK_HEADER_TRACEPARENT),
+    MK_HEADER_SLOT(10, 't', 't', 'e', MK_HEADER_TRACESTATE),
+    MK_HEADER_SLOT(17, 't', 'n', 'g', MK_HEADER_TRANSFER_ENCODING),
+    MK_HEADER_SLOT( 7, 'u', 'd', 'e', MK_HEADER_UPGRADE),
+    MK_HEADER_SLOT(25, 'u', 't', 's', MK_HEADER_UPGRADE_INSECURE_REQUESTS),
+    MK_HEADER_SLOT(10, 'u', 'n', 't', MK_HEADER_USER_AGENT),
+    MK_HEADER_SLOT( 3, 'v', 'i', 'a', MK_HEADER_VIA),
+    MK_HEADER_SLOT(15, 'x', 'o', 'r', MK_HEADER_X_FORWARDED_FOR),
+    MK_HEADER_SLOT(16, 'x', 's', 't', MK_HEADER_X_FORWARDED_HOST),
+    MK_HEADER_SLOT(17, 'x', 't', 'o', MK_HEADER_X_FORWARDED_PROTO),
+    MK_HEADER_SLOT( 9, 'x', 'i', 'p', MK_HEADER_X_REAL_IP),
+    MK_HEADER_SLOT(16, 'x', 't', 'h', MK_HEADER_X_REQUESTED_WITH),
+};
+
+/*
+ * Bulk scan
+ * ---------
+ * The fields of the request line and the header rows are not walked byte by
+ * byte by the state machine, the parser jumps to the next byte stopping the
+ * field: a delimiter, the end of the line or an invalid (control) byte. The
+ * scan uses SSE4.2 or AVX2 when the CPU has them, it's picked at runtime and
+ * falls back to a scalar loop.
+ */
+struct parser_scan_set {
+    char ranges[16];        /* SSE4.2: inclusive ranges of stop bytes  */
+    int ranges_len;
+    unsigned char d1;       /* AVX2/scalar: delimiters besides the     */
+    unsigned char d2;       /* control bytes                           */
+    unsigned char allow;    /* control byte allowed, 0xff if none      */
 };
 
-static inline void char_lookup(char *buf, char c, int len, struct mk_http_parser *p)
+/* URI: ' ', '?' and control bytes */
+static const struct parser_scan_set scan_uri = {
+    "\x00\x1f\x7f\x7f  ??", 8, ' ', '?', 0xff
+};
+
+/* Query string: ' ' and control bytes */
+static const struct parser_scan_set scan_query = {
+    "\x00\x1f\x7f\x7f  ", 6, ' ', ' ', 0xff
+};
+
+/* Header key: ':' and control bytes */
+static const struct parser_scan_set scan_key = {
+    "\x00\x1f\x7f\x7f::", 6, ':', ':', 0xff
+};
+
+/* Header value: control bytes except the horizontal tab */
+static const struct parser_scan_set scan_value = {
+    "\x00\x08\x0a\x1f\x7f\x7f", 6, 0x7f, 0x7f, '\t'
+};
+
+static int scan_scalar(const char *buf, int i, int len,
+                       const struct parser_scan_set *set)
+{
+    unsigned char c;
+
+    for (; i < len; i++) {
+        c = buf[i];
+        if (c < 0x20) {
+            if (c != set->allow) {
+                return i;
+            }
+        }
+        else if (c == 0x7f || c == set->d1 || c == set->d2) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+#ifdef MK_HTTP_PARSER_SIMD
+__attribute__((target("sse4.2")))
+static int scan_sse42(const char *buf, int i, int len,
+                      const struct parser_scan_set *set)
+{
+    int r;
+    __m128i b;
+    __m128i ranges;
+
+    ranges = _mm_loadu_si128((const __m128i *) set->ranges);
+    while (len - i >= 16) {
+        b = _mm_loadu_si128((const __m128i *) (buf + i));
+        r = _mm_cmpestri(ranges, set->ranges_len, b, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                         _SIDD_LEAST_SIGNIFICANT);
+        if (r != 16) {
+            return i + r;
+        }
+        i += 16;
+    }
+
+    return scan_scalar(buf, i, len, set);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const char *buf, int i, int len,
+                     const struct parser_scan_set *set)
+{
+    unsigned int mask;
+    __m256i b;
+    __m256i m;
+    const __m256i ctl   = _mm256_set1_epi8(0x1f);
+    const __m256i del   = _mm256_set1_epi8(0x7f);
+    const __m256i d1    = _mm256_set1_epi8(set->d1);
+    const __m256i d2    = _mm256_set1_epi8(set->d2);
+    const __m256i allow = _mm256_set1_epi8(set->allow);
+
+    while (len - i >= 32) {
+        b = _mm256_loadu_si256((const __m256i *) (buf + i));
+
+        /* b <= 0x1f, but the allowed control byte */
+        m = _mm256_cmpeq_epi8(_mm256_min_epu8(b, ctl), b);
+        m = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, allow), m);
+
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, del));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, d1));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(b, d2));
+
+        mask = _mm256_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+
+    return scan_sse42(buf, i, len, set);
+}
+#endif
+
+/* Set by mk_http_parser_scan_init() before the workers start */
+static int (*scan_bytes)(const char *, int, int,
+                         const struct parser_scan_set *) = scan_scalar;
+
+/*
+ * Pick the scan implementation, MK_HTTP_PARSER_SCAN_AUTO takes the best one
+ * the CPU supports. It returns -1 if the build or the CPU lacks the one
+ * requested. It's not thread safe, the server calls it once on setup.
+ */
+int mk_http_parser_scan_init(int type)
 {
-    int x = 0;
+#ifdef MK_HTTP_PARSER_SIMD
+    int sse42;
+    int avx2;
+
+    __builtin_cpu_init();
+    sse42 = __builtin_cpu_supports("sse4.2");
+    avx2 = sse42 && __builtin_cpu_supports("avx2");
 
-    x = p->i;
-    do {
-        if (buf[x] == c) {
-            p->i = x;
-            return;
+    if (type == MK_HTTP_PARSER_SCAN_AUTO) {
+        if (avx2) {
+            type = MK_HTTP_PARSER_SCAN_AVX2;
         }
-        x++;
-    } while (x < len);
+        else if (sse42) {
+            type = MK_HTTP_PARSER_SCAN_SSE42;
+        }
+        else {
+            type = MK_HTTP_PARSER_SCAN_SCALAR;
+        }
+    }
+
+    switch (type) {
+    case MK_HTTP_PARSER_SCAN_SCALAR:
+        scan_bytes = scan_scalar;
+        return 0;
+    case MK_HTTP_PARSER_SCAN_SSE42:
+        if (!sse42) {
+            return -1;
+        }
+        scan_bytes = scan_sse42;
+        return 0;
+    case MK_HTTP_PARSER_SCAN_AVX2:
+        if (!avx2) {
+            return -1;
+        }
+        scan_bytes = scan_avx2;
+        return 0;
+    }
+#else
+    if (type == MK_HTTP_PARSER_SCAN_AUTO ||
+        type == MK_HTTP_PARSER_SCAN_SCALAR) {
+        scan_bytes = scan_scalar;
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+/*
+ * Move the parser to the next stop byte of the set and return MK_TRUE. If
+ * the buffer has none, the parser is left on its last byte so the loop
+ * resumes after it once more data arrives.
+ */
+static inline int parser_scan(struct mk_http_parser *p, char *buffer, int len,
+                              const struct parser_scan_set *set)
+{
+    int i;
+
+    i = scan_bytes(buffer, p->i, len, set);
+    if (i == len) {
+        p->i = len - 1;
+        return MK_FALSE;
+    }
+
+    p->i = i;
+    return MK_TRUE;
 }
 
 static inline int str_searchr(char *buf, char c, int len)
@@ -154,7 +451,7 @@ static inline void request_set(mk_ptr_t *ptr, struct mk_http_parser *p, char *bu
  *
  * If it matches it return zero. Otherwise -1.
  */
-static inline int header_cmp(const char *expected, char *value, int len)
+static inline int header_cmp(const char *expected, const char *value, int len)
 {
     int i = 0;
 
@@ -179,6 +476,100 @@ static inline int header_cmp(const char *expected, char *value, int len)
     return 0;
 }
 
+/* Return the index of a known header name or -1 */
+static inline int header_index(const char *key, int len)
+{
+    int i;
+    struct row_entry *h;
+
+    if (len < 2) {
+        return -1;
+    }
+
+    i = mk_headers_hash[MK_HEADER_HASH(len,
+                                       tolower(key[0]),
+                                       tolower(key[len - 2]),
+                                       tolower(key[len - 1]))] - 1;
+    if (i < 0) {
+        return -1;
+    }
+
+    h = &mk_headers_table[i];
+    if (h->len != len || header_cmp(h->name, key, len) != 0) {
+        return -1;
+    }
+
+    return i;
+}
+
+int mk_http_header_index(const char *key, int len)
+{
+    return header_index(key, len);
+}
+
+/*
+ * Grow the extra headers table. The entries are linked in the headers list,
+ * once copied their links are moved to the new table.
+ */
+static int headers_extra_grow(struct mk_http_parser *p)
+{
+    int i;
+    int size;
+    char *old_start;
+    char *old_end;
+    struct mk_list *link;
+    struct mk_http_header *old;
+    struct mk_http_header *table;
+    struct mk_http_header *header;
+
+    if (p->headers_extra_size >= MK_HEADER_EXTRA_MAX) {
+        return -1;
+    }
+
+    size = p->headers_extra_size * 2;
+    table = mk_mem_alloc(sizeof(struct mk_http_header) * size);
+    if (!table) {
+        return -1;
+    }
+
+    old = p->headers_extra;
+    old_start = (char *) old;
+    old_end = (char *) (old + p->headers_extra_count);
+    memcpy(table, old, sizeof(struct mk_http_header) * p->headers_extra_count);
+
+    /* Links between extra headers point to the old table */
+    for (i = 0; i < p->headers_extra_count; i++) {
+        header = &table[i];
+
+        link = header->_head.prev;
+        if ((char *) link >= old_start && (char *) link < old_end) {
+            header->_head.prev = (struct mk_list *)
+                ((char *) table + ((char *) link - old_start));
+        }
+
+        link = header->_head.next;
+        if ((char *) link >= old_start && (char *) link < old_end) {
+            header->_head.next = (struct mk_list *)
+                ((char *) table + ((char *) link - old_start));
+        }
+    }
+
+    /* Then the known headers and the list head linked to them */
+    for (i = 0; i < p->headers_extra_count; i++) {
+        header = &table[i];
+        header->_head.prev->next = &header->_head;
+        header->_head.next->prev = &header->_head;
+    }
+
+    if (old != p->headers_extra_fixed) {
+        mk_mem_free(old);
+    }
+    p->headers_extra = table;
+    p->headers_extra_size = size;
+
+    return 0;
+}
+
 static inline int header_lookup(struct mk_http_parser *p, char *buffer)
 {
     int i;
@@ -190,155 +581,184 @@ static inline int header_lookup(struct mk_http_parser *p, char *buffer)
 
     struct mk_http_header *header;
     struct mk_http_header *header_extra;
-    struct row_entry *h;
 
     len = (p->header_sep - p->header_key);
 
-    for (i = p->header_min; i <= p->header_max; i++) {
-        h = &mk_headers_table[i];
-
-        /* Check string length first */
-        if (h->len != len) {
-            continue;
-        }
-
-        if (header_cmp(h->name + 1, buffer + p->header_key + 1, len - 1) == 0) {
-            /* We got a header match, register the header index */
-            header = &p->headers[i];
-            header->type = i;
-            header->key.data = buffer + p->header_key;
-            header->key.len  = len;
-            header->val.data = buffer + p->header_val;
-            header->val.len  = p->end - p->header_val;
-            p->header_count++;
-            mk_list_add(&header->_head, &p->header_list);
-
-            if (i == MK_HEADER_HOST) {
-                /* Handle a possible port number in the Host header */
-                int sep = str_searchr(header->val.data, ':', header->val.len);
-                if (sep > 0) {
-                    int plen;
-                    short int port_size = 6;
-                    char port[port_size];
-
-                    plen = header->val.len - sep - 1;
-                    if (plen <= 0 || plen >= port_size) {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-                    memcpy(&port, header->val.data + sep + 1, plen);
-                    port[plen] = '\0';
-
-                    errno = 0;
-                    val = strtol(port, &endptr, 10);
-                    if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
-                        || (errno != 0 && val == 0)) {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-
-                    if (endptr == port || *endptr != '\0') {
-                        return -MK_CLIENT_BAD_REQUEST;
-                    }
-
-                    p->header_host_port = val;
-
-                    /* Re-set the Host header value without port */
-                    header->val.len = sep;
+    i = header_index(buffer + p->header_key, len);
+    if (i >= 0 && p->headers[i].key.data == NULL) {
+        /* We got a header match, register the header index */
+        header = &p->headers[i];
+        header->type = i;
+        header->key.data = buffer + p->header_key;
+        header->key.len  = len;
+        header->val.data = buffer + p->header_val;
+        header->val.len  = p->end - p->header_val;
+        p->header_count++;
+        mk_list_add(&header->_head, &p->header_list);
+
+        if (i == MK_HEADER_HOST) {
+            /* Handle a possible port number in the Host header */
+            int sep = str_searchr(header->val.data, ':', header->val.len);
+            if (sep > 0) {
+                int plen;
+                short int port_size = 6;
+                char port[port_size];
+
+                plen = header->val.len - sep - 1;
+                if (plen <= 0 || plen >= port_size) {
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
-            }
-            else if (i == MK_HEADER_CONTENT_LENGTH) {
+                memcpy(&port, header->val.data + sep + 1, plen);
+                port[plen] = '\0';
+
                 errno = 0;
-                val = strtol(header->val.data, &endptr, 10);
+                val = strtol(port, &endptr, 10);
                 if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
                     || (errno != 0 && val == 0)) {
-                    return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
-                }
-                if (endptr == header->val.data) {
-                    return -1;
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
-                if (val < 0) {
-                    return -1;
+
+                if (endptr == port || *endptr != '\0') {
+                    return -MK_CLIENT_BAD_REQUEST;
                 }
 
-                p->header_content_length = val;
+                p->header_host_port = val;
+
+                /* Re-set the Host header value without port */
+                header->val.len = sep;
             }
-            else if (i == MK_HEADER_CONNECTION) {
-                /* Check Connection: Keep-Alive */
-                if (header->val.len == sizeof(MK_CONN_KEEP_ALIVE) - 1) {
-                    if (header_cmp(MK_CONN_KEEP_ALIVE,
-                                   header->val.data,
-                                   header->val.len ) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_KA;
-                    }
+        }
+        else if (i == MK_HEADER_CONTENT_LENGTH) {
+            errno = 0;
+            val = strtol(header->val.data, &endptr, 10);
+            if ((errno == ERANGE && (val == LONG_MAX || val == LONG_MIN))
+                || (errno != 0 && val == 0)) {
+                return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+            }
+            if (endptr == header->val.data) {
+                return -1;
+            }
+            if (val < 0) {
+                return -1;
+            }
+
+            p->header_content_length = val;
+        }
+        else if (i == MK_HEADER_CONNECTION) {
+            /* Check Connection: Keep-Alive */
+            if (header->val.len == sizeof(MK_CONN_KEEP_ALIVE) - 1) {
+                if (header_cmp(MK_CONN_KEEP_ALIVE,
+                               header->val.data,
+                               header->val.len ) == 0) {
+                    p->header_connection = MK_HTTP_PARSER_CONN_KA;
                 }
-                /* Check Connection: Close */
-                else if (header->val.len == sizeof(MK_CONN_CLOSE) -1) {
-                    if (header_cmp(MK_CONN_CLOSE,
-                                   header->val.data, header->val.len) == 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_CLOSE;
-                    }
+            }
+            /* Check Connection: Close */
+            else if (header->val.len == sizeof(MK_CONN_CLOSE) -1) {
+                if (header_cmp(MK_CONN_CLOSE,
+                               header->val.data, header->val.len) == 0) {
+                    p->header_connection = MK_HTTP_PARSER_CONN_CLOSE;
                 }
-                else {
-                    p->header_connection = MK_HTTP_PARSER_CONN_UNKNOWN;
+            }
+            else {
+                p->header_connection = MK_HTTP_PARSER_CONN_UNKNOWN;
 
-                    /* Try to find some known values */
+                /* Try to find some known values */
 
-                    /* Connection: upgrade */
-                    pos = mk_string_search_n(header->val.data,
-                                             "Upgrade",
-                                             MK_STR_INSENSITIVE,
-                                             header->val.len);
-                    if (pos >= 0) {
-                        p->header_connection = MK_HTTP_PARSER_CONN_UPGRADE;
-                    }
+                /* Connection: upgrade */
+                pos = mk_string_search_n(header->val.data,
+                                         "Upgrade",
+                                         MK_STR_INSENSITIVE,
+                                         header->val.len);
+                if (pos >= 0) {
+                    p->header_connection = MK_HTTP_PARSER_CONN_UPGRADE;
+                }
 
-                    /* Connection: HTTP2-Settings */
-                    pos = mk_string_search_n(header->val.data,
-                                             "HTTP2-Settings",
-                                             MK_STR_INSENSITIVE,
-                                             header->val.len);
-                    if (pos >= 0) {
-                        p->header_connection |= MK_HTTP_PARSER_CONN_HTTP2_SE;
-                    }
+                /* Connection: HTTP2-Settings */
+                pos = mk_string_search_n(header->val.data,
+                                         "HTTP2-Settings",
+                                         MK_STR_INSENSITIVE,
+                                         header->val.len);
+                if (pos >= 0) {
+                    p->header_connection |= MK_HTTP_PARSER_CONN_HTTP2_SE;
                 }
             }
-            else if (i == MK_HEADER_UPGRADE) {
-                    if (header_cmp(MK_UPGRADE_H2C,
-                                   header->val.data, header->val.len) == 0) {
-                        p->header_upgrade = MK_HTTP_PARSER_UPGRADE_H2C;
-                    }
+        }
+        else if (i == MK_HEADER_EXPECT) {
+            if (header->val.len == sizeof(MK_EXPECT_CONTINUE) - 1 &&
+                header_cmp(MK_EXPECT_CONTINUE,
+                           header->val.data, header->val.len) == 0) {
+                p->header_expect_continue = MK_TRUE;
+            }
+        }
+        else if (i == MK_HEADER_TRANSFER_ENCODING) {
+            /* Only the chunked coding alone is supported */
+            if (header->val.len == sizeof(MK_TE_CHUNKED) - 1 &&
+                header_cmp(MK_TE_CHUNKED,
+                           header->val.data, header->val.len) == 0) {
+                p->header_transfer_encoding = MK_HTTP_PARSER_TE_CHUNKED;
+            }
+            else {
+                p->header_transfer_encoding = MK_HTTP_PARSER_TE_UNKNOWN;
             }
-
-            return 0;
         }
+        else if (i == MK_HEADER_UPGRADE) {
+                if (header_cmp(MK_UPGRADE_H2C,
+                               header->val.data, header->val.len) == 0) {
+                    p->header_upgrade = MK_HTTP_PARSER_UPGRADE_H2C;
+                }
+        }
+
+
+        return 0;
     }
 
     /*
-     * The header_lookup did not match any known header, so we register this
-     * entry into the headers_extra array.
+     * A known header found again is only kept in the list, the first value
+     * is the one used. Repeating the ones defining the request target or
+     * its body is not allowed.
      */
-    if (p->headers_extra_count < MK_HEADER_EXTRA_SIZE) {
-        header_extra = &p->headers_extra[p->headers_extra_count];
-        header_extra->key.data = tmp = (buffer + p->header_key);
-        header_extra->key.len  = len;
+    if (i == MK_HEADER_HOST || i == MK_HEADER_CONTENT_LENGTH ||
+        i == MK_HEADER_TRANSFER_ENCODING) {
+        return -MK_CLIENT_BAD_REQUEST;
+    }
+
+    /*
+     * The header is unknown or repeated, register this entry into the
+     * headers_extra table.
+     */
+    if (p->headers_extra_count == p->headers_extra_size &&
+        headers_extra_grow(p) != 0) {
+        /*
+         * The header cannot be stored on our extra headers table as it
+         * reached its limit. Request is too large.
+         */
+        return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    header_extra = &p->headers_extra[p->headers_extra_count];
+    header_extra->key.data = tmp = (buffer + p->header_key);
+    header_extra->key.len  = len;
+
+    if (i >= 0) {
+        header_extra->type = i;
+    }
+    else {
+        header_extra->type = MK_HEADER_OTHER;
 
         /* Transform the header key string to lowercase */
         for (i = 0; i < len; i++) {
             tmp[i] = tolower(tmp[i]);
         }
-
-        header_extra->val.data = buffer + p->header_val;
-        header_extra->val.len  = p->end - p->header_val;
-        p->headers_extra_count++;
-        p->header_count++;
-        mk_list_add(&header_extra->_head, &p->header_list);
-        return 0;
     }
 
-    /*
-     * Header is unknown and we cannot store it on our extra headers
-     * list as it's already full. Request is too large.
-     */
-    return -MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+    header_extra->val.data = buffer + p->header_val;
+    header_extra->val.len  = p->end - p->header_val;
+    p->headers_extra_count++;
+    p->header_count++;
+    mk_list_add(&header_extra->_head, &p->header_list);
+
+    return 0;
 }
 
 /*
@@ -358,8 +778,9 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 
     /* POST checks */
     if (req->method == MK_METHOD_POST || req->method == MK_METHOD_PUT) {
-        /* validate Content-Length exists */
-        if (p->headers[MK_HEADER_CONTENT_LENGTH].type == 0) {
+        /* validate Content-Length exists or the body is chunked */
+        if (p->headers[MK_HEADER_CONTENT_LENGTH].type == 0 &&
+            mk_http_parser_chunked(p) == MK_FALSE) {
             mk_http_error(MK_CLIENT_LENGTH_REQUIRED, req->session, req, server);
             return MK_HTTP_PARSER_ERROR;
         }
@@ -368,6 +789,240 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
     return MK_HTTP_PARSER_OK;
 }
 
+/*
+ * Point the request data to the body, or to the part of it received so far
+ * when the body is streamed. The parser index is left on the last body byte,
+ * anything after it belongs to the next pipelined request.
+ */
+static inline int parser_body_cut(struct mk_http_request *req,
+                                  struct mk_http_parser *p, char *buffer,
+                                  struct mk_server *server)
+{
+    if (p->body_received > p->header_content_length) {
+        p->body_received = p->header_content_length;
+    }
+
+    req->data.data = buffer + p->start;
+    req->data.len  = p->body_received;
+    p->i = p->start + p->body_received - 1;
+
+    return mk_http_parser_ok(req, p, server);
+}
+
+static inline int chunk_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * Decode a piece of a chunked body. The chunk data found in 'in' is written
+ * to 'out' without the framing, 'out' can point to 'in' or before it in the
+ * same buffer so the body is compacted in place. On return 'consumed' holds
+ * the bytes of 'in' that were processed and 'produced' the data bytes
+ * written, when the last chunk is complete the bytes after it are left
+ * untouched.
+ */
+int mk_http_chunked_decode(struct mk_http_chunked *c,
+                           char *in, size_t in_len, char *out,
+                           size_t *consumed, size_t *produced)
+{
+    int v;
+    int ret = MK_HTTP_CHUNKED_PENDING;
+    char ch;
+    size_t i = 0;
+    size_t o = 0;
+    size_t n;
+
+    while (i < in_len && c->state != MK_CHUNK_DONE) {
+        /* Chunk data, move it in one shot */
+        if (c->state == MK_CHUNK_DATA) {
+            n = in_len - i;
+            if (n > (size_t) c->chunk_left) {
+                n = c->chunk_left;
+            }
+            if (out + o != in + i) {
+                memmove(out + o, in + i, n);
+            }
+            o += n;
+            i += n;
+            c->chunk_left -= n;
+            if (c->chunk_left == 0) {
+                c->state = MK_CHUNK_DATA_CR;
+            }
+            continue;
+        }
+
+        ch = in[i++];
+        switch (c->state) {
+        case MK_CHUNK_SIZE:
+            v = chunk_hex(ch);
+            if (v >= 0) {
+                if (c->chunk_left > (MK_HTTP_CHUNK_SIZE_MAX - v) / 16) {
+                    ret = MK_HTTP_CHUNKED_TOO_LARGE;
+                    goto out;
+                }
+                c->chunk_left = (c->chunk_left * 16) + v;
+                c->digits++;
+            }
+            else if (c->digits == 0) {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            else if (ch == ';' || ch == ' ' || ch == '\t') {
+                c->state = MK_CHUNK_EXT;
+            }
+            else if (ch == '\r') {
+                c->state = MK_CHUNK_SIZE_LF;
+            }
+            else {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            if (++c->line_len > MK_HTTP_CHUNK_LINE_MAX) {
+                ret = MK_HTTP_CHUNKED_TOO_LARGE;
+                goto out;
+            }
+            break;
+        case MK_CHUNK_EXT:
+            if (ch == '\r') {
+                c->state = MK_CHUNK_SIZE_LF;
+            }
+            else if (ch == '\n') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            if (++c->line_len > MK_HTTP_CHUNK_LINE_MAX) {
+                ret = MK_HTTP_CHUNKED_TOO_LARGE;
+                goto out;
+            }
+            break;
+        case MK_CHUNK_SIZE_LF:
+            if (ch != '\n') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            c->digits = 0;
+            c->line_len = 0;
+            if (c->chunk_left == 0) {
+                c->state = MK_CHUNK_TRAILER;
+            }
+            else {
+                c->state = MK_CHUNK_DATA;
+            }
+            break;
+        case MK_CHUNK_DATA_CR:
+            if (ch != '\r') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            c->state = MK_CHUNK_DATA_LF;
+            break;
+        case MK_CHUNK_DATA_LF:
+            if (ch != '\n') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            c->state = MK_CHUNK_SIZE;
+            break;
+        case MK_CHUNK_TRAILER:
+            if (ch == '\r') {
+                c->state = MK_CHUNK_END_LF;
+                break;
+            }
+            c->state = MK_CHUNK_TRAILER_LINE;
+            /* fall through */
+        case MK_CHUNK_TRAILER_LINE:
+            if (ch == '\r') {
+                c->state = MK_CHUNK_TRAILER_LF;
+            }
+            else if (ch == '\n') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            if (++c->trailer_len > MK_HTTP_CHUNK_TRAILER_MAX) {
+                ret = MK_HTTP_CHUNKED_TOO_LARGE;
+                goto out;
+            }
+            break;
+        case MK_CHUNK_TRAILER_LF:
+            if (ch != '\n') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            c->state = MK_CHUNK_TRAILER;
+            break;
+        case MK_CHUNK_END_LF:
+            if (ch != '\n') {
+                ret = MK_HTTP_CHUNKED_ERROR;
+                goto out;
+            }
+            c->state = MK_CHUNK_DONE;
+            break;
+        }
+    }
+
+    if (c->state == MK_CHUNK_DONE) {
+        ret = MK_HTTP_CHUNKED_DONE;
+    }
+
+ out:
+    c->decoded += o;
+    *consumed = i;
+    *produced = o;
+    return ret;
+}
+
+/*
+ * Decode the chunked body found in the buffer. The data is compacted in
+ * place right after the headers, so once the last chunk arrives the request
+ * data points to the whole body. A streamed body is reported with what was
+ * decoded so far, the handler decodes the rest as it reads it.
+ */
+static inline int parser_body_chunked(struct mk_http_request *req,
+                                      struct mk_http_parser *p, char *buffer,
+                                      int len, struct mk_server *server)
+{
+    int ret;
+    size_t consumed = 0;
+    size_t produced;
+
+    if (p->i < len) {
+        ret = mk_http_chunked_decode(&p->chunk, buffer + p->i, len - p->i,
+                                     buffer + p->start + p->chunk.decoded,
+                                     &consumed, &produced);
+        if (ret == MK_HTTP_CHUNKED_ERROR) {
+            mk_http_error(MK_CLIENT_BAD_REQUEST, req->session, req, server);
+            return MK_HTTP_PARSER_ERROR;
+        }
+        else if (ret == MK_HTTP_CHUNKED_TOO_LARGE) {
+            mk_http_error(MK_CLIENT_REQUEST_ENTITY_TOO_LARGE,
+                          req->session, req, server);
+            return MK_HTTP_PARSER_ERROR;
+        }
+    }
+    p->i += consumed;
+    p->body_received = p->chunk.decoded;
+
+    if (p->chunk.state != MK_CHUNK_DONE && p->body_stream == MK_FALSE) {
+        return MK_HTTP_PARSER_PENDING;
+    }
+
+    req->data.data = buffer + p->start;
+    req->data.len  = p->chunk.decoded;
+
+    /* Leave the index on the last byte of the chunked message */
+    p->i--;
+
+    return mk_http_parser_ok(req, p, server);
+}
+
 /*
  * Parse the protocol and point relevant fields, don't take logic decisions
  * based on this, just parse to locate things.
@@ -375,7 +1030,6 @@ static inline int mk_http_parser_ok(struct mk_http_request *req,
 int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                    char *buffer, int buf_len, struct mk_server *server)
 {
-    int s;
     int tmp;
     int ret;
     int len;
@@ -442,6 +1096,9 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 }
                 break;
             case MK_ST_REQ_URI:                         /* URI */
+                if (parser_scan(p, buffer, len, &scan_uri) == MK_FALSE) {
+                    break;
+                }
                 if (buffer[p->i] == ' ') {
                     mark_end();
                     p->status = MK_ST_REQ_PROT_VERSION;
@@ -457,21 +1114,24 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     p->status = MK_ST_REQ_QUERY_STRING;
                     start_next();
                 }
-                else if (buffer[p->i] == '\r' || buffer[p->i] == '\n') {
+                else {
+                    /* end of line or control byte */
                     mk_http_error(MK_CLIENT_BAD_REQUEST, req->session,
                                   req, server);
                     return MK_HTTP_PARSER_ERROR;
                 }
                 break;
             case MK_ST_REQ_QUERY_STRING:                /* Query string */
-                char_lookup(buffer, ' ', len, p);
+                if (parser_scan(p, buffer, len, &scan_query) == MK_FALSE) {
+                    break;
+                }
                 if (buffer[p->i] == ' ') {
                     mark_end();
                     request_set(&req->query_string, p, buffer);
                     p->status = MK_ST_REQ_PROT_VERSION;
                     start_next();
                 }
-                else if (buffer[p->i] == '\r' || buffer[p->i] == '\n') {
+                else {
                     mk_http_error(MK_CLIENT_BAD_REQUEST, req->session,
                                   req, server);
                     return MK_HTTP_PARSER_ERROR;
@@ -561,54 +1221,17 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
 
                 if (p->chars == 0) {
                     /*
-                     * We reach the start of a Header row, lets catch the most
-                     * probable header.
-                     *
-                     * The goal of this 'first row character lookup', is to define a
-                     * small range set of probable headers comparison once we catch
-                     * a header end.
+                     * We reach the start of a Header row, the name is looked
+                     * up once we catch the header end.
                      */
-                    s = tolower(buffer[p->i]);
-                    switch (s) {
-                    case 'a':
-                        p->header_min = MK_HEADER_ACCEPT;
-                        p->header_max = MK_HEADER_AUTHORIZATION;
-                        break;
-                    case 'c':
-                        p->header_min = MK_HEADER_CACHE_CONTROL;
-                        p->header_max = MK_HEADER_CONTENT_TYPE;
-                        break;
-                    case 'h':
-                        p->header_min = MK_HEADER_HOST;
-                        p->header_max = MK_HEADER_HTTP2_SETTINGS;
-                        break;
-                    case 'i':
-                        header_scope_eq(p, MK_HEADER_IF_MODIFIED_SINCE);
-                        break;
-                    case 'l':
-                        p->header_min = MK_HEADER_LAST_MODIFIED;
-                        p->header_max = MK_HEADER_LAST_MODIFIED_SINCE;
-                        break;
-                    case 'r':
-                        p->header_min = MK_HEADER_RANGE;
-                        p->header_max = MK_HEADER_REFERER;
-                        break;
-                    case 'u':
-                        p->header_min = MK_HEADER_UPGRADE;
-                        p->header_max = MK_HEADER_USER_AGENT;
-                        break;
-                    default:
-                        p->header_key = -1;
-                        p->header_sep = -1;
-                        p->header_min = -1;
-                        p->header_max = -1;
-                    };
                     p->header_key = p->i;
                     continue;
                 }
 
                 /* Found key/value separator */
-                char_lookup(buffer, ':', len, p);
+                if (parser_scan(p, buffer, len, &scan_key) == MK_FALSE) {
+                    continue;
+                }
                 if (buffer[p->i] == ':') {
                     /* Set the key/value middle point */
                     p->header_sep = p->i;
@@ -623,6 +1246,10 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     p->status = MK_ST_HEADER_VALUE;
                     start_next();
                 }
+                else {
+                    /* end of line or control byte */
+                    return MK_HTTP_PARSER_ERROR;
+                }
             }
             /* Parsing the header value */
             else if (p->status == MK_ST_HEADER_VALUE) {
@@ -630,14 +1257,21 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                 if (buffer[p->i] == '\r' || buffer[p->i] == '\n') {
                     return MK_HTTP_PARSER_ERROR;
                 }
-                else if (buffer[p->i] != ' ') {
-                    p->status = MK_ST_HEADER_VAL_STARTS;
-                    p->start = p->header_val = p->i;
+                else if (buffer[p->i] == ' ') {
+                    continue;
                 }
-                continue;
+
+                /* the value is scanned from its first byte */
+                p->status = MK_ST_HEADER_VAL_STARTS;
+                p->start = p->header_val = p->i;
             }
+
             /* New header row starts */
-            else if (p->status == MK_ST_HEADER_VAL_STARTS) {
+            if (p->status == MK_ST_HEADER_VAL_STARTS) {
+                if (parser_scan(p, buffer, len, &scan_value) == MK_FALSE) {
+                    continue;
+                }
+
                 /* Maybe there is no more headers and we reach the end ? */
                 if (buffer[p->i] == '\r') {
                     mark_end();
@@ -670,7 +1304,8 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
                     p->status = MK_ST_HEADER_END;
                     start_next();
                 }
-                else if (buffer[p->i] == '\n' && buffer[p->i - 1] != '\r') {
+                else {
+                    /* bare LF or control byte */
                     return MK_HTTP_PARSER_ERROR;
                 }
             }
@@ -687,7 +1322,27 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
         }
         else if (p->level == REQ_LEVEL_END) {
             if (buffer[p->i] == '\n') {
-                if (p->header_content_length > 0) {
+                if (p->header_transfer_encoding != MK_HTTP_PARSER_TE_NONE) {
+                    /*
+                     * Other codings are not supported and a message with both
+                     * framings is ambiguous (request smuggling), reject them.
+                     */
+                    if (p->header_transfer_encoding ==
+                        MK_HTTP_PARSER_TE_UNKNOWN) {
+                        mk_http_error(MK_SERVER_NOT_IMPLEMENTED,
+                                      req->session, req, server);
+                        return MK_HTTP_PARSER_ERROR;
+                    }
+                    if (p->headers[MK_HEADER_CONTENT_LENGTH].type != 0) {
+                        mk_http_error(MK_CLIENT_BAD_REQUEST,
+                                      req->session, req, server);
+                        return MK_HTTP_PARSER_ERROR;
+                    }
+                    p->level = REQ_LEVEL_BODY;
+                    p->chars = -1;
+                    start_next();
+                }
+                else if (p->header_content_length > 0) {
                     p->level = REQ_LEVEL_BODY;
                     p->chars = -1;
                     start_next();
@@ -707,21 +1362,29 @@ int mk_http_parser(struct mk_http_request *req, struct mk_http_parser *p,
              * - A Pipeline Request
              * - A Body content (POST/PUT methods)
              */
-            if (p->header_content_length > 0) {
-
+            if (mk_http_parser_chunked(p)) {
+                return parser_body_chunked(req, p, buffer, len, server);
+            }
+            else if (p->header_content_length > 0) {
                 p->body_received = len - p->start;
-                if ((len - p->start) < p->header_content_length) {
+                if (p->body_received < p->header_content_length &&
+                    p->body_stream == MK_FALSE) {
                     return MK_HTTP_PARSER_PENDING;
                 }
-
-                /* Cut off */
-                p->i += p->body_received;
-                req->data.len  = p->body_received;
-                req->data.data = (buffer + p->start);
+                return parser_body_cut(req, p, buffer, server);
             }
             return mk_http_parser_ok(req, p, server);
         }
     }
 
+    /* Streamed body and no body bytes after the headers yet */
+    if (p->level == REQ_LEVEL_BODY && p->body_stream == MK_TRUE) {
+        if (mk_http_parser_chunked(p)) {
+            return parser_body_chunked(req, p, buffer, len, server);
+        }
+        p->body_received = 0;
+        return parser_body_cut(req, p, buffer, server);
+    }
+
     return MK_HTTP_PARSER_PENDING;
 }
@@ -52,6 +52,7 @@ static inline void thread_cb_init_vars()
     struct mk_http_session *session = libco_param.session;
     struct mk_http_request *request = libco_param.request;
     struct mk_thread *th = libco_param.th;
+    struct mk_http_thread *mth;
     //struct mk_plugin *plugin;
 
     /*
@@ -65,6 +66,18 @@ static inline void thread_cb_init_vars()
         /* Invoke the handler callback */
         handler->cb(request, handler->data);
 
+        /*
+         * If the client hung up while the callback was running, the
+         * connection is being dropped by the scheduler: just release
+         * the coroutine context.
+         */
+        mth = request->thread;
+        if (mth->cancelled == MK_TRUE) {
+            request->thread = NULL;
+            mk_http_thread_purge(mth);
+            mk_thread_yield(th);
+        }
+
         /*
          * Once the callback finished, we need to sanitize the connection
          * so other further requests can be processed.
@@ -85,8 +98,9 @@ static inline void thread_cb_init_vars()
             //return -1;
         }
 
+        request->thread = NULL;
         mk_http_request_end(session, session->server);
-        mk_http_thread_purge(request->thread);
+        mk_http_thread_purge(mth);
 
         /* Return control to caller */
         mk_thread_yield(th);
@@ -145,6 +159,7 @@ struct mk_http_thread *mk_http_thread_create(int type,
         return NULL;
     }
 
+    mth->cancelled = MK_FALSE;
     mth->session = session;
     mth->request = request;
     mth->parent  = th;
@@ -185,6 +200,26 @@ int mk_http_thread_purge(struct mk_http_thread *mth)
     return 0;
 }
 
+/*
+ * The client connection is gone: flag the channel so further calls to
+ * mk_http_send() and mk_http_done() fail right away, and resume the
+ * coroutine so the handler callback can unwind and release its resources.
+ */
+int mk_http_thread_cancel(struct mk_http_thread *mth)
+{
+    if (mth->cancelled == MK_TRUE) {
+        return 0;
+    }
+
+    MK_TRACE("[http thread] cancel thread=%p", mth->parent);
+
+    mth->cancelled = MK_TRUE;
+    mth->session->channel->status = MK_CHANNEL_ERROR;
+    mk_http_thread_resume(mth);
+
+    return 0;
+}
+
 int mk_http_thread_destroy(struct mk_http_thread *mth)
 {
     struct mk_thread *th;
@@ -0,0 +1,393 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_status.h>
+#include <monkey/mk_http_upload.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_vhost.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* Upload <prefix> <directory> [max size in MB] */
+struct mk_http_upload_rule *mk_http_upload_rule_create(char *val)
+{
+    int i = 0;
+    long max_size = MK_HTTP_UPLOAD_MAX_SIZE;
+    char *prefix = NULL;
+    char *dir = NULL;
+    struct stat st;
+    struct mk_list *line;
+    struct mk_list *head;
+    struct mk_string_line *entry;
+    struct mk_http_upload_rule *rule;
+
+    line = mk_string_split_line(val);
+    if (!line) {
+        return NULL;
+    }
+
+    mk_list_foreach(head, line) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+        switch (i) {
+        case 0:
+            prefix = entry->val;
+            break;
+        case 1:
+            dir = entry->val;
+            break;
+        case 2:
+            max_size = atol(entry->val);
+            break;
+        default:
+            prefix = NULL;
+        }
+        i++;
+    }
+
+    if (!prefix || !dir || prefix[0] != '/' || max_size < 0) {
+        mk_err("[Host Upload] invalid Location '%s'", val);
+        mk_string_split_free(line);
+        return NULL;
+    }
+
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        mk_err("[Host Upload] invalid directory '%s'", dir);
+        mk_string_split_free(line);
+        return NULL;
+    }
+
+    rule = mk_mem_alloc_z(sizeof(struct mk_http_upload_rule));
+    if (!rule) {
+        mk_string_split_free(line);
+        return NULL;
+    }
+    rule->prefix = mk_string_dup(prefix);
+    rule->prefix_len = strlen(prefix);
+    rule->dir = mk_string_dup(dir);
+    rule->max_size = max_size * 1024 * 1024;
+    mk_string_split_free(line);
+
+    return rule;
+}
+
+void mk_http_upload_rule_free(struct mk_http_upload_rule *rule)
+{
+    mk_mem_free(rule->prefix);
+    mk_mem_free(rule->dir);
+    mk_mem_free(rule);
+}
+
+/*
+ * The name of the stored file: path segments that are empty or start with
+ * a dot (the temporary files and any '.' or '..') are refused.
+ */
+static int upload_name_valid(char *name, size_t len)
+{
+    size_t i;
+
+    if (len == 0 || name[len - 1] == '/') {
+        return MK_FALSE;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (i == 0 || name[i - 1] == '/') {
+            if (name[i] == '/' || name[i] == '.') {
+                return MK_FALSE;
+            }
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/* Upload location of a PUT or POST request, or NULL */
+struct mk_http_upload_rule *mk_http_upload_lookup(struct mk_http_request *sr)
+{
+    struct mk_list *head;
+    struct mk_http_upload_rule *rule;
+
+    if (sr->method != MK_METHOD_PUT && sr->method != MK_METHOD_POST) {
+        return NULL;
+    }
+
+    mk_list_foreach(head, &sr->host_conf->uploads) {
+        rule = mk_list_entry(head, struct mk_http_upload_rule, _head);
+        if (sr->uri_processed.len >= rule->prefix_len &&
+            strncmp(sr->uri_processed.data, rule->prefix,
+                    rule->prefix_len) == 0) {
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+static int upload_write(int fd, char *buf, size_t len)
+{
+    ssize_t bytes;
+
+    while (len > 0) {
+        bytes = write(fd, buf, len);
+        if (bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += bytes;
+        len -= bytes;
+    }
+
+    return 0;
+}
+
+/* Body complete: move the file into place */
+static int upload_finish(struct mk_http_upload *up)
+{
+    int ret;
+
+    ret = close(up->fd);
+    up->fd = -1;
+    if (ret == -1 || rename(up->tmp_path, up->path) == -1) {
+        mk_warn("[upload] cannot store '%s': %s", up->path, strerror(errno));
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+
+    mk_mem_free(up->tmp_path);
+    up->tmp_path = NULL;
+
+    return up->replace ? MK_HTTP_NOCONTENT : MK_HTTP_CREATED;
+}
+
+/*
+ * Start storing the body of a request. It returns zero while the body is
+ * arriving, otherwise the status of the response: the upload is complete
+ * or it failed.
+ */
+int mk_http_upload_start(struct mk_http_session *cs,
+                         struct mk_http_request *sr,
+                         struct mk_http_upload_rule *rule)
+{
+    int err;
+    char *slash;
+    unsigned long len;
+    struct stat st;
+    struct mk_http_upload *up;
+
+    if (!upload_name_valid(sr->uri_processed.data + rule->prefix_len,
+                           sr->uri_processed.len - rule->prefix_len)) {
+        return MK_CLIENT_FORBIDDEN;
+    }
+
+    if (rule->max_size > 0 && mk_http_parser_chunked(&cs->parser) == MK_FALSE &&
+        cs->parser.header_content_length > rule->max_size) {
+        return MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    up = mk_mem_alloc_z(sizeof(struct mk_http_upload));
+    if (!up) {
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+    up->fd = -1;
+    up->pipe[0] = -1;
+    up->pipe[1] = -1;
+    up->max_size = rule->max_size;
+    sr->upload = up;
+
+    mk_string_build(&up->path, &len, "%s/%.*s", rule->dir,
+                    (int) (sr->uri_processed.len - rule->prefix_len),
+                    sr->uri_processed.data + rule->prefix_len);
+    if (stat(up->path, &st) == 0) {
+        if (!S_ISREG(st.st_mode)) {
+            return MK_CLIENT_FORBIDDEN;
+        }
+        up->replace = MK_TRUE;
+    }
+
+    /* The temporary file goes in the same directory, rename() needs it */
+    slash = strrchr(up->path, '/');
+    mk_string_build(&up->tmp_path, &len, "%.*s.%s.XXXXXX",
+                    (int) (slash - up->path + 1), up->path, slash + 1);
+    up->fd = mkostemp(up->tmp_path, O_CLOEXEC);
+    if (up->fd == -1) {
+        err = errno;
+        mk_mem_free(up->tmp_path);
+        up->tmp_path = NULL;
+        if (err == ENOENT || err == ENOTDIR) {
+            return MK_CLIENT_NOT_FOUND;
+        }
+        else if (err == EACCES) {
+            return MK_CLIENT_FORBIDDEN;
+        }
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+    fchmod(up->fd, 0644);
+
+    /* Body bytes that came with the headers */
+    if (sr->data.len > 0 &&
+        upload_write(up->fd, sr->data.data, sr->data.len) == -1) {
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+    up->received = sr->data.len;
+    if (up->max_size > 0 && up->received > up->max_size) {
+        return MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    if (sr->body_left == 0) {
+        return upload_finish(up);
+    }
+
+    if (mk_http_body_continue(cs, sr) != 0) {
+        return MK_SERVER_INTERNAL_ERROR;
+    }
+
+#if defined(__linux__)
+    /* A plain body of known length is spliced from the socket */
+    if (mk_http_parser_chunked(&cs->parser) == MK_FALSE &&
+        !(MK_SCHED_CONN_PROP(cs->conn) & MK_CAP_SOCK_TLS) &&
+        pipe2(up->pipe, O_CLOEXEC) == 0) {
+        fcntl(up->pipe[1], F_SETPIPE_SZ, MK_HTTP_UPLOAD_PIPE_SIZE);
+    }
+    else {
+        up->pipe[0] = -1;
+        up->pipe[1] = -1;
+    }
+#endif
+
+    return 0;
+}
+
+#if defined(__linux__)
+/* Socket -> pipe -> file, the data stays in the kernel */
+static long upload_splice(struct mk_http_session *cs,
+                          struct mk_http_request *sr)
+{
+    long want;
+    ssize_t bytes;
+    ssize_t moved;
+    ssize_t left;
+    struct mk_http_upload *up = sr->upload;
+
+    want = sr->body_left;
+    if (want > MK_HTTP_UPLOAD_PIPE_SIZE) {
+        want = MK_HTTP_UPLOAD_PIPE_SIZE;
+    }
+
+    bytes = splice(cs->socket, NULL, up->pipe[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes == 0) {
+        errno = 0;
+        return -1;
+    }
+    else if (bytes == -1) {
+        return -1;
+    }
+    mk_sched_conn_rate_add(cs->conn, bytes);
+
+    for (left = bytes; left > 0; left -= moved) {
+        moved = splice(up->pipe[0], NULL, up->fd, NULL, left, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINTR) {
+            moved = 0;
+        }
+        else if (moved <= 0) {
+            return MK_HTTP_BODY_INVALID;
+        }
+    }
+
+    sr->body_left -= bytes;
+    return bytes;
+}
+#endif
+
+/*
+ * Socket data for a body being stored, same return values than
+ * mk_http_upload_start() and -1 if the connection must be dropped.
+ */
+int mk_http_upload_read(struct mk_http_session *cs,
+                        struct mk_http_request *sr)
+{
+    long bytes;
+    char buf[MK_HTTP_BODY_CHUNK];
+    struct mk_http_upload *up = sr->upload;
+
+#if defined(__linux__)
+    if (up->pipe[0] != -1) {
+        bytes = upload_splice(cs, sr);
+        if (bytes == MK_HTTP_BODY_INVALID) {
+            mk_warn("[upload] cannot write '%s': %s", up->path,
+                    strerror(errno));
+            return MK_SERVER_INTERNAL_ERROR;
+        }
+    }
+    else
+#endif
+    {
+        bytes = mk_http_body_recv(cs, sr, buf, sizeof(buf));
+        if (bytes == MK_HTTP_BODY_INVALID) {
+            return MK_CLIENT_BAD_REQUEST;
+        }
+        else if (bytes > 0 && upload_write(up->fd, buf, bytes) == -1) {
+            mk_warn("[upload] cannot write '%s': %s", up->path,
+                    strerror(errno));
+            return MK_SERVER_INTERNAL_ERROR;
+        }
+    }
+
+    if (bytes == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        return -1;
+    }
+
+    up->received += bytes;
+    if (up->max_size > 0 && up->received > up->max_size) {
+        return MK_CLIENT_REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    if (sr->body_left == 0) {
+        return upload_finish(up);
+    }
+
+    return 0;
+}
+
+/* Release the upload of a request, an incomplete file is removed */
+void mk_http_upload_free(struct mk_http_request *sr)
+{
+    struct mk_http_upload *up = sr->upload;
+
+    if (up->fd != -1) {
+        close(up->fd);
+    }
+    if (up->pipe[0] != -1) {
+        close(up->pipe[0]);
+        close(up->pipe[1]);
+    }
+    if (up->tmp_path) {
+        unlink(up->tmp_path);
+        mk_mem_free(up->tmp_path);
+    }
+    mk_mem_free(up->path);
+    mk_mem_free(up);
+    sr->upload = NULL;
+}
@@ -27,6 +27,7 @@
 #include <monkey/mk_lib.h>
 #include <monkey/monkey.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_stream_deflate.h>
 #include <monkey/mk_thread.h>
 
 #define config_eq(a, b) strcasecmp(a, b)
@@ -64,6 +65,49 @@ int mk_destroy(mk_ctx_t *ctx)
     return 0;
 }
 
+/*
+ * Wait until the client sends more data. The connection is registered as a
+ * thread event so the event loop resumes the coroutine instead of invoking
+ * the protocol read handler.
+ */
+static inline int mk_lib_read_wait(mk_request_t *req)
+{
+    int ret;
+    struct mk_thread *th;
+    struct mk_channel *channel;
+    struct mk_sched_worker *sched;
+
+    sched = mk_sched_get_thread_conf();
+    if (!sched) {
+        return -1;
+    }
+
+    th = pthread_getspecific(mk_thread_key);
+    channel = req->session->channel;
+    channel->thread = th;
+
+    if (channel->event->status & MK_EVENT_REGISTERED) {
+        mk_event_del(sched->loop, channel->event);
+    }
+
+    MK_EVENT_NEW(channel->event);
+    ret = mk_event_add(sched->loop,
+                       channel->fd,
+                       MK_EVENT_THREAD,
+                       MK_EVENT_READ, channel->event);
+    if (ret == -1) {
+        return -1;
+    }
+
+    mk_thread_yield(th);
+
+    if (channel->event->status & MK_EVENT_REGISTERED) {
+        mk_event_del(sched->loop, channel->event);
+    }
+
+    return 0;
+}
+
 static inline int mk_lib_yield(mk_request_t *req)
 {
     int ret;
@@ -221,7 +265,6 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
     int b;
     int ret;
     int num;
-    unsigned long len;
 
     if (config_eq(k, "Listen") == 0) {
         ret = mk_config_listen_parse(v, server);
@@ -229,6 +272,13 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
             return -1;
         }
     }
+    else if (config_eq(k, "ListenBacklog") == 0) {
+        num = atoi(v);
+        if (num <= 0) {
+            return -1;
+        }
+        server->listen_backlog = num;
+    }
     else if (config_eq(k, "Workers") == 0) {
         num = atoi(v);
         if (num <= 0) {
@@ -266,6 +316,34 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->keep_alive_timeout = num;
     }
+    else if (config_eq(k, "KeepAliveAdaptive") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->keep_alive_adaptive = b;
+    }
+    else if (config_eq(k, "MaxHeaderTime") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->max_header_time = num;
+    }
+    else if (config_eq(k, "MinRequestRate") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->min_request_rate = num;
+    }
+    else if (config_eq(k, "MinResponseRate") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->min_response_rate = num;
+    }
     else if (config_eq(k, "UserDir") == 0) {
         server->conf_user_pub = mk_string_dup(v);
     }
@@ -304,7 +382,7 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         server->symlink = b;
     }
     else if (config_eq(k, "DefaultMimeType") == 0) {
-        mk_string_build(&server->mimetype_default_str, &len, "%s\r\n", v);
+        server->mimetype_default_str = mk_string_dup(v);
     }
     else if (config_eq(k, "FDT") == 0) {
         b = bool_val(v);
@@ -313,6 +391,55 @@ int mk_config_set_property(struct mk_server *server, char *k, char *v)
         }
         server->fdt = b;
     }
+    else if (config_eq(k, "Precompressed") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        server->precompressed = b;
+    }
+    else if (config_eq(k, "FileCacheSize") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_size = num;
+    }
+    else if (config_eq(k, "FileCacheTTL") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_ttl = num;
+    }
+    else if (config_eq(k, "FileCacheNegativeSize") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_neg_size = num;
+    }
+    else if (config_eq(k, "FileCacheNegativeTTL") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->file_cache_neg_ttl = num;
+    }
+    else if (config_eq(k, "ResponseCacheSize") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->response_cache_size = (size_t) num * 1024;
+    }
+    else if (config_eq(k, "ResponseCacheMaxFile") == 0) {
+        num = atoi(v);
+        if (num < 0) {
+            return -1;
+        }
+        server->response_cache_max_file = (size_t) num * 1024;
+    }
 
     return 0;
 }
@@ -376,6 +503,9 @@ int mk_vhost_create(mk_ctx_t *ctx, char *name)
     mk_list_init(&h->error_pages);
     mk_list_init(&h->server_names);
     mk_list_init(&h->handlers);
+    mk_list_init(&h->uploads);
+    mk_list_init(&h->cache_rules);
+    mk_vhost_compression_init(h);
 
     /* Host alias */
     halias = mk_mem_alloc_z(sizeof(struct mk_vhost_alias));
@@ -400,6 +530,8 @@ int mk_vhost_create(mk_ctx_t *ctx, char *name)
 
 static int mk_vhost_set_property(struct mk_vhost *vh, char *k, char *v)
 {
+    int b;
+    int num;
     struct mk_vhost_alias *ha;
 
     if (config_eq(k, "Name") == 0) {
@@ -415,6 +547,26 @@ static int mk_vhost_set_property(struct mk_vhost *vh, char *k, char *v)
         vh->documentroot.data = mk_string_dup(v);
         vh->documentroot.len  = strlen(v);
     }
+    else if (config_eq(k, "Compression") == 0) {
+        b = bool_val(v);
+        if (b == -1) {
+            return -1;
+        }
+        vh->compression.enabled = b;
+    }
+    else if (config_eq(k, "CompressionLevel") == 0) {
+        num = atoi(v);
+        if (num < 1 || num > 9) {
+            return -1;
+        }
+        vh->compression.level = num;
+    }
+    else if (config_eq(k, "CompressionMinSize") == 0) {
+        vh->compression.min_size = atol(v);
+    }
+    else if (config_eq(k, "CompressionTypes") == 0) {
+        return mk_vhost_compression_types(vh, v);
+    }
 
     return 0;
 }
@@ -476,6 +628,110 @@ int mk_vhost_handler(mk_ctx_t *ctx, int vid, char *regex,
     return 0;
 }
 
+/*
+ * Same as mk_vhost_handler() but the callback gets the control as soon as
+ * the request headers arrive, the body is read through mk_http_body_read().
+ */
+int mk_vhost_handler_stream(mk_ctx_t *ctx, int vid, char *regex,
+                            void (*cb)(mk_request_t *, void *), void *data)
+{
+    struct mk_vhost *vh;
+    struct mk_vhost_handler *handler;
+
+    if (mk_vhost_handler(ctx, vid, regex, cb, data) != 0) {
+        return -1;
+    }
+
+    vh = mk_vhost_lookup(ctx, vid);
+    handler = mk_list_entry_last(&vh->handlers, struct mk_vhost_handler,
+                                 _head);
+    handler->stream_body = MK_TRUE;
+
+    return 0;
+}
+
+/*
+ * Read the request body. The bytes that arrived with the headers come
+ * first, a streamed body is then read from the socket as the callback asks
+ * for it: the coroutine waits for the client data without blocking the
+ * worker. It returns the number of bytes copied, 0 once the body is
+ * complete or -1 if the connection failed.
+ */
+long mk_http_body_read(mk_request_t *req, char *buf, size_t size)
+{
+    int ret;
+    int bytes;
+    size_t avail;
+    size_t count;
+    struct mk_http_session *cs = req->session;
+
+    if (cs->channel->status != MK_CHANNEL_OK) {
+        return -1;
+    }
+
+    /* Data received together with the headers */
+    if (req->body_offset < req->data.len) {
+        avail = req->data.len - req->body_offset;
+        if (size > avail) {
+            size = avail;
+        }
+        memcpy(buf, req->data.data + req->body_offset, size);
+        req->body_offset += size;
+        return size;
+    }
+
+    if (req->body_left <= 0) {
+        return 0;
+    }
+
+    /* The interim response goes out before waiting for the body */
+    if (mk_http_body_continue_queue(cs, req) == MK_TRUE) {
+        while (mk_list_is_empty(&req->stream_continue.inputs) != 0) {
+            ret = mk_channel_write(cs->channel, &count);
+            if (ret & (MK_CHANNEL_ERROR | MK_CHANNEL_EMPTY)) {
+                return -1;
+            }
+            else if (ret == MK_CHANNEL_BUSY &&
+                     (mk_lib_yield(req) != 0 ||
+                      cs->channel->status != MK_CHANNEL_OK)) {
+                return -1;
+            }
+        }
+    }
+
+    /* The client is held to the body rate while the handler reads */
+    mk_sched_conn_rate(cs->conn, mk_sched_get_thread_conf(),
+                       MK_SCHED_RATE_BODY, log_current_utime);
+
+    while (1) {
+        bytes = mk_http_body_recv(cs, req, buf, size);
+        if (bytes >= 0 && req->body_left == 0) {
+            mk_sched_conn_rate(cs->conn, mk_sched_get_thread_conf(),
+                               MK_SCHED_RATE_NONE, log_current_utime);
+        }
+
+        if (bytes > 0) {
+            return bytes;
+        }
+        else if (bytes == 0) {
+            /* only chunk framing was read, maybe the last chunk */
+            if (req->body_left == 0) {
+                return 0;
+            }
+            continue;
+        }
+        else if (bytes == MK_HTTP_BODY_INVALID || errno != EAGAIN) {
+            return -1;
+        }
+
+        /* Wait for the client */
+        if (mk_lib_read_wait(req) != 0 ||
+            cs->channel->status != MK_CHANNEL_OK) {
+            return -1;
+        }
+    }
+}
+
 /* Flush streams data associated to a request in question */
 int mk_http_flush(mk_request_t *req)
 {
@@ -597,33 +853,53 @@ int mk_http_send(mk_request_t *req, char *buf, size_t len,
         return -1;
     }
 
-    /* Chunk encoding prefix */
-    if (req->protocol == MK_HTTP_PROTOCOL_11) {
-        chunk_len = chunk_header(len, chunk_pre);
-        tmp = mk_string_dup(chunk_pre);
-        if (!tmp) {
-            return -1;
-        }
-        ret = mk_stream_in_raw(&req->stream, NULL,
-                               tmp, chunk_len, NULL, free_chunk_header);
+    /*
+     * Before the headers are sent, check if the body must be compressed
+     * on the fly. The compressed stream does its own chunk framing.
+     */
+    if (req->headers.sent == MK_FALSE) {
+        mk_http_compress_start(req);
+    }
+
+    if (req->deflate) {
+        /* An empty buffer finishes the compressed stream */
+        ret = mk_stream_in_deflate(&req->stream, NULL, req->deflate,
+                                   MK_STREAM_RAW, buf, len, len == 0,
+                                   NULL);
         if (ret != 0) {
             return -1;
         }
+        req->stream_size += len;
     }
+    else {
+        /* Chunk encoding prefix */
+        if (req->protocol == MK_HTTP_PROTOCOL_11) {
+            chunk_len = chunk_header(len, chunk_pre);
+            tmp = mk_string_dup(chunk_pre);
+            if (!tmp) {
+                return -1;
+            }
+            ret = mk_stream_in_raw(&req->stream, NULL,
+                                   tmp, chunk_len, NULL, free_chunk_header);
+            if (ret != 0) {
+                return -1;
+            }
+        }
 
-    /* Append raw data */
-    if (len > 0) {
-        ret = mk_stream_in_raw(&req->stream, NULL,
-                               buf, len, NULL, NULL);
-        if (ret == 0) {
-            /* Update count of bytes */
-            req->stream_size += len;
+        /* Append raw data */
+        if (len > 0) {
+            ret = mk_stream_in_raw(&req->stream, NULL,
+                                   buf, len, NULL, NULL);
+            if (ret == 0) {
+                /* Update count of bytes */
+                req->stream_size += len;
+            }
         }
-    }
 
-    if (req->protocol == MK_HTTP_PROTOCOL_11 && len > 0) {
-        ret = mk_stream_in_raw(&req->stream, NULL,
-                               "\r\n", 2, NULL, NULL);
+        if (req->protocol == MK_HTTP_PROTOCOL_11 && len > 0) {
+            ret = mk_stream_in_raw(&req->stream, NULL,
+                                   "\r\n", 2, NULL, NULL);
+        }
     }
 
     /*
@@ -683,6 +959,9 @@ int mk_http_done(mk_request_t *req)
     case MK_EVENT_THREAD:
         printf("thread");
         break;
+    case MK_EVENT_THREAD_NET:
+        printf("thread (upstream)");
+        break;
     default:
         printf("OTHER: %i", event->type);
     };
@@ -718,8 +997,9 @@ int mk_http_done(mk_request_t *req)
     fflush(stdout);
     */
 
-    if (req->headers.transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED) {
-        /* Append end-of-chunk bytes */
+    if (req->headers.transfer_encoding == MK_HEADER_TE_TYPE_CHUNKED ||
+        req->deflate) {
+        /* Append end-of-chunk bytes and finish the compressed stream */
         mk_http_send(req, NULL, 0, NULL);
     }
 
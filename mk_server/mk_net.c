@@ -89,7 +89,7 @@ struct mk_net_connection *mk_net_conn_create(char *addr, int port)
         sched = mk_sched_get_thread_conf();
         // FIXME: not including the thread
         //conn->thread = mk_thread_get();
-        ret = mk_event_add(sched->loop, conn->fd, MK_EVENT_THREAD,
+        ret = mk_event_add(sched->loop, conn->fd, MK_EVENT_THREAD_NET,
                            MK_EVENT_WRITE, &conn->event);
         if (ret == -1) {
             close(fd);
@@ -261,6 +261,8 @@ void mk_plugin_api_init(struct mk_server *server)
     /* HTTP callbacks */
     api->http_request_end = mk_plugin_http_request_end;
     api->http_request_error = mk_plugin_http_error;
+    api->http_body_pause = mk_http_body_pause;
+    api->http_body_resume = mk_http_body_resume;
 
     /* Memory callbacks */
     api->pointer_set = mk_ptr_set;
@@ -23,6 +23,7 @@
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_scheduler_tls.h>
 #include <monkey/mk_server.h>
+#include <monkey/mk_socket.h>
 #include <monkey/mk_thread.h>
 #include <monkey/mk_cache.h>
 #include <monkey/mk_config.h>
@@ -33,6 +34,7 @@
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
 #include <monkey/mk_http_thread.h>
+#include <monkey/mk_stream_deflate.h>
 
 #include <signal.h>
 #include <sys/syscall.h>
@@ -50,24 +52,25 @@ static pthread_mutex_t pth_mutex;
 
 /*
  * Returns the worker id which should take a new incomming connection,
- * it returns the worker id with less active connections. Just used
- * if config->scheduler_mode is MK_SCHEDULER_FAIR_BALANCING.
+ * it returns the worker id with less active connections in the range
+ * of workers given. Used if config->scheduler_mode is
+ * MK_SCHEDULER_FAIR_BALANCING and when looking up a worker pool target.
  */
-static inline int _next_target(struct mk_server *server)
+static inline int _next_target(struct mk_server *server, int first, int count)
 {
     int i;
-    int target = 0;
+    int target = first;
     unsigned long long tmp = 0, cur = 0;
     struct mk_sched_ctx *ctx = server->sched_ctx;
     struct mk_sched_worker *worker;
 
-    cur = (ctx->workers[0].accepted_connections -
-           ctx->workers[0].closed_connections);
+    cur = (ctx->workers[first].accepted_connections -
+           ctx->workers[first].closed_connections);
     if (cur == 0)
-        return 0;
+        return first;
 
     /* Finds the lowest load worker */
-    for (i = 1; i < server->workers; i++) {
+    for (i = first + 1; i < first + count; i++) {
         worker = &ctx->workers[i];
         tmp = worker->accepted_connections - worker->closed_connections;
         if (tmp < cur) {
@@ -98,7 +101,27 @@ struct mk_sched_worker *mk_sched_next_target(struct mk_server *server)
     int t;
     struct mk_sched_ctx *ctx = server->sched_ctx;
 
-    t = _next_target(server);
+    /* New connections always land on the default pool */
+    t = _next_target(server, 0, server->workers);
+    if (mk_likely(t != -1)) {
+        return &ctx->workers[t];
+    }
+
+    return NULL;
+}
+
+/* Returns the less loaded worker of a worker pool, NULL = default pool */
+struct mk_sched_worker *mk_sched_pool_target(struct mk_config_pool *pool,
+                                             struct mk_server *server)
+{
+    int t;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
+
+    if (!pool) {
+        return mk_sched_next_target(server);
+    }
+
+    t = _next_target(server, pool->first, pool->workers);
     if (mk_likely(t != -1)) {
         return &ctx->workers[t];
     }
@@ -130,10 +153,12 @@ void mk_sched_worker_free(struct mk_server *server)
     mk_plugin_exit_worker();
     mk_vhost_fdt_worker_exit(server);
     mk_cache_worker_exit();
+    mk_stream_deflate_worker_exit();
+    mk_user_worker_exit();
 
     /* Scheduler stuff */
     tid = pthread_self();
-    for (i = 0; i < server->workers; i++) {
+    for (i = 0; i < ctx->n_workers; i++) {
         worker = &ctx->workers[i];
         if (worker->tid == tid) {
             break;
@@ -164,31 +189,16 @@ struct mk_sched_handler *mk_sched_handler_cap(char cap)
     return NULL;
 }
 
-/*
- * Register a new client connection into the scheduler, this call takes place
- * inside the worker/thread context.
- */
-struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
-                                              struct mk_server_listen *listener,
-                                              struct mk_sched_worker *sched,
-                                              struct mk_server *server)
+/* Allocate and initialize the scheduler context of a client connection */
+static struct mk_sched_conn *mk_sched_conn_create(int remote_fd,
+                                                  struct mk_server_listen *listener,
+                                                  struct mk_sched_worker *sched)
 {
-    int ret;
     int size;
     struct mk_sched_handler *handler;
     struct mk_sched_conn *conn;
     struct mk_event *event;
 
-    /* Before to continue, we need to run plugin stage 10 */
-    ret = mk_plugin_stage_run_10(remote_fd, server);
-
-    /* Close connection, otherwise continue */
-    if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
-        listener->network->network->close(remote_fd);
-        MK_LT_SCHED(remote_fd, "PLUGIN_CLOSE");
-        return NULL;
-    }
-
     handler = listener->protocol;
     if (handler->sched_extra_size > 0) {
         void *data;
@@ -211,6 +221,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     event->mask         = MK_EVENT_EMPTY;
     event->status       = MK_EVENT_NONE;
     conn->arrive_time   = log_current_utime;
+    conn->arrive_clock  = mk_clock_mono();
     conn->protocol      = handler;
     conn->net           = listener->network->network;
     conn->is_timeout_on = MK_FALSE;
@@ -242,6 +253,159 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     return conn;
 }
 
+/*
+ * Register a new client connection into the scheduler, this call takes place
+ * inside the worker/thread context.
+ */
+struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
+                                              struct mk_server_listen *listener,
+                                              struct mk_sched_worker *sched,
+                                              struct mk_server *server)
+{
+    int ret;
+
+    /* Before to continue, we need to run plugin stage 10 */
+    ret = mk_plugin_stage_run_10(remote_fd, server);
+
+    /* Close connection, otherwise continue */
+    if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
+        listener->network->network->close(remote_fd);
+        MK_LT_SCHED(remote_fd, "PLUGIN_CLOSE");
+        return NULL;
+    }
+
+    return mk_sched_conn_create(remote_fd, listener, sched);
+}
+
+/*
+ * Move a connection to a worker of a different pool: the connection is
+ * unregistered from the current worker without closing the socket and
+ * queued on the target worker together with the data already read, the
+ * target is notified through its signal channel.
+ */
+int mk_sched_conn_handoff(struct mk_sched_conn *conn,
+                          struct mk_sched_worker *sched,
+                          struct mk_sched_worker *target,
+                          char *data, size_t size)
+{
+    ssize_t n;
+    uint64_t val;
+    struct mk_sched_handoff *handoff;
+
+    /* The TLS state of the socket belongs to this worker */
+    if (MK_SCHED_CONN_PROP(conn) & MK_CAP_SOCK_TLS) {
+        return -1;
+    }
+
+    handoff = mk_mem_alloc(sizeof(struct mk_sched_handoff));
+    if (!handoff) {
+        return -1;
+    }
+
+    handoff->data = NULL;
+    if (size > 0) {
+        handoff->data = mk_mem_alloc(size);
+        if (!handoff->data) {
+            mk_mem_free(handoff);
+            return -1;
+        }
+        memcpy(handoff->data, data, size);
+    }
+    handoff->fd = conn->event.fd;
+    handoff->size = size;
+    handoff->server_listen = conn->server_listen;
+
+    MK_TRACE("[FD %i] Handoff to worker %i", conn->event.fd, target->idx);
+
+    /* Release the connection context, the socket stays open */
+    mk_event_del(sched->loop, &conn->event);
+    sched->closed_connections++;
+    mk_sched_conn_timeout_del(conn);
+    mk_sched_conn_rate_del(conn);
+    mk_channel_clean(&conn->channel);
+    mk_sched_event_free(&conn->event);
+    conn->status = MK_SCHED_CONN_CLOSED;
+
+    pthread_mutex_lock(&target->handoff_mutex);
+    mk_list_add(&handoff->_head, &target->handoff_queue);
+    pthread_mutex_unlock(&target->handoff_mutex);
+
+    val = MK_SCHED_SIGNAL_HANDOFF;
+    n = write(target->signal_channel_w, &val, sizeof(val));
+    if (n < 0) {
+        mk_libc_error("write");
+    }
+
+    MK_LT_SCHED(handoff->fd, "HANDOFF");
+    return 0;
+}
+
+/*
+ * Register the connections handed off by other workers, this call takes
+ * place inside the target worker context.
+ */
+int mk_sched_conn_handoff_resume(struct mk_sched_worker *sched,
+                                 struct mk_server *server)
+{
+    int c = 0;
+    int ret;
+    struct mk_list queue;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_sched_conn *conn;
+    struct mk_sched_handoff *handoff;
+
+    /* Take the pending entries, keep the lock as short as possible */
+    mk_list_init(&queue);
+    pthread_mutex_lock(&sched->handoff_mutex);
+    mk_list_foreach_safe(head, tmp, &sched->handoff_queue) {
+        handoff = mk_list_entry(head, struct mk_sched_handoff, _head);
+        mk_list_del(&handoff->_head);
+        mk_list_add(&handoff->_head, &queue);
+    }
+    pthread_mutex_unlock(&sched->handoff_mutex);
+
+    mk_list_foreach_safe(head, tmp, &queue) {
+        handoff = mk_list_entry(head, struct mk_sched_handoff, _head);
+        mk_list_del(&handoff->_head);
+
+        conn = mk_sched_conn_create(handoff->fd, handoff->server_listen, sched);
+        if (!conn) {
+            handoff->server_listen->network->network->close(handoff->fd);
+            goto next;
+        }
+
+        ret = mk_event_add(sched->loop, handoff->fd,
+                           MK_EVENT_CONNECTION, MK_EVENT_READ, conn);
+        sched->accepted_connections++;
+        if (mk_unlikely(ret != 0)) {
+            mk_err("[server] Error registering file descriptor: %s",
+                   strerror(errno));
+            mk_sched_drop_connection(conn, sched, server);
+            goto next;
+        }
+
+        if (conn->protocol->cb_handoff) {
+            ret = conn->protocol->cb_handoff(conn, sched,
+                                             handoff->data, handoff->size,
+                                             server);
+            if (ret == -1 && conn->status != MK_SCHED_CONN_CLOSED) {
+                mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED,
+                                     server);
+            }
+        }
+        c++;
+
+    next:
+        if (handoff->data) {
+            mk_mem_free(handoff->data);
+        }
+        mk_mem_free(handoff);
+    }
+
+    return c;
+}
+
 static void mk_sched_thread_lists_init()
 {
     struct mk_list *sched_cs_incomplete;
@@ -255,6 +419,8 @@ static void mk_sched_thread_lists_init()
 /* Register thread information. The caller thread is the thread information's owner */
 static int mk_sched_register_thread(struct mk_server *server)
 {
+    struct mk_list *head;
+    struct mk_config_pool *pool;
     struct mk_sched_ctx *ctx = server->sched_ctx;
     struct mk_sched_worker *worker;
     static int wid = 0;
@@ -267,6 +433,17 @@ static int mk_sched_register_thread(struct mk_server *server)
     worker->idx = wid++;
     worker->tid = pthread_self();
 
+    /* Lookup the worker pool, workers are launched in pool order */
+    worker->pool = NULL;
+    mk_list_foreach(head, &server->worker_pools) {
+        pool = mk_list_entry(head, struct mk_config_pool, _head);
+        if (worker->idx >= pool->first &&
+            worker->idx < pool->first + pool->workers) {
+            worker->pool = pool;
+            break;
+        }
+    }
+
 
 #if defined(__linux__)
     /*
@@ -290,6 +467,26 @@ static int mk_sched_register_thread(struct mk_server *server)
 
     /* Initialize lists */
     mk_list_init(&worker->timeout_queue);
+    mk_list_init(&worker->ka_idle_queue);
+
+    /* Keep-alive governor */
+    worker->capacity = server->server_capacity / ctx->n_workers;
+    if (worker->capacity == 0) {
+        worker->capacity = 1;
+    }
+    worker->ka_pressure_closed = 0;
+    mk_sched_ka_update(worker, server);
+
+    /* Data rates */
+    mk_list_init(&worker->rate_queue);
+    worker->rate_limits = (server->max_header_time > 0 ||
+                           server->min_request_rate > 0 ||
+                           server->min_response_rate > 0);
+    worker->shed_header_time = 0;
+    worker->shed_request_rate = 0;
+    worker->shed_response_rate = 0;
+    mk_list_init(&worker->handoff_queue);
+    pthread_mutex_init(&worker->handoff_mutex, NULL);
     worker->request_handler = NULL;
 
     return worker->idx;
@@ -382,7 +579,8 @@ void *mk_sched_launch_worker_loop(void *data)
     MK_TLS_SET(mk_tls_sched_worker_node, sched);
     mk_plugin_core_thread(server);
 
-    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
+    /* Only the default pool takes connections from the listeners */
+    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT && !sched->pool) {
         sched->listeners = mk_server_listen_init(server);
         if (!sched->listeners) {
             exit(EXIT_FAILURE);
@@ -455,6 +653,8 @@ int mk_sched_launch_thread(struct mk_server *server, pthread_t *tout)
 int mk_sched_init(struct mk_server *server)
 {
     int size;
+    struct mk_list *head;
+    struct mk_config_pool *pool;
     struct mk_sched_ctx *ctx;
 
     ctx = mk_mem_alloc_z(sizeof(struct mk_sched_ctx));
@@ -463,8 +663,16 @@ int mk_sched_init(struct mk_server *server)
         return -1;
     }
 
-    size = (sizeof(struct mk_sched_worker) * server->workers);
-    ctx->workers = mk_mem_alloc(size);
+    /* Worker pools are placed after the default pool workers */
+    ctx->n_workers = server->workers;
+    mk_list_foreach(head, &server->worker_pools) {
+        pool = mk_list_entry(head, struct mk_config_pool, _head);
+        pool->first = ctx->n_workers;
+        ctx->n_workers += pool->workers;
+    }
+
+    size = (sizeof(struct mk_sched_worker) * ctx->n_workers);
+    ctx->workers = mk_mem_alloc_z(size);
     if (!ctx->workers) {
         mk_libc_error("malloc");
         mk_mem_free(ctx);
@@ -527,6 +735,7 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
     /* Unlink from the red-black tree */
     //rb_erase(&conn->_rb_head, &sched->rb_queue);
     mk_sched_conn_timeout_del(conn);
+    mk_sched_conn_rate_del(conn);
 
     /* Close at network layer level */
     conn->net->close(event->fd);
@@ -592,6 +801,183 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched,
     return 0;
 }
 
+/* Keep-alive settings for the current load of the worker */
+void mk_sched_ka_update(struct mk_sched_worker *sched,
+                        struct mk_server *server)
+{
+    int load;
+    int timeout;
+    int requests;
+    int min_timeout;
+    int min_requests;
+    unsigned long long active;
+
+    timeout = server->keep_alive_timeout;
+    requests = server->max_keep_alive_request;
+
+    active = sched->accepted_connections - sched->closed_connections;
+    load = (active * 100) / sched->capacity;
+
+    if (server->keep_alive_adaptive == MK_TRUE && load > MK_SCHED_KA_LOW) {
+        min_timeout = MK_SCHED_KA_MIN_TIMEOUT;
+        if (min_timeout > timeout) {
+            min_timeout = timeout;
+        }
+        min_requests = MK_SCHED_KA_MIN_REQUESTS;
+        if (min_requests > requests) {
+            min_requests = requests;
+        }
+
+        if (load >= MK_SCHED_KA_HIGH) {
+            timeout = min_timeout;
+            requests = min_requests;
+        }
+        else {
+            timeout -= ((timeout - min_timeout) * (load - MK_SCHED_KA_LOW)) /
+                (MK_SCHED_KA_HIGH - MK_SCHED_KA_LOW);
+            requests -= ((requests - min_requests) * (load - MK_SCHED_KA_LOW)) /
+                (MK_SCHED_KA_HIGH - MK_SCHED_KA_LOW);
+        }
+    }
+
+    sched->ka_timeout = timeout;
+    sched->ka_max_requests = requests;
+}
+
+/*
+ * Close the idle persistent connections that waited longer than the
+ * keep-alive timeout in effect and, while the worker is over the high
+ * watermark, the oldest ones. Returns the number of connections closed.
+ */
+int mk_sched_ka_check(struct mk_sched_worker *sched,
+                      struct mk_server *server)
+{
+    int c = 0;
+    int pressure;
+    unsigned long long active;
+    struct mk_sched_conn *conn;
+    struct mk_list *head;
+    struct mk_list *temp;
+
+    mk_sched_ka_update(sched, server);
+
+    mk_list_foreach_safe(head, temp, &sched->ka_idle_queue) {
+        conn = mk_list_entry(head, struct mk_sched_conn, timeout_head);
+
+        active = sched->accepted_connections - sched->closed_connections;
+        pressure = (server->keep_alive_adaptive == MK_TRUE &&
+                    (active * 100) / sched->capacity >= MK_SCHED_KA_HIGH);
+
+        /* The queue is sorted by idle time, the rest waited less */
+        if (conn->arrive_time + sched->ka_timeout > log_current_utime &&
+            pressure == MK_FALSE) {
+            break;
+        }
+
+        MK_TRACE("[FD %i] Keep-alive %s", conn->event.fd,
+                 pressure ? "pressure" : "timeout");
+        MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_IDLE");
+        if (pressure == MK_TRUE) {
+            sched->ka_pressure_closed++;
+        }
+        conn->protocol->cb_close(conn, sched, MK_SCHED_CONN_TIMEOUT,
+                                 server);
+        mk_sched_drop_connection(conn, sched, server);
+        c++;
+    }
+
+    return c;
+}
+
+/*
+ * The response of a connection is waiting for the client to read it,
+ * 'bytes' were just written. The phase starts with what is already queued
+ * in the socket, the check subtracts what is still there: the difference
+ * is what the client really read.
+ */
+void mk_sched_conn_rate_drain(struct mk_sched_conn *conn,
+                              struct mk_sched_worker *sched,
+                              size_t bytes)
+{
+    if (conn->rate_mode == MK_SCHED_RATE_DRAIN) {
+        mk_sched_conn_rate_add(conn, bytes);
+    }
+    else if (sched->rate_limits == MK_TRUE) {
+        mk_sched_conn_rate(conn, sched, MK_SCHED_RATE_DRAIN,
+                           log_current_utime);
+        conn->rate_bytes = mk_socket_unsent(conn->event.fd);
+    }
+}
+
+/*
+ * Shed the connections too slow in their current phase: the headers took
+ * longer than MaxHeaderTime or, past the grace period, the average rate
+ * is under the minimum. They are reset instead of closed gracefully so no
+ * more resources are spent on them. Returns the number of connections shed.
+ */
+int mk_sched_rate_check(struct mk_sched_worker *sched,
+                        struct mk_server *server)
+{
+    int c = 0;
+    int rate;
+    int unsent;
+    time_t elapsed;
+    unsigned long bytes;
+    struct mk_sched_conn *conn;
+    struct mk_list *head;
+    struct mk_list *temp;
+
+    mk_list_foreach_safe(head, temp, &sched->rate_queue) {
+        conn = mk_list_entry(head, struct mk_sched_conn, rate_head);
+        elapsed = log_current_utime - conn->rate_start;
+
+        if (conn->rate_mode == MK_SCHED_RATE_HEADER &&
+            server->max_header_time > 0 &&
+            elapsed >= server->max_header_time) {
+            MK_TRACE("[FD %i] Header time exceeded", conn->event.fd);
+            sched->shed_header_time++;
+        }
+        else if (elapsed >= MK_SCHED_RATE_GRACE) {
+            bytes = conn->rate_bytes;
+            if (conn->rate_mode == MK_SCHED_RATE_DRAIN) {
+                rate = server->min_response_rate;
+
+                /* what still sits in the socket was not read */
+                unsent = mk_socket_unsent(conn->event.fd);
+                bytes = ((unsigned long) unsent < bytes) ? bytes - unsent : 0;
+            }
+            else {
+                rate = server->min_request_rate;
+            }
+
+            if (rate == 0 || bytes >= (unsigned long) rate * elapsed) {
+                continue;
+            }
+
+            MK_TRACE("[FD %i] Data rate under %i bytes/s", conn->event.fd,
+                     rate);
+            if (conn->rate_mode == MK_SCHED_RATE_DRAIN) {
+                sched->shed_response_rate++;
+            }
+            else {
+                sched->shed_request_rate++;
+            }
+        }
+        else {
+            continue;
+        }
+
+        MK_LT_SCHED(conn->event.fd, "RATE_SHED");
+        mk_socket_set_linger_reset(conn->event.fd);
+        conn->protocol->cb_close(conn, sched, MK_SCHED_CONN_TIMEOUT,
+                                 server);
+        mk_sched_drop_connection(conn, sched, server);
+        c++;
+    }
+
+    return c;
+}
+
 int mk_sched_threads_purge(struct mk_sched_worker *sched)
 {
     int c = 0;
@@ -648,16 +1034,19 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
                          struct mk_server *server)
 {
     int ret = -1;
-    size_t count;
+    size_t count = 0;
     struct mk_event *event;
 
     MK_TRACE("[FD %i] Connection Handler / write", conn->event.fd);
 
     ret = mk_channel_write(&conn->channel, &count);
     if (ret == MK_CHANNEL_FLUSH || ret == MK_CHANNEL_BUSY) {
+        mk_sched_conn_rate_drain(conn, sched, count);
         return 0;
     }
     else if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
+        mk_sched_conn_rate(conn, sched, MK_SCHED_RATE_NONE,
+                           log_current_utime);
         if (conn->protocol->cb_done) {
             ret = conn->protocol->cb_done(conn, sched, server);
         }
@@ -681,6 +1070,24 @@ int mk_sched_event_write(struct mk_sched_conn *conn,
     return -1;
 }
 
+/*
+ * The remote peer hung up while the connection is still registered in the
+ * event loop. Let the protocol handler abort any pending work, a return
+ * value of -1 means the connection must be closed.
+ */
+int mk_sched_event_cancel(struct mk_sched_conn *conn,
+                          struct mk_sched_worker *sched,
+                          struct mk_server *server)
+{
+    MK_TRACE("[FD %i] Connection Handler, cancel", conn->event.fd);
+
+    if (!conn->protocol->cb_cancel) {
+        return 0;
+    }
+
+    return conn->protocol->cb_cancel(conn, sched, server);
+}
+
 int mk_sched_event_close(struct mk_sched_conn *conn,
                          struct mk_sched_worker *sched,
                          int type, struct mk_server *server)
@@ -751,7 +1158,7 @@ int mk_sched_send_signal(struct mk_server *server, uint64_t val)
     struct mk_sched_worker *worker;
 
     ctx = server->sched_ctx;
-    for (i = 0; i < server->workers; i++) {
+    for (i = 0; i < ctx->n_workers; i++) {
         worker = &ctx->workers[i];
         n = write(worker->signal_channel_w, &val, sizeof(uint64_t));
         if (n < 0) {
@@ -777,7 +1184,7 @@ int mk_sched_workers_join(struct mk_server *server)
     struct mk_sched_worker *worker;
 
     ctx = server->sched_ctx;
-    for (i = 0; i < server->workers; i++) {
+    for (i = 0; i < ctx->n_workers; i++) {
         worker = &ctx->workers[i];
         pthread_join(worker->tid, NULL);
         count++;
@@ -34,6 +34,10 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 
+/* Kernel listen queue overflows when the first sample was taken */
+static int listen_overflows_init = MK_FALSE;
+static unsigned long long listen_overflows_base;
+
 /* Return the number of clients that can be attended  */
 unsigned int mk_server_capacity(struct mk_server *server)
 {
@@ -143,6 +147,7 @@ void mk_server_listen_exit(struct mk_list *list)
 struct mk_list *mk_server_listen_init(struct mk_server *server)
 {
     int i = 0;
+    int backlog;
     int server_fd;
     int reuse_port = MK_FALSE;
     struct mk_list *head;
@@ -167,9 +172,11 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
     mk_list_foreach(head, &server->listeners) {
         listen = mk_list_entry(head, struct mk_config_listener, _head);
 
+        backlog = listen->backlog > 0 ? listen->backlog : server->listen_backlog;
         server_fd = mk_socket_server(listen->port,
                                      listen->address,
                                      reuse_port,
+                                     backlog,
                                      server);
         if (server_fd >= 0) {
             if (mk_socket_set_tcp_defer_accept(server_fd) != 0) {
@@ -191,6 +198,13 @@ struct mk_list *mk_server_listen_init(struct mk_server *server)
             listener->server_fd = server_fd;
             listener->listen    = listen;
 
+            /* accept queue telemetry */
+            listener->backlog    = backlog;
+            listener->queue_len  = 0;
+            listener->queue_max  = 0;
+            listener->queue_peak = 0;
+            listener->queue_full = 0;
+
             if (listen->flags & MK_CAP_HTTP) {
                 protocol = mk_sched_handler_cap(MK_CAP_HTTP);
                 if (!protocol) {
@@ -241,14 +255,79 @@ error:
     return NULL;
 }
 
+/*
+ * Sample the accept queue of each listener, so it's possible to tell if
+ * connections are waiting before a worker accept them. This runs on every
+ * timeout check of the thread owning the listeners.
+ */
+void mk_server_listen_sample(struct mk_list *listeners)
+{
+    int ret;
+    unsigned int len;
+    unsigned int max;
+    struct mk_list *head;
+    struct mk_server_listen *listener;
+
+    if (!listeners) {
+        return;
+    }
+
+    mk_list_foreach(head, listeners) {
+        listener = mk_list_entry(head, struct mk_server_listen, _head);
+        ret = mk_socket_accept_queue(listener->server_fd, &len, &max);
+        if (ret != 0) {
+            continue;
+        }
+
+        listener->queue_len = len;
+        listener->queue_max = max;
+        if (len > listener->queue_peak) {
+            listener->queue_peak = len;
+        }
+
+        if (max > 0 && len >= max) {
+            listener->queue_full++;
+            mk_warn("[server] Accept queue full on %s:%s (%u/%u), "
+                    "consider to increase Workers or ListenBacklog",
+                    listener->listen->address, listener->listen->port,
+                    len, max);
+        }
+    }
+}
+
+/*
+ * Sample the Kernel counter of connections dropped on full listen queues.
+ * It's system wide, so the clock thread takes it once per second for the
+ * whole server and only the increments since startup are reported.
+ */
+void mk_server_listen_overflows(struct mk_server *server)
+{
+    unsigned long long overflows;
+
+    if (mk_socket_listen_overflows(&overflows) != 0) {
+        return;
+    }
+
+    if (listen_overflows_init == MK_FALSE) {
+        listen_overflows_base = overflows;
+        listen_overflows_init = MK_TRUE;
+    }
+    else if (overflows - listen_overflows_base > server->listen_overflows) {
+        mk_warn("[server] Kernel dropped %llu connections on full listen queues",
+                overflows - listen_overflows_base - server->listen_overflows);
+        server->listen_overflows = overflows - listen_overflows_base;
+    }
+}
+
 /* Here we launch the worker threads to attend clients */
 void mk_server_launch_workers(struct mk_server *server)
 {
     int i;
     pthread_t skip;
+    struct mk_sched_ctx *ctx = server->sched_ctx;
 
-    /* Launch workers */
-    for (i = 0; i < server->workers; i++) {
+    /* Launch workers: default pool first, then each worker pool */
+    for (i = 0; i < ctx->n_workers; i++) {
         /* Spawn the thread */
         mk_sched_launch_thread(server, &skip);
     }
@@ -264,6 +343,9 @@ void mk_server_launch_workers(struct mk_server *server)
  */
 void mk_server_loop_balancer(struct mk_server *server)
 {
+    int ret;
+    uint64_t val;
+    struct mk_event timer;
     struct mk_list *head;
     struct mk_list *listeners;
     struct mk_server_listen *listener;
@@ -293,15 +375,28 @@ void mk_server_loop_balancer(struct mk_server *server)
                      listener);
     }
 
+    /* Timer to sample the listeners accept queue */
+    mk_event_timeout_create(evl, server->timeout, 0, &timer);
+
     while (1) {
         mk_event_wait(evl);
         mk_event_foreach(event, evl) {
+            if (event->type == MK_EVENT_NOTIFICATION) {
+                ret = read(event->fd, &val, sizeof(val));
+                if (ret < 0) {
+                    mk_libc_error("read");
+                    continue;
+                }
+                mk_server_listen_sample(listeners);
+                continue;
+            }
+
             if (event->mask & MK_EVENT_READ) {
                 /*
                  * Accept connection: determinate which thread may work on this
                  * new connection.
                  */
-                sched = mk_sched_next_target();
+                sched = mk_sched_next_target(server);
                 if (sched != NULL) {
                     mk_server_listen_handler(sched, event, server);
 #ifdef MK_TRACE
@@ -340,6 +435,8 @@ void mk_server_worker_loop(struct mk_server *server)
 {
     int ret = -1;
     int timeout_fd;
+    int tick_fd;
+    uint32_t mask;
     uint64_t val;
     struct mk_event *event;
     struct mk_event_loop *evl;
@@ -349,6 +446,7 @@ void mk_server_worker_loop(struct mk_server *server)
     struct mk_sched_worker *sched;
     struct mk_server_listen *listener;
     struct mk_server_timeout *server_timeout;
+    struct mk_server_timeout tick;
 
     /* Get thread conf */
     sched = mk_sched_get_thread_conf();
@@ -377,7 +475,7 @@ void mk_server_worker_loop(struct mk_server *server)
         }
     }
 
-    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
+    if (server->scheduler_mode == MK_SCHEDULER_REUSEPORT && !sched->pool) {
         /* Register listeners */
         list = MK_TLS_GET(mk_tls_server_listen);
         mk_list_foreach(head, list) {
@@ -393,6 +491,12 @@ void mk_server_worker_loop(struct mk_server *server)
     MK_TLS_SET(mk_tls_server_timeout, server_timeout);
     timeout_fd = mk_event_timeout_create(evl, server->timeout, 0, server_timeout);
 
+    /*
+     * Keep-alive governor and data rates: idle and slow connections are
+     * checked with a second resolution.
+     */
+    tick_fd = mk_event_timeout_create(evl, 1, 0, &tick);
+
     while (1) {
         mk_event_wait(evl);
         mk_event_foreach(event, evl) {
@@ -404,6 +508,12 @@ void mk_server_worker_loop(struct mk_server *server)
             if (event->type == MK_EVENT_CONNECTION) {
                 conn = (struct mk_sched_conn *) event;
 
+                /*
+                 * The handlers may change the mask, e.g: a connection put
+                 * to sleep must not be taken as closed below.
+                 */
+                mask = event->mask;
+
                 if (event->mask & MK_EVENT_WRITE) {
                     MK_TRACE("[FD %i] Event WRITE", event->fd);
                     ret = mk_sched_event_write(conn, sched, server);
@@ -415,11 +525,24 @@ void mk_server_worker_loop(struct mk_server *server)
                 }
 
 
-                if (event->mask & MK_EVENT_CLOSE && ret != -1) {
+                if (mask & MK_EVENT_CLOSE && ret != -1) {
                     MK_TRACE("[FD %i] Event CLOSE", event->fd);
                     ret = -1;
                 }
 
+                /*
+                 * The connection is gone (reset or error): do not wait
+                 * until a later write fails, let the protocol abort any
+                 * work still in progress for this connection. A client
+                 * that only shut down its sending side still gets its
+                 * response.
+                 */
+                if (ret >= 0 && mk_event_hangup(evl) &&
+                    conn->status != MK_SCHED_CONN_CLOSED) {
+                    MK_TRACE("[FD %i] Event HANGUP", event->fd);
+                    ret = mk_sched_event_cancel(conn, sched, server);
+                }
+
                 if (ret < 0 && conn->status != MK_SCHED_CONN_CLOSED) {
                     MK_TRACE("[FD %i] Event FORCE CLOSE | ret = %i",
                              event->fd, ret);
@@ -437,6 +560,11 @@ void mk_server_worker_loop(struct mk_server *server)
                 if (conn) {
                     //conn->event.mask = MK_EVENT_READ
                     //goto speed;
+
+                    /* Make room for the next clients if we are full */
+                    if (server->keep_alive_adaptive == MK_TRUE) {
+                        mk_sched_ka_check(sched, server);
+                    }
                 }
                 continue;
             }
@@ -461,10 +589,21 @@ void mk_server_worker_loop(struct mk_server *server)
                         //FIXME:mk_sched_sync_counters();
                         continue;
                     }
+                    else if (val == MK_SCHED_SIGNAL_HANDOFF) {
+                        mk_sched_conn_handoff_resume(sched, server);
+                        continue;
+                    }
+                    else if (val == MK_SCHED_SIGNAL_USER) {
+                        mk_user_resume(sched, server);
+                        continue;
+                    }
                     else if (val == MK_SCHED_SIGNAL_FREE_ALL) {
                         if (timeout_fd > 0) {
                             close(timeout_fd);
                         }
+                        if (tick_fd > 0) {
+                            close(tick_fd);
+                        }
                         mk_mem_free(MK_TLS_GET(mk_tls_server_timeout));
                         mk_server_listen_exit(sched->listeners);
                         mk_event_loop_destroy(evl);
@@ -474,10 +613,34 @@ void mk_server_worker_loop(struct mk_server *server)
                 }
                 else if (event->fd == timeout_fd) {
                     mk_sched_check_timeouts(sched, server);
+                    mk_server_listen_sample(sched->listeners);
+                }
+                else if (event->fd == tick_fd) {
+                    mk_sched_ka_check(sched, server);
+                    if (sched->rate_limits == MK_TRUE) {
+                        mk_sched_rate_check(sched, server);
+                    }
                 }
                 continue;
             }
             else if (event->type == MK_EVENT_THREAD) {
+                if (mk_event_hangup(evl)) {
+                    /*
+                     * The coroutine output have no reader anymore, these
+                     * events always belong to a client connection channel.
+                     */
+                    conn = (struct mk_sched_conn *) event;
+                    MK_TRACE("[FD %i] Event HANGUP (thread)", event->fd);
+                    mk_sched_event_cancel(conn, sched, server);
+                    mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED,
+                                         server);
+                    continue;
+                }
+                mk_http_thread_event(event);
+                continue;
+            }
+            else if (event->type == MK_EVENT_THREAD_NET) {
+                /* Upstream socket of a coroutine, not a client connection */
                 mk_http_thread_event(event);
                 continue;
             }
@@ -32,6 +32,11 @@
 #include <netinet/tcp.h>
 #include <sys/un.h>
 
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#endif
+
 /*
  * Example from:
  * http://www.baus.net/on-tcp_cork
@@ -61,6 +66,32 @@ int mk_socket_set_nonblocking(int sockfd)
     return 0;
 }
 
+/*
+ * A zero linger time makes close(2) send a RST and drop any unsent data,
+ * the socket does not wait in FIN_WAIT or TIME_WAIT.
+ */
+int mk_socket_set_linger_reset(int sockfd)
+{
+    struct linger lg = {1, 0};
+
+    return setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+}
+
+/* Bytes written to the socket the peer did not acknowledge yet */
+int mk_socket_unsent(int sockfd)
+{
+#if defined(SIOCOUTQ)
+    int queued;
+
+    if (ioctl(sockfd, SIOCOUTQ, &queued) == 0) {
+        return queued;
+    }
+#else
+    (void) sockfd;
+#endif
+    return 0;
+}
+
 /*
  * Enable the TCP_FASTOPEN feature for server side implemented in
  * Linux Kernel >= 3.7, for more details read here:
@@ -270,7 +301,7 @@ int mk_socket_bind(int socket_fd, const struct sockaddr *addr,
 
 /* Just IPv4 for now... */
 int mk_socket_server(char *port, char *listen_addr,
-                     int reuse_port, struct mk_server *server)
+                     int reuse_port, int backlog, struct mk_server *server)
 {
     int ret;
     int socket_fd = -1;
@@ -314,7 +345,7 @@ int mk_socket_server(char *port, char *listen_addr,
         }
 
         ret = mk_socket_bind(socket_fd, rp->ai_addr, rp->ai_addrlen,
-                             MK_SOMAXCONN, server);
+                             backlog, server);
         if(ret == -1) {
             mk_err("Cannot listen on %s:%s", listen_addr, port);
             freeaddrinfo(res);
@@ -330,6 +361,92 @@ int mk_socket_server(char *port, char *listen_addr,
     return socket_fd;
 }
 
+/*
+ * Get the accept queue status of a listening socket: on Linux TCP_INFO
+ * reports the number of established connections waiting for accept(2)
+ * in tcpi_unacked and the backlog limit in tcpi_sacked.
+ */
+int mk_socket_accept_queue(int server_fd, unsigned int *len, unsigned int *max)
+{
+#if defined (__linux__) && defined (TCP_INFO)
+    int ret;
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+
+    ret = getsockopt(server_fd, SOL_TCP, TCP_INFO, &info, &size);
+    if (ret == -1) {
+        return -1;
+    }
+
+    *len = info.tcpi_unacked;
+    *max = info.tcpi_sacked;
+    return 0;
+#else
+    (void) server_fd;
+    (void) len;
+    (void) max;
+    return -1;
+#endif
+}
+
+/*
+ * Get the Kernel counter of connections dropped because a listen queue
+ * was full (TcpExt ListenOverflows), it's system wide.
+ */
+int mk_socket_listen_overflows(unsigned long long *overflows)
+{
+#if defined (__linux__)
+    int i;
+    int idx = -1;
+    int ret = -1;
+    char *p;
+    char *save;
+    char keys[4096];
+    char values[4096];
+    FILE *f;
+
+    f = fopen("/proc/net/netstat", "r");
+    if (!f) {
+        return -1;
+    }
+
+    /* The file contains pairs of lines: keys and values */
+    while (fgets(keys, sizeof(keys), f) && fgets(values, sizeof(values), f)) {
+        if (strncmp(keys, "TcpExt:", 7) != 0) {
+            continue;
+        }
+
+        i = 0;
+        for (p = strtok_r(keys, " \n", &save); p;
+             p = strtok_r(NULL, " \n", &save)) {
+            if (strcmp(p, "ListenOverflows") == 0) {
+                idx = i;
+                break;
+            }
+            i++;
+        }
+
+        i = 0;
+        for (p = strtok_r(values, " \n", &save); p;
+             p = strtok_r(NULL, " \n", &save)) {
+            if (i == idx) {
+                *overflows = strtoull(p, NULL, 10);
+                ret = 0;
+                break;
+            }
+            i++;
+        }
+        break;
+    }
+
+    fclose(f);
+    return ret;
+#else
+    (void) overflows;
+    return -1;
+#endif
+}
+
 int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len)
 {
     int ret;
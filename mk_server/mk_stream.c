@@ -19,6 +19,7 @@
 
 #include <monkey/monkey.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_stream_deflate.h>
 #include <assert.h>
 
 /* Create a new channel */
@@ -55,6 +56,27 @@ static inline size_t channel_write_in_file(struct mk_channel *channel,
     return bytes;
 }
 
+static inline ssize_t channel_write_in_deflate(struct mk_channel *channel,
+                                               struct mk_stream_input *in)
+{
+    ssize_t bytes;
+    struct mk_stream_deflate *d = in->context;
+
+    /* Compress the first piece once the input reach the channel */
+    if (d->current != in) {
+        if (mk_stream_deflate_fill(in) == -1) {
+            return -1;
+        }
+    }
+
+    bytes = mk_sched_conn_write(channel,
+                                mk_stream_deflate_data(in), in->bytes_total);
+    MK_TRACE("[CH %i] STREAM_DEFLATE, bytes=%lu/%lu",
+             channel->fd, bytes, in->bytes_total);
+
+    return bytes;
+}
+
 /*
  * It 'intent' to write a few streams over the channel and alter the
  * channel notification side if required: READ -> WRITE.
@@ -159,6 +181,9 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
             MK_TRACE("[CH %i] STREAM_RAW, bytes=%lu/%lu\n",
                      channel->fd, bytes, input->bytes_total);
         }
+        else if (input->type == MK_STREAM_DEFLATE) {
+            bytes = channel_write_in_deflate(channel, input);
+        }
 
         if (bytes > 0) {
             *count = bytes;
@@ -192,11 +217,135 @@ int mk_channel_stream_write(struct mk_stream *stream, size_t *count)
     return bytes;
 }
 
+/*
+ * Gather the IOV inputs queued right after 'input', they can belong to the
+ * next streams of the channel (responses of pipelined requests). Only whole
+ * inputs are taken, it returns the number of inputs gathered.
+ */
+static int channel_iov_gather(struct mk_channel *channel,
+                              struct mk_stream *stream,
+                              struct mk_stream_input *input,
+                              struct mk_stream_input **inputs,
+                              struct mk_iov *out)
+{
+    int i;
+    int n = 0;
+    struct mk_iov *iov;
+    struct mk_list *head_st;
+    struct mk_list *head_in;
+    struct mk_stream *st;
+    struct mk_stream_input *in;
+
+    mk_list_foreach(head_st, &channel->streams) {
+        st = mk_list_entry(head_st, struct mk_stream, _head);
+        if (n == 0 && st != stream) {
+            continue;
+        }
+
+        mk_list_foreach(head_in, &st->inputs) {
+            in = mk_list_entry(head_in, struct mk_stream_input, _head);
+            if (n == 0 && in != input) {
+                continue;
+            }
+
+            iov = in->buffer;
+            if (in->type != MK_STREAM_IOV || !iov ||
+                out->iov_idx + iov->iov_idx > out->size ||
+                n == MK_CHANNEL_GATHER_MAX) {
+                return n;
+            }
+
+            for (i = 0; i < iov->iov_idx; i++) {
+                if (iov->io[i].iov_len == 0) {
+                    continue;
+                }
+                out->io[out->iov_idx++] = iov->io[i];
+                out->total_len += iov->io[i].iov_len;
+            }
+            inputs[n++] = in;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Consume the bytes written from a group of gathered inputs, the inputs
+ * completed are released in order.
+ */
+static void channel_iov_consume(struct mk_stream_input **inputs, int n,
+                                size_t bytes)
+{
+    int i;
+    size_t len;
+    struct mk_stream *stream;
+    struct mk_stream_input *in;
+
+    for (i = 0; i < n && bytes > 0; i++) {
+        in = inputs[i];
+        stream = in->stream;
+
+        len = in->bytes_total;
+        if (len > bytes) {
+            len = bytes;
+        }
+        bytes -= len;
+
+        mk_iov_consume(in->buffer, len);
+        mk_stream_input_consume(in, len);
+
+        if (stream->cb_bytes_consumed) {
+            stream->cb_bytes_consumed(stream, len);
+        }
+        if (in->cb_consumed) {
+            in->cb_consumed(in, len);
+        }
+
+        if (in->bytes_total == 0) {
+            mk_stream_in_release(in);
+            if (mk_list_is_empty(&stream->inputs) == 0 &&
+                stream->cb_finished) {
+                stream->cb_finished(stream);
+            }
+        }
+    }
+}
+
+static ssize_t channel_write_iov_batch(struct mk_channel *channel,
+                                       struct mk_stream *stream,
+                                       struct mk_stream_input *input)
+{
+    int n;
+    ssize_t bytes;
+    struct iovec io[MK_CHANNEL_GATHER_IOV];
+    struct mk_iov out;
+    struct mk_stream_input *inputs[MK_CHANNEL_GATHER_MAX];
+
+    memset(&out, '\0', sizeof(out));
+    out.io   = io;
+    out.size = MK_CHANNEL_GATHER_IOV;
+
+    n = channel_iov_gather(channel, stream, input, inputs, &out);
+    if (n < 2) {
+        return 0;
+    }
+
+    bytes = mk_sched_conn_writev(channel, &out);
+    MK_TRACE("[CH %i] STREAM_IOV x %i, wrote %d bytes",
+             channel->fd, n, bytes);
+    if (bytes > 0) {
+        channel_iov_consume(inputs, n, bytes);
+    }
+
+    return bytes;
+}
+
 /* It perform a direct stream I/O write through the network layer */
 int mk_channel_write(struct mk_channel *channel, size_t *count)
 {
     ssize_t bytes = -1;
     struct mk_iov *iov;
+    struct mk_list *head;
     struct mk_stream *stream = NULL;
     struct mk_stream_input *input;
 
@@ -207,13 +356,40 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
         return MK_CHANNEL_EMPTY;
     }
 
-    /* Get the input source */
-    stream = mk_list_entry_first(&channel->streams, struct mk_stream, _head);
-    if (mk_list_is_empty(&stream->inputs) == 0) {
+    /*
+     * Get the input source: the streams of the responses already sent stay
+     * linked until their request ends, skip them.
+     */
+    mk_list_foreach(head, &channel->streams) {
+        stream = mk_list_entry(head, struct mk_stream, _head);
+        if (mk_list_is_empty(&stream->inputs) != 0) {
+            break;
+        }
+        stream = NULL;
+    }
+    if (!stream) {
         return MK_CHANNEL_EMPTY;
     }
     input = mk_list_entry_first(&stream->inputs, struct mk_stream_input, _head);
 
+    /* Several buffers queued in a row go out in one writev(2) */
+    if (channel->type == MK_CHANNEL_SOCKET && input->type == MK_STREAM_IOV &&
+        (input->_head.next != &stream->inputs ||
+         stream->_head.next != &channel->streams)) {
+        bytes = channel_write_iov_batch(channel, stream, input);
+        if (bytes > 0) {
+            *count = bytes;
+            MK_TRACE("[CH %i] CHANNEL_FLUSH", channel->fd);
+            return MK_CHANNEL_FLUSH;
+        }
+        else if (bytes < 0) {
+            if (errno == EAGAIN) {
+                return MK_CHANNEL_BUSY;
+            }
+            return MK_CHANNEL_ERROR;
+        }
+    }
+
     /*
      * Based on the Stream Input type we consume on that way, not all inputs
      * requires to read from buffer, e.g: Static File, Pipes.
@@ -246,6 +422,9 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
                 /* DEPRECATED: consume_raw(input, bytes); */
             }
         }
+        else if (input->type == MK_STREAM_DEFLATE) {
+            bytes = channel_write_in_deflate(channel, input);
+        }
 
         if (bytes > 0) {
             *count = bytes;
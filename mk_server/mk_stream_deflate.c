@@ -0,0 +1,390 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_info.h>
+
+#ifdef MK_HAVE_ZLIB
+
+#include <monkey/monkey.h>
+#include <monkey/mk_stream.h>
+#include <monkey/mk_stream_deflate.h>
+#include <monkey/mk_stream_deflate_tls.h>
+
+static voidpf deflate_zalloc(voidpf opaque, uInt items, uInt size)
+{
+    (void) opaque;
+    return mk_mem_alloc((size_t) items * size);
+}
+
+static void deflate_zfree(voidpf opaque, voidpf address)
+{
+    (void) opaque;
+    mk_mem_free(address);
+}
+
+static void deflate_destroy(struct mk_stream_deflate *d)
+{
+    deflateEnd(&d->strm);
+    mk_mem_free(d);
+}
+
+/* Get a compressor from the worker pool, or create a new one */
+struct mk_stream_deflate *mk_stream_deflate_get(int format, int level,
+                                                int chunked)
+{
+    int ret;
+    int bits;
+    struct mk_list *head;
+    struct mk_stream_deflate *d = NULL;
+    struct mk_stream_deflate *tmp;
+    struct mk_stream_deflate_pool *pool;
+
+    pool = MK_TLS_GET(mk_tls_stream_deflate);
+    if (!pool) {
+        pool = mk_mem_alloc(sizeof(struct mk_stream_deflate_pool));
+        if (!pool) {
+            return NULL;
+        }
+        pool->size = 0;
+        mk_list_init(&pool->list);
+        MK_TLS_SET(mk_tls_stream_deflate, pool);
+    }
+
+    mk_list_foreach(head, &pool->list) {
+        tmp = mk_list_entry(head, struct mk_stream_deflate, _head);
+        if (tmp->format == format) {
+            d = tmp;
+            break;
+        }
+    }
+
+    if (d) {
+        mk_list_del(&d->_head);
+        pool->size--;
+
+        if (d->level != level) {
+            ret = deflateParams(&d->strm, level, Z_DEFAULT_STRATEGY);
+            if (ret != Z_OK) {
+                deflate_destroy(d);
+                return NULL;
+            }
+            d->level = level;
+        }
+    }
+    else {
+        d = mk_mem_alloc(sizeof(struct mk_stream_deflate));
+        if (!d) {
+            return NULL;
+        }
+
+        d->strm.zalloc = deflate_zalloc;
+        d->strm.zfree  = deflate_zfree;
+        d->strm.opaque = Z_NULL;
+
+        /* gzip wrapper is requested adding 16 to the window bits */
+        bits = MAX_WBITS;
+        if (format == MK_STREAM_DEFLATE_GZIP) {
+            bits += 16;
+        }
+
+        ret = deflateInit2(&d->strm, level, Z_DEFLATED, bits,
+                           MK_STREAM_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            mk_mem_free(d);
+            return NULL;
+        }
+        d->format = format;
+        d->level  = level;
+    }
+
+    d->chunked  = chunked;
+    d->finished = MK_FALSE;
+    d->current  = NULL;
+    d->out_end = 0;
+
+    return d;
+}
+
+/* Return a compressor to the worker pool */
+void mk_stream_deflate_put(struct mk_stream_deflate *d)
+{
+    struct mk_stream_deflate_pool *pool;
+
+    pool = MK_TLS_GET(mk_tls_stream_deflate);
+    if (!pool || pool->size >= MK_STREAM_DEFLATE_POOL ||
+        deflateReset(&d->strm) != Z_OK) {
+        deflate_destroy(d);
+        return;
+    }
+
+    d->current = NULL;
+    mk_list_add(&d->_head, &pool->list);
+    pool->size++;
+}
+
+void mk_stream_deflate_worker_exit()
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_stream_deflate *d;
+    struct mk_stream_deflate_pool *pool;
+
+    pool = MK_TLS_GET(mk_tls_stream_deflate);
+    if (!pool) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &pool->list) {
+        d = mk_list_entry(head, struct mk_stream_deflate, _head);
+        mk_list_del(&d->_head);
+        deflate_destroy(d);
+    }
+
+    mk_mem_free(pool);
+    MK_TLS_SET(mk_tls_stream_deflate, NULL);
+}
+
+/* Get the next piece of uncompressed data from the source */
+static inline size_t deflate_src_data(struct mk_stream_deflate_src *src,
+                                      unsigned char **data, int *piece_last)
+{
+    size_t len;
+    struct mk_iov *iov;
+
+    if (src->in.type == MK_STREAM_RAW) {
+        *data = (unsigned char *) src->in.buffer + src->in.bytes_offset;
+        *piece_last = MK_TRUE;
+        return src->in.bytes_total;
+    }
+
+    iov = src->in.buffer;
+    while (src->iov_idx < iov->iov_idx) {
+        len = iov->io[src->iov_idx].iov_len - src->iov_off;
+        if (len > 0) {
+            *data = (unsigned char *) iov->io[src->iov_idx].iov_base +
+                src->iov_off;
+            *piece_last = (len == src->in.bytes_total);
+            return len;
+        }
+        src->iov_idx++;
+        src->iov_off = 0;
+    }
+
+    *data = NULL;
+    *piece_last = MK_TRUE;
+    return 0;
+}
+
+static inline void deflate_src_consume(struct mk_stream_deflate_src *src,
+                                       size_t bytes)
+{
+    src->in.bytes_total -= bytes;
+    if (src->in.type == MK_STREAM_RAW) {
+        src->in.bytes_offset += bytes;
+    }
+    else {
+        src->iov_off += bytes;
+    }
+}
+
+/*
+ * Compress the next piece of the input source into the output buffer. It
+ * sets the input bytes_total to the number of bytes ready to be written,
+ * zero means the input is complete.
+ */
+int mk_stream_deflate_fill(struct mk_stream_input *in)
+{
+    int ret;
+    int flush;
+    int piece_last;
+    int len;
+    size_t hdr;
+    size_t room;
+    size_t start;
+    size_t end;
+    size_t size;
+    size_t bytes;
+    char hex[16];
+    unsigned char *data;
+    z_stream *z;
+    struct mk_stream_deflate *d = in->context;
+    struct mk_stream_deflate_src *src = in->buffer;
+
+    d->current = in;
+    if (src->done == MK_TRUE) {
+        in->bytes_total = 0;
+        return 0;
+    }
+
+    hdr = 0;
+    room = MK_STREAM_DEFLATE_BUF;
+    if (d->chunked == MK_TRUE) {
+        hdr = MK_STREAM_DEFLATE_CHUNK_HDR;
+        room -= (MK_STREAM_DEFLATE_CHUNK_HDR + MK_STREAM_DEFLATE_CHUNK_END);
+    }
+
+    z = &d->strm;
+    z->next_out  = (unsigned char *) d->out + hdr;
+    z->avail_out = room;
+
+    while (z->avail_out > 0) {
+        size = deflate_src_data(src, &data, &piece_last);
+        if (piece_last == MK_TRUE) {
+            flush = (src->last == MK_TRUE) ? Z_FINISH : Z_SYNC_FLUSH;
+        }
+        else {
+            flush = Z_NO_FLUSH;
+        }
+
+        z->next_in  = data;
+        z->avail_in = size;
+        ret = deflate(z, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return -1;
+        }
+
+        bytes = size - z->avail_in;
+        deflate_src_consume(src, bytes);
+
+        if (flush == Z_NO_FLUSH || src->in.bytes_total > 0) {
+            continue;
+        }
+
+        /*
+         * Everything was consumed: the flush is complete once zlib did not
+         * fill the output buffer, or when there was nothing left to do.
+         */
+        if ((flush == Z_FINISH && ret == Z_STREAM_END) ||
+            (flush == Z_SYNC_FLUSH && z->avail_out > 0) ||
+            ret == Z_BUF_ERROR) {
+            src->done = MK_TRUE;
+            break;
+        }
+    }
+
+    bytes = room - z->avail_out;
+    start = hdr;
+    end = hdr + bytes;
+
+    /* HTTP chunk framing */
+    if (d->chunked == MK_TRUE) {
+        if (bytes > 0) {
+            len = snprintf(hex, sizeof(hex), "%zX\r\n", bytes);
+            start = hdr - len;
+            memcpy(d->out + start, hex, len);
+            d->out[end++] = '\r';
+            d->out[end++] = '\n';
+        }
+        if (src->done == MK_TRUE && src->last == MK_TRUE) {
+            memcpy(d->out + end, "0\r\n\r\n", 5);
+            end += 5;
+        }
+    }
+
+    d->out_end = end;
+    in->bytes_total = end - start;
+
+    return 0;
+}
+
+/* Refill the output buffer once the channel consumed it */
+static void cb_deflate_consumed(struct mk_stream_input *in, long bytes)
+{
+    (void) bytes;
+
+    if (in->bytes_total == 0) {
+        if (mk_stream_deflate_fill(in) == -1) {
+            in->bytes_total = 0;
+        }
+    }
+}
+
+static void cb_deflate_finished(struct mk_stream_input *in)
+{
+    struct mk_stream_deflate *d = in->context;
+    struct mk_stream_deflate_src *src = in->buffer;
+
+    if (src->in.cb_finished) {
+        src->in.cb_finished(&src->in);
+    }
+    mk_mem_free(src);
+
+    if (d->current == in) {
+        d->current = NULL;
+    }
+}
+
+/*
+ * Queue a RAW or IOV buffer to be compressed through 'd'. If 'last' is set
+ * the compressed stream is finished after this input.
+ */
+int mk_stream_in_deflate(struct mk_stream *stream,
+                         struct mk_stream_input *in,
+                         struct mk_stream_deflate *d,
+                         int type, void *buffer, size_t size, int last,
+                         void (*cb_finished)(struct mk_stream_input *))
+{
+    int ret;
+    struct mk_iov *iov;
+    struct mk_stream_deflate_src *src;
+
+    /* Nothing can be added once the compressed stream is finished */
+    if (d->finished == MK_TRUE) {
+        return 0;
+    }
+
+    src = mk_mem_alloc_z(sizeof(struct mk_stream_deflate_src));
+    if (!src) {
+        return -1;
+    }
+
+    if (type == MK_STREAM_IOV) {
+        iov = buffer;
+        size = iov->total_len;
+    }
+
+    src->in.type        = type;
+    src->in.fd          = -1;
+    src->in.buffer      = buffer;
+    src->in.bytes_total = size;
+    src->in.cb_finished = cb_finished;
+    src->in.stream      = stream;
+    src->last           = last;
+    mk_list_init(&src->in._head);
+
+    /*
+     * Until the compression of this input starts, bytes_total holds the
+     * uncompressed length (at least one byte to finish the stream).
+     */
+    ret = mk_stream_input(stream, in, MK_STREAM_DEFLATE, -1,
+                          src, size > 0 ? size : 1, 0,
+                          cb_deflate_consumed, cb_deflate_finished);
+    if (ret != 0) {
+        mk_mem_free(src);
+        return -1;
+    }
+
+    in = mk_list_entry_last(&stream->inputs, struct mk_stream_input, _head);
+    in->context = d;
+    d->finished = last;
+
+    return 0;
+}
+
+#endif /* MK_HAVE_ZLIB */
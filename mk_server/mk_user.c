@@ -24,22 +24,338 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_config.h>
+#include <monkey/mk_clock.h>
+#include <monkey/mk_user_tls.h>
 
 #include <pwd.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <grp.h>
 
+static inline unsigned int user_hash(const char *name, size_t len)
+{
+    size_t i;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static inline void user_entry_free(struct mk_user_entry *entry)
+{
+    if (entry->home) {
+        mk_mem_free(entry->home);
+    }
+    mk_mem_free(entry->name);
+    mk_mem_free(entry);
+}
+
+/* Find a cached user, it must be called under the cache lock */
+static struct mk_user_entry *user_find(struct mk_user_cache *cache,
+                                       char *name, size_t len,
+                                       unsigned int hash)
+{
+    struct mk_list *head;
+    struct mk_user_entry *entry;
+
+    mk_list_foreach(head, &cache->buckets[hash % MK_USER_CACHE_BUCKETS]) {
+        entry = mk_list_entry(head, struct mk_user_entry, _head);
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Register a new user and queue it to the resolver, the least recently
+ * used entries already resolved are released. It returns NULL if the
+ * resolver has too many users waiting. Called under the cache lock.
+ */
+static struct mk_user_entry *user_queue(struct mk_user_cache *cache,
+                                        char *name, size_t len,
+                                        unsigned int hash)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_user_entry *entry;
+
+    if (cache->pending >= MK_USER_CACHE_PENDING) {
+        return NULL;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->lru) {
+        if (cache->entries < MK_USER_CACHE_SIZE) {
+            break;
+        }
+        entry = mk_list_entry(head, struct mk_user_entry, _lru);
+        mk_list_del(&entry->_head);
+        mk_list_del(&entry->_lru);
+        user_entry_free(entry);
+        cache->entries--;
+    }
+
+    entry = mk_mem_alloc_z(sizeof(struct mk_user_entry));
+    if (!entry) {
+        return NULL;
+    }
+    entry->name = mk_string_copy_substr(name, 0, len);
+    if (!entry->name) {
+        mk_mem_free(entry);
+        return NULL;
+    }
+    entry->len = len;
+    entry->hash = hash;
+    entry->state = MK_USER_PENDING;
+
+    mk_list_add(&entry->_head, &cache->buckets[hash % MK_USER_CACHE_BUCKETS]);
+    mk_list_add(&entry->_lru, &cache->queue);
+    cache->entries++;
+    cache->pending++;
+    pthread_cond_signal(&cache->cond);
+
+    return entry;
+}
+
+/* Resolve the queued users out of the workers event loop */
+static void user_resolver(struct mk_user_cache *cache)
+{
+    int ret;
+    long size;
+    char *buf;
+    char *home;
+    struct passwd pwd;
+    struct passwd *result;
+    struct mk_user_entry *entry;
+
+    mk_utils_worker_rename("monkey: users");
+
+    size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    if (size <= 0) {
+        size = 16384;
+    }
+
+    buf = mk_mem_alloc(size);
+    if (!buf) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    while (cache->exit == MK_FALSE) {
+        if (mk_list_is_empty(&cache->queue) == 0) {
+            pthread_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+
+        /* The entry stays in its bucket, only resolved entries are evicted */
+        entry = mk_list_entry_first(&cache->queue, struct mk_user_entry, _lru);
+        mk_list_del(&entry->_lru);
+        mk_list_init(&entry->_lru);
+        pthread_mutex_unlock(&cache->lock);
+
+        home = NULL;
+        ret = getpwnam_r(entry->name, &pwd, buf, size, &result);
+        if (ret == 0 && result) {
+            home = mk_string_dup(result->pw_dir);
+        }
+
+        MK_TRACE("user '%s' resolved: %s", entry->name, home ? home : "none");
+
+        pthread_mutex_lock(&cache->lock);
+        if (entry->home) {
+            mk_mem_free(entry->home);
+            entry->home = NULL;
+        }
+        entry->refresh = MK_FALSE;
+        if (home) {
+            entry->home = home;
+            entry->state = MK_USER_FOUND;
+            entry->expire = log_current_utime + cache->ttl;
+        }
+        else {
+            entry->state = MK_USER_NONE;
+            entry->expire = log_current_utime + cache->neg_ttl;
+        }
+        mk_list_add(&entry->_lru, &cache->lru);
+        cache->pending--;
+        pthread_mutex_unlock(&cache->lock);
+
+        /* Wake up the requests waiting for it */
+        mk_sched_send_signal(cache->server, MK_SCHED_SIGNAL_USER);
+
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    mk_mem_free(buf);
+}
+
+int mk_user_cache_init(struct mk_server *server)
+{
+    int i;
+    struct mk_user_cache *cache;
+
+    cache = mk_mem_alloc_z(sizeof(struct mk_user_cache));
+    if (!cache) {
+        return -1;
+    }
+
+    cache->ttl = server->user_cache_ttl;
+    cache->neg_ttl = server->user_cache_neg_ttl;
+    cache->exit = MK_FALSE;
+    cache->server = server;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    mk_list_init(&cache->lru);
+    mk_list_init(&cache->queue);
+    for (i = 0; i < MK_USER_CACHE_BUCKETS; i++) {
+        mk_list_init(&cache->buckets[i]);
+    }
+
+    if (mk_utils_worker_spawn((void *) user_resolver, cache,
+                              &cache->tid) != 0) {
+        pthread_mutex_destroy(&cache->lock);
+        pthread_cond_destroy(&cache->cond);
+        mk_mem_free(cache);
+        return -1;
+    }
+
+    server->user_cache = cache;
+    return 0;
+}
+
+void mk_user_cache_exit(struct mk_server *server)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_user_entry *entry;
+    struct mk_user_cache *cache = server->user_cache;
+
+    if (!cache) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->exit = MK_TRUE;
+    pthread_cond_signal(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->tid, NULL);
+
+    for (i = 0; i < MK_USER_CACHE_BUCKETS; i++) {
+        mk_list_foreach_safe(head, tmp, &cache->buckets[i]) {
+            entry = mk_list_entry(head, struct mk_user_entry, _head);
+            mk_list_del(&entry->_head);
+            user_entry_free(entry);
+        }
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->cond);
+    mk_mem_free(cache);
+    server->user_cache = NULL;
+}
+
+/*
+ * Get the home directory of a user from the cache. Unknown users are
+ * queued to the resolver and MK_USER_PENDING is returned, expired ones are
+ * queued too but their last answer is returned meanwhile. The path is only
+ * set for MK_USER_FOUND. It returns -1 if the resolver is saturated.
+ */
+static int user_lookup(struct mk_user_cache *cache, char *name, size_t len,
+                       char **home)
+{
+    int state;
+    unsigned int hash;
+    struct mk_user_entry *entry;
+
+    hash = user_hash(name, len);
+
+    pthread_mutex_lock(&cache->lock);
+    entry = user_find(cache, name, len, hash);
+    if (entry && entry->state != MK_USER_PENDING &&
+        entry->refresh == MK_FALSE && entry->expire <= log_current_utime &&
+        cache->pending < MK_USER_CACHE_PENDING) {
+        /* Expired, resolve it again but keep serving it until then */
+        entry->refresh = MK_TRUE;
+        mk_list_del(&entry->_lru);
+        mk_list_add(&entry->_lru, &cache->queue);
+        cache->pending++;
+        pthread_cond_signal(&cache->cond);
+    }
+    else if (!entry) {
+        entry = user_queue(cache, name, len, hash);
+        if (!entry) {
+            pthread_mutex_unlock(&cache->lock);
+            return -1;
+        }
+    }
+
+    state = entry->state;
+    if (state == MK_USER_FOUND) {
+        *home = mk_string_dup(entry->home);
+        if (entry->refresh == MK_FALSE) {
+            mk_list_del(&entry->_lru);
+            mk_list_add(&entry->_lru, &cache->lru);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (state == MK_USER_FOUND && !*home) {
+        return MK_USER_NONE;
+    }
+
+    return state;
+}
+
+/*
+ * Wait for the resolver: the connection sleeps, no more data is read and
+ * the responses queued before this request are held to keep their order.
+ */
+static int user_wait(struct mk_http_session *cs, struct mk_http_request *sr)
+{
+    struct mk_list *list;
+
+    list = MK_TLS_GET(mk_tls_user_wait);
+    if (!list) {
+        list = mk_mem_alloc(sizeof(struct mk_list));
+        if (!list) {
+            return -1;
+        }
+        mk_list_init(list);
+        MK_TLS_SET(mk_tls_user_wait, list);
+    }
+
+    sr->user_wait = MK_TRUE;
+    mk_list_add(&sr->_user_head, list);
+    mk_event_add(mk_sched_loop(), cs->socket, MK_EVENT_CONNECTION,
+                 MK_EVENT_SLEEP, cs->channel->event);
+    return 0;
+}
+
+/*
+ * Map a /~user request to the public directory of the user home. It
+ * returns MK_USER_WAIT if the user is being resolved, the request then
+ * continues through mk_user_resume(), or MK_USER_BUSY if the resolver
+ * cannot take more users.
+ */
 int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
                  struct mk_server *server)
 {
+    int ret;
     int limit;
     const int offset = 2; /* The user is defined after the '/~' string, so offset = 2 */
     const int user_len = 255;
-    char user[user_len], *user_uri;
-    struct passwd *s_user;
+    char *home = NULL;
+    char *user_uri;
 
-    if (sr->uri_processed.len <= 2) {
+    if (sr->uri_processed.len <= 2 || !server->user_cache) {
         return -1;
     }
 
@@ -54,20 +370,28 @@ int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
         return -1;
     }
 
-    memcpy(user, sr->uri_processed.data + offset, limit);
-    user[limit] = '\0';
-
-    MK_TRACE("user: '%s'", user);
+    MK_TRACE("user: '%.*s'", limit, sr->uri_processed.data + offset);
 
     /* Check system user */
-    if ((s_user = getpwnam(user)) == NULL) {
-        mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr, server);
+    ret = user_lookup(server->user_cache, sr->uri_processed.data + offset,
+                      limit, &home);
+    if (ret == -1) {
+        return MK_USER_BUSY;
+    }
+    else if (ret == MK_USER_PENDING) {
+        if (user_wait(cs, sr) == -1) {
+            return -1;
+        }
+        return MK_USER_WAIT;
+    }
+    else if (ret != MK_USER_FOUND) {
         return -1;
     }
 
     if (sr->uri_processed.len > (unsigned int) (offset+limit)) {
         user_uri = mk_mem_alloc(sr->uri_processed.len);
         if (!user_uri) {
+            mk_mem_free(home);
             return -1;
         }
 
@@ -78,18 +402,72 @@ int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr,
 
         mk_string_build(&sr->real_path.data, &sr->real_path.len,
                         "%s/%s%s",
-                        s_user->pw_dir, server->conf_user_pub, user_uri);
+                        home, server->conf_user_pub, user_uri);
         mk_mem_free(user_uri);
     }
     else {
         mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s", s_user->pw_dir, server->conf_user_pub);
+                        "%s/%s", home, server->conf_user_pub);
     }
+    mk_mem_free(home);
 
     sr->user_home = MK_TRUE;
     return 0;
 }
 
+/*
+ * MK_SCHED_SIGNAL_USER handler, it runs in the worker context: the
+ * requests of the users resolved so far continue.
+ */
+void mk_user_resume(struct mk_sched_worker *sched, struct mk_server *server)
+{
+    int ret;
+    struct mk_list queue;
+    struct mk_list *list;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_http_request *sr;
+    struct mk_sched_conn *conn;
+
+    list = MK_TLS_GET(mk_tls_user_wait);
+    if (!list || mk_list_is_empty(list) == 0) {
+        return;
+    }
+
+    /* A request may wait again if its entry expired meanwhile */
+    mk_list_init(&queue);
+    mk_list_foreach_safe(head, tmp, list) {
+        sr = mk_list_entry(head, struct mk_http_request, _user_head);
+        mk_list_del(&sr->_user_head);
+        mk_list_add(&sr->_user_head, &queue);
+    }
+
+    mk_list_foreach_safe(head, tmp, &queue) {
+        sr = mk_list_entry(head, struct mk_http_request, _user_head);
+        mk_list_del(&sr->_user_head);
+        sr->user_wait = MK_FALSE;
+
+        conn = sr->session->conn;
+        ret = mk_http_request_continue(sr->session, sr, server);
+        if (ret == -1 && conn->status != MK_SCHED_CONN_CLOSED) {
+            mk_sched_event_close(conn, sched, MK_EP_SOCKET_CLOSED, server);
+        }
+    }
+}
+
+void mk_user_worker_exit()
+{
+    struct mk_list *list;
+
+    list = MK_TLS_GET(mk_tls_user_wait);
+    if (!list) {
+        return;
+    }
+
+    mk_mem_free(list);
+    MK_TLS_SET(mk_tls_user_wait, NULL);
+}
+
 /* Change process user */
 int mk_user_set_uidgid(struct mk_server *server)
 {
@@ -45,6 +45,13 @@
 
 #define MK_UTILS_GMT_DATEFORMAT "%a, %d %b %Y %H:%M:%S GMT"
 
+/* Obsolete HTTP-date formats (RFC 7231, section 7.1.1.1) */
+#define MK_UTILS_RFC850_DATEFORMAT  "%A, %d-%b-%y %H:%M:%S GMT"
+#define MK_UTILS_ASCTIME_DATEFORMAT "%a %b %e %H:%M:%S %Y"
+
+/* IMF-fixdate length, e.g: Sun, 06 Nov 1994 08:49:37 GMT */
+#define MK_UTILS_GMT_DATE_LEN  29
+
 /* Date helpers */
 static const char mk_date_wd[][6]  = {"Sun, ", "Mon, ", "Tue, ", "Wed, ", "Thu, ", "Fri, ", "Sat, "};
 static const char mk_date_ym[][5] = {"Jan ", "Feb ", "Mar ", "Apr ", "May ", "Jun ", "Jul ",
@@ -178,19 +185,103 @@ int mk_utils_utime2gmt(char **data, time_t date)
     return size;
 }
 
-time_t mk_utils_gmt2utime(char *date)
+/* Two digits number, -1 if any of them is not a digit */
+static inline int mk_utils_2digits(char *p)
+{
+    if (p[0] < '0' || p[0] > '9' || p[1] < '0' || p[1] > '9') {
+        return -1;
+    }
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+/* Days since 1970-01-01 of a date in the proleptic Gregorian calendar */
+static inline long mk_utils_days_from_civil(int y, int m, int d)
+{
+    long era;
+    unsigned int yoe;
+    unsigned int doy;
+    unsigned int doe;
+
+    y -= (m <= 2);
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = (unsigned int) (y - era * 400);
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (long) doe - 719468;
+}
+
+/*
+ * Convert a HTTP-date to Unix time. The IMF-fixdate format sent by every
+ * modern client is parsed by hand with fixed offsets; the obsolete RFC 850
+ * and asctime() formats fall back to strptime(3).
+ */
+time_t mk_utils_gmt2utime(char *date, int len)
 {
-    time_t new_unix_time;
+    int i;
+    int mday;
+    int mon = -1;
+    int century;
+    int year;
+    int hour;
+    int min;
+    int sec;
+    char buf[64];
     struct tm t_data;
-    memset(&t_data, 0, sizeof(struct tm));
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    if (len == MK_UTILS_GMT_DATE_LEN) {
+        /* Sun, 06 Nov 1994 08:49:37 GMT */
+        if (date[3] != ',' || date[4] != ' ' || date[7] != ' ' ||
+            date[11] != ' ' || date[16] != ' ' || date[19] != ':' ||
+            date[22] != ':' || strncmp(date + 25, " GMT", 4) != 0) {
+            return -1;
+        }
 
-    if (!strptime(date, MK_UTILS_GMT_DATEFORMAT, (struct tm *) &t_data)) {
+        for (i = 0; i < 12; i++) {
+            if (strncmp(date + 8, months + (i * 3), 3) == 0) {
+                mon = i + 1;
+                break;
+            }
+        }
+
+        mday    = mk_utils_2digits(date + 5);
+        century = mk_utils_2digits(date + 12);
+        year    = mk_utils_2digits(date + 14);
+        hour    = mk_utils_2digits(date + 17);
+        min     = mk_utils_2digits(date + 20);
+        sec     = mk_utils_2digits(date + 23);
+
+        /* Both halves of the year must be digits, e.g: not '199x' */
+        if (century < 0 || year < 0) {
+            return -1;
+        }
+        year += century * 100;
+
+        if (mon == -1 || mday < 1 || mday > 31 || year < 1970 ||
+            hour < 0 || hour > 23 || min < 0 || min > 59 ||
+            sec < 0 || sec > 60) {
+            return -1;
+        }
+
+        return (time_t) mk_utils_days_from_civil(year, mon, mday) * 86400 +
+            hour * 3600 + min * 60 + sec;
+    }
+
+    /* Obsolete formats */
+    if (len <= 0 || len >= (int) sizeof(buf)) {
         return -1;
     }
+    memcpy(buf, date, len);
+    buf[len] = '\0';
 
-    new_unix_time = timegm((struct tm *) &t_data);
+    memset(&t_data, 0, sizeof(struct tm));
+    if (!strptime(buf, MK_UTILS_RFC850_DATEFORMAT, &t_data) &&
+        !strptime(buf, MK_UTILS_ASCTIME_DATEFORMAT, &t_data)) {
+        return -1;
+    }
 
-    return (new_unix_time);
+    return timegm(&t_data);
 }
 
 int mk_buffer_cat(mk_ptr_t *p, char *buf1, int len1, char *buf2, int len2)
@@ -24,6 +24,11 @@
 #include <monkey/mk_vhost_tls.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_http_status.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_vhost_matcher.h>
+#include <monkey/mk_vhost_rewrite.h>
+#include <monkey/mk_http_upload.h>
+#include <monkey/mk_vhost_cache.h>
 #include <monkey/mk_info.h>
 
 #include <sys/stat.h>
@@ -297,6 +302,11 @@ int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server)
     int off;
     unsigned int hash;
 
+    /* The open file cache owns a shared descriptor for this resource */
+    if (sr->file_cache) {
+        return mk_file_cache_open(sr->file_cache);
+    }
+
     off = sr->host_conf->documentroot.len;
     hash = mk_utils_gen_hash(sr->real_path.data + off,
                              sr->real_path.len - off);
@@ -307,6 +317,12 @@ int mk_vhost_open(struct mk_http_request *sr, struct mk_server *server)
 
 int mk_vhost_close(struct mk_http_request *sr, struct mk_server *server)
 {
+    if (sr->file_cache) {
+        mk_file_cache_release(sr->file_cache);
+        sr->file_cache = NULL;
+        return 0;
+    }
+
     return mk_vhost_fdt_close(sr, server);
 }
 
@@ -325,6 +341,8 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
     h->name = NULL;
     h->cb   = cb;
     h->data = data;
+    h->stream_body = MK_FALSE;
+    h->pool = NULL;
     mk_list_init(&h->params);
 
     ret = str_to_regex(match, &h->match);
@@ -332,6 +350,7 @@ struct mk_vhost_handler *mk_vhost_handler_match(char *match,
         mk_mem_free(h);
         return NULL;
     }
+    h->pattern = mk_string_dup(match);
 
     return h;
 }
@@ -352,7 +371,13 @@ struct mk_vhost *mk_vhost_read(char *path)
     struct mk_rconf *cnf;
     struct mk_rconf_section *section_host;
     struct mk_rconf_section *section_ep;
+    struct mk_rconf_section *section_cmp;
     struct mk_rconf_section *section_handlers;
+    struct mk_rconf_section *section_rewrite;
+    struct mk_rconf_section *section_upload;
+    struct mk_http_upload_rule *upload;
+    struct mk_rconf_section *section_cache;
+    struct mk_vhost_cache_rule *cache_rule;
     struct mk_rconf_entry *entry_ep;
     struct mk_string_line *entry;
     struct mk_list *head, *list, *line;
@@ -387,6 +412,15 @@ struct mk_vhost *mk_vhost_read(char *path)
     /* Init list for content handlers */
     mk_list_init(&host->handlers);
 
+    /* Init list for upload locations */
+    mk_list_init(&host->uploads);
+
+    /* Init list for cache policy rules */
+    mk_list_init(&host->cache_rules);
+
+    /* Compression defaults */
+    mk_vhost_compression_init(host);
+
     /* Lookup Servername */
     list = mk_rconf_section_get_key(section_host, "Servername", MK_RCONF_LIST);
     if (!list) {
@@ -457,6 +491,11 @@ struct mk_vhost *mk_vhost_read(char *path)
         mk_mem_free(tmp);
     }
 
+    /* Worker pool */
+    host->worker_pool = mk_rconf_section_get_key(section_host,
+                                                 "WorkerPool",
+                                                 MK_RCONF_STR);
+
     /* Error Pages */
     section_ep = mk_rconf_section_get(cnf, "ERROR_PAGES");
     if (section_ep) {
@@ -492,6 +531,91 @@ struct mk_vhost *mk_vhost_read(char *path)
         }
     }
 
+    /* Compression */
+    section_cmp = mk_rconf_section_get(cnf, "COMPRESSION");
+    if (section_cmp) {
+        ret = (size_t) mk_rconf_section_get_key(section_cmp,
+                                                "Enabled", MK_RCONF_BOOL);
+        if (ret == -1) {
+            mk_err("[Host Compression] invalid Enabled value in %s", path);
+        }
+        else {
+            host->compression.enabled = ret;
+        }
+
+        tmp = mk_rconf_section_get_key(section_cmp, "Level", MK_RCONF_STR);
+        if (tmp) {
+            ret = atoi(tmp);
+            if (ret < 1 || ret > 9) {
+                mk_err("[Host Compression] Level must be between 1 and 9");
+            }
+            else {
+                host->compression.level = ret;
+            }
+            mk_mem_free(tmp);
+        }
+
+        tmp = mk_rconf_section_get_key(section_cmp, "MinSize", MK_RCONF_STR);
+        if (tmp) {
+            host->compression.min_size = atol(tmp);
+            mk_mem_free(tmp);
+        }
+
+        tmp = mk_rconf_section_get_key(section_cmp, "Types", MK_RCONF_STR);
+        if (tmp) {
+            mk_vhost_compression_types(host, tmp);
+            mk_mem_free(tmp);
+        }
+    }
+
+    /* Rewrite and redirect rules */
+    section_rewrite = mk_rconf_section_get(cnf, "REWRITE");
+    if (section_rewrite && mk_list_is_empty(&section_rewrite->entries) != 0) {
+        host->rewrite = mk_vhost_rewrite_create(section_rewrite, path);
+        if (!host->rewrite) {
+            mk_err("[Host Rewrite] invalid rules in %s", path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Upload locations */
+    section_upload = mk_rconf_section_get(cnf, "UPLOAD");
+    if (section_upload) {
+        mk_list_foreach(head, &section_upload->entries) {
+            entry_ep = mk_list_entry(head, struct mk_rconf_entry, _head);
+            if (strcasecmp(entry_ep->key, "Location") != 0) {
+                mk_err("[Host Upload] invalid key '%s' in %s",
+                       entry_ep->key, path);
+                exit(EXIT_FAILURE);
+            }
+
+            upload = mk_http_upload_rule_create(entry_ep->val);
+            if (!upload) {
+                exit(EXIT_FAILURE);
+            }
+            mk_list_add(&upload->_head, &host->uploads);
+        }
+    }
+
+    /* Cache policy */
+    section_cache = mk_rconf_section_get(cnf, "CACHE");
+    if (section_cache) {
+        mk_list_foreach(head, &section_cache->entries) {
+            entry_ep = mk_list_entry(head, struct mk_rconf_entry, _head);
+            if (strcasecmp(entry_ep->key, "Rule") != 0) {
+                mk_err("[Host Cache] invalid key '%s' in %s",
+                       entry_ep->key, path);
+                exit(EXIT_FAILURE);
+            }
+
+            cache_rule = mk_vhost_cache_rule_create(host, entry_ep->val);
+            if (!cache_rule) {
+                exit(EXIT_FAILURE);
+            }
+            mk_list_add(&cache_rule->_head, &host->cache_rules);
+        }
+    }
+
     /* Handlers */
     int i;
     int params;
@@ -513,6 +637,7 @@ struct mk_vhost *mk_vhost_read(char *path)
                 exit(EXIT_FAILURE);
             }
             h_handler->cb = NULL;
+            h_handler->pool = NULL;
             mk_list_init(&h_handler->params);
 
             i = 0;
@@ -525,6 +650,7 @@ struct mk_vhost *mk_vhost_read(char *path)
                     if (ret == -1) {
                         return NULL;
                     }
+                    h_handler->pattern = mk_string_dup(entry->val);
                     break;
                 case 1:
                     h_handler->name = mk_string_dup(entry->val);
@@ -582,6 +708,7 @@ int mk_vhost_map_handlers(struct mk_server *server)
             }
 
             h_handler->handler = p;
+            h_handler->pool = mk_config_pool_handler(h_handler->name, server);
             n++;
         }
     }
@@ -589,6 +716,67 @@ int mk_vhost_map_handlers(struct mk_server *server)
     return n;
 }
 
+/* Compile the handlers match rules of every virtual host */
+int mk_vhost_matchers_init(struct mk_server *server)
+{
+    struct mk_list *head;
+    struct mk_vhost *host;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        mk_vhost_matcher_destroy(host->matcher);
+        host->matcher = mk_vhost_matcher_create(&host->handlers);
+        if (!host->matcher) {
+            mk_err("Virtual host: could not compile the handlers rules");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find the first handler matching the URI (NULL terminated). Without a
+ * compiled matcher, every rule is evaluated in order.
+ */
+struct mk_vhost_handler *mk_vhost_handler_lookup(struct mk_vhost *host,
+                                                 char *uri, size_t len)
+{
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+
+    if (host->matcher) {
+        return mk_vhost_matcher_lookup(host->matcher, uri, len);
+    }
+
+    mk_list_foreach(head, &host->handlers) {
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+        if (regexec(&h->match, uri, 0, NULL, 0) == 0) {
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+/* Next handler after 'h' matching the URI, used when a handler declines */
+struct mk_vhost_handler *mk_vhost_handler_next(struct mk_vhost *host,
+                                               struct mk_vhost_handler *h,
+                                               char *uri)
+{
+    struct mk_list *head;
+    struct mk_vhost_handler *next;
+
+    for (head = h->_head.next; head != &host->handlers; head = head->next) {
+        next = mk_list_entry(head, struct mk_vhost_handler, _head);
+        if (regexec(&next->match, uri, 0, NULL, 0) == 0) {
+            return next;
+        }
+    }
+
+    return NULL;
+}
+
 void mk_vhost_set_single(char *path, struct mk_server *server)
 {
     struct mk_vhost *host;
@@ -608,6 +796,7 @@ void mk_vhost_set_single(char *path, struct mk_server *server)
     host->documentroot.data = mk_string_dup(path);
     host->documentroot.len = strlen(path);
     host->header_redirect.data = NULL;
+    mk_vhost_compression_init(host);
 
     /* Validate document root configured */
     if (stat(host->documentroot.data, &checkdir) == -1) {
@@ -620,6 +809,8 @@ void mk_vhost_set_single(char *path, struct mk_server *server)
     }
     mk_list_add(&host->_head, &server->hosts);
     mk_list_init(&host->handlers);
+    mk_list_init(&host->uploads);
+    mk_list_init(&host->cache_rules);
 }
 
 /* Given a configuration directory, start reading the virtual host entries */
@@ -631,6 +822,7 @@ void mk_vhost_init(char *path, struct mk_server *server)
     char *sites = 0;
     char *file;
     struct mk_vhost *p_host;     /* debug */
+    struct mk_list *head;
     struct dirent *ent;
     struct file_info f_info;
     int ret;
@@ -697,6 +889,21 @@ void mk_vhost_init(char *path, struct mk_server *server)
     }
     closedir(dir);
     mk_mem_free(sites);
+
+    /* Map the worker pools serving a whole virtual host */
+    mk_list_foreach(head, &server->hosts) {
+        p_host = mk_list_entry(head, struct mk_vhost, _head);
+        if (!p_host->worker_pool) {
+            continue;
+        }
+
+        p_host->pool = mk_config_pool_get(p_host->worker_pool, server);
+        if (!p_host->pool) {
+            mk_err("[Host] WorkerPool '%s' is not defined in %s",
+                   p_host->worker_pool, p_host->file);
+            exit(EXIT_FAILURE);
+        }
+    }
 }
 
 
@@ -725,6 +932,89 @@ int mk_vhost_get(mk_ptr_t host, struct mk_vhost **vhost,
     return -1;
 }
 
+void mk_vhost_compression_init(struct mk_vhost *host)
+{
+    host->compression.enabled  = MK_FALSE;
+    host->compression.level    = MK_VHOST_COMPRESSION_LEVEL;
+    host->compression.min_size = MK_VHOST_COMPRESSION_MIN_SIZE;
+    host->compression.types    = NULL;
+    mk_vhost_compression_types(host, MK_VHOST_COMPRESSION_TYPES);
+}
+
+/* Set the space separated list of mime types that can be compressed */
+int mk_vhost_compression_types(struct mk_vhost *host, char *types)
+{
+    struct mk_list *list;
+
+    list = mk_string_split_line(types);
+    if (!list) {
+        return -1;
+    }
+
+    if (host->compression.types) {
+        mk_string_split_free(host->compression.types);
+    }
+    host->compression.types = list;
+
+    return 0;
+}
+
+/*
+ * Check if a 'Content-Type: ...' header row matches the compression
+ * rules of the virtual host. Parameters such as charset are ignored.
+ */
+int mk_vhost_compression_match(struct mk_vhost *host, mk_ptr_t *row)
+{
+    int len;
+    char *p;
+    char *end;
+    struct mk_list *head;
+    struct mk_string_line *type;
+
+    if (!host->compression.types || !row->data || row->len <= 0) {
+        return MK_FALSE;
+    }
+
+    p = memchr(row->data, ':', row->len);
+    if (!p) {
+        return MK_FALSE;
+    }
+    end = row->data + row->len;
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    len = 0;
+    while (p + len < end && p[len] != ';' && p[len] != ' ' &&
+           p[len] != '\r' && p[len] != '\n') {
+        len++;
+    }
+    if (len == 0) {
+        return MK_FALSE;
+    }
+
+    mk_list_foreach(head, host->compression.types) {
+        type = mk_list_entry(head, struct mk_string_line, _head);
+
+        /* wildcard subtype, e.g: 'text/' followed by an asterisk */
+        if (type->len >= 2 && type->val[type->len - 1] == '*' &&
+            type->val[type->len - 2] == '/') {
+            if (len >= type->len - 1 &&
+                strncasecmp(p, type->val, type->len - 1) == 0) {
+                return MK_TRUE;
+            }
+            continue;
+        }
+
+        if (len == type->len && strncasecmp(p, type->val, len) == 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
 static void mk_vhost_handler_free(struct mk_vhost_handler *h)
 {
     struct mk_list *tmp;
@@ -740,6 +1030,7 @@ static void mk_vhost_handler_free(struct mk_vhost_handler *h)
     }
 
     regfree(&h->match);
+    mk_mem_free(h->pattern);
     mk_mem_free(h->name);
     mk_mem_free(h);
 }
@@ -750,6 +1041,8 @@ void mk_vhost_free_all(struct mk_server *server)
     struct mk_vhost_alias *host_alias;
     struct mk_vhost_handler *host_handler;
     struct mk_vhost_error_page *ep;
+    struct mk_http_upload_rule *upload;
+    struct mk_vhost_cache_rule *cache_rule;
     struct mk_list *head;
     struct mk_list *tmp;
     struct mk_list *head2;
@@ -767,11 +1060,30 @@ void mk_vhost_free_all(struct mk_server *server)
         }
 
         /* Handlers */
+        mk_vhost_matcher_destroy(host->matcher);
         mk_list_foreach_safe(head2, tmp2, &host->handlers) {
             host_handler = mk_list_entry(head2, struct mk_vhost_handler, _head);
             mk_vhost_handler_free(host_handler);
         }
 
+        /* Rewrite rules */
+        mk_vhost_rewrite_destroy(host->rewrite);
+
+        /* Upload locations */
+        mk_list_foreach_safe(head2, tmp2, &host->uploads) {
+            upload = mk_list_entry(head2, struct mk_http_upload_rule, _head);
+            mk_list_del(&upload->_head);
+            mk_http_upload_rule_free(upload);
+        }
+
+        /* Cache policy */
+        mk_list_foreach_safe(head2, tmp2, &host->cache_rules) {
+            cache_rule = mk_list_entry(head2, struct mk_vhost_cache_rule,
+                                       _head);
+            mk_list_del(&cache_rule->_head);
+            mk_vhost_cache_rule_free(cache_rule);
+        }
+
         /* Free error pages */
         mk_list_foreach_safe(head2, tmp2, &host->error_pages) {
             ep = mk_list_entry(head2, struct mk_vhost_error_page, _head);
@@ -781,7 +1093,14 @@ void mk_vhost_free_all(struct mk_server *server)
             mk_mem_free(ep);
         }
 
+        if (host->compression.types) {
+            mk_string_split_free(host->compression.types);
+        }
+
         mk_ptr_free(&host->documentroot);
+        if (host->worker_pool) {
+            mk_mem_free(host->worker_pool);
+        }
 
         /* Free source configuration */
         if (host->config) {
@@ -0,0 +1,231 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_cache.h>
+
+#define RH_CACHE_CONTROL   "Cache-Control: "
+#define RH_EXPIRES_FMT     "Expires: %a, %d %b %Y %H:%M:%S GMT\r\n"
+
+/* Directives allowed in a rule, besides max-age=N and expires */
+static const char *cache_directives[] = {
+    "public", "private", "no-cache", "no-store", "must-revalidate",
+    "immutable", NULL
+};
+
+static int cache_directive_valid(char *val)
+{
+    int i;
+
+    for (i = 0; cache_directives[i]; i++) {
+        if (strcasecmp(val, cache_directives[i]) == 0) {
+            return MK_TRUE;
+        }
+    }
+    return MK_FALSE;
+}
+
+/* Rule <prefix|*> <mime|*> <directives> */
+struct mk_vhost_cache_rule *mk_vhost_cache_rule_create(struct mk_vhost *host,
+                                                       char *val)
+{
+    int i = 0;
+    int expires = MK_FALSE;
+    int len = 0;
+    long max_age = -1;
+    char *end;
+    char *prefix = NULL;
+    char *mime = NULL;
+    char cc[256];
+    unsigned long row_len;
+    struct mk_list *line;
+    struct mk_list *head;
+    struct mk_string_line *entry;
+    struct mk_vhost_cache_rule *rule;
+
+    line = mk_string_split_line(val);
+    if (!line) {
+        return NULL;
+    }
+
+    cc[0] = '\0';
+    mk_list_foreach(head, line) {
+        entry = mk_list_entry(head, struct mk_string_line, _head);
+        if (i == 0) {
+            prefix = entry->val;
+        }
+        else if (i == 1) {
+            mime = entry->val;
+        }
+        else if (strcasecmp(entry->val, "expires") == 0) {
+            expires = MK_TRUE;
+        }
+        else {
+            if (strncasecmp(entry->val, "max-age=", 8) == 0) {
+                max_age = strtol(entry->val + 8, &end, 10);
+                if (end == entry->val + 8 || *end != '\0' || max_age < 0) {
+                    goto error;
+                }
+            }
+            else if (cache_directive_valid(entry->val) == MK_FALSE) {
+                goto error;
+            }
+
+            len += snprintf(cc + len, sizeof(cc) - len, "%s%s",
+                            len > 0 ? ", " : "", entry->val);
+            if (len >= (int) sizeof(cc)) {
+                goto error;
+            }
+        }
+        i++;
+    }
+
+    /* Expires is computed from max-age */
+    if (i < 3 || (prefix[0] != '/' && strcmp(prefix, "*") != 0) ||
+        (expires == MK_TRUE && max_age < 0)) {
+        goto error;
+    }
+
+    rule = mk_mem_alloc_z(sizeof(struct mk_vhost_cache_rule));
+    if (!rule) {
+        mk_string_split_free(line);
+        return NULL;
+    }
+    rule->max_age = max_age;
+
+    /* Prefixes are matched against the path of the file */
+    if (prefix[0] == '/') {
+        mk_string_build(&rule->prefix, &row_len, "%.*s%s",
+                        (int) host->documentroot.len, host->documentroot.data,
+                        prefix);
+        rule->prefix_len = row_len;
+    }
+    if (strcmp(mime, "*") != 0) {
+        rule->mime = mk_string_dup(mime);
+        rule->mime_len = strlen(mime);
+    }
+
+    if (len > 0) {
+        mk_string_build(&rule->row.data, &row_len, "%s%s%s",
+                        RH_CACHE_CONTROL, cc, MK_CRLF);
+        rule->row.len = row_len;
+    }
+
+    if (expires == MK_TRUE) {
+        rule->expires_buf[0] = mk_mem_alloc_z(MK_VHOST_CACHE_EXPIRES_SIZE);
+        rule->expires_buf[1] = mk_mem_alloc_z(MK_VHOST_CACHE_EXPIRES_SIZE);
+    }
+    mk_string_split_free(line);
+
+    return rule;
+
+ error:
+    mk_err("[Host Cache] invalid Rule '%s'", val);
+    mk_string_split_free(line);
+    return NULL;
+}
+
+void mk_vhost_cache_rule_free(struct mk_vhost_cache_rule *rule)
+{
+    mk_mem_free(rule->prefix);
+    mk_mem_free(rule->mime);
+    mk_mem_free(rule->row.data);
+    mk_mem_free(rule->expires_buf[0]);
+    mk_mem_free(rule->expires_buf[1]);
+    mk_mem_free(rule);
+}
+
+/* First rule matching a static file, or NULL */
+struct mk_vhost_cache_rule *mk_vhost_cache_match(struct mk_vhost *host,
+                                                 char *path, size_t len,
+                                                 struct mk_mimetype *mime)
+{
+    size_t type_len;
+    struct mk_list *head;
+    struct mk_vhost_cache_rule *rule;
+
+    mk_list_foreach(head, &host->cache_rules) {
+        rule = mk_list_entry(head, struct mk_vhost_cache_rule, _head);
+        if (rule->prefix &&
+            (len < rule->prefix_len ||
+             strncmp(path, rule->prefix, rule->prefix_len) != 0)) {
+            continue;
+        }
+
+        if (rule->mime) {
+            if (!mime) {
+                continue;
+            }
+
+            /* the mime type length counts the CRLF of the header row */
+            type_len = mime->type.len - 2;
+            if (rule->mime[rule->mime_len - 1] == '/') {
+                if (type_len <= rule->mime_len ||
+                    strncasecmp(mime->type.data, rule->mime,
+                                rule->mime_len) != 0) {
+                    continue;
+                }
+            }
+            else if (type_len != rule->mime_len ||
+                     strncasecmp(mime->type.data, rule->mime,
+                                 rule->mime_len) != 0) {
+                continue;
+            }
+        }
+        return rule;
+    }
+
+    return NULL;
+}
+
+/* Called by the clock worker: Expires rows for the current time */
+void mk_vhost_cache_expires_update(struct mk_server *server, time_t utime)
+{
+    time_t t;
+    char *buf;
+    struct tm tm;
+    struct mk_list *head;
+    struct mk_list *r_head;
+    struct mk_vhost *host;
+    struct mk_vhost_cache_rule *rule;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        mk_list_foreach(r_head, &host->cache_rules) {
+            rule = mk_list_entry(r_head, struct mk_vhost_cache_rule, _head);
+            if (!rule->expires_buf[0]) {
+                continue;
+            }
+
+            if (rule->expires.data == rule->expires_buf[0]) {
+                buf = rule->expires_buf[1];
+            }
+            else {
+                buf = rule->expires_buf[0];
+            }
+
+            t = utime + rule->max_age;
+            rule->expires.len = strftime(buf, MK_VHOST_CACHE_EXPIRES_SIZE,
+                                         RH_EXPIRES_FMT, gmtime_r(&t, &tm));
+            rule->expires.data = buf;
+        }
+    }
+}
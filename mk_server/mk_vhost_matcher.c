@@ -0,0 +1,449 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_matcher.h>
+
+#define MK_VHOST_MATCHER_LITERAL  256    /* max literal length            */
+#define MK_VHOST_MATCHER_ALTS     8      /* max alternatives per literal rule */
+
+static inline unsigned char matcher_lower(unsigned char c)
+{
+    if (c >= 'A' && c <= 'Z') {
+        return c + ('a' - 'A');
+    }
+    return c;
+}
+
+/* Characters that can follow a backslash and still be a literal */
+static inline int matcher_escaped(char c)
+{
+    return (c != '\0' && strchr(".[]()*+?{}|^$\\/-", c) != NULL);
+}
+
+static inline int matcher_meta(char c)
+{
+    return (strchr(".[]()*+?{}|^$\\", c) != NULL);
+}
+
+/*
+ * Check if a regex alternative is a literal, optionally anchored. On
+ * success the lowercase literal is written into 'out' and the kind of
+ * rule is returned, otherwise -1.
+ */
+static int matcher_literal(char *alt, size_t len, char *out, size_t *out_len)
+{
+    int start = MK_FALSE;
+    int end = MK_FALSE;
+    size_t i = 0;
+    size_t n = 0;
+
+    if (len > 0 && alt[0] == '^') {
+        start = MK_TRUE;
+        i++;
+    }
+
+    /* A trailing '.*' does not change the result of a prefix match */
+    if (len >= 2 && alt[len - 2] == '.' && alt[len - 1] == '*' &&
+        (len < 3 || alt[len - 3] != '\\')) {
+        len -= 2;
+    }
+    else if (len > 0 && alt[len - 1] == '$' &&
+             (len < 2 || alt[len - 2] != '\\')) {
+        end = MK_TRUE;
+        len--;
+    }
+
+    while (i < len) {
+        if (n >= MK_VHOST_MATCHER_LITERAL - 1) {
+            return -1;
+        }
+
+        if (alt[i] == '\\') {
+            if (i + 1 >= len || !matcher_escaped(alt[i + 1])) {
+                return -1;
+            }
+            out[n++] = matcher_lower(alt[i + 1]);
+            i += 2;
+            continue;
+        }
+        else if (matcher_meta(alt[i])) {
+            return -1;
+        }
+
+        out[n++] = matcher_lower(alt[i]);
+        i++;
+    }
+
+    if (n == 0) {
+        return -1;
+    }
+    out[n] = '\0';
+    *out_len = n;
+
+    if (start == MK_TRUE) {
+        return (end == MK_TRUE) ? MK_VHOST_MATCH_EXACT : MK_VHOST_MATCH_PREFIX;
+    }
+    return (end == MK_TRUE) ? MK_VHOST_MATCH_SUFFIX : MK_VHOST_MATCH_SUBSTR;
+}
+
+static int trie_node_new(struct mk_vhost_matcher_trie *t, unsigned char c)
+{
+    int size;
+    struct mk_vhost_matcher_node *tmp;
+    struct mk_vhost_matcher_node *node;
+
+    if (t->size == t->capacity) {
+        size = (t->capacity == 0) ? 32 : t->capacity * 2;
+        tmp = mk_mem_realloc(t->nodes,
+                             sizeof(struct mk_vhost_matcher_node) * size);
+        if (!tmp) {
+            return -1;
+        }
+        t->nodes = tmp;
+        t->capacity = size;
+    }
+
+    node = &t->nodes[t->size];
+    node->c       = c;
+    node->child   = -1;
+    node->sibling = -1;
+    node->match   = MK_VHOST_MATCH_NONE;
+    node->exact   = MK_VHOST_MATCH_NONE;
+
+    return t->size++;
+}
+
+static inline int trie_child(struct mk_vhost_matcher_trie *t, int node,
+                             unsigned char c)
+{
+    int i;
+
+    for (i = t->nodes[node].child; i != -1; i = t->nodes[i].sibling) {
+        if (t->nodes[i].c == c) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Register a literal, 'reverse' inserts it from the last byte */
+static int trie_add(struct mk_vhost_matcher_trie *t, char *lit, size_t len,
+                    int reverse, int exact, int priority)
+{
+    int i;
+    int node = 0;
+    int next;
+    size_t n;
+    unsigned char c;
+
+    if (t->size == 0 && trie_node_new(t, 0) == -1) {
+        return -1;
+    }
+
+    for (n = 0; n < len; n++) {
+        c = reverse ? lit[len - n - 1] : lit[n];
+        next = trie_child(t, node, c);
+        if (next == -1) {
+            i = trie_node_new(t, c);
+            if (i == -1) {
+                return -1;
+            }
+            t->nodes[i].sibling = t->nodes[node].child;
+            t->nodes[node].child = i;
+            next = i;
+        }
+        node = next;
+    }
+
+    if (exact == MK_TRUE) {
+        if (priority < t->nodes[node].exact) {
+            t->nodes[node].exact = priority;
+        }
+    }
+    else if (priority < t->nodes[node].match) {
+        t->nodes[node].match = priority;
+    }
+
+    return 0;
+}
+
+static int matcher_scan_add(struct mk_vhost_matcher *m, int type,
+                            int priority, char *lit, size_t len,
+                            struct mk_vhost_handler *h)
+{
+    struct mk_vhost_matcher_scan *tmp;
+    struct mk_vhost_matcher_scan *s;
+
+    tmp = mk_mem_realloc(m->scan,
+                         sizeof(struct mk_vhost_matcher_scan) * (m->n_scan + 1));
+    if (!tmp) {
+        return -1;
+    }
+    m->scan = tmp;
+
+    s = &m->scan[m->n_scan];
+    s->type     = type;
+    s->priority = priority;
+    s->handler  = h;
+    s->literal  = NULL;
+    s->len      = len;
+    if (lit) {
+        s->literal = mk_string_dup(lit);
+        if (!s->literal) {
+            return -1;
+        }
+    }
+    m->n_scan++;
+
+    return 0;
+}
+
+/*
+ * Split the rule in its alternatives: all of them must be literals to be
+ * decomposed, otherwise the rule is kept as a regex.
+ */
+static int matcher_rule_literals(char *pattern, char lits[][MK_VHOST_MATCHER_LITERAL],
+                                 size_t *lens, int *kinds, int max)
+{
+    int n = 0;
+    int kind;
+    char *p;
+    char *start;
+
+    if (!pattern || strpbrk(pattern, "([{")) {
+        return -1;
+    }
+
+    start = pattern;
+    p = pattern;
+    while (1) {
+        if (*p == '\\' && *(p + 1) != '\0') {
+            p += 2;
+            continue;
+        }
+
+        if (*p == '|' || *p == '\0') {
+            if (n == max) {
+                return -1;
+            }
+            kind = matcher_literal(start, p - start, lits[n], &lens[n]);
+            if (kind == -1) {
+                return -1;
+            }
+            kinds[n++] = kind;
+
+            if (*p == '\0') {
+                break;
+            }
+            start = p + 1;
+        }
+        p++;
+    }
+
+    return n;
+}
+
+struct mk_vhost_matcher *mk_vhost_matcher_create(struct mk_list *handlers)
+{
+    int i;
+    int n;
+    int ret;
+    int priority = 0;
+    int kinds[MK_VHOST_MATCHER_ALTS];
+    size_t lens[MK_VHOST_MATCHER_ALTS];
+    char lits[MK_VHOST_MATCHER_ALTS][MK_VHOST_MATCHER_LITERAL];
+    struct mk_list *head;
+    struct mk_vhost_handler *h;
+    struct mk_vhost_matcher *m;
+
+    m = mk_mem_alloc_z(sizeof(struct mk_vhost_matcher));
+    if (!m) {
+        return NULL;
+    }
+
+    m->n_rules = mk_list_size(handlers);
+    if (m->n_rules == 0) {
+        return m;
+    }
+
+    m->rules = mk_mem_alloc(sizeof(struct mk_vhost_handler *) * m->n_rules);
+    if (!m->rules) {
+        mk_mem_free(m);
+        return NULL;
+    }
+
+    mk_list_foreach(head, handlers) {
+        h = mk_list_entry(head, struct mk_vhost_handler, _head);
+        m->rules[priority] = h;
+
+        n = matcher_rule_literals(h->pattern, lits, lens, kinds,
+                                  MK_VHOST_MATCHER_ALTS);
+        if (n <= 0) {
+            ret = matcher_scan_add(m, MK_VHOST_MATCH_REGEX, priority,
+                                   NULL, 0, h);
+        }
+        else {
+            for (i = 0, ret = 0; i < n && ret == 0; i++) {
+                switch (kinds[i]) {
+                case MK_VHOST_MATCH_PREFIX:
+                    ret = trie_add(&m->prefix, lits[i], lens[i],
+                                   MK_FALSE, MK_FALSE, priority);
+                    break;
+                case MK_VHOST_MATCH_EXACT:
+                    ret = trie_add(&m->prefix, lits[i], lens[i],
+                                   MK_FALSE, MK_TRUE, priority);
+                    break;
+                case MK_VHOST_MATCH_SUFFIX:
+                    ret = trie_add(&m->suffix, lits[i], lens[i],
+                                   MK_TRUE, MK_FALSE, priority);
+                    break;
+                case MK_VHOST_MATCH_SUBSTR:
+                    ret = matcher_scan_add(m, MK_VHOST_MATCH_SUBSTR, priority,
+                                           lits[i], lens[i], h);
+                    break;
+                }
+            }
+        }
+
+        if (ret != 0) {
+            mk_vhost_matcher_destroy(m);
+            return NULL;
+        }
+        priority++;
+    }
+
+    return m;
+}
+
+void mk_vhost_matcher_destroy(struct mk_vhost_matcher *m)
+{
+    int i;
+
+    if (!m) {
+        return;
+    }
+
+    for (i = 0; i < m->n_scan; i++) {
+        mk_mem_free(m->scan[i].literal);
+    }
+    mk_mem_free(m->scan);
+    mk_mem_free(m->prefix.nodes);
+    mk_mem_free(m->suffix.nodes);
+    mk_mem_free(m->rules);
+    mk_mem_free(m);
+}
+
+static inline int trie_walk(struct mk_vhost_matcher_trie *t, char *uri,
+                            size_t len, int reverse, int best)
+{
+    int node = 0;
+    size_t n;
+    unsigned char c;
+
+    if (t->size == 0) {
+        return best;
+    }
+
+    for (n = 0; n < len; n++) {
+        c = matcher_lower(reverse ? uri[len - n - 1] : uri[n]);
+        node = trie_child(t, node, c);
+        if (node == -1) {
+            break;
+        }
+
+        if (t->nodes[node].match < best) {
+            best = t->nodes[node].match;
+        }
+        if (n == len - 1 && t->nodes[node].exact < best) {
+            best = t->nodes[node].exact;
+        }
+    }
+
+    return best;
+}
+
+static inline int matcher_substr(char *uri, size_t len,
+                                 char *lit, size_t lit_len)
+{
+    size_t i;
+    size_t j;
+
+    if (lit_len > len) {
+        return MK_FALSE;
+    }
+
+    for (i = 0; i <= len - lit_len; i++) {
+        for (j = 0; j < lit_len; j++) {
+            if (matcher_lower(uri[i + j]) != (unsigned char) lit[j]) {
+                break;
+            }
+        }
+        if (j == lit_len) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Lookup the handler for a NULL terminated URI, it returns NULL if no
+ * rule matches.
+ */
+struct mk_vhost_handler *mk_vhost_matcher_lookup(struct mk_vhost_matcher *m,
+                                                 char *uri, size_t len)
+{
+    int i;
+    int best = MK_VHOST_MATCH_NONE;
+    struct mk_vhost_matcher_scan *s;
+
+    if (m->n_rules == 0) {
+        return NULL;
+    }
+
+    best = trie_walk(&m->prefix, uri, len, MK_FALSE, best);
+    best = trie_walk(&m->suffix, uri, len, MK_TRUE, best);
+
+    /* Only the rules that can beat the literal match are evaluated */
+    for (i = 0; i < m->n_scan; i++) {
+        s = &m->scan[i];
+        if (s->priority >= best) {
+            break;
+        }
+
+        if (s->type == MK_VHOST_MATCH_SUBSTR) {
+            if (matcher_substr(uri, len, s->literal, s->len) == MK_TRUE) {
+                best = s->priority;
+                break;
+            }
+        }
+        else if (regexec(&s->handler->match, uri, 0, NULL, 0) == 0) {
+            best = s->priority;
+            break;
+        }
+    }
+
+    if (best == MK_VHOST_MATCH_NONE) {
+        return NULL;
+    }
+
+    return m->rules[best];
+}
@@ -0,0 +1,1059 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2017 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_utils.h>
+#include <monkey/mk_header.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_rewrite.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+
+#define MK_VHOST_REWRITE_GROUPS     10      /* $0 to $9                  */
+#define MK_VHOST_REWRITE_CL_ZERO    "0\r\n\r\n"
+
+#define REWRITE_NOTIFY_MASK  (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+/* Inotify context, the maps are found through the virtual hosts */
+struct mk_vhost_rewrite_watch {
+    int fd;
+    pthread_t tid;
+    struct mk_server *server;
+};
+
+/* Expanded target under construction */
+struct rewrite_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Redirect status or rewrite, -1 if invalid */
+static int rewrite_action(char *val)
+{
+    int status;
+
+    if (!val) {
+        return MK_REDIR_MOVED;
+    }
+
+    if (strcasecmp(val, "rewrite") == 0) {
+        return MK_VHOST_REWRITE_INTERNAL;
+    }
+
+    status = atoi(val);
+    switch (status) {
+    case MK_REDIR_MOVED:
+    case MK_REDIR_MOVED_T:
+    case MK_REDIR_SEE_OTHER:
+    case MK_REDIR_TEMPORARY:
+    case MK_REDIR_PERMANENT:
+        return status;
+    }
+
+    return -1;
+}
+
+/* Targets are written in the response headers */
+static int rewrite_target_valid(char *target)
+{
+    unsigned char *p;
+
+    for (p = (unsigned char *) target; *p; p++) {
+        if (*p < 0x20 || *p == 0x7f) {
+            return MK_FALSE;
+        }
+    }
+
+    return MK_TRUE;
+}
+
+/*
+ * Path bytes are decoded, the ones that would change the meaning of a
+ * Location (or break the header) are encoded again.
+ */
+static inline int rewrite_encoded(unsigned char c)
+{
+    return (c <= 0x20 || c >= 0x7f || c == '%' || c == '?' || c == '#');
+}
+
+static int buf_append(struct rewrite_buf *b, const char *src, size_t len,
+                      int encode)
+{
+    size_t i;
+    size_t need;
+    size_t size;
+    char *tmp;
+    unsigned char c;
+    static const char hex[] = "0123456789ABCDEF";
+
+    need = b->len + (encode ? len * 3 : len) + 1;
+    if (need > b->size) {
+        size = (b->size == 0) ? 256 : b->size;
+        while (size < need) {
+            size *= 2;
+        }
+        tmp = mk_mem_realloc(b->data, size);
+        if (!tmp) {
+            return -1;
+        }
+        b->data = tmp;
+        b->size = size;
+    }
+
+    if (!encode) {
+        memcpy(b->data + b->len, src, len);
+        b->len += len;
+    }
+    else {
+        for (i = 0; i < len; i++) {
+            c = src[i];
+            if (rewrite_encoded(c)) {
+                b->data[b->len++] = '%';
+                b->data[b->len++] = hex[c >> 4];
+                b->data[b->len++] = hex[c & 0x0f];
+            }
+            else {
+                b->data[b->len++] = c;
+            }
+        }
+    }
+    b->data[b->len] = '\0';
+
+    return 0;
+}
+
+/* Append the 'Location' and 'Content-Length' rows around a target */
+static int rows_append(struct rewrite_buf *b, const char *target, size_t len,
+                       mk_ptr_t query)
+{
+    int ret;
+
+    ret = buf_append(b, mk_header_short_location.data,
+                     mk_header_short_location.len, MK_FALSE);
+    ret |= buf_append(b, target, len, MK_FALSE);
+    if (query.len > 0 && !memchr(target, '?', len)) {
+        ret |= buf_append(b, "?", 1, MK_FALSE);
+        ret |= buf_append(b, query.data, query.len, MK_FALSE);
+    }
+    ret |= buf_append(b, MK_CRLF, sizeof(MK_CRLF) - 1, MK_FALSE);
+    ret |= buf_append(b, mk_header_content_length.data,
+                      mk_header_content_length.len, MK_FALSE);
+    ret |= buf_append(b, MK_VHOST_REWRITE_CL_ZERO,
+                      sizeof(MK_VHOST_REWRITE_CL_ZERO) - 1, MK_FALSE);
+
+    return ret;
+}
+
+/*
+ * Set the result of a rule from its expanded target. Redirects get the
+ * response rows (the final CRLF follows 'len' in the buffer), a rewrite
+ * gets the new path and, if the target sets one, the query string.
+ */
+static int rewrite_result(int action, struct rewrite_buf *target,
+                          mk_ptr_t query, struct mk_vhost_rewrite_result *res)
+{
+    char *q;
+    struct rewrite_buf rows = {NULL, 0, 0};
+
+    res->action = action;
+    res->query = NULL;
+    res->query_len = 0;
+
+    if (action == MK_VHOST_REWRITE_INTERNAL) {
+        res->buf = target->data;
+        res->len = target->len;
+
+        q = memchr(target->data, '?', target->len);
+        if (q) {
+            *q = '\0';
+            res->len = q - target->data;
+            res->query = q + 1;
+            res->query_len = target->len - res->len - 1;
+        }
+        return 0;
+    }
+
+    if (rows_append(&rows, target->data, target->len, query) != 0) {
+        mk_mem_free(rows.data);
+        mk_mem_free(target->data);
+        return -1;
+    }
+    mk_mem_free(target->data);
+
+    res->buf = rows.data;
+    res->len = rows.len - (sizeof(MK_CRLF) - 1);
+    return 0;
+}
+
+/*
+ * Hash table
+ * ----------
+ */
+static struct mk_vhost_rewrite_table *table_create(unsigned int size)
+{
+    struct mk_vhost_rewrite_table *t;
+
+    t = mk_mem_alloc_z(sizeof(struct mk_vhost_rewrite_table));
+    if (!t) {
+        return NULL;
+    }
+
+    t->slots = mk_mem_alloc_z(sizeof(struct mk_vhost_rewrite_entry *) * size);
+    if (!t->slots) {
+        mk_mem_free(t);
+        return NULL;
+    }
+    t->size = size;
+
+    return t;
+}
+
+static void table_destroy(struct mk_vhost_rewrite_table *t)
+{
+    unsigned int i;
+
+    if (!t) {
+        return;
+    }
+
+    for (i = 0; i < t->size; i++) {
+        mk_mem_free(t->slots[i]);
+    }
+    mk_mem_free(t->slots);
+    mk_mem_free(t);
+}
+
+static inline struct mk_vhost_rewrite_entry **table_slot(struct mk_vhost_rewrite_table *t,
+                                                         const char *path,
+                                                         size_t len,
+                                                         unsigned int hash)
+{
+    unsigned int i;
+    struct mk_vhost_rewrite_entry *e;
+
+    for (i = hash & (t->size - 1); ; i = (i + 1) & (t->size - 1)) {
+        e = t->slots[i];
+        if (!e) {
+            return &t->slots[i];
+        }
+        if (e->hash == hash && e->path_len == len &&
+            memcmp(e->path, path, len) == 0) {
+            return &t->slots[i];
+        }
+    }
+}
+
+/* Keep the load factor under 1/2 */
+static int table_grow(struct mk_vhost_rewrite_table *t)
+{
+    unsigned int i;
+    unsigned int size = t->size;
+    struct mk_vhost_rewrite_entry **slots = t->slots;
+    struct mk_vhost_rewrite_entry *e;
+
+    t->slots = mk_mem_alloc_z(sizeof(struct mk_vhost_rewrite_entry *) * size * 2);
+    if (!t->slots) {
+        t->slots = slots;
+        return -1;
+    }
+    t->size = size * 2;
+
+    for (i = 0; i < size; i++) {
+        e = slots[i];
+        if (e) {
+            *table_slot(t, e->path, e->path_len, e->hash) = e;
+        }
+    }
+    mk_mem_free(slots);
+
+    return 0;
+}
+
+/* Register an exact rule, a path given again replaces the previous one */
+static int table_add(struct mk_vhost_rewrite_table *t, char *path,
+                     char *target, int action)
+{
+    size_t len;
+    size_t target_len;
+    size_t size;
+    char *p;
+    struct mk_vhost_rewrite_entry *e;
+    struct mk_vhost_rewrite_entry **slot;
+    struct rewrite_buf rows = {NULL, 0, 0};
+    mk_ptr_t no_query = {NULL, 0};
+
+    if ((t->count + 1) * 2 > t->size && table_grow(t) != 0) {
+        return -1;
+    }
+
+    len = strlen(path);
+    target_len = strlen(target);
+
+    if (action != MK_VHOST_REWRITE_INTERNAL &&
+        rows_append(&rows, target, target_len, no_query) != 0) {
+        mk_mem_free(rows.data);
+        return -1;
+    }
+
+    size = sizeof(struct mk_vhost_rewrite_entry) + len + 1 + target_len + 1 +
+        rows.len;
+    e = mk_mem_alloc(size);
+    if (!e) {
+        mk_mem_free(rows.data);
+        return -1;
+    }
+
+    p = (char *) (e + 1);
+    e->hash = mk_utils_gen_hash(path, len);
+    e->action = action;
+    e->path = p;
+    e->path_len = len;
+    memcpy(p, path, len + 1);
+    p += len + 1;
+
+    e->target.data = p;
+    e->target.len = target_len;
+    memcpy(p, target, target_len + 1);
+    p += target_len + 1;
+
+    e->rows.data = NULL;
+    e->rows.len = 0;
+    if (rows.data) {
+        memcpy(p, rows.data, rows.len);
+        e->rows.data = p;
+        e->rows.len = rows.len;
+        mk_mem_free(rows.data);
+    }
+
+    slot = table_slot(t, path, len, e->hash);
+    if (*slot) {
+        mk_mem_free(*slot);
+    }
+    else {
+        t->count++;
+    }
+    *slot = e;
+
+    return 0;
+}
+
+/*
+ * Parse a rule made of '<match> <target> [action]', the fields are set
+ * in place. It returns the action or -1.
+ */
+static int rule_fields(char *line, char **match, char **target)
+{
+    char *save;
+    char *action;
+
+    *match = strtok_r(line, " \t\r\n", &save);
+    if (!*match) {
+        return -1;
+    }
+    *target = strtok_r(NULL, " \t\r\n", &save);
+    if (!*target || !rewrite_target_valid(*target)) {
+        return -1;
+    }
+    action = strtok_r(NULL, " \t\r\n", &save);
+    if (action && strtok_r(NULL, " \t\r\n", &save)) {
+        return -1;
+    }
+
+    return rewrite_action(action);
+}
+
+/* Load a map file, one exact rule per line ('#' starts a comment) */
+static struct mk_vhost_rewrite_table *table_load(char *file)
+{
+    int n = 0;
+    int action;
+    char *p;
+    char *path;
+    char *target;
+    char line[MK_VHOST_REWRITE_LINE];
+    FILE *f;
+    struct mk_vhost_rewrite_table *t;
+
+    f = fopen(file, "r");
+    if (!f) {
+        mk_warn("[rewrite] cannot open map '%s'", file);
+        return NULL;
+    }
+
+    t = table_create(64);
+    if (!t) {
+        fclose(f);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        if (!strchr(line, '\n') && !feof(f)) {
+            mk_warn("[rewrite] %s:%i line too long", file, n);
+            table_destroy(t);
+            fclose(f);
+            return NULL;
+        }
+
+        p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') {
+            continue;
+        }
+
+        action = rule_fields(p, &path, &target);
+        if (action == -1 || path[0] != '/') {
+            mk_warn("[rewrite] %s:%i invalid rule", file, n);
+            continue;
+        }
+
+        if (table_add(t, path, target, action) != 0) {
+            table_destroy(t);
+            fclose(f);
+            return NULL;
+        }
+    }
+    fclose(f);
+
+    return t;
+}
+
+static struct mk_vhost_rewrite_map *map_create(char *file, char *vhost_file)
+{
+    int dirs;
+    char *slash;
+    unsigned long len;
+    struct mk_vhost_rewrite_map *map;
+
+    map = mk_mem_alloc_z(sizeof(struct mk_vhost_rewrite_map));
+    if (!map) {
+        return NULL;
+    }
+    pthread_rwlock_init(&map->lock, NULL);
+    map->wd = -1;
+
+    if (!file) {
+        map->table = table_create(64);
+        if (!map->table) {
+            mk_mem_free(map);
+            return NULL;
+        }
+        return map;
+    }
+
+    /*
+     * Every file under sites/ is a virtual host, a relative path is found
+     * in the configuration directory holding it.
+     */
+    dirs = 0;
+    slash = vhost_file + strlen(vhost_file);
+    while (file[0] != '/' && slash > vhost_file + 1 && dirs < 2) {
+        slash--;
+        if (*slash == '/' && slash[-1] != '/') {
+            dirs++;
+        }
+    }
+
+    if (dirs == 2) {
+        mk_string_build(&map->file, &len, "%.*s/%s",
+                        (int) (slash - vhost_file), vhost_file, file);
+    }
+    else {
+        map->file = mk_string_dup(file);
+    }
+
+    slash = strrchr(map->file, '/');
+    if (slash) {
+        map->dir  = mk_string_copy_substr(map->file, 0,
+                                          (slash == map->file) ?
+                                          1 : slash - map->file);
+        map->name = mk_string_dup(slash + 1);
+    }
+
+    map->table = table_load(map->file);
+    if (!map->table) {
+        mk_mem_free(map->file);
+        mk_mem_free(map->dir);
+        mk_mem_free(map->name);
+        mk_mem_free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+static void map_destroy(struct mk_vhost_rewrite_map *map)
+{
+    table_destroy(map->table);
+    pthread_rwlock_destroy(&map->lock);
+    mk_mem_free(map->file);
+    mk_mem_free(map->dir);
+    mk_mem_free(map->name);
+    mk_mem_free(map);
+}
+
+/* Load the file of a map again and replace its table */
+static void map_reload(struct mk_vhost_rewrite_map *map)
+{
+    struct mk_vhost_rewrite_table *t;
+    struct mk_vhost_rewrite_table *old;
+
+    t = table_load(map->file);
+    if (!t) {
+        mk_warn("[rewrite] keeping the previous rules of '%s'", map->file);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&map->lock);
+    old = map->table;
+    map->table = t;
+    pthread_rwlock_unlock(&map->lock);
+
+    table_destroy(old);
+    mk_info("[rewrite] map '%s' reloaded, %u rules", map->file, t->count);
+}
+
+/*
+ * Prefix trie
+ * -----------
+ */
+static int trie_node_new(struct mk_vhost_rewrite *rw, unsigned char c)
+{
+    int size;
+    struct mk_vhost_rewrite_node *tmp;
+    struct mk_vhost_rewrite_node *node;
+
+    if (rw->n_nodes == rw->nodes_size) {
+        size = (rw->nodes_size == 0) ? 32 : rw->nodes_size * 2;
+        tmp = mk_mem_realloc(rw->nodes,
+                             sizeof(struct mk_vhost_rewrite_node) * size);
+        if (!tmp) {
+            return -1;
+        }
+        rw->nodes = tmp;
+        rw->nodes_size = size;
+    }
+
+    node = &rw->nodes[rw->n_nodes];
+    node->c       = c;
+    node->child   = -1;
+    node->sibling = -1;
+    node->rule    = -1;
+
+    return rw->n_nodes++;
+}
+
+static inline int trie_child(struct mk_vhost_rewrite *rw, int node,
+                             unsigned char c)
+{
+    int i;
+
+    for (i = rw->nodes[node].child; i != -1; i = rw->nodes[i].sibling) {
+        if (rw->nodes[i].c == c) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* The first rule given for a prefix wins */
+static int trie_add(struct mk_vhost_rewrite *rw, char *prefix, size_t len,
+                    int rule)
+{
+    int i;
+    int node = 0;
+    int next;
+    size_t n;
+
+    if (rw->n_nodes == 0 && trie_node_new(rw, 0) == -1) {
+        return -1;
+    }
+
+    for (n = 0; n < len; n++) {
+        next = trie_child(rw, node, prefix[n]);
+        if (next == -1) {
+            i = trie_node_new(rw, prefix[n]);
+            if (i == -1) {
+                return -1;
+            }
+            rw->nodes[i].sibling = rw->nodes[node].child;
+            rw->nodes[node].child = i;
+            next = i;
+        }
+        node = next;
+    }
+
+    if (rw->nodes[node].rule == -1) {
+        rw->nodes[node].rule = rule;
+    }
+
+    return 0;
+}
+
+/* Longest prefix rule of the path, or -1 */
+static inline int trie_lookup(struct mk_vhost_rewrite *rw, char *path,
+                              size_t len)
+{
+    int node = 0;
+    int best = -1;
+    size_t n;
+
+    if (rw->n_nodes == 0) {
+        return -1;
+    }
+
+    for (n = 0; n < len; n++) {
+        node = trie_child(rw, node, path[n]);
+        if (node == -1) {
+            break;
+        }
+        if (rw->nodes[node].rule != -1) {
+            best = rw->nodes[node].rule;
+        }
+    }
+
+    return best;
+}
+
+static int rule_add(struct mk_vhost_rewrite_rule **rules, int *n,
+                    char *pattern, char *target, int action, int regex)
+{
+    int ret;
+    struct mk_vhost_rewrite_rule *tmp;
+    struct mk_vhost_rewrite_rule *r;
+
+    tmp = mk_mem_realloc(*rules,
+                         sizeof(struct mk_vhost_rewrite_rule) * (*n + 1));
+    if (!tmp) {
+        return -1;
+    }
+    *rules = tmp;
+
+    r = &tmp[*n];
+    if (regex == MK_TRUE) {
+        ret = regcomp(&r->regex, pattern, REG_EXTENDED);
+        if (ret != 0) {
+            mk_err("[rewrite] invalid regex '%s'", pattern);
+            return -1;
+        }
+    }
+    r->action = action;
+    r->pattern = mk_string_dup(pattern);
+    r->len = strlen(pattern);
+    r->target.data = mk_string_dup(target);
+    r->target.len = strlen(target);
+    (*n)++;
+
+    return 0;
+}
+
+struct mk_vhost_rewrite *mk_vhost_rewrite_create(struct mk_rconf_section *section,
+                                                 char *vhost_file)
+{
+    int ret;
+    int action;
+    char *match;
+    char *target;
+    char *val;
+    struct mk_list *head;
+    struct mk_rconf_entry *entry;
+    struct mk_vhost_rewrite *rw;
+    struct mk_vhost_rewrite_map *map;
+    struct mk_vhost_rewrite_map *exact;
+
+    rw = mk_mem_alloc_z(sizeof(struct mk_vhost_rewrite));
+    if (!rw) {
+        return NULL;
+    }
+    mk_list_init(&rw->maps);
+
+    exact = map_create(NULL, vhost_file);
+    if (!exact) {
+        mk_mem_free(rw);
+        return NULL;
+    }
+    mk_list_add(&exact->_head, &rw->maps);
+
+    mk_list_foreach(head, &section->entries) {
+        entry = mk_list_entry(head, struct mk_rconf_entry, _head);
+
+        if (strcasecmp(entry->key, "Map") == 0) {
+            map = map_create(entry->val, vhost_file);
+            if (!map) {
+                goto error;
+            }
+            mk_list_add(&map->_head, &rw->maps);
+            continue;
+        }
+
+        val = mk_string_dup(entry->val);
+        action = rule_fields(val, &match, &target);
+        if (action == -1) {
+            mk_err("[rewrite] invalid %s rule '%s'", entry->key, entry->val);
+            mk_mem_free(val);
+            goto error;
+        }
+
+        if (strcasecmp(entry->key, "Exact") == 0 && match[0] == '/') {
+            ret = table_add(exact->table, match, target, action);
+        }
+        else if (strcasecmp(entry->key, "Prefix") == 0 && match[0] == '/') {
+            ret = rule_add(&rw->prefix, &rw->n_prefix, match, target,
+                           action, MK_FALSE);
+            if (ret == 0) {
+                ret = trie_add(rw, match, strlen(match), rw->n_prefix - 1);
+            }
+        }
+        else if (strcasecmp(entry->key, "Regex") == 0) {
+            ret = rule_add(&rw->regex, &rw->n_regex, match, target,
+                           action, MK_TRUE);
+        }
+        else {
+            mk_err("[rewrite] invalid rule '%s %s'", entry->key, entry->val);
+            ret = -1;
+        }
+        mk_mem_free(val);
+
+        if (ret != 0) {
+            goto error;
+        }
+    }
+
+    return rw;
+
+ error:
+    mk_vhost_rewrite_destroy(rw);
+    return NULL;
+}
+
+void mk_vhost_rewrite_destroy(struct mk_vhost_rewrite *rw)
+{
+    int i;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct mk_vhost_rewrite_map *map;
+
+    if (!rw) {
+        return;
+    }
+
+    mk_list_foreach_safe(head, tmp, &rw->maps) {
+        map = mk_list_entry(head, struct mk_vhost_rewrite_map, _head);
+        mk_list_del(&map->_head);
+        map_destroy(map);
+    }
+
+    for (i = 0; i < rw->n_prefix; i++) {
+        mk_mem_free(rw->prefix[i].pattern);
+        mk_mem_free(rw->prefix[i].target.data);
+    }
+    for (i = 0; i < rw->n_regex; i++) {
+        regfree(&rw->regex[i].regex);
+        mk_mem_free(rw->regex[i].pattern);
+        mk_mem_free(rw->regex[i].target.data);
+    }
+    mk_mem_free(rw->prefix);
+    mk_mem_free(rw->regex);
+    mk_mem_free(rw->nodes);
+    mk_mem_free(rw);
+}
+
+/* Expand '$n' references of a regex target with the matched groups */
+static int regex_expand(struct rewrite_buf *b, mk_ptr_t *target, char *path,
+                        regmatch_t *groups, int encode)
+{
+    int n;
+    size_t i;
+    size_t start = 0;
+    char *t = target->data;
+
+    for (i = 0; i < target->len; i++) {
+        if (t[i] != '$' || i + 1 >= target->len ||
+            t[i + 1] < '0' || t[i + 1] > '9') {
+            continue;
+        }
+
+        if (buf_append(b, t + start, i - start, MK_FALSE) != 0) {
+            return -1;
+        }
+
+        n = t[i + 1] - '0';
+        if (groups[n].rm_so >= 0 &&
+            buf_append(b, path + groups[n].rm_so,
+                       groups[n].rm_eo - groups[n].rm_so, encode) != 0) {
+            return -1;
+        }
+        i++;
+        start = i + 1;
+    }
+
+    return buf_append(b, t + start, target->len - start, MK_FALSE);
+}
+
+/*
+ * Lookup the rules for a path (NULL terminated). It returns MK_TRUE and
+ * sets the result if a rule matches, MK_FALSE if none does, -1 on error.
+ */
+int mk_vhost_rewrite_lookup(struct mk_vhost_rewrite *rw,
+                            mk_ptr_t path, mk_ptr_t query,
+                            struct mk_vhost_rewrite_result *res)
+{
+    int i;
+    int ret = MK_FALSE;
+    int encode;
+    unsigned int hash;
+    struct mk_list *head;
+    struct mk_vhost_rewrite_map *map;
+    struct mk_vhost_rewrite_entry *e;
+    struct mk_vhost_rewrite_rule *r;
+    struct rewrite_buf b = {NULL, 0, 0};
+    regmatch_t groups[MK_VHOST_REWRITE_GROUPS];
+
+    /* Exact rules */
+    hash = mk_utils_gen_hash(path.data, path.len);
+    mk_list_foreach(head, &rw->maps) {
+        map = mk_list_entry(head, struct mk_vhost_rewrite_map, _head);
+
+        pthread_rwlock_rdlock(&map->lock);
+        e = *table_slot(map->table, path.data, path.len, hash);
+        if (e) {
+            if (e->rows.data && query.len == 0) {
+                /* precomposed, the table may be replaced once unlocked */
+                res->action = e->action;
+                res->query = NULL;
+                res->query_len = 0;
+                res->buf = mk_mem_alloc(e->rows.len);
+                if (res->buf) {
+                    memcpy(res->buf, e->rows.data, e->rows.len);
+                    res->len = e->rows.len - (sizeof(MK_CRLF) - 1);
+                    ret = MK_TRUE;
+                }
+                else {
+                    ret = -1;
+                }
+            }
+            else if (buf_append(&b, e->target.data, e->target.len,
+                                MK_FALSE) == 0 &&
+                     rewrite_result(e->action, &b, query, res) == 0) {
+                ret = MK_TRUE;
+            }
+            else {
+                mk_mem_free(b.data);
+                ret = -1;
+            }
+        }
+        pthread_rwlock_unlock(&map->lock);
+
+        if (e) {
+            return ret;
+        }
+    }
+
+    /* Prefix rules, the rest of the path follows the target */
+    i = trie_lookup(rw, path.data, path.len);
+    if (i >= 0) {
+        r = &rw->prefix[i];
+        encode = (r->action != MK_VHOST_REWRITE_INTERNAL);
+        if (buf_append(&b, r->target.data, r->target.len, MK_FALSE) != 0 ||
+            buf_append(&b, path.data + r->len, path.len - r->len,
+                       encode) != 0) {
+            mk_mem_free(b.data);
+            return -1;
+        }
+        return (rewrite_result(r->action, &b, query, res) == 0) ? MK_TRUE : -1;
+    }
+
+    /* Regex rules */
+    for (i = 0; i < rw->n_regex; i++) {
+        r = &rw->regex[i];
+        if (regexec(&r->regex, path.data, MK_VHOST_REWRITE_GROUPS,
+                    groups, 0) != 0) {
+            continue;
+        }
+
+        encode = (r->action != MK_VHOST_REWRITE_INTERNAL);
+        if (regex_expand(&b, &r->target, path.data, groups, encode) != 0) {
+            mk_mem_free(b.data);
+            return -1;
+        }
+        return (rewrite_result(r->action, &b, query, res) == 0) ? MK_TRUE : -1;
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Map files reload
+ * ----------------
+ * The directory of every map is watched, a map is loaded again when its
+ * file is written or renamed over (the usual way to replace it at once).
+ */
+#if defined(__linux__)
+static void rewrite_notify_event(struct mk_server *server,
+                                 struct inotify_event *ev)
+{
+    struct mk_list *head;
+    struct mk_list *head_map;
+    struct mk_vhost *host;
+    struct mk_vhost_rewrite_map *map;
+
+    if (ev->len == 0) {
+        return;
+    }
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (!host->rewrite) {
+            continue;
+        }
+
+        mk_list_foreach(head_map, &host->rewrite->maps) {
+            map = mk_list_entry(head_map, struct mk_vhost_rewrite_map, _head);
+            if (map->wd == ev->wd && map->name &&
+                strcmp(map->name, ev->name) == 0) {
+                map_reload(map);
+            }
+        }
+    }
+}
+
+static void *rewrite_notify_worker(void *data)
+{
+    ssize_t bytes;
+    char *p;
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct mk_vhost_rewrite_watch *watch = data;
+
+    mk_utils_worker_rename("monkey: rewrite");
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+    while (1) {
+        bytes = read(watch->fd, buf, sizeof(buf));
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (p = buf; p < buf + bytes;
+             p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            rewrite_notify_event(watch->server, ev);
+        }
+    }
+
+    return NULL;
+}
+
+int mk_vhost_rewrite_watch_init(struct mk_server *server)
+{
+    int fd = -1;
+    struct mk_list *head;
+    struct mk_list *head_map;
+    struct mk_vhost *host;
+    struct mk_vhost_rewrite_map *map;
+    struct mk_vhost_rewrite_watch *watch;
+
+    server->rewrite_watch = NULL;
+
+    mk_list_foreach(head, &server->hosts) {
+        host = mk_list_entry(head, struct mk_vhost, _head);
+        if (!host->rewrite) {
+            continue;
+        }
+
+        mk_list_foreach(head_map, &host->rewrite->maps) {
+            map = mk_list_entry(head_map, struct mk_vhost_rewrite_map, _head);
+            if (!map->dir) {
+                continue;
+            }
+
+            if (fd == -1) {
+                fd = inotify_init1(IN_CLOEXEC);
+                if (fd == -1) {
+                    mk_warn("[rewrite] inotify not available, maps are "
+                            "not reloaded");
+                    return 0;
+                }
+            }
+
+            map->wd = inotify_add_watch(fd, map->dir, REWRITE_NOTIFY_MASK);
+            if (map->wd == -1) {
+                mk_warn("[rewrite] cannot watch '%s'", map->dir);
+            }
+        }
+    }
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    watch = mk_mem_alloc(sizeof(struct mk_vhost_rewrite_watch));
+    if (!watch) {
+        close(fd);
+        return -1;
+    }
+    watch->fd = fd;
+    watch->server = server;
+
+    if (mk_utils_worker_spawn((void *) rewrite_notify_worker, watch,
+                              &watch->tid) != 0) {
+        close(fd);
+        mk_mem_free(watch);
+        return -1;
+    }
+
+    server->rewrite_watch = watch;
+    return 0;
+}
+
+void mk_vhost_rewrite_watch_exit(struct mk_server *server)
+{
+    struct mk_vhost_rewrite_watch *watch = server->rewrite_watch;
+
+    if (!watch) {
+        return;
+    }
+
+    pthread_cancel(watch->tid);
+    pthread_join(watch->tid, NULL);
+    close(watch->fd);
+    mk_mem_free(watch);
+    server->rewrite_watch = NULL;
+}
+#else
+int mk_vhost_rewrite_watch_init(struct mk_server *server)
+{
+    server->rewrite_watch = NULL;
+    return 0;
+}
+
+void mk_vhost_rewrite_watch_exit(struct mk_server *server)
+{
+    (void) server;
+}
+#endif
@@ -24,6 +24,10 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_mimetype.h>
+#include <monkey/mk_file_cache.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_vhost_rewrite.h>
+#include <monkey/mk_http_parser.h>
 
 void mk_server_info(struct mk_server *server)
 {
@@ -141,6 +145,9 @@ int mk_server_setup(struct mk_server *server)
 
     mk_sched_init(server);
 
+    /* HTTP parser byte scan, picked before any worker parses a request */
+    mk_http_parser_scan_init(MK_HTTP_PARSER_SCAN_AUTO);
+
     /* Clock init that must happen before starting threads */
     mk_clock_sequential_init(server);
 
@@ -163,6 +170,31 @@ int mk_server_setup(struct mk_server *server)
     /* Invoke Plugin PRCTX hooks */
     mk_plugin_core_process(server);
 
+    /* Open file cache */
+    if (mk_file_cache_init(server) != 0) {
+        return -1;
+    }
+
+    /* Default error pages */
+    if (mk_http_error_bodies_init(server) != 0) {
+        return -1;
+    }
+
+    /* Users home directories */
+    if (server->conf_user_pub && mk_user_cache_init(server) != 0) {
+        return -1;
+    }
+
+    /* Compile the virtual hosts handlers rules */
+    if (mk_vhost_matchers_init(server) != 0) {
+        return -1;
+    }
+
+    /* Reload the rewrite map files when they change */
+    if (mk_vhost_rewrite_watch_init(server) != 0) {
+        return -1;
+    }
+
     /* Launch monkey http workers */
     MK_TLS_INIT();
     mk_server_launch_workers(server);
@@ -192,6 +224,10 @@ void mk_exit_all(struct mk_server *server)
     /* Continue exiting */
     mk_plugin_exit_all(server);
     mk_clock_exit();
+    mk_file_cache_exit(server);
+    mk_http_error_bodies_exit(server);
+    mk_user_cache_exit(server);
+    mk_vhost_rewrite_watch_exit(server);
 
     mk_sched_exit(server);
     mk_config_free_all(server);
@@ -466,6 +466,33 @@ int mk_cgi_stage30_hangup(struct mk_plugin *plugin,
     return 0;
 }
 
+/*
+ * The remote client hung up before the CGI finished: kill the child process
+ * now, the hangup callback will release the request once the connection is
+ * dropped.
+ */
+int mk_cgi_stage30_cancel(struct mk_plugin *plugin,
+                          struct mk_http_session *cs,
+                          struct mk_http_request *sr)
+{
+    struct cgi_request *r;
+    (void) sr;
+    (void) plugin;
+
+    PLUGIN_TRACE("CGI / Parent connection hung up (cancel)");
+    r = requests_by_socket[cs->socket];
+    if (!r) {
+        return -1;
+    }
+
+    if (r->child > 0) {
+        kill(r->child, SIGKILL);
+        r->child = 0;
+    }
+    r->active = MK_FALSE;
+    return 0;
+}
+
 void mk_cgi_worker_init()
 {
     struct mk_list *list = mk_api->mem_alloc_z(sizeof(struct mk_list));
@@ -477,7 +504,8 @@ void mk_cgi_worker_init()
 
 struct mk_plugin_stage mk_plugin_stage_cgi = {
     .stage30        = &mk_cgi_stage30,
-    .stage30_hangup = &mk_cgi_stage30_hangup
+    .stage30_hangup = &mk_cgi_stage30_hangup,
+    .stage30_cancel = &mk_cgi_stage30_cancel
 };
 
 struct mk_plugin mk_plugin_cgi = {
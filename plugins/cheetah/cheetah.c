@@ -81,13 +81,6 @@ static int mk_cheetah_config(char *path)
         return -1;
     }
 
-    /* Cheetah cannot work in STDIN mode if Monkey is working in background */
-    if (listen_mode == LISTEN_STDIN && mk_api->config->is_daemon == MK_TRUE) {
-        printf("\nCheetah!: Forcing SERVER mode as Monkey is running in background\n");
-        fflush(stdout);
-        listen_mode = LISTEN_SERVER;
-    }
-
     return 0;
 }
 
@@ -138,6 +131,13 @@ int mk_cheetah_master_init(struct mk_server *server)
     int ret;
     pthread_t tid;
 
+    /* Cheetah cannot work in STDIN mode if Monkey is working in background */
+    if (listen_mode == LISTEN_STDIN && server->is_daemon == MK_TRUE) {
+        printf("\nCheetah!: Forcing SERVER mode as Monkey is running in background\n");
+        fflush(stdout);
+        listen_mode = LISTEN_SERVER;
+    }
+
     ret = mk_api->worker_spawn(mk_cheetah_init, server, &tid);
     if (ret != 0) {
         return -1;
@@ -18,6 +18,7 @@
  */
 
 #include <monkey/mk_api.h>
+#include <monkey/mk_file_cache.h>
 
 #include <pwd.h>
 #include <ctype.h>
@@ -188,7 +189,7 @@ void mk_cheetah_cmd_plugins(struct mk_server *server)
     if (mk_list_is_empty(&server->stage10_handler)) {
         CHEETAH_WRITE("%s[%sSTAGE_10%s]%s",
                       ANSI_BOLD, ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
-        mk_list_foreach(head, &mk_api->config->stage10_handler) {
+        mk_list_foreach(head, &server->stage10_handler) {
             s = mk_list_entry(head, struct mk_plugin_stage, _head);
             p = s->plugin;
             CHEETAH_WRITE("\n  [%s] %s v%s on \"%s\"",
@@ -196,10 +197,10 @@ void mk_cheetah_cmd_plugins(struct mk_server *server)
         }
     }
 
-    if (mk_list_is_empty(&mk_api->config->stage20_handler)) {
+    if (mk_list_is_empty(&server->stage20_handler)) {
         CHEETAH_WRITE("%s[%sSTAGE_20%s]%s",
                       ANSI_BOLD, ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
-        mk_list_foreach(head, &mk_api->config->stage20_handler) {
+        mk_list_foreach(head, &server->stage20_handler) {
             s = mk_list_entry(head, struct mk_plugin_stage, _head);
             p = s->plugin;
             CHEETAH_WRITE("\n  [%s] %s v%s on \"%s\"",
@@ -207,10 +208,10 @@ void mk_cheetah_cmd_plugins(struct mk_server *server)
         }
     }
 
-    if (mk_list_is_empty(&mk_api->config->stage30_handler)) {
+    if (mk_list_is_empty(&server->stage30_handler)) {
         CHEETAH_WRITE("%s[%sSTAGE_30%s]%s",
                       ANSI_BOLD, ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
-        mk_list_foreach(head, &mk_api->config->stage30_handler) {
+        mk_list_foreach(head, &server->stage30_handler) {
             s = mk_list_entry(head, struct mk_plugin_stage, _head);
             p = s->plugin;
             CHEETAH_WRITE("\n  [%s] %s v%s on \"%s\"",
@@ -218,10 +219,10 @@ void mk_cheetah_cmd_plugins(struct mk_server *server)
         }
     }
 
-    if (mk_list_is_empty(&mk_api->config->stage40_handler)) {
+    if (mk_list_is_empty(&server->stage40_handler)) {
         CHEETAH_WRITE("%s[%sSTAGE_40%s]%s",
                       ANSI_BOLD, ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
-        mk_list_foreach(head, &mk_api->config->stage40_handler) {
+        mk_list_foreach(head, &server->stage40_handler) {
             s = mk_list_entry(head, struct mk_plugin_stage, _head);
             p = s->plugin;
             CHEETAH_WRITE("\n  [%s] %s v%s on \"%s\"",
@@ -229,10 +230,10 @@ void mk_cheetah_cmd_plugins(struct mk_server *server)
         }
     }
 
-    if (mk_list_is_empty(&mk_api->config->stage50_handler)) {
+    if (mk_list_is_empty(&server->stage50_handler)) {
         CHEETAH_WRITE("%s[%sSTAGE_50%s]%s",
                       ANSI_BOLD, ANSI_YELLOW, ANSI_WHITE, ANSI_RESET);
-        mk_list_foreach(head, &mk_api->config->stage50_handler) {
+        mk_list_foreach(head, &server->stage50_handler) {
             s = mk_list_entry(head, struct mk_plugin_stage, _head);
             p = s->plugin;
             CHEETAH_WRITE("\n  [%s] %s v%s on \"%s\"",
@@ -298,6 +299,8 @@ void mk_cheetah_cmd_workers(struct mk_server *server)
 {
     int i;
     unsigned long long active_connections;
+    struct mk_list *head;
+    struct mk_server_listen *listener;
     struct mk_sched_worker *node;
     struct mk_sched_ctx *ctx;
 
@@ -309,8 +312,30 @@ void mk_cheetah_cmd_workers(struct mk_server *server)
         CHEETAH_WRITE("* Worker %i\n", node[i].idx);
         CHEETAH_WRITE("      - Task ID           : %i\n", node[i].pid);
         CHEETAH_WRITE("      - Active Connections: %llu\n", active_connections);
+        CHEETAH_WRITE("      - Keep-Alive        : %is timeout, %i requests, "
+                      "%llu closed by pressure\n",
+                      node[i].ka_timeout, node[i].ka_max_requests,
+                      node[i].ka_pressure_closed);
+        CHEETAH_WRITE("      - Shed (slow)       : %llu header time, "
+                      "%llu request rate, %llu response rate\n",
+                      node[i].shed_header_time, node[i].shed_request_rate,
+                      node[i].shed_response_rate);
+
+        /* Accept queue of the listeners owned by the worker (REUSEPORT) */
+        if (!node[i].listeners) {
+            continue;
+        }
+        mk_list_foreach(head, node[i].listeners) {
+            listener = mk_list_entry(head, struct mk_server_listen, _head);
+            CHEETAH_WRITE("      - Accept Queue      : %s:%s %u/%u "
+                          "(peak %u, full %llu)\n",
+                          listener->listen->address, listener->listen->port,
+                          listener->queue_len, listener->queue_max,
+                          listener->queue_peak, listener->queue_full);
+        }
     }
 
+    CHEETAH_WRITE("\n* Listen overflows: %llu\n", server->listen_overflows);
     CHEETAH_WRITE("\n");
 }
 
@@ -369,21 +394,21 @@ void mk_cheetah_cmd_config(struct mk_server *server)
     CHEETAH_WRITE("Basic configuration");
     CHEETAH_WRITE("\n-------------------");
     mk_cheetah_listen_config(server);
-    CHEETAH_WRITE("\nWorkers            : %i threads", mk_api->config->workers);
-    CHEETAH_WRITE("\nTimeout            : %i seconds", mk_api->config->timeout);
+    CHEETAH_WRITE("\nWorkers            : %i threads", server->workers);
+    CHEETAH_WRITE("\nTimeout            : %i seconds", server->timeout);
     CHEETAH_WRITE("\nPidFile            : %s.%s",
-                  mk_api->config->path_conf_pidfile,
+                  server->path_conf_pidfile,
                   listener->port);
     CHEETAH_WRITE("\nUserDir            : %s",
-                  mk_api->config->conf_user_pub);
+                  server->conf_user_pub);
 
 
-    if (mk_list_is_empty(mk_api->config->index_files) == 0) {
+    if (mk_list_is_empty(server->index_files) == 0) {
         CHEETAH_WRITE("\nIndexFile          : No index files defined");
     }
     else {
         CHEETAH_WRITE("\nIndexFile          : ");
-        mk_list_foreach(head, mk_api->config->index_files) {
+        mk_list_foreach(head, server->index_files) {
             entry = mk_list_entry(head, struct mk_string_line, _head);
             CHEETAH_WRITE("%s ", entry->val);
         }
@@ -391,7 +416,7 @@ void mk_cheetah_cmd_config(struct mk_server *server)
     }
 
     CHEETAH_WRITE("\nHideVersion        : ");
-    if (mk_api->config->hideversion == MK_TRUE) {
+    if (server->hideversion == MK_TRUE) {
         CHEETAH_WRITE("On");
     }
     else {
@@ -399,30 +424,43 @@ void mk_cheetah_cmd_config(struct mk_server *server)
     }
 
     CHEETAH_WRITE("\nResume             : ");
-    if (mk_api->config->resume == MK_TRUE) {
+    if (server->resume == MK_TRUE) {
         CHEETAH_WRITE("On");
     }
     else {
         CHEETAH_WRITE("Off");
     }
 
-    CHEETAH_WRITE("\nUser               : %s", mk_api->config->user);
+    CHEETAH_WRITE("\nUser               : %s", server->user);
     CHEETAH_WRITE("\n\nAdvanced configuration");
     CHEETAH_WRITE("\n----------------------");
     CHEETAH_WRITE("\nKeepAlive           : ");
-    if (mk_api->config->keep_alive == MK_TRUE) {
+    if (server->keep_alive == MK_TRUE) {
         CHEETAH_WRITE("On");
     }
     else {
         CHEETAH_WRITE("Off");
     }
     CHEETAH_WRITE("\nMaxKeepAliveRequest : %i req/connection",
-           mk_api->config->max_keep_alive_request);
-    CHEETAH_WRITE("\nKeepAliveTimeout    : %i seconds", mk_api->config->keep_alive_timeout);
+           server->max_keep_alive_request);
+    CHEETAH_WRITE("\nKeepAliveTimeout    : %i seconds", server->keep_alive_timeout);
+    CHEETAH_WRITE("\nKeepAliveAdaptive   : ");
+    if (server->keep_alive_adaptive == MK_TRUE) {
+        CHEETAH_WRITE("On");
+    }
+    else {
+        CHEETAH_WRITE("Off");
+    }
+    CHEETAH_WRITE("\nMaxHeaderTime       : %i seconds",
+                  server->max_header_time);
+    CHEETAH_WRITE("\nMinRequestRate      : %i bytes/second",
+                  server->min_request_rate);
+    CHEETAH_WRITE("\nMinResponseRate     : %i bytes/second",
+                  server->min_response_rate);
     CHEETAH_WRITE("\nMaxRequestSize      : %i KB",
-           mk_api->config->max_request_size/1024);
+           server->max_request_size/1024);
     CHEETAH_WRITE("\nSymLink             : ");
-    if (mk_api->config->symlink == MK_TRUE) {
+    if (server->symlink == MK_TRUE) {
         CHEETAH_WRITE("On");
     }
     else {
@@ -431,6 +469,46 @@ void mk_cheetah_cmd_config(struct mk_server *server)
     CHEETAH_WRITE("\n\n");
 }
 
+/* Open file and response cache metrics, shards are read without locking */
+static void mk_cheetah_file_cache(struct mk_server *server)
+{
+    int i;
+    int entries = 0;
+    int neg_entries = 0;
+    size_t mem = 0;
+    unsigned long long lookups = 0;
+    unsigned long long hits = 0;
+    unsigned long long resp_hits = 0;
+    struct mk_file_cache *cache = server->file_cache;
+    struct mk_file_cache_shard *shard;
+
+    if (!cache) {
+        CHEETAH_WRITE("File Cache         : disabled\n");
+        return;
+    }
+
+    for (i = 0; i < MK_FILE_CACHE_SHARDS; i++) {
+        shard = &cache->shards[i];
+        entries     += shard->entries;
+        neg_entries += shard->neg_entries;
+        mem         += shard->mem;
+        lookups     += shard->lookups;
+        hits        += shard->hits;
+        resp_hits   += shard->resp_hits;
+    }
+
+    CHEETAH_WRITE("File Cache         : %i entries, %i negative, "
+                  "hit ratio %.1f%% (%llu/%llu)\n",
+                  entries, neg_entries,
+                  lookups ? (hits * 100.0) / lookups : 0.0, hits, lookups);
+    CHEETAH_WRITE("Response Cache     : %zu/%zu KB, %llu hits "
+                  "(%.1f%% of lookups)\n",
+                  mem / 1024,
+                  (cache->mem_limit * MK_FILE_CACHE_SHARDS) / 1024,
+                  resp_hits,
+                  lookups ? (resp_hits * 100.0) / lookups : 0.0);
+}
+
 void mk_cheetah_cmd_status(struct mk_server *server)
 {
     int nthreads = server->workers;
@@ -468,5 +546,6 @@ void mk_cheetah_cmd_status(struct mk_server *server)
     }
 
     CHEETAH_WRITE("Events backend     : %s\n", mk_api->ev_backend());
+    mk_cheetah_file_cache(server);
     CHEETAH_WRITE("\n");
 }
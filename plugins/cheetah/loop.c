@@ -81,7 +81,7 @@ void mk_cheetah_loop_server(struct mk_server *server)
         exit(EXIT_FAILURE);
     }
 
-    listener = mk_list_entry_first(&mk_api->config->listeners,
+    listener = mk_list_entry_first(&server->listeners,
                                    struct mk_config_listener,
                                  _head);
     cheetah_server = NULL;
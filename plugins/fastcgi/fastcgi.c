@@ -175,6 +175,22 @@ int mk_fastcgi_stage30_hangup(struct mk_plugin *plugin,
     return 0;
 }
 
+int mk_fastcgi_stage30_cancel(struct mk_plugin *plugin,
+                              struct mk_http_session *cs,
+                              struct mk_http_request *sr)
+{
+    (void) plugin;
+    (void) cs;
+    struct fcgi_handler *handler;
+
+    handler = sr->handler_data;
+    if (!handler) {
+        return -1;
+    }
+
+    return fcgi_abort(handler);
+}
+
 int mk_fastcgi_plugin_init(struct plugin_api **api, char *confdir)
 {
     int ret;
@@ -207,7 +223,8 @@ void mk_fastcgi_worker_init()
 struct mk_plugin_stage mk_plugin_stage_fastcgi = {
     .stage30        = &mk_fastcgi_stage30,
     .stage30_thread = &mk_fastcgi_stage30_thread,
-    .stage30_hangup = &mk_fastcgi_stage30_hangup
+    .stage30_hangup = &mk_fastcgi_stage30_hangup,
+    .stage30_cancel = &mk_fastcgi_stage30_cancel
 };
 
 struct mk_plugin mk_plugin_fastcgi = {
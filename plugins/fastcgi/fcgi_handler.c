@@ -596,6 +596,32 @@ int fcgi_exit(struct fcgi_handler *handler)
     return 1;
 }
 
+/*
+ * The HTTP client went away: tell the FastCGI server to stop processing
+ * our request (FCGI_ABORT_REQUEST), the output is discarded from now on.
+ */
+int fcgi_abort(struct fcgi_handler *handler)
+{
+    ssize_t ret;
+    struct fcgi_record_header rec;
+
+    if (handler->server_fd <= 0 || handler->active == MK_FALSE) {
+        return 0;
+    }
+
+    MK_TRACE("[fastcgi=%i] abort request", handler->server_fd);
+
+    fcgi_build_header(&rec, FCGI_ABORT_REQUEST, 1, 0);
+    ret = write(handler->server_fd, &rec, sizeof(rec));
+    if (ret != sizeof(rec)) {
+        MK_TRACE("[fastcgi=%i] could not send abort request",
+                 handler->server_fd);
+    }
+
+    handler->active = MK_FALSE;
+    return 0;
+}
+
 int fcgi_error(struct fcgi_handler *handler)
 {
     fcgi_exit(handler);
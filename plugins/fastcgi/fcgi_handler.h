@@ -124,5 +124,6 @@ struct fcgi_handler *fcgi_handler_new(struct mk_plugin *plugin,
                                       struct mk_http_request *sr);
 
 int fcgi_exit(struct fcgi_handler *handler);
+int fcgi_abort(struct fcgi_handler *handler);
 
 #endif
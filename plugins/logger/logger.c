@@ -23,6 +23,7 @@
 
 /* System Headers */
 #include <time.h>
+#include <inttypes.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -53,14 +54,19 @@ static struct status_response response_codes[] = {
     {505, "505"},
 };
 
-static struct log_target *mk_logger_match_by_host(struct mk_vhost *host, int is_ok)
+/* Request phases reported by the slow requests log */
+static const char *slow_phases[] = {
+    "queue", "parse", "match", "open", "stage30", "first_byte", "last_byte"
+};
+
+static struct log_target *mk_logger_match_by_host(struct mk_vhost *host, int type)
 {
     struct mk_list *head;
     struct log_target *entry;
 
     mk_list_foreach(head, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
-        if (entry->host == host && entry->is_ok == is_ok) {
+        if (entry->host == host && entry->type == type) {
             return entry;
         }
     }
@@ -257,6 +263,15 @@ static int mk_logger_read_config(char *path)
         mk_logger_timeout = timeout;
         MK_TRACE("FlushTimeout %i seconds", mk_logger_timeout);
 
+        /* SlowRequestTime */
+        timeout = (size_t) mk_api->config_section_get_key(section,
+                                                          "SlowRequestTime",
+                                                          MK_RCONF_NUM);
+        if (timeout > 0) {
+            mk_logger_slow_time = timeout;
+        }
+        MK_TRACE("SlowRequestTime %i ms", mk_logger_slow_time);
+
         /* MasterLog */
         logfilename = mk_api->config_section_get_key(section,
                                                      "MasterLog",
@@ -322,6 +337,8 @@ int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
 
     /* Global configuration */
     mk_logger_timeout = MK_LOGGER_TIMEOUT_DEFAULT;
+    mk_logger_slow_time = MK_LOGGER_SLOW_TIME_DEFAULT;
+    mk_logger_slow_enabled = MK_FALSE;
     mk_logger_master_path = NULL;
     mk_logger_read_config(confdir);
 
@@ -361,16 +378,42 @@ int mk_logger_plugin_exit()
     return 0;
 }
 
+/* Register a log file of a virtual host, written through a pipe */
+static void mk_logger_target_create(struct mk_vhost *host, int type, char *file)
+{
+    struct log_target *new;
+
+    new = mk_api->mem_alloc(sizeof(struct log_target));
+    new->type = type;
+
+    if (pipe(new->pipe) < 0) {
+        mk_err("Could not create pipe");
+        exit(EXIT_FAILURE);
+    }
+    if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl");
+    }
+    if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
+        perror("fcntl");
+    }
+    if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
+        perror("fcntl");
+    }
+    new->file = file;
+    new->host = host;
+    mk_list_add(&new->_head, &targets_list);
+}
+
 int mk_logger_master_init(struct mk_server_config *config)
 {
     int ret;
-    struct log_target *new;
     struct mk_vhost *entry_host;
     struct mk_list *hosts = &mk_api->config->hosts;
     struct mk_list *head_host;
     struct mk_rconf_section *section;
     char *access_file_name = NULL;
     char *error_file_name = NULL;
+    char *slow_file_name = NULL;
     pthread_t tid;
     (void) config;
 
@@ -398,52 +441,22 @@ int mk_logger_master_init(struct mk_server_config *config)
             error_file_name = (char *) mk_api->config_section_get_key(section,
                                                                       "ErrorLog",
                                                                       MK_RCONF_STR);
+            slow_file_name = (char *) mk_api->config_section_get_key(section,
+                                                                     "SlowLog",
+                                                                     MK_RCONF_STR);
 
             if (access_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_TRUE;
-
-                /* Set access pipe */
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                new->file = access_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
+                mk_logger_target_create(entry_host, MK_LOGGER_TARGET_ACCESS,
+                                        access_file_name);
             }
-
-            /* Set error pipe */
             if (error_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_FALSE;
-
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1 ){
-                    perror("fcntl");
-                }
-                new->file = error_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
-
+                mk_logger_target_create(entry_host, MK_LOGGER_TARGET_ERROR,
+                                        error_file_name);
+            }
+            if (slow_file_name) {
+                mk_logger_target_create(entry_host, MK_LOGGER_TARGET_SLOW,
+                                        slow_file_name);
+                mk_logger_slow_enabled = MK_TRUE;
             }
         }
     }
@@ -489,6 +502,107 @@ void mk_logger_worker_init()
     pthread_setspecific(cache_ip_str, (void *) ip_str);
 }
 
+/*
+ * Slow requests log: a request that took longer than SlowRequestTime is
+ * written with the time spent in every phase, in milliseconds. A phase the
+ * request did not go through is printed as '-'.
+ */
+static void mk_logger_slow(struct mk_http_session *cs,
+                           struct mk_http_request *sr)
+{
+    int i, n, ret;
+    int len;
+    char buf[MK_LOGGER_SLOW_BUFFER];
+    uint64_t prev, end, delta;
+    uint64_t points[ARRAY_SIZE(slow_phases)];
+    struct mk_http_timing *t = &sr->timing;
+    struct log_target *target;
+    struct mk_iov *iov;
+    mk_ptr_t *date;
+    mk_ptr_t *ip_str;
+
+    points[0] = t->read;
+    points[1] = t->parsed;
+    points[2] = t->matched;
+    points[3] = t->opened;
+    points[4] = t->stage30;
+    points[5] = t->first_byte;
+    points[6] = t->last_byte;
+
+    /* The request ends at the last phase it went through */
+    end = t->arrive;
+    for (i = 0; i < (int) ARRAY_SIZE(points); i++) {
+        if (points[i] > end) {
+            end = points[i];
+        }
+    }
+
+    if (end - t->arrive < (uint64_t) mk_logger_slow_time * 1000) {
+        return;
+    }
+
+    target = mk_logger_match_by_host(sr->host_conf, MK_LOGGER_TARGET_SLOW);
+    if (!target) {
+        return;
+    }
+
+    delta = end - t->arrive;
+    len = snprintf(buf, sizeof(buf), "%i %" PRIu64 ".%03" PRIu64,
+                   sr->headers.status, delta / 1000, delta % 1000);
+
+    prev = t->arrive;
+    for (i = 0; i < (int) ARRAY_SIZE(points); i++) {
+        if (points[i] == 0) {
+            n = snprintf(buf + len, sizeof(buf) - len, " %s=-",
+                         slow_phases[i]);
+        }
+        else {
+            delta = points[i] - prev;
+            n = snprintf(buf + len, sizeof(buf) - len,
+                         " %s=%" PRIu64 ".%03" PRIu64,
+                         slow_phases[i], delta / 1000, delta % 1000);
+            prev = points[i];
+        }
+        len += n;
+    }
+    buf[len++] = '\n';
+
+    iov = (struct mk_iov *) mk_logger_get_cache();
+    iov->iov_idx = 0;
+    iov->buf_idx = 0;
+    iov->total_len = 0;
+
+    ip_str = pthread_getspecific(cache_ip_str);
+    ret = mk_api->socket_ip_str(cs->socket,
+                                &ip_str->data,
+                                INET6_ADDRSTRLEN + 1,
+                                &ip_str->len);
+    if (mk_unlikely(ret < 0)) {
+        return;
+    }
+
+    date = mk_api->time_human();
+    mk_api->iov_add(iov, ip_str->data, ip_str->len, MK_FALSE);
+    mk_api->iov_add(iov,
+                    mk_logger_iov_dash.data, mk_logger_iov_dash.len,
+                    MK_FALSE);
+    mk_api->iov_add(iov, date->data, date->len, MK_FALSE);
+    mk_api->iov_add(iov,
+                    mk_logger_iov_space.data, mk_logger_iov_space.len,
+                    MK_FALSE);
+    mk_api->iov_add(iov, sr->method_p.data, sr->method_p.len, MK_FALSE);
+    mk_api->iov_add(iov,
+                    mk_logger_iov_space.data, mk_logger_iov_space.len,
+                    MK_FALSE);
+    mk_api->iov_add(iov, sr->uri.data, sr->uri.len, MK_FALSE);
+    mk_api->iov_add(iov,
+                    mk_logger_iov_space.data, mk_logger_iov_space.len,
+                    MK_FALSE);
+    mk_api->iov_add(iov, buf, len, MK_FALSE);
+
+    mk_api->iov_send(target->pipe[1], iov);
+}
+
 int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
 {
     int i, http_status, ret, tmp;
@@ -504,11 +618,16 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
     /* Set response status */
     http_status = sr->headers.status;
 
+    /* Slow requests are logged whatever the response status is */
+    if (mk_logger_slow_enabled == MK_TRUE) {
+        mk_logger_slow(cs, sr);
+    }
+
     if (http_status < 400) {
-        access = MK_TRUE;
+        access = MK_LOGGER_TARGET_ACCESS;
     }
     else {
-        access = MK_FALSE;
+        access = MK_LOGGER_TARGET_ERROR;
     }
 
     /* Look for target log file */
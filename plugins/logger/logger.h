@@ -26,9 +26,20 @@
 
 #define MK_LOGGER_PIPE_LIMIT 0.75
 #define MK_LOGGER_TIMEOUT_DEFAULT 3
+#define MK_LOGGER_SLOW_TIME_DEFAULT 1000
+#define MK_LOGGER_SLOW_BUFFER 512
+
+/* Log target types */
+#define MK_LOGGER_TARGET_ERROR   0
+#define MK_LOGGER_TARGET_ACCESS  1
+#define MK_LOGGER_TARGET_SLOW    2
 
 int mk_logger_timeout;
 
+/* Slow requests: threshold in milliseconds, any virtual host with a SlowLog */
+int mk_logger_slow_time;
+int mk_logger_slow_enabled;
+
 /* MasterLog variables */
 char *mk_logger_master_path;
 FILE *mk_logger_master_stdout;
@@ -44,7 +55,7 @@ struct log_target
     struct mk_event event;
 
     /* Pipes */
-    int is_ok;
+    int type;
     int pipe[2];
     char *file;
 
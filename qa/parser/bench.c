@@ -0,0 +1,86 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HTTP parser microbenchmark: it parses a browser request with every byte
+ * scan implementation the CPU supports. Configure with MK_PARSER_BENCH=On
+ * and CMAKE_BUILD_TYPE=Release.
+ *
+ *   usage: mk_parser_bench [iterations]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+
+int main(int argc, char **argv)
+{
+    int i;
+    int ret;
+    int len;
+    int loops = 2000000;
+    unsigned int s;
+    double ns;
+    struct timespec t1;
+    struct timespec t2;
+    struct mk_http_request req;
+    static struct mk_http_parser p;
+    static char buf[sizeof(parser_request)];
+
+    if (argc > 1) {
+        loops = atoi(argv[1]);
+        if (loops <= 0) {
+            fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    len = sizeof(parser_request) - 1;
+    memcpy(buf, parser_request, len);
+
+    for (s = 0; s < PARSER_SCANS; s++) {
+        if (mk_http_parser_scan_init(parser_scans[s].type) != 0) {
+            printf("%-8s not supported\n", parser_scans[s].name);
+            continue;
+        }
+
+        ret = parser_run(&req, &p, buf, len, 0);
+        if (ret != MK_HTTP_PARSER_OK) {
+            fprintf(stderr, "%s: parser returned %i\n",
+                    parser_scans[s].name, ret);
+            return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        for (i = 0; i < loops; i++) {
+            parser_run(&req, &p, buf, len, 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t2);
+
+        ns = ((t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec)) /
+             loops;
+        printf("%-8s %i bytes %8.1f ns/request %6.2f GB/s\n",
+               parser_scans[s].name, len, ns, len / ns);
+    }
+
+    return 0;
+}
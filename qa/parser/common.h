@@ -0,0 +1,110 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Shared by the HTTP parser benchmark and fuzzer: they are linked with
+ * mk_http_parser.c alone, so the error responses the parser queues are
+ * stubbed out.
+ */
+
+#ifndef MK_QA_PARSER_COMMON_H
+#define MK_QA_PARSER_COMMON_H
+
+#include <stdio.h>
+#include <string.h>
+
+#include <monkey/mk_http.h>
+#include <monkey/mk_http_parser.h>
+
+static struct mk_server parser_server;
+
+int mk_http_error(int http_status, struct mk_http_session *cs,
+                  struct mk_http_request *sr, struct mk_server *server)
+{
+    (void) cs;
+    (void) sr;
+    (void) server;
+    return http_status;
+}
+
+/* Implementations to compare, the ones the CPU lacks are skipped */
+static const struct {
+    int type;
+    const char *name;
+} parser_scans[] = {
+    {MK_HTTP_PARSER_SCAN_SCALAR, "scalar"},
+    {MK_HTTP_PARSER_SCAN_SSE42,  "sse4.2"},
+    {MK_HTTP_PARSER_SCAN_AVX2,   "avx2"  },
+};
+
+#define PARSER_SCANS (sizeof(parser_scans) / sizeof(parser_scans[0]))
+
+/* A request as sent by a current browser */
+static const char parser_request[] =
+    "GET /static/js/app.bundle.min.js?v=1234567890abcdef HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+    "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/products/item?ref=homepage\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9,de;q=0.8,fr;q=0.7\r\n"
+    "Cookie: session_id=abcdef0123456789abcdef0123456789; "
+    "_ga=GA1.2.1234567890.1234567890; preferences=theme%3Ddark\r\n"
+    "If-None-Match: \"5f2b-1a2b3c4d5e6f\"\r\n"
+    "If-Modified-Since: Wed, 21 Oct 2015 07:28:00 GMT\r\n"
+    "\r\n";
+
+/*
+ * Parse the buffer from scratch, the parser must start zeroed. It's fed
+ * 'step' bytes at a time as if they arrived in several reads, a step of 0
+ * feeds it at once.
+ */
+static int parser_run(struct mk_http_request *req, struct mk_http_parser *p,
+                      char *buf, int len, int step)
+{
+    int ret;
+    int pos;
+
+    memset(req, 0, sizeof(struct mk_http_request));
+    mk_http_parser_init(p);
+
+    if (step <= 0) {
+        return mk_http_parser(req, p, buf, len, &parser_server);
+    }
+
+    for (pos = step; ; pos += step) {
+        if (pos > len) {
+            pos = len;
+        }
+        ret = mk_http_parser(req, p, buf, pos, &parser_server);
+        if (ret != MK_HTTP_PARSER_PENDING || pos == len) {
+            return ret;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,253 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * HTTP parser fuzzer: every input is parsed with each byte scan
+ * implementation the CPU supports, at once and split in several reads,
+ * and all the results must match the scalar one.
+ *
+ * Built with clang it's a libFuzzer target, otherwise it mutates a few
+ * sample requests by itself:
+ *
+ *   usage: mk_parser_fuzz [cases] [seed]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define FUZZ_INPUT_MAX  8192
+#define FUZZ_SIG_MAX    65536
+
+/* Describe the outcome of a parse, only the status if it did not end OK */
+static int fuzz_signature(char *out, int ret, struct mk_http_request *req,
+                          struct mk_http_parser *p)
+{
+    int i;
+    int n;
+    struct mk_http_header *h;
+
+#define FUZZ_PRINT(...)                                                 \
+    if (n < FUZZ_SIG_MAX) {                                             \
+        n += snprintf(out + n, FUZZ_SIG_MAX - n, __VA_ARGS__);          \
+    }
+
+    n = 0;
+    FUZZ_PRINT("ret=%i", ret);
+    if (ret != MK_HTTP_PARSER_OK) {
+        return n;
+    }
+
+    FUZZ_PRINT(" method=%i uri='%.*s' query='%.*s' protocol='%.*s'",
+               p->method,
+               (int) req->uri.len, req->uri.data ? req->uri.data : "",
+               (int) req->query_string.len,
+               req->query_string.data ? req->query_string.data : "",
+               (int) req->protocol_p.len,
+               req->protocol_p.data ? req->protocol_p.data : "");
+    FUZZ_PRINT(" headers=%i", p->header_count);
+
+    for (i = 0; i < MK_HEADER_SIZEOF; i++) {
+        h = &p->headers[i];
+        if (h->type) {
+            FUZZ_PRINT(" [%i '%.*s']", i, (int) h->val.len, h->val.data);
+        }
+    }
+
+    for (i = 0; i < p->headers_extra_count; i++) {
+        h = &p->headers_extra[i];
+        FUZZ_PRINT(" ['%.*s' '%.*s']",
+                   (int) h->key.len, h->key.data,
+                   (int) h->val.len, h->val.data);
+    }
+
+#undef FUZZ_PRINT
+
+    return n;
+}
+
+static void fuzz_report(const char *name, int step, const char *expected,
+                        const char *got, const char *data, size_t size)
+{
+    size_t i;
+
+    fprintf(stderr, "mismatch: %s, step %i\n  scalar: %s\n  got   : %s\n"
+            "  input : \"", name, step, expected, got);
+    for (i = 0; i < size; i++) {
+        if (data[i] >= 0x20 && data[i] < 0x7f && data[i] != '"' &&
+            data[i] != '\\') {
+            fputc(data[i], stderr);
+        }
+        else {
+            fprintf(stderr, "\\x%02x", (unsigned char) data[i]);
+        }
+    }
+    fprintf(stderr, "\"\n");
+    abort();
+}
+
+/* Parse an input every way and check the results agree */
+static int fuzz_check(const char *data, size_t size)
+{
+    int i;
+    int ret;
+    int len;
+    int status;
+    int steps[3];
+    unsigned int s;
+    struct mk_http_request req;
+    static struct mk_http_parser p;
+    static char buf[FUZZ_INPUT_MAX];
+    static char expected[FUZZ_SIG_MAX];
+    static char got[FUZZ_SIG_MAX];
+
+    if (size == 0 || size > FUZZ_INPUT_MAX) {
+        return 0;
+    }
+
+    len = size;
+    memcpy(buf, data, len);
+
+    mk_http_parser_scan_init(MK_HTTP_PARSER_SCAN_SCALAR);
+    status = parser_run(&req, &p, buf, len, 0);
+    fuzz_signature(expected, status, &req, &p);
+
+    steps[0] = 0;
+    steps[1] = 1;
+    steps[2] = 2 + (len % 61);
+
+    for (s = 0; s < PARSER_SCANS; s++) {
+        if (mk_http_parser_scan_init(parser_scans[s].type) != 0) {
+            continue;
+        }
+
+        for (i = 0; i < 3; i++) {
+            ret = parser_run(&req, &p, buf, len, steps[i]);
+            fuzz_signature(got, ret, &req, &p);
+            if (strcmp(expected, got) != 0) {
+                fuzz_report(parser_scans[s].name, steps[i], expected, got,
+                            data, size);
+            }
+        }
+    }
+
+    return status;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    fuzz_check((const char *) data, size);
+    return 0;
+}
+
+#ifndef MK_FUZZ_LIBFUZZER
+
+static const char *fuzz_samples[] = {
+    parser_request,
+
+    "POST /upload/file.bin?name=a%20b HTTP/1.1\r\n"
+    "Host: localhost:2001\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 11\r\n"
+    "Expect: 100-continue\r\n"
+    "\r\n"
+    "hello world",
+
+    "PUT /chunked HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Transfer-Encoding: chunked\r\n"
+    "X-Custom-Header:\tvalue with\ttabs \r\n"
+    "Connection: Upgrade, HTTP2-Settings\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n",
+
+    "GET / HTTP/1.0\r\n\r\n",
+};
+
+/* Bytes the parser stops at, picked more often than the others */
+static const char fuzz_alphabet[] = " :?/%-.\t\r\n\"=;aZ09\x7f";
+
+#define FUZZ_SAMPLES (sizeof(fuzz_samples) / sizeof(fuzz_samples[0]))
+
+int main(int argc, char **argv)
+{
+    int i;
+    int k;
+    int len;
+    int pos;
+    int cases = 100000;
+    int ok = 0;
+    unsigned int seed = 1;
+    static char buf[FUZZ_INPUT_MAX];
+
+    if (argc > 1) {
+        cases = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        seed = strtoul(argv[2], NULL, 10);
+    }
+    if (cases <= 0) {
+        fprintf(stderr, "usage: %s [cases] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    srand(seed);
+    for (k = 0; k < cases; k++) {
+        len = strlen(fuzz_samples[k % FUZZ_SAMPLES]);
+        memcpy(buf, fuzz_samples[k % FUZZ_SAMPLES], len);
+
+        for (i = rand() % 5; i > 0 && len > 1; i--) {
+            pos = rand() % len;
+            switch (rand() % 5) {
+            case 0:
+                memmove(buf + pos, buf + pos + 1, len - pos - 1);
+                len--;
+                break;
+            case 1:
+                if (len < FUZZ_INPUT_MAX) {
+                    memmove(buf + pos + 1, buf + pos, len - pos);
+                    len++;
+                }
+                break;
+            case 2:
+                buf[pos] = rand();
+                break;
+            default:
+                buf[pos] = fuzz_alphabet[rand() % (sizeof(fuzz_alphabet) - 1)];
+            }
+        }
+
+        if (rand() % 8 == 0) {
+            len = 1 + rand() % len;
+        }
+
+        if (fuzz_check(buf, len) == MK_HTTP_PARSER_OK) {
+            ok++;
+        }
+    }
+
+    printf("%i cases, %i parsed, all scan implementations agree\n",
+           cases, ok);
+    return 0;
+}
+
+#endif